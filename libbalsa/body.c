@@ -715,14 +715,65 @@ libbalsa_message_body_get_pixbuf(LibBalsaMessageBody * body, GError ** err)
     return pixbuf;
 }
 
+/* Copies the content of a part that is still being fetched to dest,
+ * so that saving need not wait for all of it. */
+static gboolean
+libbalsa_message_body_save_input_stream(GInputStream * in,
+                                        GMimeStream * dest,
+                                        gboolean filter_crlf,
+                                        GError ** err)
+{
+    gchar buf[16384];
+    gssize len;
+
+    if (filter_crlf) {
+        GMimeFilter *filter = g_mime_filter_crlf_new(FALSE, FALSE);
+        dest = libbalsa_message_body_stream_add_filter(dest, filter);
+    }
+
+    while ((len = g_input_stream_read(in, buf, sizeof buf, NULL, err)) > 0)
+        if (g_mime_stream_write(dest, buf, len) != len) {
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_ACCESS_ERROR,
+                        "Write error in save_stream");
+            len = -1;
+            break;
+        }
+    if (len == 0 && g_mime_stream_flush(dest) != 0) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_ACCESS_ERROR,
+                    "Write error in save_stream");
+        len = -1;
+    }
+
+    g_input_stream_close(in, NULL, NULL);
+    g_object_unref(in);
+    g_object_unref(dest);
+
+    return len == 0;
+}
+
 gboolean
 libbalsa_message_body_save_stream(LibBalsaMessageBody * body,
                                   GMimeStream * dest, gboolean filter_crlf,
                                   GError ** err)
 {
     GMimeStream *stream;
+    GInputStream *in;
     ssize_t len;
 
+    /* Parts that need no charset conversion can be saved as they
+     * arrive, if the mailbox streams them. */
+    if (!body->mime_part
+        && body->body_type != LIBBALSA_MESSAGE_BODY_TYPE_TEXT
+        && body->body_type != LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE
+        && body->body_type != LIBBALSA_MESSAGE_BODY_TYPE_MULTIPART
+        && body->message->mailbox
+        && (in = libbalsa_mailbox_get_part_stream(body->message, body,
+                                                  NULL)) != NULL)
+        return libbalsa_message_body_save_input_stream(in, dest,
+                                                       filter_crlf, err);
+
     stream = libbalsa_message_body_get_stream(body, err);
     if (!body->mime_part)
         return FALSE;
@@ -0,0 +1,561 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LibBalsaGzipIndex: random read access to a gzip file.
+ *
+ * Inflating a gzip file can only start at its beginning, unless the
+ * state of the decompressor is known at some later point: the bit
+ * offset of a deflate block boundary in the compressed data, and the
+ * 32K of uncompressed data preceding it.  The index records such
+ * restart points about every `span' bytes of uncompressed data, so that
+ * reading at any offset needs to inflate at most `span' bytes that are
+ * thrown away.  This is the technique of zran.c in the zlib examples.
+ *
+ * The index is built with one pass over the file the first time it is
+ * opened, and saved in a file, which is valid as long as the size and
+ * mtime of the gzip file do not change.
+ *
+ * Reads go on from where the previous one stopped, if possible, so
+ * reading the file sequentially inflates it only once.  The caller must
+ * serialize access to an index; LibBalsaMimeStreamShared does that with
+ * its stream lock.
+ *
+ * Only the first member of a multi-member gzip file is read.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include "gzip-index.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "libbalsa.h"
+#include <glib/gi18n.h>
+
+#define LBGI_WINSIZE 32768U     /* deflate window size */
+#define LBGI_CHUNK   16384      /* input buffer size */
+
+#define LBGI_MAGIC   "BalsaGzI"
+#define LBGI_VERSION 1
+
+typedef struct {
+    gint64 out;                 /* offset in the uncompressed data */
+    gint64 in;                  /* offset in the compressed file */
+    gint32 bits;                /* bits of the byte before in, if any */
+    guchar window[LBGI_WINSIZE]; /* uncompressed data preceding out */
+} LibBalsaGzipIndexPoint;
+
+/* Header of the index file; the points follow it. */
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 n_points;
+    gint64 span;
+    gint64 gzip_size;           /* size of the gzip file */
+    gint64 gzip_mtime;          /* mtime of the gzip file */
+    gint64 size;                /* size of the uncompressed data */
+} LibBalsaGzipIndexHeader;
+
+struct _LibBalsaGzipIndex {
+    guint ref_count;
+    int fd;
+    gint64 span;
+    gint64 size;
+    GArray *points;
+
+    /* The read cursor. */
+    z_stream strm;
+    gboolean strm_init;         /* inflateInit2 has been called */
+    gboolean strm_valid;        /* strm can continue at strm_out */
+    gint64 strm_out;            /* uncompressed offset of the cursor */
+    gint64 strm_in;             /* file offset of the next input */
+    guchar input[LBGI_CHUNK];
+};
+
+/*
+ * Building the index.
+ */
+
+static void
+lbgi_add_point(GArray * points, gint bits, gint64 in, gint64 out,
+               guint left, const guchar * window)
+{
+    LibBalsaGzipIndexPoint *point;
+
+    g_array_set_size(points, points->len + 1);
+    point = &g_array_index(points, LibBalsaGzipIndexPoint, points->len - 1);
+    point->bits = bits;
+    point->in = in;
+    point->out = out;
+
+    /* The window is circular; copy it so that it ends at out. */
+    if (left > 0)
+        memcpy(point->window, window + LBGI_WINSIZE - left, left);
+    if (left < LBGI_WINSIZE)
+        memcpy(point->window + left, window, LBGI_WINSIZE - left);
+}
+
+static gboolean
+lbgi_build(LibBalsaGzipIndex * index, GError ** err)
+{
+    z_stream strm;
+    guchar *input;
+    guchar *window;
+    gint64 totin, totout, last, pos;
+    int ret;
+
+    memset(&strm, 0, sizeof strm);
+    /* 47: detect zlib or gzip header, 32K window. */
+    if (inflateInit2(&strm, 47) != Z_OK) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_OPEN_ERROR,
+                    _("Cannot initialize decompression."));
+        return FALSE;
+    }
+
+    input = g_malloc(LBGI_CHUNK);
+    /* Zeroed: the first point copies the whole window, and it is
+     * saved to the index file. */
+    window = g_malloc0(LBGI_WINSIZE);
+
+    totin = totout = last = pos = 0;
+    strm.avail_out = 0;
+    do {
+        ssize_t count;
+
+        count = pread(index->fd, input, LBGI_CHUNK, pos);
+        if (count <= 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        pos += count;
+        strm.avail_in = count;
+        strm.next_in = input;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = LBGI_WINSIZE;
+                strm.next_out = window;
+            }
+
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+
+            if (ret == Z_NEED_DICT)
+                ret = Z_DATA_ERROR;
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR
+                || ret == Z_STREAM_END)
+                break;
+
+            /* At the end of a block that is not the last one, add a
+             * restart point if we have come far enough. */
+            if ((strm.data_type & 128) && !(strm.data_type & 64)
+                && (totout == 0 || totout - last > index->span)) {
+                lbgi_add_point(index->points, strm.data_type & 7, totin,
+                               totout, strm.avail_out, window);
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret != Z_STREAM_END && ret != Z_MEM_ERROR
+             && ret != Z_DATA_ERROR);
+
+    inflateEnd(&strm);
+    g_free(window);
+    g_free(input);
+
+    if (ret != Z_STREAM_END || index->points->len == 0) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_OPEN_ERROR,
+                    _("Compressed file is damaged."));
+        return FALSE;
+    }
+
+    index->size = totout;
+
+    return TRUE;
+}
+
+/*
+ * Saving and restoring the index.
+ */
+
+static void
+lbgi_save(LibBalsaGzipIndex * index, const gchar * index_file,
+          struct stat * st)
+{
+    LibBalsaGzipIndexHeader header;
+    GByteArray *contents;
+    GError *err = NULL;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, LBGI_MAGIC, sizeof header.magic);
+    header.version = LBGI_VERSION;
+    header.n_points = index->points->len;
+    header.span = index->span;
+    header.gzip_size = st->st_size;
+    header.gzip_mtime = st->st_mtime;
+    header.size = index->size;
+
+    contents = g_byte_array_sized_new(sizeof header + index->points->len
+                                      * sizeof(LibBalsaGzipIndexPoint));
+    g_byte_array_append(contents, (guint8 *) & header, sizeof header);
+    g_byte_array_append(contents, (guint8 *) index->points->data,
+                        index->points->len *
+                        sizeof(LibBalsaGzipIndexPoint));
+
+    if (!g_file_set_contents(index_file, (gchar *) contents->data,
+                             contents->len, &err)) {
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             _("Could not write file %s: %s"),
+                             index_file, err->message);
+        g_error_free(err);
+    }
+    g_byte_array_free(contents, TRUE);
+}
+
+static gboolean
+lbgi_restore(LibBalsaGzipIndex * index, const gchar * index_file,
+             struct stat * st)
+{
+    gchar *contents;
+    gsize length;
+    LibBalsaGzipIndexHeader *header;
+
+    if (!g_file_get_contents(index_file, &contents, &length, NULL))
+        return FALSE;
+
+    header = (LibBalsaGzipIndexHeader *) contents;
+    if (length < sizeof *header
+        || memcmp(header->magic, LBGI_MAGIC, sizeof header->magic) != 0
+        || header->version != LBGI_VERSION
+        || header->span != index->span
+        || header->gzip_size != st->st_size
+        || header->gzip_mtime != st->st_mtime
+        || header->n_points == 0
+        || length != sizeof *header
+        + header->n_points * sizeof(LibBalsaGzipIndexPoint)) {
+        /* Stale or damaged: build it again. */
+        g_free(contents);
+        return FALSE;
+    }
+
+    index->size = header->size;
+    g_array_append_vals(index->points, contents + sizeof *header,
+                        header->n_points);
+    g_free(contents);
+
+    return TRUE;
+}
+
+/*
+ * Public methods.
+ */
+
+/**
+ * libbalsa_gzip_index_new:
+ * @fd: file descriptor of the gzip file
+ * @index_file: where the index is saved
+ * @span: approximate distance between restart points
+ * @err: for error reporting
+ *
+ * Load the index of the gzip file from @index_file, or build it and
+ * save it there if it is missing or stale.
+ *
+ * Returns: the index, or NULL on error
+ **/
+LibBalsaGzipIndex *
+libbalsa_gzip_index_new(int fd, const gchar * index_file, gint64 span,
+                        GError ** err)
+{
+    LibBalsaGzipIndex *index;
+    struct stat st;
+
+    g_return_val_if_fail(fd >= 0, NULL);
+    g_return_val_if_fail(index_file != NULL, NULL);
+    g_return_val_if_fail(span > 0, NULL);
+
+    if (fstat(fd, &st) < 0) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_OPEN_ERROR, "%s", g_strerror(errno));
+        return NULL;
+    }
+
+    index = g_new0(LibBalsaGzipIndex, 1);
+    index->ref_count = 1;
+    index->fd = fd;
+    index->span = span;
+    index->points =
+        g_array_new(FALSE, TRUE, sizeof(LibBalsaGzipIndexPoint));
+
+    if (!lbgi_restore(index, index_file, &st)) {
+        if (!lbgi_build(index, err)) {
+            libbalsa_gzip_index_unref(index);
+            return NULL;
+        }
+        lbgi_save(index, index_file, &st);
+    }
+
+    return index;
+}
+
+LibBalsaGzipIndex *
+libbalsa_gzip_index_ref(LibBalsaGzipIndex * index)
+{
+    g_return_val_if_fail(index != NULL, NULL);
+
+    ++index->ref_count;
+
+    return index;
+}
+
+void
+libbalsa_gzip_index_unref(LibBalsaGzipIndex * index)
+{
+    g_return_if_fail(index != NULL);
+    g_return_if_fail(index->ref_count > 0);
+
+    if (--index->ref_count > 0)
+        return;
+
+    if (index->strm_init)
+        inflateEnd(&index->strm);
+    g_array_free(index->points, TRUE);
+    g_free(index);
+}
+
+gint64
+libbalsa_gzip_index_get_size(LibBalsaGzipIndex * index)
+{
+    g_return_val_if_fail(index != NULL, -1);
+
+    return index->size;
+}
+
+/* Position the cursor at the start of the data. */
+static gboolean
+lbgi_restart_at_start(LibBalsaGzipIndex * index)
+{
+    /* 47: detect zlib or gzip header, 32K window. */
+    if (inflateReset2(&index->strm, 47) != Z_OK)
+        return FALSE;
+    index->strm.avail_in = 0;
+    index->strm_in = 0;
+    index->strm_out = 0;
+    index->strm_valid = TRUE;
+
+    return TRUE;
+}
+
+/* Position the cursor at the last restart point at or before offset,
+ * or at the start of the data if the decompressor cannot be set up
+ * there. */
+static gboolean
+lbgi_restart(LibBalsaGzipIndex * index, gint64 offset)
+{
+    LibBalsaGzipIndexPoint *point;
+    guint lo, hi;
+    int ret;
+
+    /* Binary search for the last point with point->out <= offset. */
+    lo = 0;
+    hi = index->points->len;
+    while (hi - lo > 1) {
+        guint mid = (lo + hi) / 2;
+
+        if (g_array_index(index->points, LibBalsaGzipIndexPoint, mid).out
+            <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    point = &g_array_index(index->points, LibBalsaGzipIndexPoint, lo);
+
+    ret = index->strm_init ?
+        inflateReset2(&index->strm, -15) :
+        inflateInit2(&index->strm, -15);    /* raw inflate */
+    if (ret != Z_OK)
+        return FALSE;
+    index->strm_init = TRUE;
+    index->strm.avail_in = 0;
+
+    index->strm_in = point->in;
+    if (point->bits > 0) {
+        guchar byte;
+
+        if (pread(index->fd, &byte, 1, point->in - 1) != 1)
+            return FALSE;
+        if (inflatePrime(&index->strm, point->bits,
+                         byte >> (8 - point->bits)) != Z_OK)
+            return lbgi_restart_at_start(index);
+    }
+    if (inflateSetDictionary(&index->strm, point->window, LBGI_WINSIZE)
+        != Z_OK)
+        return lbgi_restart_at_start(index);
+
+    index->strm_out = point->out;
+    index->strm_valid = TRUE;
+
+    return TRUE;
+}
+
+/* Inflate up to len bytes at the cursor into out. */
+static gssize
+lbgi_inflate(LibBalsaGzipIndex * index, guchar * out, gsize len)
+{
+    z_stream *strm = &index->strm;
+    gsize produced;
+
+    strm->next_out = out;
+    strm->avail_out = len;
+    while (strm->avail_out > 0) {
+        int ret;
+
+        if (strm->avail_in == 0) {
+            ssize_t count;
+
+            count = pread(index->fd, index->input, LBGI_CHUNK,
+                          index->strm_in);
+            if (count <= 0)
+                break;
+            index->strm_in += count;
+            strm->next_in = index->input;
+            strm->avail_in = count;
+        }
+
+        ret = inflate(strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            break;
+        if (ret != Z_OK) {
+            index->strm_valid = FALSE;
+            return -1;
+        }
+    }
+
+    produced = len - strm->avail_out;
+    index->strm_out += produced;
+
+    return produced;
+}
+
+/**
+ * libbalsa_gzip_index_read:
+ * @index: the index
+ * @offset: offset in the uncompressed data
+ * @buf: buffer for the data
+ * @len: number of bytes to read
+ *
+ * Read uncompressed data.
+ *
+ * Returns: the number of bytes read, 0 at end of data, -1 on error
+ **/
+gssize
+libbalsa_gzip_index_read(LibBalsaGzipIndex * index, gint64 offset,
+                         gchar * buf, gsize len)
+{
+    g_return_val_if_fail(index != NULL, -1);
+
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset >= index->size)
+        return 0;
+    len = MIN((gint64) len, index->size - offset);
+
+    /* Go on from the cursor if it is not too far behind; otherwise
+     * restart at the nearest restart point. */
+    if (!index->strm_valid || offset < index->strm_out
+        || offset - index->strm_out > index->span)
+        if (!lbgi_restart(index, offset))
+            return -1;
+
+    while (index->strm_out < offset) {
+        guchar discard[LBGI_CHUNK];
+        gssize count;
+
+        count = lbgi_inflate(index, discard,
+                             MIN((gint64) sizeof discard,
+                                 offset - index->strm_out));
+        if (count <= 0)
+            return -1;
+    }
+
+    return lbgi_inflate(index, (guchar *) buf, len);
+}
+
+/**
+ * libbalsa_gzip_peek:
+ * @path: path of a file
+ * @buf: buffer for the data
+ * @len: number of bytes to read
+ *
+ * Read the first bytes of the uncompressed data, for example to check
+ * the type of a compressed file.
+ *
+ * Returns: the number of bytes read, or -1 if the file cannot be read
+ * or is not compressed.
+ **/
+gssize
+libbalsa_gzip_peek(const gchar * path, gchar * buf, gsize len)
+{
+    int fd;
+    guchar input[LBGI_CHUNK];
+    ssize_t count;
+    z_stream strm;
+    gssize retval = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return retval;
+    count = read(fd, input, sizeof input);
+    close(fd);
+    if (count < 2 || input[0] != 0x1f || input[1] != 0x8b)
+        return retval;
+
+    memset(&strm, 0, sizeof strm);
+    if (inflateInit2(&strm, 31) != Z_OK)        /* gzip only */
+        return retval;
+    strm.next_in = input;
+    strm.avail_in = count;
+    strm.next_out = (guchar *) buf;
+    strm.avail_out = len;
+    switch (inflate(&strm, Z_SYNC_FLUSH)) {
+    case Z_OK:
+    case Z_STREAM_END:
+    case Z_BUF_ERROR:
+        retval = len - strm.avail_out;
+        break;
+    default:
+        break;
+    }
+    inflateEnd(&strm);
+
+    return retval;
+}
@@ -0,0 +1,44 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBBALSA_GZIP_INDEX_H__
+#define __LIBBALSA_GZIP_INDEX_H__
+
+#ifndef BALSA_VERSION
+# error "Include config.h before this file."
+#endif
+
+#include <glib.h>
+
+typedef struct _LibBalsaGzipIndex LibBalsaGzipIndex;
+
+LibBalsaGzipIndex *libbalsa_gzip_index_new(int fd,
+                                           const gchar * index_file,
+                                           gint64 span, GError ** err);
+LibBalsaGzipIndex *libbalsa_gzip_index_ref(LibBalsaGzipIndex * index);
+void libbalsa_gzip_index_unref(LibBalsaGzipIndex * index);
+
+gint64 libbalsa_gzip_index_get_size(LibBalsaGzipIndex * index);
+gssize libbalsa_gzip_index_read(LibBalsaGzipIndex * index, gint64 offset,
+                                gchar * buf, gsize len);
+
+gssize libbalsa_gzip_peek(const gchar * path, gchar * buf, gsize len);
+
+#endif                          /* __LIBBALSA_GZIP_INDEX_H__ */
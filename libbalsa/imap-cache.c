@@ -0,0 +1,960 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LibBalsaImapCache: the store for IMAP message bodies and parts.
+ *
+ * Each cached item is named by a message key, which identifies the
+ * message by server, mailbox, UIDVALIDITY and UID, and an item name
+ * such as "body" or "part-1.2".  The data is stored by content: the
+ * file is named by the SHA-256 of its contents, in one of 256
+ * subdirectories chosen by the first two digits of the hash, so that
+ * no directory grows too large.  Items with the same contents, such
+ * as those of a message and its copy in another mailbox, share the
+ * file.
+ *
+ * The index, which maps items to files and records the size of the
+ * files and the order in which they were last used, is kept in
+ * memory and saved as a journal: every change appends one line to
+ * the index file.  Reading the journal at startup restores the
+ * index without looking at the files, and eviction of the least
+ * recently used files is done from the index alone.  When the
+ * journal has grown well beyond the size of the index, it is
+ * rewritten.  Uses of files are not journaled: the rewritten
+ * journal lists the files in the order they were last used, and it
+ * is also rewritten after many uses, so that the order is not lost.
+ *
+ * Journal records, one per line, fields separated by a space:
+ *
+ *   O <hash> <size>          file stored or used
+ *   T <hash>                 file used (older versions only)
+ *   E <key> <item> <hash>    item refers to file
+ *   R <key> <item>           item removed
+ *   D <hash>                 file evicted
+ *
+ * Message keys must not contain white space; the callers encode
+ * them.  A file is removed when the last item referring to it is.
+ *
+ * All functions may be called from any thread.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include "imap-cache.h"
+
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "libbalsa.h"
+#include <glib/gi18n.h>
+
+#define LBIC_INDEX   "index"
+#define LBIC_OBJECTS "objects"
+#define LBIC_MAGIC   "BalsaImapCache 1"
+#define LBIC_TMP     "tmp-"
+
+/* The journal is rewritten when it has more than twice as many
+ * records as needed, plus this many. */
+#define LBIC_SLACK   4096
+
+/* Files being resumed by libbalsa_imap_cache_resume() are kept this
+ * long, in seconds, after they were last written. */
+#define LBIC_PARTIAL_MAX_AGE (7 * 24 * 60 * 60)
+
+typedef struct _LibBalsaImapCacheObject LibBalsaImapCacheObject;
+typedef struct _LibBalsaImapCacheMessage LibBalsaImapCacheMessage;
+typedef struct _LibBalsaImapCacheEntry LibBalsaImapCacheEntry;
+
+struct _LibBalsaImapCacheObject {
+    gchar *hash;
+    off_t size;
+    GSList *entries;            /* LibBalsaImapCacheEntry */
+    GList lru;                  /* link in cache->lru */
+};
+
+struct _LibBalsaImapCacheMessage {
+    gchar *key;
+    GSList *entries;            /* LibBalsaImapCacheEntry */
+};
+
+struct _LibBalsaImapCacheEntry {
+    LibBalsaImapCacheMessage *message;
+    gchar *item;
+    LibBalsaImapCacheObject *object;
+};
+
+struct _LibBalsaImapCache {
+    GMutex lock;
+    gchar *dir;
+    GHashTable *objects;        /* hash -> LibBalsaImapCacheObject */
+    GHashTable *messages;       /* key -> LibBalsaImapCacheMessage */
+    GQueue lru;                 /* objects, most recently used first */
+    guint n_entries;
+    off_t size;                 /* of all objects */
+    FILE *journal;              /* NULL if it cannot be opened */
+    guint records;              /* in the journal */
+    guint uses;                 /* not saved in the journal yet */
+    gboolean loading;           /* replaying the journal */
+};
+
+static GHashTable *imap_caches;
+G_LOCK_DEFINE_STATIC(imap_caches);
+
+/* Path of the file for hash. */
+static gchar *
+lbic_object_path(LibBalsaImapCache * cache, const gchar * hash)
+{
+    gchar shard[3];
+
+    shard[0] = hash[0];
+    shard[1] = hash[1];
+    shard[2] = '\0';
+
+    return g_build_filename(cache->dir, LBIC_OBJECTS, shard, hash, NULL);
+}
+
+/* Appends a record to the journal. */
+static void G_GNUC_PRINTF(2, 3)
+lbic_log(LibBalsaImapCache * cache, const gchar * format, ...)
+{
+    va_list args;
+
+    if (!cache->journal)
+        return;
+
+    va_start(args, format);
+    vfprintf(cache->journal, format, args);
+    va_end(args);
+    fputc('\n', cache->journal);
+    fflush(cache->journal);
+    cache->records++;
+}
+
+static void
+lbic_touch(LibBalsaImapCache * cache, LibBalsaImapCacheObject * object)
+{
+    g_queue_unlink(&cache->lru, &object->lru);
+    g_queue_push_head_link(&cache->lru, &object->lru);
+}
+
+/* Finds the object for hash, creating it if needed, and makes it the
+ * most recently used one. */
+static LibBalsaImapCacheObject *
+lbic_object_get(LibBalsaImapCache * cache, const gchar * hash, off_t size)
+{
+    LibBalsaImapCacheObject *object;
+
+    object = g_hash_table_lookup(cache->objects, hash);
+    if (object) {
+        lbic_touch(cache, object);
+        return object;
+    }
+
+    object = g_new0(LibBalsaImapCacheObject, 1);
+    object->hash = g_strdup(hash);
+    object->size = size;
+    object->lru.data = object;
+    g_hash_table_insert(cache->objects, object->hash, object);
+    g_queue_push_head_link(&cache->lru, &object->lru);
+    cache->size += size;
+
+    return object;
+}
+
+/* Removes the entry from its message, freeing the message when it has
+ * no entries left. */
+static void
+lbic_entry_free(LibBalsaImapCache * cache, LibBalsaImapCacheEntry * entry)
+{
+    LibBalsaImapCacheMessage *message = entry->message;
+
+    message->entries = g_slist_remove(message->entries, entry);
+    if (!message->entries) {
+        g_hash_table_remove(cache->messages, message->key);
+        g_free(message->key);
+        g_free(message);
+    }
+    cache->n_entries--;
+    g_free(entry->item);
+    g_free(entry);
+}
+
+/* Forgets the object and all entries referring to it.  The file is
+ * removed, except while the journal is read: it describes the past,
+ * and the hash may have been stored again later. */
+static void
+lbic_object_drop(LibBalsaImapCache * cache,
+                 LibBalsaImapCacheObject * object)
+{
+    GSList *list;
+
+    for (list = object->entries; list; list = list->next)
+        lbic_entry_free(cache, list->data);
+    g_slist_free(object->entries);
+
+    if (!cache->loading) {
+        gchar *path = lbic_object_path(cache, object->hash);
+        g_unlink(path);
+        g_free(path);
+    }
+
+    g_queue_unlink(&cache->lru, &object->lru);
+    cache->size -= object->size;
+    g_hash_table_remove(cache->objects, object->hash);
+    g_free(object->hash);
+    g_free(object);
+}
+
+static LibBalsaImapCacheEntry *
+lbic_entry_find(LibBalsaImapCache * cache, const gchar * msg_key,
+                const gchar * item)
+{
+    LibBalsaImapCacheMessage *message;
+    GSList *list;
+
+    message = g_hash_table_lookup(cache->messages, msg_key);
+    if (!message)
+        return NULL;
+    for (list = message->entries; list; list = list->next) {
+        LibBalsaImapCacheEntry *entry = list->data;
+        if (strcmp(entry->item, item) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Removes the entry; the object goes when nothing refers to it. */
+static void
+lbic_entry_unbind(LibBalsaImapCache * cache, LibBalsaImapCacheEntry * entry)
+{
+    LibBalsaImapCacheObject *object = entry->object;
+
+    object->entries = g_slist_remove(object->entries, entry);
+    lbic_entry_free(cache, entry);
+    if (!object->entries)
+        lbic_object_drop(cache, object);
+}
+
+/* Makes item of msg_key refer to object. */
+static void
+lbic_entry_bind(LibBalsaImapCache * cache, const gchar * msg_key,
+                const gchar * item, LibBalsaImapCacheObject * object)
+{
+    LibBalsaImapCacheMessage *message;
+    LibBalsaImapCacheEntry *entry;
+
+    entry = lbic_entry_find(cache, msg_key, item);
+    if (entry) {
+        if (entry->object == object)
+            return;
+        lbic_entry_unbind(cache, entry);
+    }
+
+    message = g_hash_table_lookup(cache->messages, msg_key);
+    if (!message) {
+        message = g_new0(LibBalsaImapCacheMessage, 1);
+        message->key = g_strdup(msg_key);
+        g_hash_table_insert(cache->messages, message->key, message);
+    }
+
+    entry = g_new(LibBalsaImapCacheEntry, 1);
+    entry->message = message;
+    entry->item = g_strdup(item);
+    entry->object = object;
+    message->entries = g_slist_prepend(message->entries, entry);
+    object->entries = g_slist_prepend(object->entries, entry);
+    cache->n_entries++;
+}
+
+/* Removes the files left over by an interrupted store, except recent
+ * ones of libbalsa_imap_cache_resume(), which a later transfer of the
+ * same item goes on with. */
+static void
+lbic_remove_tmp_files(LibBalsaImapCache * cache)
+{
+    gchar *objects = g_build_filename(cache->dir, LBIC_OBJECTS, NULL);
+    GDir *dir;
+    const gchar *name;
+    time_t now = time(NULL);
+
+    dir = g_dir_open(objects, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name(dir)) != NULL)
+            if (g_str_has_prefix(name, LBIC_TMP)) {
+                gchar *path = g_build_filename(objects, name, NULL);
+                GStatBuf st;
+
+                if (!g_str_has_prefix(name, LBIC_TMP "partial-")
+                    || g_stat(path, &st) != 0
+                    || now - st.st_mtime > LBIC_PARTIAL_MAX_AGE)
+                    g_unlink(path);
+                g_free(path);
+            }
+        g_dir_close(dir);
+    }
+    g_free(objects);
+}
+
+/* Whether name is that of a file of the flat cache used by older
+ * versions: the encoded "USER@HOST-MAILBOX-UIDVALIDITY-UID-body", or
+ * "...-UID-part-SECTION". */
+static gboolean
+lbic_is_flat_file(const gchar * name)
+{
+    const gchar *end;
+    guint i;
+
+    if (!strstr(name, "%40"))   /* the encoded '@' */
+        return FALSE;
+    if (g_str_has_suffix(name, "-body"))
+        end = name + strlen(name) - strlen("-body");
+    else if ((end = g_strrstr(name, "-part-")) != NULL) {
+        const gchar *section = end + strlen("-part-");
+
+        if (!*section
+            || section[strspn(section, "0123456789.")] != '\0')
+            return FALSE;
+    } else
+        return FALSE;
+
+    /* Preceded by "-UIDVALIDITY-UID". */
+    for (i = 0; i < 2; i++) {
+        const gchar *digits = end;
+
+        while (digits > name && g_ascii_isdigit(digits[-1]))
+            digits--;
+        if (digits == end || digits == name || digits[-1] != '-')
+            return FALSE;
+        end = digits - 1;
+    }
+
+    return TRUE;
+}
+
+/* Removes everything in the objects directory; used when there is no
+ * usable index.  Also removes the files of the flat cache used by
+ * older versions, which are named after the item. */
+static void
+lbic_wipe(LibBalsaImapCache * cache)
+{
+    gchar *objects = g_build_filename(cache->dir, LBIC_OBJECTS, NULL);
+    GDir *dir;
+    const gchar *name;
+
+    dir = g_dir_open(objects, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            gchar *path = g_build_filename(objects, name, NULL);
+            GDir *shard = g_dir_open(path, 0, NULL);
+
+            if (shard) {
+                const gchar *file;
+                while ((file = g_dir_read_name(shard)) != NULL) {
+                    gchar *fname = g_build_filename(path, file, NULL);
+                    g_unlink(fname);
+                    g_free(fname);
+                }
+                g_dir_close(shard);
+                g_rmdir(path);
+            } else
+                g_unlink(path);
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+    g_free(objects);
+
+    dir = g_dir_open(cache->dir, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name(dir)) != NULL)
+            if (lbic_is_flat_file(name)) {
+                gchar *path = g_build_filename(cache->dir, name, NULL);
+                g_unlink(path);
+                g_free(path);
+            }
+        g_dir_close(dir);
+    }
+}
+
+/* Splits line at spaces into at most n fields; returns the number of
+ * fields. */
+static guint
+lbic_split(gchar * line, gchar ** fields, guint n)
+{
+    guint i = 0;
+
+    while (*line && i < n) {
+        fields[i++] = line;
+        line = strchr(line, ' ');
+        if (!line)
+            break;
+        *line++ = '\0';
+    }
+
+    return i;
+}
+
+/* Replays one journal record; returns FALSE if it is malformed. */
+static gboolean
+lbic_replay(LibBalsaImapCache * cache, gchar * line)
+{
+    gchar *f[4];
+    guint n = lbic_split(line, f, 4);
+    LibBalsaImapCacheObject *object;
+    LibBalsaImapCacheEntry *entry;
+
+    if (n < 2 || f[0][1] != '\0')
+        return FALSE;
+
+    switch (f[0][0]) {
+    case 'O':
+        if (n != 3)
+            return FALSE;
+        lbic_object_get(cache, f[1], g_ascii_strtoll(f[2], NULL, 10));
+        return TRUE;
+    case 'T':
+    case 'D':
+        if (n != 2)
+            return FALSE;
+        object = g_hash_table_lookup(cache->objects, f[1]);
+        if (object) {
+            if (f[0][0] == 'T')
+                lbic_touch(cache, object);
+            else
+                lbic_object_drop(cache, object);
+        }
+        return TRUE;
+    case 'E':
+        if (n != 4
+            || !(object = g_hash_table_lookup(cache->objects, f[3])))
+            return FALSE;
+        lbic_entry_bind(cache, f[1], f[2], object);
+        return TRUE;
+    case 'R':
+        if (n != 3)
+            return FALSE;
+        if ((entry = lbic_entry_find(cache, f[1], f[2])))
+            lbic_entry_unbind(cache, entry);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Reads the journal; returns FALSE if there is none, or it is not
+ * ours.  A malformed record, probably the last one, written when we
+ * crashed, ends the replay, and sets damaged. */
+static gboolean
+lbic_load(LibBalsaImapCache * cache, const gchar * index,
+          gboolean * damaged)
+{
+    gchar *contents;
+    gchar *line, *next;
+
+    if (!g_file_get_contents(index, &contents, NULL, NULL))
+        return FALSE;
+
+    next = strchr(contents, '\n');
+    if (!next || strncmp(contents, LBIC_MAGIC "\n",
+                         sizeof(LBIC_MAGIC)) != 0) {
+        g_free(contents);
+        return FALSE;
+    }
+
+    *damaged = FALSE;
+    cache->loading = TRUE;
+    for (line = next + 1; *line; line = next + 1) {
+        next = strchr(line, '\n');
+        if (next)
+            *next = '\0';
+        if (!next || !lbic_replay(cache, line)) {
+            *damaged = TRUE;
+            break;
+        }
+        cache->records++;
+    }
+    cache->loading = FALSE;
+    g_free(contents);
+
+    return TRUE;
+}
+
+/* Rewrites the journal with just the records needed, from the least
+ * recently used object to the most recently used one, and opens it
+ * for appending. */
+static void
+lbic_compact(LibBalsaImapCache * cache)
+{
+    gchar *index = g_build_filename(cache->dir, LBIC_INDEX, NULL);
+    gchar *tmp = g_strconcat(index, ".new", NULL);
+    FILE *fp;
+    GList *list;
+    guint records = 0;
+
+    if (cache->journal) {
+        fclose(cache->journal);
+        cache->journal = NULL;
+    }
+
+    fp = fopen(tmp, "w");
+    if (fp) {
+        gboolean ok;
+
+        fputs(LBIC_MAGIC "\n", fp);
+        for (list = cache->lru.tail; list; list = list->prev) {
+            LibBalsaImapCacheObject *object = list->data;
+            GSList *l;
+
+            fprintf(fp, "O %s %" G_GINT64_FORMAT "\n", object->hash,
+                    (gint64) object->size);
+            for (l = object->entries; l; l = l->next) {
+                LibBalsaImapCacheEntry *entry = l->data;
+                fprintf(fp, "E %s %s %s\n", entry->message->key,
+                        entry->item, object->hash);
+            }
+            records += 1 + g_slist_length(object->entries);
+        }
+        ok = !ferror(fp);
+        ok = fclose(fp) == 0 && ok && g_rename(tmp, index) == 0;
+        if (ok) {
+            cache->records = records;
+            cache->uses = 0;
+        } else {
+            libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                                 _("Could not write the IMAP cache "
+                                   "index %s"), index);
+            g_unlink(tmp);
+        }
+    }
+
+    cache->journal = fopen(index, "a");
+    g_free(tmp);
+    g_free(index);
+}
+
+static void
+lbic_maybe_compact(LibBalsaImapCache * cache)
+{
+    guint needed = g_hash_table_size(cache->objects) + cache->n_entries;
+
+    if (cache->records > 2 * needed + LBIC_SLACK
+        || cache->uses > LBIC_SLACK)
+        lbic_compact(cache);
+}
+
+static LibBalsaImapCache *
+lbic_new(const gchar * dir)
+{
+    LibBalsaImapCache *cache;
+    gchar *index;
+    gboolean damaged;
+
+    cache = g_new0(LibBalsaImapCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->dir = g_strdup(dir);
+    cache->objects = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->messages = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&cache->lru);
+
+    g_mkdir_with_parents(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    index = g_build_filename(dir, LBIC_INDEX, NULL);
+    if (lbic_load(cache, index, &damaged)) {
+        lbic_remove_tmp_files(cache);
+        if (damaged)
+            lbic_compact(cache);
+        else
+            lbic_maybe_compact(cache);
+        if (!cache->journal)
+            cache->journal = fopen(index, "a");
+    } else {
+        lbic_wipe(cache);
+        lbic_compact(cache);
+    }
+    g_free(index);
+
+    if (!cache->journal)
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             _("Could not open the IMAP cache index in %s: "
+                               "%s"), dir, g_strerror(errno));
+
+    return cache;
+}
+
+/**
+ * libbalsa_imap_cache_get:
+ * @dir: the cache directory
+ *
+ * Returns the cache in @dir, reading its index the first time.  The
+ * cache is never freed.
+ **/
+LibBalsaImapCache *
+libbalsa_imap_cache_get(const gchar * dir)
+{
+    LibBalsaImapCache *cache;
+
+    G_LOCK(imap_caches);
+    if (!imap_caches)
+        imap_caches = g_hash_table_new(g_str_hash, g_str_equal);
+    cache = g_hash_table_lookup(imap_caches, dir);
+    if (!cache) {
+        cache = lbic_new(dir);
+        g_hash_table_insert(imap_caches, cache->dir, cache);
+    }
+    G_UNLOCK(imap_caches);
+
+    return cache;
+}
+
+/**
+ * libbalsa_imap_cache_lookup:
+ * @cache: a #LibBalsaImapCache
+ * @msg_key: the message
+ * @item: the item of the message
+ *
+ * Returns the path of the file holding @item, or %NULL if it is not
+ * cached.  The file may vanish before it is opened, if another
+ * thread evicts it; this should be treated like a cache miss.
+ **/
+gchar *
+libbalsa_imap_cache_lookup(LibBalsaImapCache * cache,
+                           const gchar * msg_key, const gchar * item)
+{
+    LibBalsaImapCacheEntry *entry;
+    gchar *path = NULL;
+
+    g_mutex_lock(&cache->lock);
+    entry = lbic_entry_find(cache, msg_key, item);
+    if (entry) {
+        lbic_touch(cache, entry->object);
+        cache->uses++;
+        lbic_maybe_compact(cache);
+        path = lbic_object_path(cache, entry->object->hash);
+    }
+    g_mutex_unlock(&cache->lock);
+
+    return path;
+}
+
+/**
+ * libbalsa_imap_cache_contains:
+ * @cache: a #LibBalsaImapCache
+ * @msg_key: the message
+ * @item: the item of the message
+ *
+ * Like libbalsa_imap_cache_lookup(), but does not count as a use.
+ *
+ * Returns: whether @item is cached.
+ **/
+gboolean
+libbalsa_imap_cache_contains(LibBalsaImapCache * cache,
+                             const gchar * msg_key, const gchar * item)
+{
+    gboolean retval;
+
+    g_mutex_lock(&cache->lock);
+    retval = lbic_entry_find(cache, msg_key, item) != NULL;
+    g_mutex_unlock(&cache->lock);
+
+    return retval;
+}
+
+/**
+ * libbalsa_imap_cache_create:
+ * @cache: a #LibBalsaImapCache
+ * @tmp_path: location for the path of the file
+ *
+ * Creates a temporary file in the cache, to be filled by the caller
+ * and passed to libbalsa_imap_cache_store(), or removed.
+ *
+ * Returns: the file opened for reading and writing, or %NULL.
+ **/
+FILE *
+libbalsa_imap_cache_create(LibBalsaImapCache * cache, gchar ** tmp_path)
+{
+    gchar *path;
+    int fd;
+    FILE *fp;
+
+    path = g_build_filename(cache->dir, LBIC_OBJECTS, NULL);
+    g_mkdir_with_parents(path, S_IRUSR | S_IWUSR | S_IXUSR);
+    g_free(path);
+
+    path = g_build_filename(cache->dir, LBIC_OBJECTS,
+                            LBIC_TMP "XXXXXX", NULL);
+    fd = g_mkstemp(path);
+    if (fd < 0 || !(fp = fdopen(fd, "wb+"))) {
+        if (fd >= 0) {
+            close(fd);
+            g_unlink(path);
+        }
+        g_free(path);
+        return NULL;
+    }
+    *tmp_path = path;
+
+    return fp;
+}
+
+/**
+ * libbalsa_imap_cache_resume:
+ * @cache: a #LibBalsaImapCache
+ * @msg_key: the message
+ * @item: the item of the message, and anything else that decides
+ *        what is written to the file
+ * @tmp_path: location for the path of the file
+ *
+ * Like libbalsa_imap_cache_create(), but the file is named after
+ * @msg_key and @item, and what an earlier, interrupted transfer of
+ * the same item wrote to it is kept, also after a restart.  Unlike
+ * other temporary files, it is removed when the cache is opened only
+ * if it has not been written to for a week.
+ *
+ * Returns: the file opened for reading and writing, positioned at
+ * its end, or %NULL.
+ **/
+FILE *
+libbalsa_imap_cache_resume(LibBalsaImapCache * cache,
+                           const gchar * msg_key, const gchar * item,
+                           gchar ** tmp_path)
+{
+    gchar *path, *name, *hash;
+    int fd;
+    FILE *fp;
+
+    path = g_build_filename(cache->dir, LBIC_OBJECTS, NULL);
+    g_mkdir_with_parents(path, S_IRUSR | S_IWUSR | S_IXUSR);
+    g_free(path);
+
+    name = g_strconcat(msg_key, " ", item, NULL);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, name, -1);
+    g_free(name);
+    name = g_strconcat(LBIC_TMP "partial-", hash, NULL);
+    g_free(hash);
+    path = g_build_filename(cache->dir, LBIC_OBJECTS, name, NULL);
+    g_free(name);
+
+    fd = g_open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0 || !(fp = fdopen(fd, "rb+"))) {
+        if (fd >= 0)
+            close(fd);
+        g_free(path);
+        return NULL;
+    }
+    if (fseeko(fp, 0, SEEK_END) != 0) {
+        fclose(fp);
+        g_free(path);
+        return NULL;
+    }
+    *tmp_path = path;
+
+    return fp;
+}
+
+/* Computes the hash of the file at path. */
+static gchar *
+lbic_hash_file(const gchar * path, off_t * size)
+{
+    FILE *fp;
+    GChecksum *checksum;
+    guchar buf[65536];
+    size_t len;
+    gchar *hash = NULL;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    *size = 0;
+    while ((len = fread(buf, 1, sizeof buf, fp)) > 0) {
+        g_checksum_update(checksum, buf, len);
+        *size += len;
+    }
+    if (!ferror(fp))
+        hash = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    fclose(fp);
+
+    return hash;
+}
+
+/**
+ * libbalsa_imap_cache_store:
+ * @cache: a #LibBalsaImapCache
+ * @msg_key: the message
+ * @item: the item of the message
+ * @tmp_path: a complete file from libbalsa_imap_cache_create()
+ *
+ * Moves the file at @tmp_path into the cache as @item of @msg_key; the
+ * file is removed if it cannot be.
+ *
+ * Returns: the path of the cached file, or %NULL on failure.
+ **/
+gchar *
+libbalsa_imap_cache_store(LibBalsaImapCache * cache,
+                          const gchar * msg_key, const gchar * item,
+                          const gchar * tmp_path)
+{
+    LibBalsaImapCacheObject *object;
+    gchar *hash, *path, *shard;
+    off_t size;
+
+    hash = lbic_hash_file(tmp_path, &size);
+    if (!hash) {
+        g_unlink(tmp_path);
+        return NULL;
+    }
+    path = lbic_object_path(cache, hash);
+    shard = g_path_get_dirname(path);
+    g_mkdir_with_parents(shard, S_IRUSR | S_IWUSR | S_IXUSR);
+    g_free(shard);
+
+    g_mutex_lock(&cache->lock);
+    /* Replace any copy, in case it vanished or was damaged. */
+    if (g_rename(tmp_path, path) != 0) {
+        g_mutex_unlock(&cache->lock);
+        g_unlink(tmp_path);
+        g_free(hash);
+        g_free(path);
+        return NULL;
+    }
+    object = lbic_object_get(cache, hash, size);
+    lbic_log(cache, "O %s %" G_GINT64_FORMAT, hash, (gint64) size);
+    lbic_entry_bind(cache, msg_key, item, object);
+    lbic_log(cache, "E %s %s %s", msg_key, item, hash);
+    g_mutex_unlock(&cache->lock);
+    g_free(hash);
+
+    return path;
+}
+
+/**
+ * libbalsa_imap_cache_remove:
+ * @cache: a #LibBalsaImapCache
+ * @msg_key: the message
+ * @item: the item to remove, or %NULL for all items of the message
+ *
+ * Removes items from the cache.
+ **/
+void
+libbalsa_imap_cache_remove(LibBalsaImapCache * cache,
+                           const gchar * msg_key, const gchar * item)
+{
+    LibBalsaImapCacheMessage *message;
+    LibBalsaImapCacheEntry *entry;
+
+    g_mutex_lock(&cache->lock);
+    if (item) {
+        entry = lbic_entry_find(cache, msg_key, item);
+        if (entry) {
+            lbic_log(cache, "R %s %s", msg_key, item);
+            lbic_entry_unbind(cache, entry);
+        }
+    } else {
+        while ((message = g_hash_table_lookup(cache->messages, msg_key))) {
+            entry = message->entries->data;
+            lbic_log(cache, "R %s %s", msg_key, entry->item);
+            lbic_entry_unbind(cache, entry);
+        }
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+/**
+ * libbalsa_imap_cache_copy:
+ * @cache: a #LibBalsaImapCache
+ * @src_key: the message to copy from
+ * @dst_key: the message to copy to
+ *
+ * Gives @dst_key all cached items of @src_key.  The files are shared,
+ * not copied.
+ **/
+void
+libbalsa_imap_cache_copy(LibBalsaImapCache * cache,
+                         const gchar * src_key, const gchar * dst_key)
+{
+    LibBalsaImapCacheMessage *message;
+    GSList *list;
+
+    if (strcmp(src_key, dst_key) == 0)
+        return;
+
+    g_mutex_lock(&cache->lock);
+    message = g_hash_table_lookup(cache->messages, src_key);
+    if (message) {
+        for (list = message->entries; list; list = list->next) {
+            LibBalsaImapCacheEntry *entry = list->data;
+            lbic_entry_bind(cache, dst_key, entry->item, entry->object);
+            lbic_log(cache, "E %s %s %s", dst_key, entry->item,
+                     entry->object->hash);
+        }
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+/**
+ * libbalsa_imap_cache_trim:
+ * @cache: a #LibBalsaImapCache
+ * @max_size: the size to keep
+ *
+ * Evicts the least recently used files, until the cache takes at most
+ * @max_size bytes.
+ **/
+void
+libbalsa_imap_cache_trim(LibBalsaImapCache * cache, off_t max_size)
+{
+    g_mutex_lock(&cache->lock);
+    while (cache->size > max_size && cache->lru.tail) {
+        LibBalsaImapCacheObject *object = cache->lru.tail->data;
+
+        lbic_log(cache, "D %s", object->hash);
+        lbic_object_drop(cache, object);
+    }
+    lbic_maybe_compact(cache);
+    g_mutex_unlock(&cache->lock);
+}
+
+/**
+ * libbalsa_imap_cache_get_size:
+ * @cache: a #LibBalsaImapCache
+ *
+ * Returns: the total size of the cached files.
+ **/
+off_t
+libbalsa_imap_cache_get_size(LibBalsaImapCache * cache)
+{
+    off_t size;
+
+    g_mutex_lock(&cache->lock);
+    size = cache->size;
+    g_mutex_unlock(&cache->lock);
+
+    return size;
+}
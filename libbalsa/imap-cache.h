@@ -0,0 +1,60 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBBALSA_IMAP_CACHE_H__
+#define __LIBBALSA_IMAP_CACHE_H__
+
+#ifndef BALSA_VERSION
+# error "Include config.h before this file."
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <glib.h>
+
+typedef struct _LibBalsaImapCache LibBalsaImapCache;
+
+LibBalsaImapCache *libbalsa_imap_cache_get(const gchar * dir);
+
+gchar *libbalsa_imap_cache_lookup(LibBalsaImapCache * cache,
+                                  const gchar * msg_key,
+                                  const gchar * item);
+gboolean libbalsa_imap_cache_contains(LibBalsaImapCache * cache,
+                                      const gchar * msg_key,
+                                      const gchar * item);
+FILE *libbalsa_imap_cache_create(LibBalsaImapCache * cache,
+                                 gchar ** tmp_path);
+FILE *libbalsa_imap_cache_resume(LibBalsaImapCache * cache,
+                                 const gchar * msg_key,
+                                 const gchar * item, gchar ** tmp_path);
+gchar *libbalsa_imap_cache_store(LibBalsaImapCache * cache,
+                                 const gchar * msg_key,
+                                 const gchar * item,
+                                 const gchar * tmp_path);
+void libbalsa_imap_cache_remove(LibBalsaImapCache * cache,
+                                const gchar * msg_key,
+                                const gchar * item);
+void libbalsa_imap_cache_copy(LibBalsaImapCache * cache,
+                              const gchar * src_key,
+                              const gchar * dst_key);
+void libbalsa_imap_cache_trim(LibBalsaImapCache * cache, off_t max_size);
+off_t libbalsa_imap_cache_get_size(LibBalsaImapCache * cache);
+
+#endif                          /* __LIBBALSA_IMAP_CACHE_H__ */
@@ -0,0 +1,465 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * LibBalsaImapPartStream: the content of a message part in the IMAP
+ * part cache, read while it is still being fetched.
+ *
+ * A cached part is a MIME header followed by the content in the
+ * transfer encoding named there.  The stream skips the header and
+ * decodes the content, so that readers get the data of the part.
+ *
+ * The file may still grow: the thread fetching it reports its size
+ * through a LibBalsaImapPartFeed, and a reader that has caught up
+ * waits until more data arrive or the transfer is over.  Creating a
+ * stream only opens the file, so it never waits: the header is read
+ * on the first read.
+ */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include "imap-part-stream.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <gmime/gmime.h>
+
+#include <glib/gi18n.h>
+
+/* The header is looked for in this many bytes at most. */
+#define LBIPS_HEADER_MAX (64*1024)
+/* A reader that has caught up checks for cancellation this often. */
+#define LBIPS_POLL_USEC  (200*1000)
+
+struct _LibBalsaImapPartFeed {
+    gint ref_count;
+    GMutex lock;
+    GCond cond;
+    goffset size;               /* of the data written so far */
+    gboolean done;
+    GError *error;              /* why the transfer failed */
+};
+
+struct _LibBalsaImapPartStream {
+    GInputStream parent;
+
+    int fd;
+    goffset pos;                /* in the file */
+    LibBalsaImapPartFeed *feed; /* NULL for a complete file */
+    gboolean header_done;       /* pos is at the content */
+    gboolean decode;
+    GMimeEncoding encoding;     /* state of the decoder */
+    GByteArray *pending;        /* decoded, not read yet */
+    gboolean eof;               /* decoder flushed */
+};
+
+G_DEFINE_TYPE(LibBalsaImapPartStream, libbalsa_imap_part_stream,
+              G_TYPE_INPUT_STREAM)
+
+/*
+ * The feed.
+ */
+
+/**
+ * libbalsa_imap_part_feed_new:
+ * @size: the size of the file already written
+ *
+ * Creates the progress record for a file that is being written.
+ *
+ * Returns: a new #LibBalsaImapPartFeed.
+ **/
+LibBalsaImapPartFeed *
+libbalsa_imap_part_feed_new(goffset size)
+{
+    LibBalsaImapPartFeed *feed = g_new0(LibBalsaImapPartFeed, 1);
+
+    feed->ref_count = 1;
+    g_mutex_init(&feed->lock);
+    g_cond_init(&feed->cond);
+    feed->size = size;
+
+    return feed;
+}
+
+LibBalsaImapPartFeed *
+libbalsa_imap_part_feed_ref(LibBalsaImapPartFeed * feed)
+{
+    g_atomic_int_inc(&feed->ref_count);
+
+    return feed;
+}
+
+void
+libbalsa_imap_part_feed_unref(LibBalsaImapPartFeed * feed)
+{
+    if (!g_atomic_int_dec_and_test(&feed->ref_count))
+        return;
+
+    g_mutex_clear(&feed->lock);
+    g_cond_clear(&feed->cond);
+    g_clear_error(&feed->error);
+    g_free(feed);
+}
+
+/**
+ * libbalsa_imap_part_feed_grow:
+ * @feed: a #LibBalsaImapPartFeed
+ * @size: the size of the data written and flushed so far
+ *
+ * Wakes up the readers waiting for data.
+ **/
+void
+libbalsa_imap_part_feed_grow(LibBalsaImapPartFeed * feed, goffset size)
+{
+    g_mutex_lock(&feed->lock);
+    feed->size = size;
+    g_cond_broadcast(&feed->cond);
+    g_mutex_unlock(&feed->lock);
+}
+
+/**
+ * libbalsa_imap_part_feed_done:
+ * @feed: a #LibBalsaImapPartFeed
+ * @error: why the transfer failed, or %NULL if the file is complete
+ *
+ * Ends the transfer.  Readers get what was written, and then @error.
+ **/
+void
+libbalsa_imap_part_feed_done(LibBalsaImapPartFeed * feed,
+                             const GError * error)
+{
+    g_mutex_lock(&feed->lock);
+    feed->done = TRUE;
+    if (error)
+        feed->error = g_error_copy(error);
+    g_cond_broadcast(&feed->cond);
+    g_mutex_unlock(&feed->lock);
+}
+
+/**
+ * libbalsa_imap_part_feed_wait:
+ * @feed: a #LibBalsaImapPartFeed
+ * @err: location for the error of a failed transfer
+ *
+ * Waits for the end of the transfer.
+ *
+ * Returns: %TRUE if the file is complete.
+ **/
+gboolean
+libbalsa_imap_part_feed_wait(LibBalsaImapPartFeed * feed, GError ** err)
+{
+    gboolean ok;
+
+    g_mutex_lock(&feed->lock);
+    while (!feed->done)
+        g_cond_wait(&feed->cond, &feed->lock);
+    ok = feed->error == NULL;
+    if (!ok)
+        g_propagate_error(err, g_error_copy(feed->error));
+    g_mutex_unlock(&feed->lock);
+
+    return ok;
+}
+
+/* Waits until there is data at pos or the transfer is over; sets
+ * *size to the size of the data. */
+static gboolean
+lbips_feed_wait_for(LibBalsaImapPartFeed * feed, goffset pos,
+                    goffset * size, GCancellable * cancellable,
+                    GError ** err)
+{
+    gboolean ok = TRUE;
+
+    g_mutex_lock(&feed->lock);
+    while (!feed->done && feed->size <= pos) {
+        if (g_cancellable_set_error_if_cancelled(cancellable, err)) {
+            ok = FALSE;
+            break;
+        }
+        g_cond_wait_until(&feed->cond, &feed->lock,
+                          g_get_monotonic_time() + LBIPS_POLL_USEC);
+    }
+    if (ok && feed->error && feed->size <= pos) {
+        g_propagate_error(err, g_error_copy(feed->error));
+        ok = FALSE;
+    }
+    *size = feed->size;
+    g_mutex_unlock(&feed->lock);
+
+    return ok;
+}
+
+/*
+ * The stream.
+ */
+
+/* Reads the file as it is, waiting for data if needed. */
+static gssize
+lbips_read_raw(LibBalsaImapPartStream * stream, void *buffer,
+               gsize count, GCancellable * cancellable, GError ** error)
+{
+    gssize got;
+
+    if (stream->feed) {
+        goffset size;
+
+        if (!lbips_feed_wait_for(stream->feed, stream->pos, &size,
+                                 cancellable, error))
+            return -1;
+        if (stream->pos >= size)
+            return 0;
+        count = MIN(count, (gsize) (size - stream->pos));
+    }
+
+    do
+        got = pread(stream->fd, buffer, count, stream->pos);
+    while (got < 0 && errno == EINTR);
+    if (got < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    _("Error reading from file: %s"), g_strerror(errsv));
+        return -1;
+    }
+    stream->pos += got;
+
+    return got;
+}
+
+/* Returns the length of the header, including the empty line that
+ * ends it, or 0 if buf does not hold all of it. */
+static gsize
+lbips_header_end(const gchar * buf, gsize len)
+{
+    gsize i = 0;
+
+    while (i < len) {
+        const gchar *eol;
+
+        if (buf[i] == '\n')
+            return i + 1;
+        if (buf[i] == '\r' && i + 1 < len && buf[i + 1] == '\n')
+            return i + 2;
+        eol = memchr(buf + i, '\n', len - i);
+        if (!eol)
+            break;
+        i = eol - buf + 1;
+    }
+
+    return 0;
+}
+
+/* Finds the Content-Transfer-Encoding in the header. */
+static GMimeContentEncoding
+lbips_header_encoding(const gchar * buf, gsize len)
+{
+    static const gchar cte[] = "Content-Transfer-Encoding:";
+    GMimeContentEncoding encoding = GMIME_CONTENT_ENCODING_DEFAULT;
+    gsize i = 0;
+
+    while (i < len) {
+        const gchar *eol = memchr(buf + i, '\n', len - i);
+        gsize end = eol ? (gsize) (eol - buf) : len;
+
+        if (end - i > sizeof cte - 1
+            && g_ascii_strncasecmp(buf + i, cte, sizeof cte - 1) == 0) {
+            gchar *value = g_strndup(buf + i + sizeof cte - 1,
+                                     end - i - (sizeof cte - 1));
+            encoding =
+                g_mime_content_encoding_from_string(g_strstrip(value));
+            g_free(value);
+        }
+        i = end + 1;
+    }
+
+    return encoding;
+}
+
+/* Skips the header, which gives the encoding of the content; waits
+ * for it if needed. */
+static gboolean
+lbips_read_header(LibBalsaImapPartStream * stream,
+                  GCancellable * cancellable, GError ** error)
+{
+    GMimeContentEncoding encoding;
+    GString *header;
+    gsize end = 0;
+
+    header = g_string_new(NULL);
+    while (header->len < LBIPS_HEADER_MAX) {
+        gchar buf[4096];
+        gssize got = lbips_read_raw(stream, buf, sizeof buf,
+                                    cancellable, error);
+
+        if (got < 0) {
+            g_string_free(header, TRUE);
+            return FALSE;
+        }
+        if (got == 0)
+            break;
+        g_string_append_len(header, buf, got);
+        if ((end = lbips_header_end(header->str, header->len)) > 0)
+            break;
+    }
+    if (end == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("The cached part has no header"));
+        g_string_free(header, TRUE);
+        return FALSE;
+    }
+
+    encoding = lbips_header_encoding(header->str, end);
+    g_string_free(header, TRUE);
+    stream->pos = end;
+    stream->header_done = TRUE;
+    if (encoding == GMIME_CONTENT_ENCODING_BASE64
+        || encoding == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE
+        || encoding == GMIME_CONTENT_ENCODING_UUENCODE) {
+        stream->decode = TRUE;
+        g_mime_encoding_init_decode(&stream->encoding, encoding);
+    }
+
+    return TRUE;
+}
+
+static gssize
+lbips_read(GInputStream * istream, void *buffer, gsize count,
+           GCancellable * cancellable, GError ** error)
+{
+    LibBalsaImapPartStream *stream = LIBBALSA_IMAP_PART_STREAM(istream);
+    gchar raw[16384];
+    gsize n;
+
+    if (!stream->header_done
+        && !lbips_read_header(stream, cancellable, error))
+        return -1;
+    if (!stream->decode)
+        return lbips_read_raw(stream, buffer, count, cancellable, error);
+
+    while (stream->pending->len == 0 && !stream->eof) {
+        gssize got = lbips_read_raw(stream, raw, sizeof raw,
+                                    cancellable, error);
+        if (got < 0)
+            return -1;
+
+        g_byte_array_set_size(stream->pending,
+                              g_mime_encoding_outlen(&stream->encoding,
+                                                     got));
+        if (got > 0)
+            n = g_mime_encoding_step(&stream->encoding, raw, got,
+                                     (gchar *) stream->pending->data);
+        else {
+            n = g_mime_encoding_flush(&stream->encoding, raw, 0,
+                                      (gchar *) stream->pending->data);
+            stream->eof = TRUE;
+        }
+        g_byte_array_set_size(stream->pending, n);
+    }
+
+    n = MIN(count, stream->pending->len);
+    memcpy(buffer, stream->pending->data, n);
+    g_byte_array_remove_range(stream->pending, 0, n);
+
+    return n;
+}
+
+static gboolean
+lbips_close(GInputStream * istream, GCancellable * cancellable,
+            GError ** error)
+{
+    LibBalsaImapPartStream *stream = LIBBALSA_IMAP_PART_STREAM(istream);
+
+    if (stream->fd >= 0) {
+        close(stream->fd);
+        stream->fd = -1;
+    }
+
+    return TRUE;
+}
+
+static void
+lbips_finalize(GObject * object)
+{
+    LibBalsaImapPartStream *stream = LIBBALSA_IMAP_PART_STREAM(object);
+
+    if (stream->fd >= 0)
+        close(stream->fd);
+    if (stream->feed)
+        libbalsa_imap_part_feed_unref(stream->feed);
+    g_byte_array_free(stream->pending, TRUE);
+
+    G_OBJECT_CLASS(libbalsa_imap_part_stream_parent_class)->
+        finalize(object);
+}
+
+static void
+libbalsa_imap_part_stream_init(LibBalsaImapPartStream * stream)
+{
+    stream->fd = -1;
+    stream->pending = g_byte_array_new();
+}
+
+static void
+libbalsa_imap_part_stream_class_init(LibBalsaImapPartStreamClass * klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS(klass);
+
+    object_class->finalize = lbips_finalize;
+    stream_class->read_fn = lbips_read;
+    stream_class->close_fn = lbips_close;
+}
+
+/**
+ * libbalsa_imap_part_stream_new:
+ * @path: a part in the IMAP cache
+ * @feed: the progress of the transfer, or %NULL if the file is complete
+ * @err: location for an error
+ *
+ * Opens the content of a cached part, which may still be growing.
+ *
+ * Returns: a new #GInputStream, or %NULL on failure.
+ **/
+GInputStream *
+libbalsa_imap_part_stream_new(const gchar * path,
+                              LibBalsaImapPartFeed * feed, GError ** err)
+{
+    LibBalsaImapPartStream *stream;
+    int fd;
+
+    fd = g_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        int errsv = errno;
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    _("Cannot open %s: %s"), path, g_strerror(errsv));
+        return NULL;
+    }
+
+    stream = g_object_new(LIBBALSA_TYPE_IMAP_PART_STREAM, NULL);
+    stream->fd = fd;
+    if (feed)
+        stream->feed = libbalsa_imap_part_feed_ref(feed);
+
+    return G_INPUT_STREAM(stream);
+}
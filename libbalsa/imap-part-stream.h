@@ -0,0 +1,67 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBBALSA_IMAP_PART_STREAM_H__
+#define __LIBBALSA_IMAP_PART_STREAM_H__
+
+#ifndef BALSA_VERSION
+# error "Include config.h before this file."
+#endif
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+#define LIBBALSA_TYPE_IMAP_PART_STREAM                                  \
+    (libbalsa_imap_part_stream_get_type())
+#define LIBBALSA_IMAP_PART_STREAM(obj)                                  \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj),                                  \
+                                LIBBALSA_TYPE_IMAP_PART_STREAM,         \
+                                LibBalsaImapPartStream))
+#define LIBBALSA_IS_IMAP_PART_STREAM(obj)                               \
+    (G_TYPE_CHECK_INSTANCE_TYPE((obj), LIBBALSA_TYPE_IMAP_PART_STREAM))
+
+typedef struct _LibBalsaImapPartStream LibBalsaImapPartStream;
+typedef struct _LibBalsaImapPartStreamClass LibBalsaImapPartStreamClass;
+
+/* Progress of a part being written to a file by another thread. */
+typedef struct _LibBalsaImapPartFeed LibBalsaImapPartFeed;
+
+struct _LibBalsaImapPartStreamClass {
+    GInputStreamClass parent_class;
+};
+
+GType libbalsa_imap_part_stream_get_type(void) G_GNUC_CONST;
+GInputStream *libbalsa_imap_part_stream_new(const gchar * path,
+                                            LibBalsaImapPartFeed * feed,
+                                            GError ** err);
+
+LibBalsaImapPartFeed *libbalsa_imap_part_feed_new(goffset size);
+LibBalsaImapPartFeed *libbalsa_imap_part_feed_ref(LibBalsaImapPartFeed *
+                                                  feed);
+void libbalsa_imap_part_feed_unref(LibBalsaImapPartFeed * feed);
+void libbalsa_imap_part_feed_grow(LibBalsaImapPartFeed * feed,
+                                  goffset size);
+void libbalsa_imap_part_feed_done(LibBalsaImapPartFeed * feed,
+                                  const GError * error);
+gboolean libbalsa_imap_part_feed_wait(LibBalsaImapPartFeed * feed,
+                                      GError ** err);
+
+G_END_DECLS
+#endif                          /* __LIBBALSA_IMAP_PART_STREAM_H__ */
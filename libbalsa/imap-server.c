@@ -19,7 +19,9 @@
 /*
   LibBalsaImapServer is a class for managing connections to one IMAP
   server. Idle connections are disconnected after a timeout, or when
-  the user switches to offline mode.
+  the user switches to offline mode. A configurable number of them is
+  opened in parallel at startup and kept warm, so that opening the
+  first folder does not wait for connecting and logging in.
 */
 
 #if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
@@ -49,12 +51,17 @@ struct LibBalsaImapServer_ {
     guint connection_cleanup_id;
     gchar *key;
     guint max_connections;
+    guint preconnect;   /**< connections to open at startup and keep */
+    gboolean preconnected;
     gboolean offline_mode;
+    guint offline_budget; /**< MB for the offline copies of all mailboxes */
+    guint offline_rate;   /**< kB/s to download them at; 0: no limit */
     
     GMutex lock; /* protects the following members */
     guint used_connections;
     GList *used_handles;
     GList *free_handles;
+    guint64 offline_used; /**< bytes the offline copies hold */
     gboolean persistent_cache; /* if TRUE, messages will be cached in
                                     $HOME and preserved between
                                     sessions. If FALSE, messages will be
@@ -82,6 +89,12 @@ static gboolean connection_cleanup(gpointer ptr);
 #define CONNECTION_CLEANUP_NOOP_TIME    (20*60)
 /* We try to avoid too many connections per server */
 #define MAX_CONNECTIONS_PER_SERVER 20
+/* Connections opened at startup by default */
+#define PRECONNECT_PER_SERVER 2
+/* Disk space for the offline copies of the mailboxes, in MB */
+#define OFFLINE_BUDGET_PER_SERVER 200
+/* Drop a handle after that many consecutive failures */
+#define HANDLE_MAX_FAILURES 3
 
 static GMutex imap_servers_lock;
 static GHashTable *imap_servers = NULL;
@@ -90,6 +103,8 @@ struct handle_info {
     ImapMboxHandle *handle;
     time_t last_used;
     void *last_user;
+    gint64 latency;     /* smoothed time of connects and NOOPs, in usec */
+    guint failures;     /* consecutive failed connects and NOOPs */
 };
 
 static int by_handle(gconstpointer a, gconstpointer b)
@@ -97,11 +112,6 @@ static int by_handle(gconstpointer a, gconstpointer b)
     return ((struct handle_info*)a)->handle != b;
 }
 
-static int by_last_user(gconstpointer a, gconstpointer b)
-{
-    return ((struct handle_info*)a)->last_user != b;
-}
-
 GType
 libbalsa_imap_server_get_type(void)
 {
@@ -195,6 +205,8 @@ libbalsa_imap_server_init(LibBalsaImapServer * imap_server)
     imap_server->key = NULL;
     g_mutex_init(&imap_server->lock);
     imap_server->max_connections = MAX_CONNECTIONS_PER_SERVER;
+    imap_server->preconnect = PRECONNECT_PER_SERVER;
+    imap_server->offline_budget = OFFLINE_BUDGET_PER_SERVER;
     imap_server->used_connections = 0;
     imap_server->used_handles = NULL;
     imap_server->free_handles = NULL;
@@ -298,17 +310,106 @@ lb_imap_server_info_free(struct handle_info *info)
     if (info == NULL)
         return;
 
-    //imap_handle_force_disconnect(info->handle); -- FIXME unref'ing handle will disconnect?
+    /* Disconnect explicitly: the handle may be referenced elsewhere,
+     * e.g. by a folder watch in mailbox_imap.c. */
+    imap_handle_force_disconnect(info->handle);
     g_object_unref(info->handle);
     g_free(info);
 }
 
-/* Check handles periodically; shut down inactive ones, and send NOOP to
- * host to keep active connections alive. */
+/* Record the outcome of a command started at start (monotonic time)
+ * in the health of the handle. */
+static void
+lb_imap_server_info_sample(struct handle_info *info, gint64 start,
+                           gboolean ok)
+{
+    gint64 sample;
+
+    if (!ok) {
+        info->failures++;
+        return;
+    }
+    sample = g_get_monotonic_time() - start;
+    info->latency = info->latency > 0
+        ? info->latency + (sample - info->latency) / 4 : sample;
+    info->failures = 0;
+}
+
+static ImapResult
+lb_imap_server_info_connect(struct handle_info *info,
+                            LibBalsaServer *server)
+{
+    gint64 start = g_get_monotonic_time();
+    ImapResult rc;
+
+    rc = imap_mbox_handle_connect(info->handle, server->host);
+    lb_imap_server_info_sample(info, start, rc == IMAP_SUCCESS);
+
+    return rc;
+}
+
+static void
+lb_imap_server_info_noop(struct handle_info *info)
+{
+    gint64 start = g_get_monotonic_time();
+    ImapResponse rc;
+
+    rc = imap_mbox_handle_noop(info->handle);
+    lb_imap_server_info_sample(info, start, rc == IMR_OK);
+}
+
+/* Pick the free handle to hand out to user: the one it used last,
+ * else one that has mbox selected read-write already, so that
+ * selecting it again costs no round trip, else the connected handle
+ * with the lowest latency.  A handle that has mbox EXAMINEd needs
+ * SELECT like any other. Called with the lock held. */
+static GList *
+lb_imap_server_pick_free(LibBalsaImapServer *imap_server, gpointer user,
+                         const gchar *mbox)
+{
+    GList *list;
+    GList *best = NULL;
+    gint best_score = -1;
+
+    for (list = imap_server->free_handles; list; list = list->next) {
+        struct handle_info *info = list->data;
+        const gchar *selected;
+        gint score;
+
+        if (info->last_user == user)
+            return list;
+
+        selected = imap_mbox_handle_get_mbox(info->handle);
+        if (mbox != NULL && selected != NULL && strcmp(mbox, selected) == 0
+            && !imap_mbox_handle_is_examined(info->handle))
+            score = 2;
+        else if (!imap_mbox_is_disconnected(info->handle))
+            score = 1;
+        else
+            score = 0;
+
+        if (score > best_score ||
+            (score == best_score &&
+             info->latency < ((struct handle_info *) best->data)->latency)) {
+            best = list;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/* Check handles periodically. Free handles are shut down when they
+ * failed repeatedly, or when they have been idle for too long and more
+ * than the preconnected number of them would stay open; the others are
+ * kept alive with NOOP. Busy handles get NOOP too, to keep active
+ * connections alive. */
 static void
 lb_imap_server_cleanup(LibBalsaImapServer * imap_server)
 {
     time_t idle_marker;
+    time_t noop_marker;
+    guint warm = 0;
     GList *list;
 
     /* Quit if there is an action going on, eg. an connection is being
@@ -318,23 +419,35 @@ lb_imap_server_cleanup(LibBalsaImapServer * imap_server)
         return; 
 
     idle_marker = time(NULL) - CONNECTION_CLEANUP_IDLE_TIME;
+    noop_marker = time(NULL) - CONNECTION_CLEANUP_NOOP_TIME;
 
-    list = imap_server->free_handles;
+    /* Most recently released handles are at the end of the list; walk
+     * backwards so that those are the ones kept warm. */
+    list = g_list_last(imap_server->free_handles);
     while (list) {
-        GList *next = list->next;
+        GList *prev = list->prev;
         struct handle_info *info = list->data;
 
-        if (info == NULL || info->last_used < idle_marker) {
+        if (info == NULL || info->failures >= HANDLE_MAX_FAILURES ||
+            (info->last_used < idle_marker &&
+             (warm >= imap_server->preconnect ||
+              imap_mbox_is_disconnected(info->handle)))) {
             imap_server->free_handles =
                 g_list_delete_link(imap_server->free_handles, list);
             lb_imap_server_info_free(info);
+        } else {
+            if (info->last_used < idle_marker)
+                warm++;
+            if (info->last_used < noop_marker) {
+                lb_imap_server_info_noop(info);
+                info->last_used = time(NULL);
+            }
         }
 
-        list = next;
+        list = prev;
     }
 
-    idle_marker -=
-        CONNECTION_CLEANUP_NOOP_TIME - CONNECTION_CLEANUP_IDLE_TIME;
+    idle_marker = noop_marker;
 
     for (list = imap_server->used_handles; list; list = list->next) {
         struct handle_info *info = list->data;
@@ -462,6 +575,18 @@ libbalsa_imap_server_new_from_config(void)
         if (!d) {
         	imap_server->max_connections = conn_limit;
         }
+        conn_limit = libbalsa_conf_get_int_with_default("Preconnect", &d);
+        if (!d) {
+        	imap_server->preconnect = conn_limit;
+        }
+        conn_limit = libbalsa_conf_get_int_with_default("OfflineBudget", &d);
+        if (!d) {
+        	imap_server->offline_budget = conn_limit;
+        }
+        conn_limit = libbalsa_conf_get_int_with_default("OfflineRate", &d);
+        if (!d) {
+        	imap_server->offline_rate = conn_limit;
+        }
         set_bool_if_defined("PersistentCache", &imap_server->persistent_cache);
         set_bool_if_defined("HasFetchBug", &imap_server->has_fetch_bug);
         set_bool_if_defined("UseStatus", &imap_server->use_status);
@@ -476,6 +601,9 @@ libbalsa_imap_server_save_config(LibBalsaImapServer *server)
 {
     libbalsa_server_save_config(LIBBALSA_SERVER(server));
     libbalsa_conf_set_int("ConnectionLimit", server->max_connections);
+    libbalsa_conf_set_int("Preconnect", server->preconnect);
+    libbalsa_conf_set_int("OfflineBudget", server->offline_budget);
+    libbalsa_conf_set_int("OfflineRate", server->offline_rate);
     libbalsa_conf_set_bool("PersistentCache", server->persistent_cache);
     libbalsa_conf_set_bool("HasFetchBug", server->has_fetch_bug);
     libbalsa_conf_set_bool("UseStatus",   server->use_status);
@@ -537,10 +665,7 @@ libbalsa_imap_server_get_handle(LibBalsaImapServer *imap_server, GError **err)
     /* look for free connection */
     if (imap_server->free_handles) {
         GList *conn;
-        conn = g_list_find_custom(imap_server->free_handles, NULL,
-                                  by_last_user);
-        if (!conn)
-            conn = g_list_first(imap_server->free_handles);
+        conn = lb_imap_server_pick_free(imap_server, NULL, NULL);
         info = (struct handle_info*)conn->data;
         imap_server->free_handles =
             g_list_delete_link(imap_server->free_handles, conn);
@@ -565,7 +690,7 @@ libbalsa_imap_server_get_handle(LibBalsaImapServer *imap_server, GError **err)
         if(imap_mbox_is_disconnected(info->handle)) {
             ImapResult rc;
 
-            rc=imap_mbox_handle_connect(info->handle, server->host);
+            rc=lb_imap_server_info_connect(info, server);
             if(rc != IMAP_SUCCESS) {
                 handle_connection_error(rc, info, server, err);
                 g_mutex_unlock(&imap_server->lock);
@@ -588,18 +713,40 @@ libbalsa_imap_server_get_handle(LibBalsaImapServer *imap_server, GError **err)
  * @server: A #LibBalsaImapServer
  * @user: user for handle
  *
+ * Same as libbalsa_imap_server_get_handle_with_mbox() without a
+ * mailbox preference.
+ *
+ * Return value: a handle to the server, or %NULL when there are no free
+ * connections.
+ **/
+ImapMboxHandle*
+libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
+                                          gpointer user, GError **err)
+{
+    return libbalsa_imap_server_get_handle_with_mbox(imap_server, user,
+                                                     NULL, err);
+}
+
+/**
+ * libbalsa_imap_server_get_handle_with_mbox:
+ * @server: A #LibBalsaImapServer
+ * @user: user for handle
+ * @mbox: mailbox @user is going to select, or %NULL
+ *
  * Returns a connected handle to the IMAP server, if needed it
  * connects.  If there is no password set, the user is asked to supply
  * one.  This function first tries to find a handle last used by
- * @user, then a handle without a user and finally the least recently
- * used. @user is usually a pointer to LibBalsaMailbox.
+ * @user, then a handle that has @mbox selected already, then the
+ * healthy handle with the lowest latency. @user is usually a pointer
+ * to LibBalsaMailbox.
  *
  * Return value: a handle to the server, or %NULL when there are no free
  * connections.
  **/
 ImapMboxHandle*
-libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
-                                          gpointer user, GError **err)
+libbalsa_imap_server_get_handle_with_mbox(LibBalsaImapServer *imap_server,
+                                          gpointer user, const gchar *mbox,
+                                          GError **err)
 {
     LibBalsaServer *server = LIBBALSA_SERVER(imap_server);
     struct handle_info *info = NULL;
@@ -610,12 +757,8 @@ libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
     g_mutex_lock(&imap_server->lock);
     /* look for free reusable connection */
     if (imap_server->free_handles) {
-        GList *conn=NULL;
-        if (user)
-            conn = g_list_find_custom(imap_server->free_handles, user,
-                                      by_last_user);
-        if (!conn)
-            conn = imap_server->free_handles;
+        GList *conn;
+        conn = lb_imap_server_pick_free(imap_server, user, mbox);
         if (conn) {
             info = (struct handle_info*)conn->data;
             imap_server->free_handles =
@@ -662,7 +805,7 @@ libbalsa_imap_server_get_handle_with_user(LibBalsaImapServer *imap_server,
     if (imap_mbox_is_disconnected(info->handle)) {
         ImapResult rc;
 
-        rc=imap_mbox_handle_connect(info->handle, server->host);
+        rc=lb_imap_server_info_connect(info, server);
         if(rc != IMAP_SUCCESS) {
             handle_connection_error(rc, info, server, err);
             g_mutex_unlock(&imap_server->lock);
@@ -699,13 +842,25 @@ void libbalsa_imap_server_release_handle(LibBalsaImapServer *imap_server,
     if (imap_server->used_handles) {
         GList *conn;
         conn = g_list_find_custom(imap_server->used_handles, handle, by_handle);
-        info = (struct handle_info*)conn->data;
-        imap_server->used_handles =
-            g_list_delete_link(imap_server->used_handles, conn);
-        imap_server->used_connections--;
+        if (conn) {
+            info = (struct handle_info*)conn->data;
+            imap_server->used_handles =
+                g_list_delete_link(imap_server->used_handles, conn);
+            imap_server->used_connections--;
+        }
     }
-    /* check max_connections */
-    if (imap_server->used_connections >= imap_server->max_connections)
+    /* not ours any more, e.g. after force_disconnect */
+    if (!info) {
+        g_mutex_unlock(&imap_server->lock);
+        return;
+    }
+    /* a handle that lost its connection will have to reconnect */
+    if (imap_mbox_is_disconnected(handle))
+        info->failures++;
+    info->last_used = time(NULL);
+    /* check max_connections and health */
+    if (imap_server->used_connections >= imap_server->max_connections ||
+        info->failures >= HANDLE_MAX_FAILURES)
         lb_imap_server_info_free(info);
     else
     /* add to free list */
@@ -736,6 +891,165 @@ libbalsa_imap_server_get_max_connections(LibBalsaImapServer *server)
     return server->max_connections;
 }
 
+/**
+ * libbalsa_imap_server_set_preconnect:
+ * @server: A #LibBalsaImapServer
+ * @count: The number of connections
+ *
+ * Sets the number of connections opened by
+ * libbalsa_imap_server_preconnect() and kept open while idle.
+ **/
+void
+libbalsa_imap_server_set_preconnect(LibBalsaImapServer *server,
+                                    guint count)
+{
+    server->preconnect = count;
+}
+
+guint
+libbalsa_imap_server_get_preconnect(LibBalsaImapServer *server)
+{
+    return server->preconnect;
+}
+
+/**
+ * libbalsa_imap_server_set_offline_limits:
+ * @server: A #LibBalsaImapServer
+ * @budget: disk space for all copies together, in MB
+ * @rate: download rate in kB/s, or 0 for no limit
+ *
+ * Limits the offline copies of the mailboxes on the server that have
+ * them enabled, see libbalsa_mailbox_set_offline().
+ **/
+void
+libbalsa_imap_server_set_offline_limits(LibBalsaImapServer *server,
+                                        guint budget, guint rate)
+{
+    server->offline_budget = budget;
+    server->offline_rate = rate;
+}
+
+void
+libbalsa_imap_server_get_offline_limits(LibBalsaImapServer *server,
+                                        guint *budget, guint *rate)
+{
+    *budget = server->offline_budget;
+    *rate = server->offline_rate;
+}
+
+/**
+ * libbalsa_imap_server_reserve_offline:
+ * @server: A #LibBalsaImapServer
+ * @bytes: disk space to take for an offline copy, or to give back
+ * when negative
+ *
+ * Accounts for the space of the offline copies, which share the
+ * budget of the server.
+ *
+ * Return value: %TRUE unless taking @bytes would exceed the budget.
+ **/
+gboolean
+libbalsa_imap_server_reserve_offline(LibBalsaImapServer *server,
+                                     gint64 bytes)
+{
+    guint64 budget = (guint64) server->offline_budget * 1024 * 1024;
+    gboolean ok = TRUE;
+
+    g_mutex_lock(&server->lock);
+    if (bytes < 0)
+        server->offline_used -= MIN((guint64) -bytes, server->offline_used);
+    else if (server->offline_used + bytes <= budget)
+        server->offline_used += bytes;
+    else
+        ok = FALSE;
+    g_mutex_unlock(&server->lock);
+
+    return ok;
+}
+
+/* Open one connection and add it to the free handles. */
+static gpointer
+lb_imap_server_preconnect_one(gpointer data)
+{
+    LibBalsaImapServer *imap_server = data;
+    LibBalsaServer *server = LIBBALSA_SERVER(imap_server);
+    struct handle_info *info;
+    gboolean ok;
+
+    info = lb_imap_server_info_new(server);
+    ok = lb_imap_server_info_connect(info, server) == IMAP_SUCCESS;
+
+    g_mutex_lock(&imap_server->lock);
+    if (ok && !imap_server->offline_mode &&
+        imap_server->used_connections +
+        g_list_length(imap_server->free_handles) <
+        imap_server->max_connections - 1) {
+        info->last_used = time(NULL);
+        imap_server->free_handles =
+            g_list_append(imap_server->free_handles, info);
+        info = NULL;
+    }
+    g_mutex_unlock(&imap_server->lock);
+    lb_imap_server_info_free(info);
+
+    return GINT_TO_POINTER(ok);
+}
+
+static gpointer
+lb_imap_server_preconnect_thread(gpointer data)
+{
+    LibBalsaImapServer *imap_server = data;
+    guint count = imap_server->preconnect;
+
+    /* Open the first connection alone: the user is asked for the
+     * password at most once, and we give up early if the server is
+     * unreachable. The others are opened in parallel. */
+    if (lb_imap_server_preconnect_one(imap_server)) {
+        GThread **threads = g_new(GThread *, count);
+        guint i;
+
+        for (i = 1; i < count; i++)
+            threads[i] = g_thread_new("lb_imap_server_preconnect_one",
+                                      lb_imap_server_preconnect_one,
+                                      imap_server);
+        for (i = 1; i < count; i++)
+            g_thread_join(threads[i]);
+        g_free(threads);
+    }
+    g_object_unref(imap_server);
+
+    return NULL;
+}
+
+/**
+ * libbalsa_imap_server_preconnect:
+ * @server: A #LibBalsaImapServer
+ *
+ * Opens the configured number of connections in the background, so
+ * that they are authenticated and ready when a mailbox is opened. Does
+ * nothing when this has been done already, in offline mode, or when
+ * logging in would mean asking the user for a password.
+ **/
+void
+libbalsa_imap_server_preconnect(LibBalsaImapServer *server)
+{
+    LibBalsaServer *lbs;
+
+    g_return_if_fail(LIBBALSA_IS_IMAP_SERVER(server));
+
+    lbs = LIBBALSA_SERVER(server);
+    if (server->preconnected || server->offline_mode ||
+        server->preconnect == 0 || lbs->host == NULL ||
+        ((lbs->passwd == NULL || lbs->passwd[0] == '\0') &&
+         !lbs->try_anonymous))
+        return;
+
+    server->preconnected = TRUE;
+    g_thread_unref(g_thread_new("lb_imap_server_preconnect",
+                                lb_imap_server_preconnect_thread,
+                                g_object_ref(server)));
+}
+
 void
 libbalsa_imap_server_enable_persistent_cache(LibBalsaImapServer *server,
                                              gboolean enable)
@@ -837,8 +1151,11 @@ void libbalsa_imap_server_set_offline_mode(LibBalsaImapServer *server,
                                            gboolean offline)
 {
     server->offline_mode = offline;
-    if (offline)
+    if (offline) {
         libbalsa_imap_server_force_disconnect(server);
+        server->preconnected = FALSE;
+    } else
+        libbalsa_imap_server_preconnect(server);
 }
 
 void
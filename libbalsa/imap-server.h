@@ -47,11 +47,24 @@ struct _ImapMboxHandle* libbalsa_imap_server_get_handle
 struct _ImapMboxHandle* libbalsa_imap_server_get_handle_with_user
                           (LibBalsaImapServer *imap_server,
                            gpointer user, GError **err);
+struct _ImapMboxHandle* libbalsa_imap_server_get_handle_with_mbox
+                          (LibBalsaImapServer *imap_server,
+                           gpointer user, const gchar *mbox, GError **err);
 void libbalsa_imap_server_release_handle(LibBalsaImapServer *server,
                                          struct _ImapMboxHandle* handle);
 void libbalsa_imap_server_set_max_connections(LibBalsaImapServer *server,
                                               int max);
 int  libbalsa_imap_server_get_max_connections(LibBalsaImapServer *server);
+void libbalsa_imap_server_set_preconnect(LibBalsaImapServer *server,
+                                         guint count);
+guint libbalsa_imap_server_get_preconnect(LibBalsaImapServer *server);
+void libbalsa_imap_server_preconnect(LibBalsaImapServer *server);
+void libbalsa_imap_server_set_offline_limits(LibBalsaImapServer *server,
+                                             guint budget, guint rate);
+void libbalsa_imap_server_get_offline_limits(LibBalsaImapServer *server,
+                                             guint *budget, guint *rate);
+gboolean libbalsa_imap_server_reserve_offline(LibBalsaImapServer *server,
+                                              gint64 bytes);
 void libbalsa_imap_server_enable_persistent_cache(LibBalsaImapServer *server,
                                                   gboolean enable);
 gboolean libbalsa_imap_server_has_persistent_cache(LibBalsaImapServer *srv);
@@ -41,9 +41,12 @@ need_fetch(unsigned seqno, struct fetch_data* fd)
     { IMFETCH_CONTENT_TYPE, IMFETCH_REFERENCES, IMFETCH_LIST_POST };
   unsigned i;
   ImapFetchType available_headers;
+  ImapMessage *msg;
 
   g_return_val_if_fail(seqno>=1 && seqno<=fd->h->exists, 0);
-  if(fd->h->msg_cache[seqno-1] == NULL) {
+  imap_mbox_handle_materialize(fd->h, seqno);
+  msg = imap_msg_store_get(&fd->h->msgs, seqno);
+  if(msg == NULL) {
     /* We know nothing of that message, we need to fetch at least UID
      * and FLAGS if we are supposed to create ImapMessage structure
      * later. */
@@ -51,13 +54,13 @@ need_fetch(unsigned seqno, struct fetch_data* fd)
     return seqno;
   }
   if( (fd->ift & IMFETCH_ENV) 
-      && fd->h->msg_cache[seqno-1]->envelope == NULL) return seqno;
+      && msg->envelope == NULL) return seqno;
   if( (fd->ift & IMFETCH_BODYSTRUCT) 
-      && fd->h->msg_cache[seqno-1]->body == NULL) return seqno;
+      && msg->body == NULL) return seqno;
   if( (fd->ift & IMFETCH_RFC822SIZE) 
-      && fd->h->msg_cache[seqno-1]->rfc822size <0) return seqno;
+      && msg->rfc822size <0) return seqno;
 
-  available_headers = fd->h->msg_cache[seqno-1]->available_headers;
+  available_headers = msg->available_headers;
   for(i=0; i<G_N_ELEMENTS(header); i++) {
     if( (fd->ift & header[i]) &&
         !(available_headers & (header[i]|IMFETCH_RFC822HEADERS|
@@ -90,19 +93,22 @@ need_fetch_view(unsigned seqno, struct fetch_data* fd)
 struct fetch_data_set {
   struct fetch_data fd;
   unsigned *set;
+  unsigned needed; /* number of messages to be fetched */
 };
 static unsigned
 need_fetch_set(unsigned i, struct fetch_data_set* fd)
 {
-  unsigned seqno = fd->set[i-1];
-  return need_fetch(seqno, &fd->fd);
+  unsigned seqno = need_fetch(fd->set[i-1], &fd->fd);
+  if(seqno) fd->needed++;
+  return seqno;
 }
 
 static unsigned
 need_fetch_view_set(unsigned i, struct fetch_data_set* fd)
 {
-  unsigned seqno = fd->set[i-1];
-  return need_fetch_view(seqno, &fd->fd);
+  unsigned seqno = need_fetch_view(fd->set[i-1], &fd->fd);
+  if(seqno) fd->needed++;
+  return seqno;
 }
 
 /* RFC2060 */
@@ -184,11 +190,21 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
   gchar *mbx7;
   ImapResponse rc;
   char* cmds[3];
+  unsigned qresync_uidval;
+  guint64 qresync_modseq;
 
   IMAP_REQUIRED_STATE3_U(handle, IMHS_CONNECTED, IMHS_AUTHENTICATED,
                          IMHS_SELECTED, IMR_BAD);
 
-  if (handle->state == IMHS_SELECTED && strcmp(handle->mbox, mbox) == 0) {
+  /* QRESYNC parameters apply to this SELECT only. */
+  qresync_uidval = handle->qresync.uidvalidity;
+  qresync_modseq = handle->qresync.modseq;
+  imap_mbox_handle_set_qresync(handle, 0, 0);
+
+  /* A mailbox opened with EXAMINE is read-only and needs SELECT. */
+  if (handle->state == IMHS_SELECTED && !handle->examined &&
+      strcmp(handle->mbox, mbox) == 0) {
+    handle->qresync.synced = 0;
     if(readonly_mbox)
       *readonly_mbox = handle->readonly_mbox;
     return IMR_OK;
@@ -197,10 +213,19 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
   mbox_view_dispose(&handle->mbox_view);
   handle->unseen = 0;
   handle->has_rights = 0;
+  handle->highestmodseq = 0;
+  handle->qresync.synced = 0;
+  g_list_free_full(handle->qresync.vanished, g_free);
+  handle->qresync.vanished = NULL;
+  handle->sort_update_cmdno = 0;
 
   mbx7 = imap_utf8_to_mailbox(mbox);
 
-  cmds[0] = g_strdup_printf("SELECT \"%s\"", mbx7);
+  if (handle->qresync.enabled && qresync_uidval && qresync_modseq)
+    cmds[0] = g_strdup_printf("SELECT \"%s\" (QRESYNC (%u %" G_GUINT64_FORMAT
+                              "))", mbx7, qresync_uidval, qresync_modseq);
+  else
+    cmds[0] = g_strdup_printf("SELECT \"%s\"", mbx7);
   if (imap_mbox_handle_can_do(handle, IMCAP_ACL)) {
     cmds[1] = g_strdup_printf("MYRIGHTS \"%s\"", mbx7);
     cmds[2] = NULL;
@@ -221,6 +246,11 @@ imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
 
   if(rc == IMR_OK) {
     handle->state = IMHS_SELECTED;
+    handle->examined = 0;
+    handle->flags_changed = 0;
+    /* The server ignores QRESYNC parameters if UIDVALIDITY changed. */
+    handle->qresync.synced = handle->qresync.enabled && qresync_modseq &&
+      qresync_uidval == handle->uidval && handle->highestmodseq != 0;
     if(readonly_mbox) {
       *readonly_mbox = handle->readonly_mbox;
     }
@@ -263,6 +293,8 @@ imap_mbox_examine(ImapMboxHandle* handle, const char* mbox)
     g_free(handle->mbox);
     handle->mbox = g_strdup(mbox);
     handle->state = IMHS_SELECTED;
+    handle->examined = 1;
+    handle->flags_changed = 0;
     handle->has_rights = 0;
   } 
   g_mutex_unlock(&handle->mutex);
@@ -432,6 +464,178 @@ imap_mbox_status(ImapMboxHandle *r, const char*what,
   }
   return rc; 
 }
+/* Mailboxes per LIST-STATUS command: keeps the command lines
+   reasonably short. */
+#define STATUS_MANY_BATCH 50
+
+/* Appends mailbox name mbx7 as a quoted string. */
+static void
+append_quoted_mailbox(GString *cmd, const char *mbx7)
+{
+  gchar *quoted = imap_quote_string(mbx7);
+  /* imap_quote_string() leaves strings with nothing to escape
+     as they are. */
+  g_string_append_printf(cmd, *quoted == '"' ? "%s" : "\"%s\"", quoted);
+  g_free(quoted);
+}
+
+/* The mailboxes first..first+cnt-1 that one command asked about. */
+struct StatusManyCmd {
+  ImapResponse *rcs;
+  unsigned first, cnt;
+};
+
+static void
+status_many_cb(ImapMboxHandle *h, ImapResponse rc, struct StatusManyCmd *smc)
+{
+  unsigned i;
+  if(rc != IMR_UNTAGGED)
+    for(i=0; i<smc->cnt; i++)
+      smc->rcs[smc->first+i] = rc;
+}
+
+/** imap_mbox_status_many() requests status of cnt mailboxes at once:
+    res[i] receives the status of what[i], and rcs[i], unless rcs is
+    NULL, the response to the command that asked for it. All res
+    arrays must ask for the same items; items of mailboxes the server
+    did not report on keep their values. A single RFC 5819 LIST-STATUS
+    command is used for each batch of mailboxes if available, pipelined
+    STATUS commands otherwise, and for names that would be taken for
+    LIST wildcards. Mailboxes must not be selected. Returns IMR_OK if
+    all the commands succeeded, the first NO or BAD response, or the
+    code of the connection error that aborted the exchange. */
+ImapResponse
+imap_mbox_status_many(ImapMboxHandle *r, unsigned cnt, const char **what,
+                      struct ImapStatusResult **res, ImapResponse *rcs)
+{
+  const char *item_arr[G_N_ELEMENTS(imap_status_item_names)+1];
+  ImapResponse rc;
+  unsigned i, ipos, ncmds;
+  gboolean use_list_status;
+  gchar *items;
+  struct StatusManyCmd *smc;
+  ImapPipeline *p;
+
+  if(cnt == 0)
+    return IMR_OK;
+  for(ipos = i= 0; res[0][i].item != IMSTAT_NONE; i++) {
+    g_return_val_if_fail(i<G_N_ELEMENTS(imap_status_item_names), IMR_BAD);
+    g_return_val_if_fail(res[0][i].item>=IMSTAT_MESSAGES &&
+                         res[0][i].item<=IMSTAT_UNSEEN, IMR_BAD);
+    item_arr[ipos++] = imap_status_item_names[res[0][i].item];
+  }
+  item_arr[ipos] = NULL;
+  if(ipos == 0)
+    return IMR_OK;
+  items = g_strjoinv(" ", (gchar**)&item_arr[0]);
+
+  g_mutex_lock(&r->mutex);
+  use_list_status = imap_mbox_handle_can_do(r, IMCAP_LIST_STATUS);
+  smc = g_new(struct StatusManyCmd, cnt);
+  p = imap_pipeline_new(r);
+  for(i = ncmds = 0; i<cnt; ncmds++) {
+    GString *cmd = g_string_new(NULL);
+    gchar *mbx7 = imap_utf8_to_mailbox(what[i]);
+
+    smc[ncmds].rcs = rcs;
+    smc[ncmds].first = i;
+    /* '%' and '*' cannot be escaped in a LIST pattern. */
+    if(use_list_status && strpbrk(mbx7, "%*") == NULL) {
+      g_string_append(cmd, "LIST \"\" (");
+      do {
+        if(i > smc[ncmds].first)
+          g_string_append_c(cmd, ' ');
+        append_quoted_mailbox(cmd, mbx7);
+        g_hash_table_insert(r->status_resps, (gpointer)what[i], res[i]);
+        g_free(mbx7);
+        mbx7 = ++i < cnt ? imap_utf8_to_mailbox(what[i]) : NULL;
+      } while(mbx7 && i - smc[ncmds].first < STATUS_MANY_BATCH &&
+              strpbrk(mbx7, "%*") == NULL);
+      g_free(mbx7);
+      g_string_append_printf(cmd, ") RETURN (STATUS (%s))", items);
+    } else {
+      g_string_append(cmd, "STATUS ");
+      append_quoted_mailbox(cmd, mbx7);
+      g_string_append_printf(cmd, " (%s)", items);
+      g_free(mbx7);
+      g_hash_table_insert(r->status_resps, (gpointer)what[i], res[i]);
+      i++;
+    }
+    smc[ncmds].cnt = i - smc[ncmds].first;
+    imap_pipeline_add(p, cmd->str, rcs ? (ImapPipelineCb)status_many_cb : NULL,
+                      &smc[ncmds]);
+    g_string_free(cmd, TRUE);
+  }
+  rc = imap_pipeline_run(p);
+
+  for(i=0; i<cnt; i++)
+    g_hash_table_remove(r->status_resps, what[i]);
+  g_mutex_unlock(&r->mutex);
+  g_free(smc);
+  g_free(items);
+
+  return rc;
+}
+
+/* RFC 5465: NOTIFY Command */
+
+/** Asks the server to report, with STATUS responses, new and expunged
+    messages and flag changes in the given mailboxes, or in all the
+    mailboxes of the personal namespace if cnt is 0; see
+    imap_handle_set_statuscb(). The server reports the current status
+    of each of them first. Nothing is requested for a selected
+    mailbox, so the handle is best left in the authenticated state. */
+ImapResponse
+imap_mbox_notify(ImapMboxHandle *h, unsigned cnt, const char **what)
+{
+  GString *cmd;
+  ImapResponse rc;
+  unsigned i;
+
+  /* A single event group: "(" filter-mailboxes SP events ")". */
+  cmd = g_string_new("NOTIFY SET STATUS (");
+  if(cnt == 0)
+    g_string_append(cmd, "personal");
+  else {
+    g_string_append(cmd, "mailboxes (");
+    for(i=0; i<cnt; i++) {
+      gchar *mbx7 = imap_utf8_to_mailbox(what[i]);
+      if(i)
+        g_string_append_c(cmd, ' ');
+      append_quoted_mailbox(cmd, mbx7);
+      g_free(mbx7);
+    }
+    g_string_append_c(cmd, ')');
+  }
+  g_string_append(cmd, " (MessageNew MessageExpunge FlagChange))");
+
+  g_mutex_lock(&h->mutex);
+  if(imap_mbox_handle_can_do(h, IMCAP_NOTIFY))
+    rc = imap_cmd_exec(h, cmd->str);
+  else
+    rc = IMR_NO;
+  g_mutex_unlock(&h->mutex);
+  g_string_free(cmd, TRUE);
+
+  return rc;
+}
+
+/** Stops the notifications requested with imap_mbox_notify(). */
+ImapResponse
+imap_mbox_notify_none(ImapMboxHandle *h)
+{
+  ImapResponse rc;
+
+  g_mutex_lock(&h->mutex);
+  if(imap_mbox_handle_can_do(h, IMCAP_NOTIFY))
+    rc = imap_cmd_exec(h, "NOTIFY NONE");
+  else
+    rc = IMR_OK;
+  g_mutex_unlock(&h->mutex);
+
+  return rc;
+}
+
 /* 6.3.11 APPEND Command */
 static gchar*
 enum_flag_to_str(ImapMsgFlags flg)
@@ -468,6 +672,8 @@ single_append_cb(char *buf, size_t buf_sz, ImapAppendMultiStage stage,
     return sz;
   case IMA_STAGE_PASS_DATA:
     return sad->cb(buf, buf_sz, sad->cb_data);
+  case IMA_STAGE_COMMITTED:
+    return 0;
   }
   g_assert_not_reached();
   return 0;
@@ -482,40 +688,106 @@ imap_mbox_append(ImapMboxHandle *handle, const char *mbox,
   return imap_mbox_append_multi(handle, mbox, single_append_cb, &sad, NULL);
 }
 
-static ImapResponse
-append_commit(ImapMboxHandle *handle, unsigned cmdno, ImapSequence *uid_seq)
-{
-  ImapResponse rc;
+/* Bulk upload. Literals are sent without waiting for the server's
+   continuation request when LITERAL+ (RFC 2088) or, for small
+   messages, LITERAL- (RFC 7888) allows it. Messages go into one
+   MULTIAPPEND command per TRANSACTION_SIZE bytes if the server can
+   do it, one APPEND per message otherwise; either way up to
+   IMAP_APPEND_PIPELINE_DEPTH commands are kept in flight. */
+#define IMAP_APPEND_PIPELINE_DEPTH 8
+#define IMAP_LITERAL_MINUS_MAX 4096
 
-  if(handle->uidplus.dst)
-    g_warning("Leaking memory in imap_append");
+struct AppendCmd {
+  unsigned cmdno;
+  unsigned msg_cnt;         /* messages sent with the command */
+};
 
-  if(uid_seq) {
-    handle->uidplus.dst = uid_seq->ranges;
-    handle->uidplus.store_response = 1;
-  }
-  net_client_siobuf_flush(handle->sio, NULL);
-  rc = imap_cmd_process_untagged(handle, cmdno);
+struct AppendBatch {
+  ImapMboxHandle *handle;
+  ImapAppendMultiFunc dump_cb;
+  void *cb_arg;
+  ImapSequence *uid_seq;    /* NULL unless APPENDUID data is collected */
+  GQueue in_flight;         /* struct AppendCmd, oldest first */
+  ImapResponse rc;          /* first NO or BAD, or a fatal error */
+  unsigned uids_broken:1;   /* APPENDUID data cannot be trusted */
+  unsigned stop:1;          /* the data callback asked to stop */
+};
 
-  if(uid_seq) {
-    if(uid_seq->uid_validity == 0) {
-      uid_seq->uid_validity = handle->uidplus.dst_uid_validity;
-      uid_seq->ranges = handle->uidplus.dst;
-    } else if(uid_seq->uid_validity != handle->uidplus.dst_uid_validity) {
+/* Reports the completion of a command to the data callback, one call
+   per message. */
+static void
+append_done(struct AppendBatch *ab, struct AppendCmd *ac, ImapResponse rc)
+{
+  ImapMboxHandle *handle = ab->handle;
+  unsigned i;
+
+  if(rc == IMR_OK && ab->uid_seq) {
+    if(ab->uid_seq->uid_validity == 0)
+      ab->uid_seq->uid_validity = handle->uidplus.dst_uid_validity;
+    else if(ab->uid_seq->uid_validity != handle->uidplus.dst_uid_validity) {
       printf("The IMAP server keeps changing UID validity, "
 	     "ignoring UIDPLUS response (%u -> %u)\n",
-	     uid_seq->uid_validity, handle->uidplus.dst_uid_validity);
-      uid_seq->uid_validity = handle->uidplus.dst_uid_validity;
-      g_list_free(uid_seq->ranges);
-      uid_seq->ranges = NULL;
-    } else {
-      uid_seq->ranges = handle->uidplus.dst;
+	     ab->uid_seq->uid_validity, handle->uidplus.dst_uid_validity);
+      ab->uids_broken = 1;
     }
   }
-  handle->uidplus.dst = NULL;
-  handle->uidplus.store_response = 0;
+  if(rc != IMR_OK && ab->rc == IMR_OK)
+    ab->rc = rc;
+  for(i=0; i<ac->msg_cnt; i++)
+    if(ab->dump_cb(NULL, rc == IMR_OK, IMA_STAGE_COMMITTED, NULL,
+                   ab->cb_arg))
+      ab->stop = 1;
+  g_free(ac);
+}
 
-  return rc;
+/* Waits for the oldest command in flight. */
+static void
+append_collect(struct AppendBatch *ab)
+{
+  struct AppendCmd *ac = g_queue_pop_head(&ab->in_flight);
+  ImapResponse rc;
+
+  if(ab->handle->state == IMHS_DISCONNECTED) {
+    imap_cmd_forget(ab->handle, ac->cmdno);
+    rc = IMR_SEVERED;
+  } else
+    rc = imap_cmd_collect(ab->handle, ac->cmdno);
+  append_done(ab, ac, rc);
+}
+
+/* Sends the command, ending it with CRLF, and keeps it in flight. */
+static void
+append_send(struct AppendBatch *ab, struct AppendCmd *ac)
+{
+  net_client_siobuf_flush(ab->handle->sio, NULL);
+  imap_cmd_keep(ab->handle, ac->cmdno);
+  g_queue_push_tail(&ab->in_flight, ac);
+}
+
+/* Writes the literal of the next message. If the server has to ask for
+   it, waits for the continuation request; commands sent earlier may
+   complete meanwhile. */
+static ImapResponse
+append_literal(struct AppendBatch *ab, struct AppendCmd *ac,
+               size_t msg_size, gboolean sync, char *buf, size_t buf_sz)
+{
+  ImapMboxHandle *handle = ab->handle;
+  size_t s, delta;
+  ImapResponse rc;
+
+  if(sync) {
+    net_client_siobuf_flush(handle->sio, NULL);
+    rc = imap_cmd_process_untagged(handle, ac->cmdno);
+    if(rc != IMR_RESPOND)
+      return rc;
+    net_client_siobuf_discard_line(handle->sio, NULL);
+  }
+  for(s=0; s<msg_size; s+= delta) {
+    delta = ab->dump_cb(buf, buf_sz, IMA_STAGE_PASS_DATA, NULL, ab->cb_arg);
+    if(s+delta>msg_size) delta = msg_size-s;
+    sio_write(handle->sio, buf, delta);
+  }
+  return IMR_OK;
 }
 
 static ImapResponse
@@ -526,109 +798,146 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
 			    ImapSequence *uid_sequence)
 {
   static const unsigned TRANSACTION_SIZE = 10*1024*1024;
-  int use_literal, use_multiappend, use_uidplus;
-  unsigned cmdno;
-  ImapResponse rc = IMR_OK;
-  char *litstr;
+  int use_literal_plus, use_literal_minus, use_multiappend;
+  unsigned depth;
+  struct AppendBatch ab;
+  struct AppendCmd *ac = NULL;
+  ImapResponse rc;
   char buf[16384];
-  size_t s, msg_size, delta, current_transaction_size = 0;
-  int c, msg_cnt;
+  size_t msg_size, current_transaction_size = 0;
   ImapMsgFlags flags;
-  gboolean new_append = TRUE;
+  gchar *mbx7;
 
-  use_literal = imap_mbox_handle_can_do(handle, IMCAP_LITERAL);
+  use_literal_plus = imap_mbox_handle_can_do(handle, IMCAP_LITERAL);
+  use_literal_minus = imap_mbox_handle_can_do(handle, IMCAP_LITERAL_MINUS);
   use_multiappend = imap_mbox_handle_can_do(handle, IMCAP_MULTIAPPEND);
-  use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
-  litstr = use_literal ? "+" : "";
+  depth = handle->enable_pipelining ? IMAP_APPEND_PIPELINE_DEPTH : 1;
 
   if(uid_sequence)
     uid_sequence->ranges = NULL;
 
   if (!imap_handle_idle_disable(handle)) return IMR_SEVERED;
-  for(msg_cnt=0;
-      (msg_size = dump_cb(buf, sizeof(buf),
-			  IMA_STAGE_NEW_MSG, &flags, cb_arg)) >0;
-      msg_cnt++) {
 
-    if (handle->state == IMHS_DISCONNECTED)
-      return IMR_SEVERED;
-  
-    if(new_append || !use_multiappend) {
+  ab.handle = handle;
+  ab.dump_cb = dump_cb;
+  ab.cb_arg = cb_arg;
+  ab.uid_seq = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS)
+    ? uid_sequence : NULL;
+  g_queue_init(&ab.in_flight);
+  ab.rc = IMR_OK;
+  ab.uids_broken = 0;
+  ab.stop = 0;
+  if(ab.uid_seq) {
+    if(handle->uidplus.dst)
+      g_warning("Leaking memory in imap_append");
+    handle->uidplus.dst = NULL;
+    handle->uidplus.store_response = 1;
+  }
+
+  mbx7 = imap_utf8_to_mailbox(mbox);
+  for(;;) {
+    gboolean sync;
+    const char *litstr;
+    gchar *flags_str;
+
+    /* Make room for a new command, and do not start one after an
+       error: the messages should be stored in order, if at all. */
+    if(!ac)
+      while(!g_queue_is_empty(&ab.in_flight) &&
+            (g_queue_get_length(&ab.in_flight) >= depth ||
+             ab.rc != IMR_OK))
+        append_collect(&ab);
+    if(ab.rc != IMR_OK || ab.stop ||
+       handle->state == IMHS_DISCONNECTED)
+      break;
+
+    msg_size = dump_cb(buf, sizeof(buf), IMA_STAGE_NEW_MSG, &flags, cb_arg);
+    if(msg_size == 0)
+      break;
+
+    sync = !(use_literal_plus ||
+             (use_literal_minus && msg_size <= IMAP_LITERAL_MINUS_MAX));
+    litstr = sync ? "" : "+";
+    flags_str = flags ? enum_flag_to_str(flags) : NULL;
+    if(!ac) {
       gchar *cmd;
-      gchar *mbx7 = imap_utf8_to_mailbox(mbox);
-      new_append = FALSE;
-      if(flags) {
-	gchar *str = enum_flag_to_str(flags);
+      if(flags_str)
 	cmd = g_strdup_printf("APPEND \"%s\" (%s) {%lu%s}",
-			      mbx7, str, (unsigned long)msg_size, litstr);
-	g_free(str);
-      } else 
+			      mbx7, flags_str, (unsigned long)msg_size, litstr);
+      else
 	cmd = g_strdup_printf("APPEND \"%s\" {%lu%s}",
 			      mbx7, (unsigned long)msg_size, litstr);
-      c = imap_cmd_start(handle, cmd, &cmdno);
-      g_free(mbx7); g_free(cmd);
-
-      if (c<0) /* irrecoverable connection error. */
-	return IMR_SEVERED;
-
+      ac = g_new0(struct AppendCmd, 1);
+      if(imap_cmd_start(handle, cmd, &ac->cmdno)<0) {
+        /* irrecoverable connection error. */
+        g_free(cmd); g_free(flags_str);
+        ac->msg_cnt = 1;
+        append_done(&ab, ac, IMR_SEVERED);
+        ac = NULL;
+        break;
+      }
+      g_free(cmd);
     } else {
       /* MULTIAPPEND continuation */
-      if(flags) {
-	gchar *str = enum_flag_to_str(flags);
-	sio_printf(handle->sio, " (%s) {%lu%s}", str,
+      if(flags_str)
+	sio_printf(handle->sio, " (%s) {%lu%s}", flags_str,
 		   (unsigned long)msg_size, litstr);
-	g_free(str);
-      } else 
+      else 
 	sio_printf(handle->sio, " {%lu%s}",
 		   (unsigned long)msg_size, litstr);
+      if(!sync) /* append_literal() does not flush the line */
+        sio_write(handle->sio, "\r\n", 2);
     }
-
-    if(use_literal)
-      rc = IMR_RESPOND; /* we do it without flushing */
-    else {
-    	net_client_siobuf_flush(handle->sio, NULL);
-    	rc = imap_cmd_process_untagged(handle, cmdno);
-      if(rc != IMR_RESPOND) return rc;
-      net_client_siobuf_discard_line(handle->sio, NULL);
+    g_free(flags_str);
+    ac->msg_cnt++;
+
+    rc = append_literal(&ab, ac, msg_size, sync, buf, sizeof(buf));
+    if(rc != IMR_OK) {
+      /* The server refused the literal: the command is over. */
+      append_done(&ab, ac, rc);
+      ac = NULL;
+      continue;
     }
 
-    for(s=0; s<msg_size; s+= delta) {
-      delta = dump_cb(buf, sizeof(buf), IMA_STAGE_PASS_DATA, NULL, cb_arg);
-      if(s+delta>msg_size) delta = msg_size-s;
-      sio_write(handle->sio, buf, delta);
-    }
-  
     current_transaction_size += msg_size;
-    if(current_transaction_size > TRANSACTION_SIZE) {
-      current_transaction_size = 0;
-      new_append = TRUE;
-    }
-    if(new_append || !use_multiappend) { /* Grab the response. */
-      /* Data written, tie up the message.  It has been though
+    if(!use_multiappend || current_transaction_size > TRANSACTION_SIZE) {
+      /* Data written, tie up the command.  It has been though
        * observed that "Cyrus IMAP4 v2.0.16-p1 server" can hang if the
        * flush isn't done under following conditions: a). TLS is
        * enabled, b). message contains NUL characters.  NUL characters
        * are forbidden (RFC3501, sect. 4.3.1) and we probably should
        * make sure on a higher level that they are not sent.
        */
-      /* sio_flush(handle->sio); */
-      if( (rc=append_commit(handle, cmdno,
-			   use_uidplus ? uid_sequence : NULL)) != IMR_OK)
-      return rc;
+      append_send(&ab, ac);
+      ac = NULL;
+      current_transaction_size = 0;
     }
     /* And move to the next message... */
   }
+  g_free(mbx7);
+
+  if(ac) { /* Finish the last MULTIAPPEND. */
+    if(handle->state != IMHS_DISCONNECTED)
+      append_send(&ab, ac);
+    else
+      append_done(&ab, ac, IMR_SEVERED);
+  }
+  while(!g_queue_is_empty(&ab.in_flight))
+    append_collect(&ab);
 
-  if(!new_append && use_multiappend) { /* We get the server response here... */
-    rc = append_commit(handle, cmdno, use_uidplus ? uid_sequence : NULL);
+  if(ab.uid_seq) {
+    if(ab.uids_broken) {
+      g_list_free_full(handle->uidplus.dst, g_free);
+      ab.uid_seq->uid_validity = 0;
+    } else
+      ab.uid_seq->ranges = g_list_reverse(handle->uidplus.dst);
+    handle->uidplus.dst = NULL;
+    handle->uidplus.store_response = 0;
   }
 
   imap_handle_idle_enable(handle, 30);
 
-  if(uid_sequence) {
-    uid_sequence->ranges = g_list_reverse(uid_sequence->ranges);
-  }
-  return rc;
+  return ab.rc;
 }
 
 
@@ -643,9 +952,17 @@ imap_mbox_append_multi_real(ImapMboxHandle *handle,
     once for each message with IMA_STAGE_NEW_MSG stage parameter to
     get the message size and message flags. Size zero indicates last
     message. Next, it is called several times with IMA_STAGE_PASS_DATA
-    stage parameter to actually get the message data.
+    stage parameter to actually get the message data. Once the server
+    has answered the command that carried a message, dump_cb is called
+    with IMA_STAGE_COMMITTED, a NULL buffer and a size of 1 if the
+    message was stored, 0 if not; messages are reported in the order
+    they were passed. A non-zero return value stops the upload after
+    the messages sent so far.
 
     @param cb_arg the context passed to dump_cb.
+
+    @param uids if not NULL and the server supports UIDPLUS, gets the
+    UIDs of the stored messages, in order.
  */
 ImapResponse
 imap_mbox_append_multi(ImapMboxHandle *handle,
@@ -845,7 +1162,7 @@ set_flag_cache_cb(ImapMboxHandle* h, unsigned seqno, void*arg)
 {
   ImapFlagCache *flags;
   ImapMsgFlag *searched_flag = (ImapMsgFlag*)arg;
-  flags = &g_array_index(h->flag_cache, ImapFlagCache, seqno-1);
+  flags = imap_msg_store_flags(&h->msgs, seqno);
   if(*searched_flag & IMSGF_SEEN)
     flags->flag_values &= ~*searched_flag;
   else
@@ -859,13 +1176,21 @@ struct flag_needed_data {
 static unsigned
 flag_unknown(int i, struct flag_needed_data* d)
 {
-  ImapFlagCache *f =
-    &g_array_index(d->handle->flag_cache, ImapFlagCache, i-1);
+  ImapFlagCache *f = imap_msg_store_flags(&d->handle->msgs, i);
   return (f->known_flags & d->flag) == d->flag ? 0 : i;
 }
   
-/* imap_assure_needed_flags issues several SEARCH queries in one shot
-   and hopes the output is not intermixed. This functionl must be
+/* Points the SEARCH response handler at the flag being searched
+   for. */
+static void
+flag_search_cb(ImapMboxHandle *h, ImapResponse rc, ImapMsgFlag *flag)
+{
+  if(rc == IMR_UNTAGGED)
+    h->search_arg = flag;
+}
+
+/* imap_assure_needed_flags pipelines several SEARCH queries and
+   hopes the output is not intermixed. This functionl must be
    called with handle locked. */
 ImapResponse
 imap_assure_needed_flags(ImapMboxHandle *h, ImapMsgFlag needed_flags)
@@ -874,12 +1199,11 @@ imap_assure_needed_flags(ImapMboxHandle *h, ImapMsgFlag needed_flags)
   void *arg;
   struct flag_needed_data fnd;
   unsigned i, shift, issued_cmd = 0;
-  unsigned cmdno[32]; /* FIXME: assume no more than 32 different flags */
-  ImapMsgFlag flag[32]; /* ditto */
-  int ics;
-  gchar *cmd = NULL, *seqno;
-  ImapResponse rc = IMR_OK;
+  ImapMsgFlag flag[32]; /* FIXME: assume no more than 32 different flags */
+  gchar *cmd, *seqno;
+  ImapResponse rc;
   gchar *cmd_format;
+  ImapPipeline *p;
 
   if (h->state == IMHS_DISCONNECTED)
     return IMR_SEVERED;
@@ -892,15 +1216,15 @@ imap_assure_needed_flags(ImapMboxHandle *h, ImapMsgFlag needed_flags)
   cb  = h->search_cb;  h->search_cb  = (ImapSearchCb)set_flag_cache_cb;
   arg = h->search_arg; 
 
+  p = imap_pipeline_new(h);
   fnd.handle = h;
   for(shift=0; needed_flags>>shift; shift++) {
     if((needed_flags>>shift) & 1) {
       const char *flg;
       fnd.flag = 1<<shift;
       if(fnd.flag & IMSGF_SEEN)
-        for(i=0; i<h->flag_cache->len; i++) {
-          ImapFlagCache *f =
-            &g_array_index(h->flag_cache, ImapFlagCache, i);
+        for(i=1; i<=h->msgs.size; i++) {
+          ImapFlagCache *f = imap_msg_store_flags(&h->msgs, i);
           if( (f->known_flags & fnd.flag) ==0)
             f->flag_values |= fnd.flag;
         }
@@ -917,30 +1241,19 @@ imap_assure_needed_flags(ImapMboxHandle *h, ImapMsgFlag needed_flags)
       case IMSGF_RECENT:   flg = "RECENT"; break;
       default: g_free(seqno); continue;
       }
-      if(!cmd) {
-        if (!imap_handle_idle_disable(h)) { rc = IMR_SEVERED; break; }
-      }
       cmd = g_strdup_printf(cmd_format, seqno, flg);
       g_free(seqno);
       flag[issued_cmd] = fnd.flag;
-      ics = imap_cmd_start(h, cmd, &cmdno[issued_cmd++]);
+      imap_pipeline_add(p, cmd, (ImapPipelineCb)flag_search_cb,
+                        &flag[issued_cmd++]);
       g_free(cmd);
-      if(ics<0)
-        return IMR_SEVERED;  /* irrecoverable connection error. */
     }
   }
-  if(cmd) { /* was ever altered */
-    for(i=0; i<issued_cmd; i++) {
-      h->search_arg = &flag[i];
-      rc = imap_cmd_process_untagged(h, cmdno[i]);
-    }
-    imap_handle_idle_enable(h, 30);
-  }
+  rc = imap_pipeline_run(p);
   h->search_cb = cb; h->search_arg = arg;
   if(rc == IMR_OK) {
-    for(i=0; i<h->flag_cache->len; i++) {
-      ImapFlagCache *f =
-        &g_array_index(h->flag_cache, ImapFlagCache, i);
+    for(i=1; i<=h->msgs.size; i++) {
+      ImapFlagCache *f = imap_msg_store_flags(&h->msgs, i);
       f->known_flags |= needed_flags;
     }
   }
@@ -959,14 +1272,18 @@ imap_mbox_handle_msgno_has_flags(ImapMboxHandle *h, unsigned msgno,
   g_mutex_lock(&h->mutex);
   IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
 
-  flags = &g_array_index(h->flag_cache, ImapFlagCache, msgno-1);
+  flags = imap_msg_store_flags(&h->msgs, msgno);
   
   needed_flags = ~flags->known_flags & (flag_set | flag_unset);
   
   retval =
-    (!needed_flags||imap_assure_needed_flags(h, needed_flags) == IMR_OK) &&
-    (flags->flag_values & flag_set) == flag_set &&
-    (flags->flag_values & flag_unset) == 0;
+    !needed_flags||imap_assure_needed_flags(h, needed_flags) == IMR_OK;
+  if(retval) {
+    /* the flag column may have been moved by an EXISTS */
+    flags = imap_msg_store_flags(&h->msgs, msgno);
+    retval = (flags->flag_values & flag_set) == flag_set &&
+      (flags->flag_values & flag_unset) == 0;
+  }
   g_mutex_unlock(&h->mutex);
 
   return retval;
@@ -1008,7 +1325,8 @@ set_avail_headers(ImapMboxHandle *h, const char *seq, ImapFetchType ift)
 {
   const char *s = seq;
   char *tmp;
-  unsigned lo, hi; 
+  unsigned lo, hi;
+  ImapMessage *msg; 
 
   if( !(ift & (IMFETCH_HEADER_MASK|IMFETCH_RFC822HEADERS|
                IMFETCH_RFC822HEADERS_SELECTED)) ) return;
@@ -1017,13 +1335,13 @@ set_avail_headers(ImapMboxHandle *h, const char *seq, ImapFetchType ift)
     switch(*tmp) {
     case '\0':
     case ',':
-      if(h->msg_cache[lo-1])
-        h->msg_cache[lo-1]->available_headers = ift;
+      if( (msg = imap_msg_store_get(&h->msgs, lo)) != NULL)
+        msg->available_headers = ift;
       break;
     case ':': hi = strtoul(tmp+1, &tmp, 10);
       for(;lo<=hi; lo++)
-        if(h->msg_cache[lo-1]) {
-          h->msg_cache[lo-1]->available_headers = ift;
+        if( (msg = imap_msg_store_get(&h->msgs, lo)) != NULL) {
+          msg->available_headers = ift;
         }
       
       break;
@@ -1085,13 +1403,18 @@ imap_mbox_handle_fetch_set_unlocked(ImapMboxHandle* handle,
 
   fd.fd.h = handle; fd.fd.ift = fd.fd.req_fetch_type = ift;
   fd.set = set;
+  fd.needed = 0;
   cf = (ImapCoalesceFunc)(mbox_view_is_active(&handle->mbox_view)
 			  ? need_fetch_view_set : need_fetch_set);
   seq = imap_coalesce_seq_range(1, cnt, cf, &fd);
   if(seq) {
     const char* hdr[13];
+    gint64 start = g_get_monotonic_time();
     ic_construct_header_list(hdr, fd.fd.req_fetch_type);
     rc = imap_mbox_handle_fetch_unlocked(handle, seq, hdr);
+    if(rc == IMR_OK && (ift & IMFETCH_ENV))
+      imap_handle_add_fetch_sample(handle, fd.needed,
+                                   g_get_monotonic_time() - start);
     if(rc == IMR_OK) set_avail_headers(handle, seq, fd.fd.req_fetch_type);
     g_free(seq);
   } else rc = IMR_OK;
@@ -1109,72 +1432,92 @@ imap_mbox_handle_fetch_set(ImapMboxHandle* handle,
   return rc;
 }
 
-static void
-write_nstring(unsigned seqno, ImapFetchBodyType body_type,
-              const char *str, size_t len, void *fl)
-{
-  if (fwrite(str, 1, len, (FILE*)fl) != len)
-    perror("write_nstring");
-}
-
-struct FetchBodyPassthroughData {
+/* Passes the literals of a FETCH on to an ImapFetchBodyCb in pieces,
+   as they are read from the connection (handle->body_chunked).  When
+   the header and the text of a message are fetched as separate
+   sections, all of the header is passed before the text, whatever
+   order the server sends them in: text that comes first is held back
+   until the header is complete. */
+struct FetchBodyOrdered {
   ImapFetchBodyCb cb;
   void *arg;
-  char *body;
-  size_t body_length;
-  unsigned seqno;
+  gboolean with_header; /* header and text are separate sections */
+  unsigned seqno;       /* message being passed, or 0 */
+  gboolean header_done;
+  gboolean text_done;
+  GByteArray *text;     /* text of seqno, held back */
   unsigned pipeline_error;
 };
 
 static void
-fetch_body_passthrough(unsigned seqno,
-		       ImapFetchBodyType body_type,
-		       const char *buf,
-		       size_t buflen, void* arg)
-{
-  struct FetchBodyPassthroughData* data = (struct FetchBodyPassthroughData*)arg;
-  switch(body_type) {
-  case IMAP_BODY_TYPE_RFC822:
-    data->cb(seqno, buf, buflen, data->arg);
-    break;
-  case IMAP_BODY_TYPE_HEADER:
-    if(data->seqno == 0) {
-      data->seqno = seqno;
-      data->cb(seqno, buf, buflen, data->arg);
-    } else {
-      if(data->seqno == seqno) {
-	data->cb(seqno, buf, buflen, data->arg);
-	data->cb(seqno, data->body, data->body_length, data->arg);
-	g_free(data->body);
-	data->body = NULL;
-	data->seqno = 0;
-      } else {
-	/* This server sends data in a strange order that makes
-	   efficient pipeline processing impossible. Just signal an
-	   error. */
-	data->pipeline_error++;
-      }
+fetch_body_ordered_init(struct FetchBodyOrdered *fbo, ImapFetchBodyCb cb,
+                        void *arg, gboolean with_header)
+{
+  fbo->cb = cb;
+  fbo->arg = arg;
+  fbo->with_header = with_header;
+  fbo->seqno = 0;
+  fbo->header_done = fbo->text_done = FALSE;
+  fbo->text = NULL;
+  fbo->pipeline_error = 0;
+}
+
+static void
+fetch_body_ordered(unsigned seqno, ImapFetchBodyType body_type,
+                   const char *buf, size_t buflen, void *arg)
+{
+  struct FetchBodyOrdered *fbo = (struct FetchBodyOrdered*)arg;
+
+  if(!fbo->with_header || body_type == IMAP_BODY_TYPE_RFC822) {
+    if(buf)
+      fbo->cb(seqno, buf, buflen, fbo->arg);
+    return;
+  }
+
+  if(fbo->seqno != seqno) {
+    if(fbo->seqno != 0) {
+      /* This server sends data in a strange order that makes
+         efficient pipeline processing impossible. Just signal an
+         error. */
+      fbo->pipeline_error++;
+      return;
     }
-    break;
-  case IMAP_BODY_TYPE_TEXT:
-    if(data->seqno == seqno) {
-      data->cb(seqno, buf, buflen, data->arg);
-      data->seqno = 0;
-    } else {
-      /* Text before header. Still, we can afford to invert it.. */
-      if(data->body)
-	data->pipeline_error++; /* Unlikely... */
-      else {
-	data->body = g_malloc(buflen);
-	memcpy(data->body, buf, buflen);
-	data->body_length = buflen;
-	data->seqno = seqno;
+    fbo->seqno = seqno;
+    fbo->header_done = fbo->text_done = FALSE;
+  }
+
+  if(body_type == IMAP_BODY_TYPE_HEADER) {
+    if(buf)
+      fbo->cb(seqno, buf, buflen, fbo->arg);
+    else {
+      fbo->header_done = TRUE;
+      if(fbo->text) {
+        fbo->cb(seqno, (const char*)fbo->text->data, fbo->text->len,
+                fbo->arg);
+        g_byte_array_free(fbo->text, TRUE);
+        fbo->text = NULL;
       }
     }
-    break;
-  default:
-    data->pipeline_error++;
+  } else if(!buf) {
+    fbo->text_done = TRUE;
+  } else if(fbo->header_done) {
+    fbo->cb(seqno, buf, buflen, fbo->arg);
+  } else {
+    /* Text before header. Still, we can afford to invert it.. */
+    if(!fbo->text)
+      fbo->text = g_byte_array_new();
+    g_byte_array_append(fbo->text, (const guint8*)buf, buflen);
   }
+
+  if(fbo->header_done && fbo->text_done)
+    fbo->seqno = 0;
+}
+
+static void
+fetch_body_ordered_free(struct FetchBodyOrdered *fbo)
+{
+  if(fbo->text) /* This should never be needed. */
+    g_byte_array_free(fbo->text, TRUE);
 }
 
 ImapResponse
@@ -1195,24 +1538,24 @@ imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
   if(seq) {
     ImapFetchBodyInternalCb cb = handle->body_cb;
     void                   *arg = handle->body_arg;
+    gboolean            chunked = handle->body_chunked;
     gchar *cmd = g_strdup_printf("FETCH %s %s", seq,
 				 peek_only
 				 ? "(BODY.PEEK[HEADER] BODY.PEEK[TEXT])"
 				 : "RFC822");
-    struct FetchBodyPassthroughData passthrough_data;
-    passthrough_data.cb = fetch_cb;
-    passthrough_data.arg = fetch_cb_data;
-    passthrough_data.body = NULL;
-    passthrough_data.seqno = 0;
-    passthrough_data.pipeline_error = 0;
-    handle->body_cb  = fetch_cb ? fetch_body_passthrough : NULL;
-    handle->body_arg = &passthrough_data;
+    struct FetchBodyOrdered ordered;
+    fetch_body_ordered_init(&ordered, fetch_cb, fetch_cb_data, peek_only);
+    handle->body_cb  = fetch_cb ? fetch_body_ordered : NULL;
+    handle->body_arg = &ordered;
+    handle->body_chunked = TRUE;
     rc = imap_cmd_exec(handle, cmd);
     handle->body_cb  = cb;
     handle->body_arg = arg;
+    handle->body_chunked = chunked;
+    fetch_body_ordered_free(&ordered);
     g_free(cmd);
     g_free(seq);
-    if(passthrough_data.pipeline_error){
+    if(ordered.pipeline_error){
       rc = IMR_NO;
       imap_mbox_handle_set_msg(handle, _("Unordered data received from server"));
     }
@@ -1222,128 +1565,65 @@ imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
   return rc;
 }
 
-/* When peeking into message, we need to assure that we save header
-   first and body later: the order the fields are returned is in
-   principle undefined. */
-struct FetchBodyHeaderText {
-  FILE *out_file;
-  char *body;
-  size_t length;
-  gboolean wrote_header;
+/* Writes fetched data to a GMimeStream. */
+struct FetchToStream {
+  GMimeStream *stream;
+  gboolean failed;
 };
 
 static void
-write_header_text_ordered(unsigned seqno, ImapFetchBodyType body_type,
-			  const char *str, size_t len, void *arg)
-{
-  struct FetchBodyHeaderText *fbht = (struct FetchBodyHeaderText*)arg;
-  switch(body_type) {
-  case IMAP_BODY_TYPE_RFC822:
-    g_warning("Server sends unrequested RFC822 response");
-    break; /* This is really unexpected response! */
-  case IMAP_BODY_TYPE_HEADER:
-    if (fwrite(str, 1, len, fbht->out_file) != len)
-      perror("write_nstring");
-    fbht->wrote_header = TRUE;
-    if(fbht->body) {
-      if (fwrite(fbht->body, 1, fbht->length, fbht->out_file) != fbht->length)
-	perror("write_nstring");
-      g_free(fbht->body); fbht->body = NULL;
-    }
-    break;
-  case IMAP_BODY_TYPE_TEXT:
-  case IMAP_BODY_TYPE_BODY:
-    if(fbht->wrote_header) {
-      if (fwrite(str, 1, len, fbht->out_file) != len)
-	perror("write_nstring");
-    } else {
-      fbht->body = g_malloc(len);
-      fbht->length = len;
-      memcpy(fbht->body, str, len);
-    }
-    break;
-  }
-}
-
-/* There is some point to code reuse here. */
-struct PassHeaderTextOrdered {
-  ImapFetchBodyCb cb;
-  void *arg;
-  char *body;
-  size_t length;
-  gboolean wrote_header;
-};
+write_to_stream(unsigned seqno, const char *buf, size_t buflen, void *arg)
+{
+  struct FetchToStream *fts = (struct FetchToStream*)arg;
 
-static void
-pass_header_text_ordered(unsigned seqno, ImapFetchBodyType body_type,
-			  const char *str, size_t len, void *arg)
-{
-  struct PassHeaderTextOrdered *phto = (struct PassHeaderTextOrdered*)arg;
-  switch(body_type) {
-  case IMAP_BODY_TYPE_RFC822:
-    g_warning("Server sends unrequested RFC822 response");
-    break; /* This is really unexpected response! */
-  case IMAP_BODY_TYPE_HEADER:
-    phto->cb(seqno, str, len, phto->arg);
-    phto->wrote_header = TRUE;
-    if(phto->body) {
-      phto->cb(seqno, phto->body, phto->length, phto->arg);
-      g_free(phto->body); phto->body = NULL;
-    }
-    break;
-  case IMAP_BODY_TYPE_TEXT:
-  case IMAP_BODY_TYPE_BODY:
-    if(phto->wrote_header) {
-      phto->cb(seqno, str, len, phto->arg);
-    } else {
-      phto->body = g_malloc(len);
-      phto->length = len;
-      memcpy(phto->body, str, len);
-    }
-    break;
-  }
+  if(!fts->failed && buflen>0 &&
+     g_mime_stream_write(fts->stream, buf, buflen) != (ssize_t)buflen)
+    fts->failed = TRUE;
 }
 
-
 ImapResponse
 imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle, unsigned uid, 
-                                  gboolean peek, FILE *fl)
+                                  gboolean peek, GMimeStream *stream)
 {
   char cmd[80];
-  ImapFetchBodyInternalCb cb = handle->body_cb;
-  void          *arg = handle->body_arg;
+  ImapFetchBodyInternalCb cb;
+  void          *arg;
+  gboolean   chunked;
   ImapResponse rc;
   char *cmdstr;
-  struct FetchBodyHeaderText separate_arg;
-
+  struct FetchToStream fts;
+  struct FetchBodyOrdered ordered;
 
   g_mutex_lock(&handle->mutex);
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
 
+  cb      = handle->body_cb;
+  arg     = handle->body_arg;
+  chunked = handle->body_chunked;
+  fts.stream = stream;
+  fts.failed = FALSE;
   /* Consider switching between BODY.PEEK[HEADER] BODY.PEEK[TEXT] and
      BODY[HEADER] BODY[TEXT] - this would simplify the callback
      code. */
-  if(peek) {
-    handle->body_cb  = write_header_text_ordered;
-    handle->body_arg = &separate_arg;
-    separate_arg.body = NULL;
-    separate_arg.wrote_header = FALSE;
-    separate_arg.out_file = fl;
-    cmdstr = "UID FETCH %u (BODY.PEEK[HEADER] BODY.PEEK[TEXT])";
-  } else {
-    handle->body_cb  = write_nstring;
-    handle->body_arg = fl;
-    cmdstr = "UID FETCH %u RFC822";
-  }
+  fetch_body_ordered_init(&ordered, write_to_stream, &fts, peek);
+  handle->body_cb  = fetch_body_ordered;
+  handle->body_arg = &ordered;
+  handle->body_chunked = TRUE;
+  cmdstr = peek
+    ? "UID FETCH %u (BODY.PEEK[HEADER] BODY.PEEK[TEXT])"
+    : "UID FETCH %u RFC822";
 
   snprintf(cmd, sizeof(cmd), cmdstr, uid);
   rc = imap_cmd_exec(handle, cmd);
-  if(peek) {
-    g_free(separate_arg.body); /* This should never be needed. */
-  }
+  fetch_body_ordered_free(&ordered);
 
   handle->body_cb  = cb;
   handle->body_arg = arg;
+  handle->body_chunked = chunked;
+  if(rc == IMR_OK && fts.failed) {
+    rc = IMR_NO;
+    imap_mbox_handle_set_msg(handle, _("Cannot write the fetched data"));
+  }
   g_mutex_unlock(&handle->mutex);
   return rc;
 }
@@ -1372,7 +1652,30 @@ imap_binary_handler(unsigned seqno, ImapFetchBodyType body_type,
     g_free(str);
     ibd->first_run = FALSE;
   }
-  ibd->body_cb(seqno, buf, buflen, ibd->body_arg);
+  if(buf)
+    ibd->body_cb(seqno, buf, buflen, ibd->body_arg);
+}
+
+/* Names the section holding the headers of section: its MIME header,
+   or the header of the message it is the body of. */
+static void
+fetch_body_header_section(const char *section, ImapFetchBodyOptions options,
+                          char *prefix, size_t size)
+{
+  if(options == IMFB_HEADER) {
+    /* We have to strip last section part and replace it with HEADER */
+    unsigned sz;
+    const char *last_dot = strrchr(section, '.');
+    strncpy(prefix, section, size - 1);
+      
+    if(last_dot) {
+      sz = last_dot-section+1;
+      if(sz>size-1) sz = size-1;
+    } else sz = 0;
+    strncpy(prefix + sz, "HEADER", size-sz-1);
+    prefix[size-1] = '\0';
+  } else
+    snprintf(prefix, size, "%s.MIME", section);
 }
 
 ImapResponse
@@ -1385,14 +1688,17 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
   char cmd[200];
   ImapFetchBodyInternalCb fcb;
   void          *farg;
+  gboolean   fchunked;
   ImapResponse rc;
   const gchar *peek_string = peek_only ? ".PEEK" : "";
-  struct PassHeaderTextOrdered pass_ordered_data;
+  struct FetchBodyOrdered ordered;
 
   g_mutex_lock(&handle->mutex);
   IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
   fcb = handle->body_cb;
   farg = handle->body_arg;
+  fchunked = handle->body_chunked;
+  handle->body_chunked = TRUE;
 
   /* Use BINARY extension if possible */
   if(handle->enable_binary && options == IMFB_MIME &&
@@ -1411,45 +1717,163 @@ imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
     if(rc != IMR_NO) { /* unknown-cte */
       handle->body_cb  = fcb;
       handle->body_arg = farg;
+      handle->body_chunked = fchunked;
       g_mutex_unlock(&handle->mutex);
       return rc;
     }
   }
 
-  handle->body_cb  = pass_header_text_ordered;
-  handle->body_arg = &pass_ordered_data;
-  pass_ordered_data.cb = body_cb;
-  pass_ordered_data.arg = arg;
-  pass_ordered_data.body = NULL;
-  pass_ordered_data.wrote_header = FALSE;
+  fetch_body_ordered_init(&ordered, body_cb, arg, options != IMFB_NONE);
+  handle->body_cb  = fetch_body_ordered;
+  handle->body_arg = &ordered;
   /* Pure IMAP without extensions */
   if(options == IMFB_NONE)
     snprintf(cmd, sizeof(cmd), "FETCH %u BODY%s[%s]",
              seqno, peek_string, section);
   else {
     char prefix[160];
-    if(options == IMFB_HEADER) {
-      /* We have to strip last section part and replace it with HEADER */
-      unsigned sz;
-      char *last_dot = strrchr(section, '.');
-      strncpy(prefix, section, sizeof(prefix) - 1);
-      
-      if(last_dot) {
-        sz = last_dot-section+1;
-        if(sz>sizeof(prefix)-1) sz = sizeof(prefix)-1;
-      } else sz = 0;
-      strncpy(prefix + sz, "HEADER", sizeof(prefix)-sz-1);
-      prefix[sizeof(prefix)-1] = '\0';
-    } else
-      snprintf(prefix, sizeof(prefix), "%s.MIME", section);
+    fetch_body_header_section(section, options, prefix, sizeof(prefix));
     snprintf(cmd, sizeof(cmd), "FETCH %u (BODY%s[%s] BODY%s[%s])",
              seqno, peek_string, prefix, peek_string, section);
   }
   rc = imap_cmd_exec(handle, cmd);
-  g_free(pass_ordered_data.body);
+  fetch_body_ordered_free(&ordered);
+  handle->body_cb  = fcb;
+  handle->body_arg = farg;
+  handle->body_chunked = fchunked;
+
+  g_mutex_unlock(&handle->mutex);
+  return rc;
+}
+
+ImapResponse
+imap_mbox_handle_fetch_body_to_stream(ImapMboxHandle* handle,
+                                      unsigned seqno, const char *section,
+                                      gboolean peek_only,
+                                      ImapFetchBodyOptions options,
+                                      GMimeStream *stream)
+{
+  struct FetchToStream fts;
+  ImapResponse rc;
+
+  fts.stream = stream;
+  fts.failed = FALSE;
+  rc = imap_mbox_handle_fetch_body(handle, seqno, section, peek_only,
+                                   options, write_to_stream, &fts);
+  if(rc == IMR_OK && fts.failed) {
+    rc = IMR_NO;
+    g_mutex_lock(&handle->mutex);
+    imap_mbox_handle_set_msg(handle, _("Cannot write the fetched data"));
+    g_mutex_unlock(&handle->mutex);
+  }
+  return rc;
+}
+
+/* Partial fetches pass the data on unordered and count it. */
+struct FetchPartial {
+  ImapFetchBodyCb cb;
+  void *arg;
+  size_t fetched;
+};
+
+static void
+fetch_partial_cb(unsigned seqno, ImapFetchBodyType body_type,
+                 const char *buf, size_t buflen, void *arg)
+{
+  struct FetchPartial *fp = (struct FetchPartial*)arg;
+
+  if(buf) {
+    fp->cb(seqno, buf, buflen, fp->arg);
+    fp->fetched += buflen;
+  }
+}
+
+static ImapResponse
+fetch_partial(ImapMboxHandle *handle, const char *cmd,
+              ImapFetchBodyCb body_cb, void *arg, size_t *fetched)
+{
+  ImapFetchBodyInternalCb fcb;
+  void          *farg;
+  gboolean   fchunked;
+  struct FetchPartial fp;
+  ImapResponse rc;
+
+  fcb = handle->body_cb;
+  farg = handle->body_arg;
+  fchunked = handle->body_chunked;
+  fp.cb = body_cb;
+  fp.arg = arg;
+  fp.fetched = 0;
+  handle->body_cb  = fetch_partial_cb;
+  handle->body_arg = &fp;
+  handle->body_chunked = TRUE;
+  rc = imap_cmd_exec(handle, cmd);
   handle->body_cb  = fcb;
   handle->body_arg = farg;
+  handle->body_chunked = fchunked;
+  if(fetched)
+    *fetched = fp.fetched;
+  return rc;
+}
+
+/** Tells whether imap_mbox_handle_fetch_body_partial() may be asked
+    for decoded data: the BINARY extension is both enabled and
+    offered by the server. */
+int
+imap_mbox_handle_can_fetch_binary(ImapMboxHandle* handle)
+{
+  return handle->enable_binary &&
+    imap_mbox_handle_can_do(handle, IMCAP_BINARY);
+}
 
+/** Fetches the headers preceding a body section of message uid: its
+    MIME header for IMFB_MIME, or the header of the enclosing message
+    for IMFB_HEADER.  Nothing is fetched for IMFB_NONE. */
+ImapResponse
+imap_mbox_handle_fetch_body_header(ImapMboxHandle* handle, unsigned uid,
+                                   const char *section,
+                                   ImapFetchBodyOptions options,
+                                   ImapFetchBodyCb body_cb, void *arg)
+{
+  char cmd[200], prefix[160];
+  ImapResponse rc;
+
+  if(options == IMFB_NONE)
+    return IMR_OK;
+  fetch_body_header_section(section, options, prefix, sizeof(prefix));
+  snprintf(cmd, sizeof(cmd), "UID FETCH %u BODY.PEEK[%s]", uid, prefix);
+  g_mutex_lock(&handle->mutex);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  rc = fetch_partial(handle, cmd, body_cb, arg, NULL);
+  g_mutex_unlock(&handle->mutex);
+  return rc;
+}
+
+/** Fetches at most length bytes of a body section of message uid,
+    starting at offset, with BODY.PEEK[section]<offset.length>.  With
+    binary set BINARY.PEEK is used instead: the data then arrive
+    decoded and offset counts decoded bytes.  The message is addressed
+    by UID so that a transfer split into many such fetches is not
+    disturbed by expunges.  *fetched is set to the number of bytes
+    passed to body_cb; fewer than length mean that the end of the
+    section has been reached. */
+ImapResponse
+imap_mbox_handle_fetch_body_partial(ImapMboxHandle* handle, unsigned uid,
+                                    const char *section, gboolean binary,
+                                    size_t offset, size_t length,
+                                    ImapFetchBodyCb body_cb, void *arg,
+                                    size_t *fetched)
+{
+  char cmd[200];
+  ImapResponse rc;
+
+  snprintf(cmd, sizeof(cmd), "UID FETCH %u %s.PEEK[%s]<%lu.%lu>",
+           uid, binary ? "BINARY" : "BODY", section,
+           (unsigned long)offset, (unsigned long)length);
+  g_mutex_lock(&handle->mutex);
+  *fetched = 0;
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  rc = fetch_partial(handle, cmd, body_cb, arg, fetched);
   g_mutex_unlock(&handle->mutex);
   return rc;
 }
@@ -1475,24 +1899,20 @@ cf_flag(unsigned idx, struct msg_set *csd)
      else return seqno;
 }
 
-static gchar*
-imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
-		   ImapMsgFlag flg, gboolean state)
+/* Sets the flags in the caches of the handle, as if the server had
+   reported them. */
+static void
+imap_store_local(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+                 ImapMsgFlag flg, gboolean state)
 {
-  gchar* cmd, *seq, *str;
-  struct msg_set csd;
   unsigned i;
 
-  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
-  csd.flag = flg; csd.state = state;
-  if(msgcnt == 0) return NULL;
-  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
-  if(!seq) return NULL;
-  str = enum_flag_to_str(flg);
   for(i=0; i<msgcnt; i++) {
     ImapMessage *msg = imap_mbox_handle_get_msg(h, seqno[i]);
-    ImapFlagCache *f =
-      &g_array_index(h->flag_cache, ImapFlagCache, seqno[i]-1);
+    ImapFlagCache *f = imap_msg_store_flags(&h->msgs, seqno[i]);
+    if((f->known_flags & flg) != flg ||
+       (f->flag_values & flg) != (state ? flg : 0))
+      imap_handle_flags_changed(h, seqno[i]);
     f->known_flags |= flg;
     if(state)
       f->flag_values |= flg;
@@ -1507,6 +1927,22 @@ imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   }
   if(h->flags_cb)
     h->flags_cb(msgcnt, seqno, h->flags_arg);
+}
+
+static gchar*
+imap_store_prepare(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
+		   ImapMsgFlag flg, gboolean state)
+{
+  gchar* cmd, *seq, *str;
+  struct msg_set csd;
+
+  csd.handle = h; csd.msgcnt = msgcnt; csd.seqno = seqno;
+  csd.flag = flg; csd.state = state;
+  if(msgcnt == 0) return NULL;
+  seq = imap_coalesce_seq_range(0, msgcnt-1, (ImapCoalesceFunc)cf_flag, &csd);
+  if(!seq) return NULL;
+  str = enum_flag_to_str(flg);
+  imap_store_local(h, msgcnt, seqno, flg, state);
 
   cmd = g_strdup_printf("Store %s %cFlags.Silent (%s)", seq,
                         state ? '+' : '-', str);
@@ -1556,8 +1992,76 @@ imap_mbox_store_flag_a(ImapMboxHandle *h, unsigned msgcnt, unsigned*seqno,
   return rc;
 }
 
+/** Changes the flags of the messages like imap_mbox_store_flag()
+    does, but only in the handle, without telling the server. It is
+    meant for a handle set up with imap_mbox_handle_set_offline(); the
+    change has to be sent later with imap_mbox_store_flag_uid(). */
+void
+imap_mbox_store_flag_local(ImapMboxHandle *h, unsigned msgcnt,
+                           unsigned *seqno, ImapMsgFlag flg, gboolean state)
+{
+  g_mutex_lock(&h->mutex);
+  imap_store_local(h, msgcnt, seqno, flg, state);
+  g_mutex_unlock(&h->mutex);
+}
+
+/** Sets or clears the flags of the messages with given UIDs, which
+    need not be known to the handle. The server reports the resulting
+    flags, so that the caches of the handle are updated for the
+    messages it knows. */
+ImapResponse
+imap_mbox_store_flag_uid(ImapMboxHandle *h, unsigned cnt, unsigned *uids,
+                         ImapMsgFlag flg, gboolean state)
+{
+  ImapResponse res;
+  gchar *cmd, *seq, *str;
+
+  if(cnt == 0)
+    return IMR_OK;
+  g_mutex_lock(&h->mutex);
+  IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
+  seq = imap_coalesce_set(cnt, uids);
+  str = enum_flag_to_str(flg);
+  cmd = g_strdup_printf("UID Store %s %cFlags (%s)", seq,
+                        state ? '+' : '-', str);
+  res = imap_cmd_exec(h, cmd);
+  g_free(cmd); g_free(str); g_free(seq);
+  g_mutex_unlock(&h->mutex);
+  return res;
+}
 
 /* 6.4.7 COPY Command */
+/** Executes COPY-like cmd, collecting UIDPLUS information about the
+    new messages in ret_sequence, if provided. Assumes that the handle
+    is already locked. */
+static ImapResponse
+imap_mbox_handle_copy_cmd(ImapMboxHandle* handle, const gchar *cmd,
+                          ImapSequence *ret_sequence)
+{
+  ImapResponse rc;
+  unsigned cmdno;
+  gboolean use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
+
+  if(ret_sequence) {
+    ret_sequence->ranges = NULL;
+    handle->uidplus.store_response = 1;
+  } else
+    handle->uidplus.store_response = 0;
+
+  rc = imap_cmd_exec_cmdno(handle, cmd, &cmdno);
+  if(use_uidplus && ret_sequence) {
+    if(rc == IMR_OK /* && cmdno == handle->uidplus.cmdno */ ) {
+      ret_sequence->uid_validity = handle->uidplus.dst_uid_validity;
+      ret_sequence->ranges = g_list_reverse(handle->uidplus.dst);
+    } else {
+      g_list_free(handle->uidplus.dst);
+    }
+    handle->uidplus.dst = NULL;
+    handle->uidplus.store_response = 0;
+  }
+  return rc;
+}
+
 /** imap_mbox_handle_copy() copies given set of seqno from the mailbox
     selected in handle to given mailbox on same server. */
 ImapResponse
@@ -1573,27 +2077,54 @@ imap_mbox_handle_copy(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
     gchar *mbx7 = imap_utf8_to_mailbox(dest);
     char *seq = imap_coalesce_set(cnt, seqno);
     gchar *cmd = g_strdup_printf("COPY %s \"%s\"", seq, mbx7);
-    unsigned cmdno;
-    gboolean use_uidplus = imap_mbox_handle_can_do(handle, IMCAP_UIDPLUS);
 
-    if(ret_sequence) {
-      ret_sequence->ranges = NULL;
-      handle->uidplus.store_response = 1;
-    } else
-      handle->uidplus.store_response = 0;
-
-    rc = imap_cmd_exec_cmdno(handle, cmd, &cmdno);
+    rc = imap_mbox_handle_copy_cmd(handle, cmd, ret_sequence);
     g_free(seq); g_free(mbx7); g_free(cmd);
-    if(use_uidplus && ret_sequence) {
-      if(rc == IMR_OK /* && cmdno == handle->uidplus.cmdno */ ) {
-	ret_sequence->uid_validity = handle->uidplus.dst_uid_validity;
-	ret_sequence->ranges = g_list_reverse(handle->uidplus.dst);
-      } else {
-	g_list_free(handle->uidplus.dst);
-      }
-      handle->uidplus.dst = NULL;
-      handle->uidplus.store_response = 0;
+  }
+  g_mutex_unlock(&handle->mutex);
+  return rc;
+}
+
+/* RFC 6851 MOVE Command */
+/** imap_mbox_handle_move() moves given set of seqno from the mailbox
+    selected in handle to given mailbox on same server, in one
+    step. The messages are referred to by UID if all of them are
+    known. They disappear from the source mailbox via usual expunge
+    notifications, which arrive before the command completes. Returns
+    IMR_NO without contacting the server if MOVE is not supported. */
+ImapResponse
+imap_mbox_handle_move(ImapMboxHandle* handle, unsigned cnt, unsigned *seqno,
+                      const gchar *dest,
+		      ImapSequence *ret_sequence)
+{
+  ImapResponse rc;
+
+  g_mutex_lock(&handle->mutex);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  if(!imap_mbox_handle_can_do(handle, IMCAP_MOVE)) {
+    rc = IMR_NO;
+  } else {
+    gchar *mbx7 = imap_utf8_to_mailbox(dest);
+    unsigned *uids = g_new(unsigned, cnt);
+    unsigned i;
+    gchar *seq, *cmd;
+
+    for(i=0; i<cnt; i++) {
+      ImapUID uid = seqno[i] >= 1 && seqno[i] <= handle->exists
+        ? imap_mbox_handle_known_uid(handle, seqno[i]) : 0;
+      if(!uid)
+        break;
+      uids[i] = uid;
+    }
+    if(i == cnt) {
+      seq = imap_coalesce_set(cnt, uids);
+      cmd = g_strdup_printf("UID MOVE %s \"%s\"", seq, mbx7);
+    } else {
+      seq = imap_coalesce_set(cnt, seqno);
+      cmd = g_strdup_printf("MOVE %s \"%s\"", seq, mbx7);
     }
+    rc = imap_mbox_handle_copy_cmd(handle, cmd, ret_sequence);
+    g_free(uids); g_free(seq); g_free(mbx7); g_free(cmd);
   }
   g_mutex_unlock(&handle->mutex);
   return rc;
@@ -1707,36 +2238,81 @@ sort_code_to_string(ImapSortKey key)
   return keystr;
 }
 
-/** executes server side sort. The @param msgno array contains @param
-    cnt message numbers. It is subseqently replaced with a new,
-    altered order */
+static void
+append_no(ImapMboxHandle *handle, unsigned seqno, void *arg)
+{
+  mbox_view_append_no(&handle->mbox_view, seqno);
+}
+
+/* Sends SORT and collects the result in mbox_view. With ESORT, the
+   result comes in an ESEARCH response. */
 static ImapResponse
-imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
-                         int ascending, unsigned int *msgno, unsigned cnt)
+imap_mbox_sort_exec(ImapMboxHandle *handle, ImapSortKey key, int ascending,
+                     const char *ret, const char *seq, unsigned *cmdno)
 {
   ImapResponse rc;
-  const char *keystr;
-  char *seq, *cmd, *cmd1;
-
-  /* IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD); */
-  if(!imap_mbox_handle_can_do(handle, IMCAP_SORT)) 
-    return IMR_NO;
+  ImapSearchCb cb;
+  void *arg;
+  char *cmd, *cmd1;
 
   /* seq can be pretty long and g_strdup_printf has a limit on
    * string length so we create the command string in two steps. */
-  keystr = sort_code_to_string(key);
-  seq = imap_coalesce_set(cnt, msgno);
-  cmd= g_strdup_printf("SORT (%s%s) UTF-8 ", 
+  cmd= g_strdup_printf("SORT %s(%s%s) UTF-8 ", ret,
                        ascending ? "" : "REVERSE ",
-                       keystr);
+                       sort_code_to_string(key));
   cmd1 = g_strconcat(cmd, seq, NULL);
-  g_free(seq);
   g_free(cmd);
   handle->mbox_view.entries = 0; /* FIXME: I do not like this! 
                                   * we should not be doing such 
                                   * low level manipulations here */
-  rc = imap_cmd_exec(handle, cmd1);
+  cb  = handle->search_cb;  handle->search_cb  = append_no;
+  arg = handle->search_arg; handle->search_arg = NULL;
+  rc = imap_cmd_exec_cmdno(handle, cmd1, cmdno);
+  handle->search_cb = cb; handle->search_arg = arg;
   g_free(cmd1);
+  return rc;
+}
+
+/** executes server side sort. The @param msgno array contains @param
+    cnt message numbers. It is subseqently replaced with a new,
+    altered order. When the whole mailbox is sorted and the server
+    can keep the result up to date (CONTEXT=SORT), it is asked to,
+    and the changes are reported to the sort update callback. */
+static ImapResponse
+imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
+                         int ascending, unsigned int *msgno, unsigned cnt)
+{
+  ImapResponse rc = IMR_NO;
+  gboolean esort;
+  unsigned cmdno;
+  char *seq;
+
+  /* IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD); */
+  if(!imap_mbox_handle_can_do(handle, IMCAP_SORT)) 
+    return IMR_NO;
+
+  if(handle->sort_update_cmdno) {
+    gchar *cmd = g_strdup_printf("CANCELUPDATE \"%x\"",
+                                 handle->sort_update_cmdno);
+    handle->sort_update_cmdno = 0;
+    imap_cmd_exec(handle, cmd); /* the result is of no interest */
+    g_free(cmd);
+  }
+
+  esort = imap_mbox_handle_can_do(handle, IMCAP_ESORT);
+  if(esort && handle->sort_update_cb && cnt == handle->exists &&
+     imap_mbox_handle_can_do(handle, IMCAP_CONTEXT_SORT)) {
+    rc = imap_mbox_sort_exec(handle, key, ascending,
+                             "RETURN (ALL UPDATE) ", "ALL", &cmdno);
+    if(rc == IMR_OK)
+      handle->sort_update_cmdno = cmdno;
+  }
+  if(rc == IMR_NO || rc == IMR_BAD) { /* NOUPDATE, or not asked for */
+    seq = imap_coalesce_set(cnt, msgno);
+    rc = imap_mbox_sort_exec(handle, key, ascending,
+                             esort ? "RETURN (ALL) " : "", seq, NULL);
+    g_free(seq);
+  }
 
   if(rc == IMR_OK) {
     unsigned i;
@@ -1761,7 +2337,8 @@ imap_mbox_sort_msgno_srv(ImapMboxHandle *handle, ImapSortKey key,
 static int
 comp_unsigned(const void *a, const void *b)
 {
-  return ((const unsigned*)a) - ((const unsigned*)b);
+  unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+  return x < y ? -1 : x > y;
 }
 
 static int
@@ -1831,6 +2408,23 @@ comp_to(const void *a, const void *b)
   return comp_imap_address(x->envelope->to,  y->envelope->to);
 }
 
+typedef int (*ImapSortFunc)(const void *a, const void *b);
+
+static ImapSortFunc
+imap_sort_func(ImapSortKey key)
+{
+  switch(key) {
+  default:
+  case IMSO_ARRIVAL: return comp_arrival;
+  case IMSO_CC:      return comp_cc;
+  case IMSO_DATE:    return comp_date;
+  case IMSO_FROM:    return comp_from;
+  case IMSO_SIZE:    return comp_size;
+  case IMSO_SUBJECT: return comp_subject;
+  case IMSO_TO:      return comp_to;
+  }
+}
+
 static ImapResponse
 imap_mbox_sort_msgno_client(ImapMboxHandle *handle, ImapSortKey key,
                             int ascending, unsigned int *msgno, unsigned cnt)
@@ -1839,8 +2433,6 @@ imap_mbox_sort_msgno_client(ImapMboxHandle *handle, ImapSortKey key,
    * about all the impliciations... */
   static const ImapFetchType fetch_type 
     = IMFETCH_UID | IMFETCH_ENV | IMFETCH_RFC822SIZE | IMFETCH_CONTENT_TYPE;
-  int (*sortfun)(const void *a, const void *b);
-    
   unsigned i, fetch_cnt, *seqno_to_fetch;
   struct SortItem *sort_items;
 
@@ -1876,17 +2468,7 @@ imap_mbox_sort_msgno_client(ImapMboxHandle *handle, ImapSortKey key,
     }
     sort_items[i].no  = msgno[i];
   }
-  switch(key) {
-  default:
-  case IMSO_ARRIVAL: sortfun = comp_arrival; break;
-  case IMSO_CC:      sortfun = comp_cc;      break;
-  case IMSO_DATE:    sortfun = comp_date;    break;
-  case IMSO_FROM:    sortfun = comp_from;    break;
-  case IMSO_SIZE:    sortfun = comp_size;    break;
-  case IMSO_SUBJECT: sortfun = comp_subject; break;
-  case IMSO_TO:      sortfun = comp_to;      break;
-  }
-  qsort(sort_items, cnt, sizeof(struct SortItem), sortfun);
+  qsort(sort_items, cnt, sizeof(struct SortItem), imap_sort_func(key));
   if(ascending)
     for(i=0; i<cnt; i++)
       msgno[i] = sort_items[i].no;
@@ -1918,10 +2500,80 @@ imap_mbox_sort_msgno(ImapMboxHandle *handle, ImapSortKey key,
   return rc;
 }
 
-static void
-append_no(ImapMboxHandle *handle, unsigned seqno, void *arg)
+/** Finds where the messages new_msgno[0..new_cnt) belong in
+    msgno[0..cnt), which is sorted by key in ascending order, so that
+    new messages can be added to a sorted view without sorting it
+    again. new_msgno is sorted in place, and pos[i] is set to the
+    number of messages of msgno that go before new_msgno[i]. The new
+    messages are fetched if need be, but the old ones are compared
+    only if their envelopes are known, from a fetch or the cache;
+    IMR_NO is returned otherwise. */
+ImapResponse
+imap_mbox_sort_merge(ImapMboxHandle *handle, ImapSortKey key,
+                     const unsigned *msgno, unsigned cnt,
+                     unsigned *new_msgno, unsigned new_cnt,
+                     unsigned *pos)
 {
-  mbox_view_append_no(&handle->mbox_view, seqno);
+  static const ImapFetchType fetch_type 
+    = IMFETCH_UID | IMFETCH_ENV | IMFETCH_RFC822SIZE | IMFETCH_CONTENT_TYPE;
+  ImapSortFunc sortfun = imap_sort_func(key);
+  struct SortItem *items, y;
+  unsigned i, lo, hi, mid, fetch_cnt, *seqno_to_fetch;
+  ImapResponse rc = IMR_OK;
+
+  if(key == IMSO_MSGNO) {
+    qsort(new_msgno, new_cnt, sizeof(unsigned), comp_unsigned);
+    for(i=0; i<new_cnt; i++) {
+      for(lo=0, hi=cnt; lo<hi; ) {
+        mid = lo + (hi-lo)/2;
+        if(msgno[mid] < new_msgno[i]) lo = mid+1; else hi = mid;
+      }
+      pos[i] = lo;
+    }
+    return IMR_OK;
+  }
+
+  g_mutex_lock(&handle->mutex);
+  IMAP_REQUIRED_STATE1(handle, IMHS_SELECTED, IMR_BAD);
+  seqno_to_fetch = g_new(unsigned, new_cnt);
+  for(i=fetch_cnt=0; i<new_cnt; i++) {
+    ImapMessage *imsg = imap_mbox_handle_get_msg(handle, new_msgno[i]);
+    if(!imsg || !imsg->envelope)
+      seqno_to_fetch[fetch_cnt++] = new_msgno[i];
+  }
+  if(fetch_cnt>0) {
+    qsort(seqno_to_fetch, fetch_cnt, sizeof(unsigned), comp_unsigned);
+    rc = imap_mbox_handle_fetch_set_unlocked(handle, seqno_to_fetch,
+					     fetch_cnt, fetch_type);
+  }
+  g_free(seqno_to_fetch);
+
+  items = g_new(struct SortItem, new_cnt);
+  for(i=0; i<new_cnt && rc == IMR_OK; i++) {
+    items[i].msg = imap_mbox_handle_get_msg(handle, new_msgno[i]);
+    items[i].no  = new_msgno[i];
+    if(!items[i].msg || !items[i].msg->envelope)
+      rc = IMR_NO;
+  }
+  if(rc == IMR_OK)
+    qsort(items, new_cnt, sizeof(struct SortItem), sortfun);
+
+  for(i=0; i<new_cnt && rc == IMR_OK; i++) {
+    new_msgno[i] = items[i].no;
+    for(lo=0, hi=cnt; lo<hi; ) {
+      mid = lo + (hi-lo)/2;
+      y.msg = imap_mbox_handle_get_msg(handle, msgno[mid]);
+      if(!y.msg || !y.msg->envelope) {
+        rc = IMR_NO;
+        break;
+      }
+      if(sortfun(&y, &items[i]) <= 0) lo = mid+1; else hi = mid;
+    }
+    pos[i] = lo;
+  }
+  g_free(items);
+  g_mutex_unlock(&handle->mutex);
+  return rc;
 }
 
 /** selects a subset of messages specified by given filter and sorts
@@ -1970,12 +2622,16 @@ imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key, int ascending,
       const char *keystr;
       int can_do_literals =
         imap_mbox_handle_can_do(handle, IMCAP_LITERAL);
+      int can_do_esort = imap_mbox_handle_can_do(handle, IMCAP_ESORT);
       ImapCmdTag tag;
+      ImapSearchCb cb;
+      void *arg;
 
       cmdno =  imap_make_tag(tag);
       keystr = sort_code_to_string(key);
       if (!imap_handle_idle_disable(handle)) { rc = IMR_SEVERED; goto cleanup; }
-      sio_printf(handle->sio, "%s SORT (%s%s) UTF-8 ", tag,
+      sio_printf(handle->sio, "%s SORT %s(%s%s) UTF-8 ", tag,
+                 can_do_esort ? "RETURN (ALL) " : "",
                  ascending ? "" : "REVERSE ", keystr);
 
       handle->mbox_view.entries = 0; /* FIXME: I do not like this! 
@@ -1990,7 +2646,10 @@ imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key, int ascending,
       }
       imap_handle_idle_enable(handle, 30);
       net_client_siobuf_flush(handle->sio, NULL);
+      cb  = handle->search_cb;  handle->search_cb  = append_no;
+      arg = handle->search_arg; handle->search_arg = NULL;
       rc = imap_cmd_process_untagged(handle, cmdno);
+      handle->search_cb = cb; handle->search_arg = arg;
     } else {                                           /* CASE 2b */
       /* try client-side sorting... */
       if(handle->enable_client_sort) {
@@ -2104,6 +2763,40 @@ imap_mbox_complete_msgids(ImapMboxHandle *h,
   return rc;
 }
 
+static void
+learn_uid_cb(ImapMboxHandle *h, unsigned uid, unsigned *seqno)
+{
+  imap_msg_store_set_uid(&h->msgs, (*seqno)++, uid);
+}
+
+/** Learns the UIDs of messages lo to hi with UID SEARCH, which is
+    cheaper than fetching them, so that imap_mbox_handle_find_uid()
+    can map their UIDs to sequence numbers.  The UIDs are expected in
+    ascending order, as servers send them.
+ */
+ImapResponse
+imap_mbox_handle_learn_uids(ImapMboxHandle *h, unsigned lo, unsigned hi)
+{
+  gchar *cmd;
+  ImapResponse rc;
+  ImapSearchCb cb;
+  void *arg;
+  unsigned seqno = lo;
+
+  if(lo < 1 || lo > hi)
+    return IMR_OK;
+  g_mutex_lock(&h->mutex);
+  IMAP_REQUIRED_STATE1(h, IMHS_SELECTED, IMR_BAD);
+  cmd = g_strdup_printf("UID SEARCH %u:%u", lo, hi);
+  cb  = h->search_cb;  h->search_cb  = (ImapSearchCb)learn_uid_cb;
+  arg = h->search_arg; h->search_arg = &seqno;
+  rc = imap_cmd_exec(h, cmd);
+  h->search_cb = cb; h->search_arg = arg;
+  g_free(cmd);
+  g_mutex_unlock(&h->mutex);
+  return rc;
+}
+
 /* RFC 2087, sect. 4.3: GETQUOTAROOT */
 ImapResponse
 imap_mbox_get_quota(ImapMboxHandle* handle, const char* mbox,
@@ -40,20 +40,15 @@ ImapResponse imap_mbox_subscribe(ImapMboxHandle* handle,
                                  const char* mbox, gboolean subscribe);
 ImapResponse imap_mbox_list(ImapMboxHandle *r, const char*what);
 ImapResponse imap_mbox_lsub(ImapMboxHandle *r, const char*what);
-typedef enum {
-  IMSTAT_MESSAGES = 0,
-  IMSTAT_RECENT,
-  IMSTAT_UIDNEXT,
-  IMSTAT_UIDVALIDITY,
-  IMSTAT_UNSEEN,
-  IMSTAT_NONE
-} ImapStatusItem;
-struct ImapStatusResult {
-  ImapStatusItem item;
-  unsigned       result;
-};
 ImapResponse imap_mbox_status(ImapMboxHandle *r, const char*what, 
                               struct ImapStatusResult *res);
+ImapResponse imap_mbox_status_many(ImapMboxHandle *r, unsigned cnt,
+                                   const char **what,
+                                   struct ImapStatusResult **res,
+                                   ImapResponse *rcs);
+ImapResponse imap_mbox_notify(ImapMboxHandle *h, unsigned cnt,
+                              const char **what);
+ImapResponse imap_mbox_notify_none(ImapMboxHandle *h);
 typedef size_t (*ImapAppendFunc)(char*, size_t, void*);
 ImapResponse imap_mbox_append(ImapMboxHandle *handle, const char *mbox,
                               ImapMsgFlags flags, size_t sz, 
@@ -61,7 +56,8 @@ ImapResponse imap_mbox_append(ImapMboxHandle *handle, const char *mbox,
 
 typedef enum {
   IMA_STAGE_NEW_MSG,
-  IMA_STAGE_PASS_DATA
+  IMA_STAGE_PASS_DATA,
+  IMA_STAGE_COMMITTED
 } ImapAppendMultiStage;
 
 typedef size_t (*ImapAppendMultiFunc)(char*, size_t,
@@ -93,11 +89,21 @@ ImapResponse imap_mbox_store_flag(ImapMboxHandle *r, unsigned cnt,
 unsigned imap_mbox_store_flag_a(ImapMboxHandle *r, unsigned cnt,
 				unsigned *seqno, ImapMsgFlag flg,
 				gboolean state);
+void imap_mbox_store_flag_local(ImapMboxHandle *r, unsigned cnt,
+                                unsigned *seqno, ImapMsgFlag flg,
+                                gboolean state);
+ImapResponse imap_mbox_store_flag_uid(ImapMboxHandle *r, unsigned cnt,
+                                      unsigned *uids, ImapMsgFlag flg,
+                                      gboolean state);
 
 ImapResponse imap_mbox_handle_copy(ImapMboxHandle* handle,
 				   unsigned cnt, unsigned *seqno,
 				   const gchar *dest,
 				   ImapSequence *ret_sequence);
+ImapResponse imap_mbox_handle_move(ImapMboxHandle* handle,
+				   unsigned cnt, unsigned *seqno,
+				   const gchar *dest,
+				   ImapSequence *ret_sequence);
 
 ImapResponse imap_mbox_find_unseen(ImapMboxHandle * h, unsigned *msgcnt,
 				   unsigned **msgs);
@@ -112,6 +118,8 @@ ImapResponse imap_mbox_handle_fetch_set(ImapMboxHandle* handle,
                                         unsigned *set, unsigned cnt,
                                         ImapFetchType ift);
 
+/* Fetched bodies are passed on in pieces as they arrive, so the
+   callback may be called several times for a message. */
 typedef void (*ImapFetchBodyCb)(unsigned seqno, const char *buf,
 				size_t buflen, void* arg);
 
@@ -123,7 +131,7 @@ ImapResponse imap_mbox_handle_fetch_rfc822(ImapMboxHandle* handle,
 
 ImapResponse imap_mbox_handle_fetch_rfc822_uid(ImapMboxHandle* handle,
                                                unsigned uid, gboolean peek,
-                                               FILE *fl);
+                                               GMimeStream *stream);
 
 ImapResponse imap_mbox_handle_fetch_body(ImapMboxHandle* handle, 
                                          unsigned seqno, 
@@ -132,6 +140,26 @@ ImapResponse imap_mbox_handle_fetch_body(ImapMboxHandle* handle,
                                          ImapFetchBodyOptions options,
                                          ImapFetchBodyCb body_handler,
                                          void *arg);
+ImapResponse imap_mbox_handle_fetch_body_to_stream(ImapMboxHandle* handle,
+                                                   unsigned seqno,
+                                                   const char *section,
+                                                   gboolean peek_only,
+                                                   ImapFetchBodyOptions options,
+                                                   GMimeStream *stream);
+int imap_mbox_handle_can_fetch_binary(ImapMboxHandle* handle);
+ImapResponse imap_mbox_handle_fetch_body_header(ImapMboxHandle* handle,
+                                                unsigned uid,
+                                                const char *section,
+                                                ImapFetchBodyOptions options,
+                                                ImapFetchBodyCb body_cb,
+                                                void *arg);
+ImapResponse imap_mbox_handle_fetch_body_partial(ImapMboxHandle* handle,
+                                                 unsigned uid,
+                                                 const char *section,
+                                                 gboolean binary,
+                                                 size_t offset, size_t length,
+                                                 ImapFetchBodyCb body_cb,
+                                                 void *arg, size_t *fetched);
 
 /* Experimental/Expansion */
 ImapResponse imap_handle_starttls(ImapMboxHandle *handle, GError **error);
@@ -148,6 +176,10 @@ ImapResponse imap_mbox_uid_search(ImapMboxHandle *handle, ImapSearchKey *key,
 ImapResponse imap_mbox_sort_msgno(ImapMboxHandle *handle, ImapSortKey key,
                                   int ascending, unsigned int *msgno,
 				  unsigned cnt);
+ImapResponse imap_mbox_sort_merge(ImapMboxHandle *handle, ImapSortKey key,
+                                  const unsigned *msgno, unsigned cnt,
+                                  unsigned *new_msgno,
+                                  unsigned new_cnt, unsigned *pos);
 ImapResponse imap_mbox_sort_filter(ImapMboxHandle *handle, ImapSortKey key,
                                    int ascending, ImapSearchKey *filter);
 ImapResponse imap_mbox_filter_msgnos(ImapMboxHandle * handle,
@@ -157,6 +189,8 @@ ImapResponse imap_mbox_filter_msgnos(ImapMboxHandle * handle,
 ImapResponse imap_mbox_complete_msgids(ImapMboxHandle *handle,
 				       GPtrArray *msgids,
 				       unsigned first_seqno_to_fetch);
+ImapResponse imap_mbox_handle_learn_uids(ImapMboxHandle *handle,
+                                         unsigned lo, unsigned hi);
 
 /* RFC 2087: Quota */
 ImapResponse imap_mbox_get_quota(ImapMboxHandle* handle, const char* mbox,
@@ -36,6 +36,7 @@
 #include "imap-handle.h"
 #include "imap-commands.h"
 #include "imap_private.h"
+#include "imap-scan.h"
 #include "siobuf-nc.h"
 #include "util.h"
 
@@ -65,7 +66,8 @@ struct _ImapMboxHandleClass {
                         ImapMboxFlags flags, const gchar* mbox);
   void (*lsub_response)(ImapMboxHandle* handle, int delim,
                         ImapMboxFlags flags, const gchar* mbox);
-  void (*expunge_notify)(ImapMboxHandle* handle, int seqno);
+  void (*expunge_batch)(ImapMboxHandle* handle, const unsigned *seqnos,
+                        const ImapUID *uids, unsigned n);
   void (*exists_notify)(ImapMboxHandle* handle);
 };
 
@@ -73,7 +75,7 @@ enum _ImapHandleSignal {
   FETCH_RESPONSE,
   LIST_RESPONSE,
   LSUB_RESPONSE,
-  EXPUNGE_NOTIFY,
+  EXPUNGE_BATCH,
   EXISTS_NOTIFY,
   LAST_SIGNAL
 };
@@ -89,6 +91,7 @@ static void imap_mbox_handle_finalize(GObject* handle);
 static ImapResult imap_mbox_connect(ImapMboxHandle* handle);
 
 static ImapResponse ir_handle_response(ImapMboxHandle *h);
+static void imap_handle_expunge_flush(ImapMboxHandle *h);
 
 static ImapAddress* imap_address_from_string(const gchar *string, gchar **n);
 static gchar*       imap_address_to_string(const ImapAddress *addr);
@@ -132,9 +135,11 @@ imap_mbox_handle_init(ImapMboxHandle *handle)
   handle->exists = 0;
   handle->recent = 0;
   handle->last_msg = NULL;
-  handle->msg_cache = NULL;
-  handle->flag_cache=  g_array_new(FALSE, TRUE, sizeof(ImapFlagCache));
+  imap_msg_store_init(&handle->msgs);
+  handle->expunge.alive = NULL;
+  handle->expunge.gone = NULL;
   handle->doing_logout = FALSE;
+  handle->offline = FALSE;
   handle->tls_mode = NET_CLIENT_CRYPT_STARTTLS;
   handle->idle_state = IDLE_INACTIVE;
   handle->cmd_info = NULL;
@@ -151,6 +156,7 @@ imap_mbox_handle_init(ImapMboxHandle *handle)
   handle->enable_client_sort = 0;
   handle->enable_binary    = 0;
   handle->enable_idle      = 1;
+  handle->enable_pipelining = 1;
 
   handle->has_rights = 0;
   mbox_view_init(&handle->mbox_view);
@@ -190,14 +196,14 @@ imap_mbox_handle_class_init(ImapMboxHandleClass * klass)
                  NULL, G_TYPE_NONE, 3,
                  G_TYPE_INT, G_TYPE_INT, G_TYPE_POINTER);
 
-  imap_mbox_handle_signals[EXPUNGE_NOTIFY] = 
-    g_signal_new("expunge-notify",
+  imap_mbox_handle_signals[EXPUNGE_BATCH] = 
+    g_signal_new("expunge-batch",
                  G_TYPE_FROM_CLASS(object_class),
                  G_SIGNAL_RUN_FIRST,
-                 G_STRUCT_OFFSET(ImapMboxHandleClass, expunge_notify),
+                 G_STRUCT_OFFSET(ImapMboxHandleClass, expunge_batch),
                  NULL, NULL,
-                 NULL, G_TYPE_NONE, 1,
-		 G_TYPE_INT);
+                 NULL, G_TYPE_NONE, 3,
+		 G_TYPE_POINTER, G_TYPE_POINTER, G_TYPE_UINT);
 
   imap_mbox_handle_signals[EXISTS_NOTIFY] = 
     g_signal_new("exists-notify",
@@ -226,6 +232,7 @@ imap_handle_set_option(ImapMboxHandle *h, ImapOption opt, gboolean state)
   case IMAP_OPT_CLIENT_SORT: h->enable_client_sort = !!state; break;
   case IMAP_OPT_COMPRESS:    h->enable_compress    = !!state; break;
   case IMAP_OPT_IDLE:        h->enable_idle        = !!state; break;
+  case IMAP_OPT_PIPELINING:  h->enable_pipelining  = !!state; break;
   default: g_warning("imap_set_option: invalid option");
   }
 }
@@ -257,6 +264,43 @@ imap_handle_set_flagscb(ImapMboxHandle* h, ImapFlagsCb cb, void* arg)
   h->flags_arg = arg;
 }
 
+/* Notes that the cached flags of message seqno differ from what they
+   were, or were not known before. */
+void
+imap_handle_flags_changed(ImapMboxHandle *h, unsigned seqno)
+{
+  if(h->flags_changed == 0 || seqno < h->flags_changed)
+    h->flags_changed = seqno;
+}
+
+/** Returns the lowest seqno whose cached flags changed since the last
+    call, or 0 if none did, whether the message is known to the client
+    or not. Flags fetched for the first time count as changed, flags
+    fetched again unchanged do not. Meant to be called from the flags
+    callback, with the handle locked. */
+unsigned
+imap_mbox_handle_take_flags_changed(ImapMboxHandle *h)
+{
+  unsigned seqno = h->flags_changed;
+  h->flags_changed = 0;
+  return seqno;
+}
+
+void
+imap_handle_set_sortupdatecb(ImapMboxHandle* h, ImapSortUpdateCb cb,
+                             void* arg)
+{
+  h->sort_update_cb  = cb;
+  h->sort_update_arg = arg;
+}
+
+void
+imap_handle_set_statuscb(ImapMboxHandle* h, ImapStatusCb cb, void* arg)
+{
+  h->status_cb  = cb;
+  h->status_arg = arg;
+}
+
 /** CmdInfo structure stores information about asynchronously executed
     commands. */
 struct CmdInfo {
@@ -313,6 +357,11 @@ static gboolean
 cmdi_empty(ImapMboxHandle *h, void *d)
 { return TRUE; }
 
+/** keeps the response code until somebody asks for it. */
+static gboolean
+cmdi_keep(ImapMboxHandle *h, void *d)
+{ return FALSE; }
+
 /** Sets new timeout. Returns the old one. */
 int
 imap_handle_set_timeout(ImapMboxHandle *h, int milliseconds)
@@ -387,6 +436,7 @@ async_process_real(ImapMboxHandle *h)
 			async_cmd);
 	}
 	g_debug("%s: loop left", __func__);
+	imap_handle_expunge_flush(h);
 	if (h->idle_state == IDLE_INACTIVE && async_cmd == 0) {
 		g_debug("%s: Last async command completed.", __func__);
 		socket_source_remove(h);
@@ -557,11 +607,13 @@ imap_handle_disconnect(ImapMboxHandle *h)
 {
   gboolean G_GNUC_UNUSED dummy;
   dummy = imap_handle_idle_disable(h);
+  imap_handle_expunge_flush(h);
   if(h->sio) {
     g_object_unref(h->sio); h->sio = NULL;
   }
   socket_source_remove(h);
   h->state = IMHS_DISCONNECTED;
+  h->sort_update_cmdno = 0;
 }
 
 int imap_mbox_is_disconnected (ImapMboxHandle *h)
@@ -573,6 +625,18 @@ int imap_mbox_is_authenticated(ImapMboxHandle *h)
 int imap_mbox_is_selected     (ImapMboxHandle *h)
 { return IMAP_MBOX_IS_SELECTED(h); }
 
+/** Enables QRESYNC extension if available. Failure is not fatal:
+    folders are then resynchronized the old way. Assumes that the
+    handle is already locked. */
+static void
+imap_handle_enable(ImapMboxHandle *h)
+{
+  h->qresync.enabled = 0;
+  if(imap_mbox_handle_can_do(h, IMCAP_ENABLE) &&
+     imap_mbox_handle_can_do(h, IMCAP_QRESYNC))
+    imap_cmd_exec(h, "ENABLE QRESYNC");
+}
+
 ImapResult
 imap_mbox_handle_connect(ImapMboxHandle* ret, const char *host)
 {
@@ -590,6 +654,8 @@ imap_mbox_handle_connect(ImapMboxHandle* ret, const char *host)
       ImapResponse response = imap_compress(ret);
       if ( !(response == IMR_NO || response == IMR_OK))
         rc = IMAP_PROTOCOL_ERROR;
+      else
+        imap_handle_enable(ret);
     }
   }
 
@@ -601,17 +667,8 @@ imap_mbox_handle_connect(ImapMboxHandle* ret, const char *host)
 void
 imap_mbox_resize_cache(ImapMboxHandle *h, unsigned new_size)
 {
-  unsigned i;
-  if(new_size<h->exists) { /* shrink msg_cache */
-    for(i=new_size; i<h->exists; i++) {
-      if(h->msg_cache[i])
-        imap_message_free(h->msg_cache[i]);
-    }
-  }
-  h->msg_cache = g_realloc(h->msg_cache, new_size*sizeof(ImapMessage*));
-  g_array_set_size(h->flag_cache, new_size);
-  for(i=h->exists; i<new_size; i++) 
-    h->msg_cache[i] = NULL;
+  imap_handle_expunge_flush(h);
+  imap_msg_store_resize(&h->msgs, new_size);
   h->exists = new_size;
 }
 
@@ -624,6 +681,10 @@ imap_mbox_handle_reconnect(ImapMboxHandle* h, gboolean *readonly)
   ImapResult rc;
   
   g_mutex_lock(&h->mutex);
+  if(h->offline) {
+    g_mutex_unlock(&h->mutex);
+    return IMAP_CONNECT_FAILED;
+  }
 
   if( (rc=imap_mbox_connect(h)) == IMAP_SUCCESS) {
     if( (rc = imap_authenticate(h)) == IMAP_SUCCESS) {
@@ -634,6 +695,10 @@ imap_mbox_handle_reconnect(ImapMboxHandle* h, gboolean *readonly)
       response = imap_compress(h);
       if (response == IMR_OK || response == IMR_NO) {
         rc = IMAP_SUCCESS;
+        imap_handle_enable(h);
+        /* Catch up with changes since the connection was lost. */
+        if(h->highestmodseq)
+          imap_mbox_handle_set_qresync(h, h->uidval, h->highestmodseq);
         if(h->mbox && 
            imap_mbox_select_unlocked(h, h->mbox, readonly) != IMR_OK) {
           rc = IMAP_SELECT_FAILED;
@@ -768,53 +833,39 @@ imap_mbox_connect(ImapMboxHandle* handle)
   return resp;
 }
 
+static unsigned tag_no = 0; /* MT-locking here */
+
 unsigned
 imap_make_tag(ImapCmdTag tag)
 {
-  static unsigned no = 0; /* MT-locking here */
-  sprintf(tag, "%x", ++no);
-  return no;
+  sprintf(tag, "%x", ++tag_no);
+  return tag_no;
+}
+
+/** Returns the number of commands tagged so far by all handles; the
+    benchmarks use it to count the commands of each phase. */
+unsigned
+imap_get_tag_count(void)
+{
+  return tag_no;
 }
 
 static int
 imap_get_atom(NetClientSioBuf *sio, char* atom, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_ATOM_CHAR(c); i++)
-    atom[i] = c;
-
-  atom[i] = '\0';
-  return c;
+  return imap_scan_token(sio, IMAP_SCAN_ATOM, atom, len);
 }
 
-#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
 static int
 imap_get_flag(NetClientSioBuf *sio, char* flag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_FLAG_CHAR(c); i++) {
-    flag[i] = c;
-  }
-  flag[i] = '\0';
-  return c;
+  return imap_scan_token(sio, IMAP_SCAN_FLAG, flag, len);
 }
 
-/* we include '+' in TAG_CHAR because we want to treat forced responses
-   in same code. This may be wrong. Reconsider.
-*/
-#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
 static int
 imap_cmd_get_tag(NetClientSioBuf *sio, char* tag, size_t len)
 {
-  unsigned i;
-  int c = 0;
-  for(i=0; i<len-1 && (c=sio_getc(sio)) >=0 && IS_TAG_CHAR(c); i++) {
-    tag[i] = c;
-  }
-  tag[i] = '\0';
-  return c;
+  return imap_scan_token(sio, IMAP_SCAN_TAG, tag, len);
 }
 
   
@@ -850,6 +901,130 @@ imap_mbox_handle_get_uidnext(ImapMboxHandle* handle)
   return handle->uidnext;
 }
 
+guint64
+imap_mbox_handle_get_highestmodseq(ImapMboxHandle *handle)
+{
+  return handle->highestmodseq;
+}
+
+/** Returns the name of the selected mailbox, or NULL when no mailbox
+    is selected. */
+const char*
+imap_mbox_handle_get_mbox(ImapMboxHandle *handle)
+{
+  return handle->state == IMHS_SELECTED ? handle->mbox : NULL;
+}
+
+/** Tells whether the selected mailbox was opened read-only with
+    EXAMINE; selecting it again then costs a round trip. */
+gboolean
+imap_mbox_handle_is_examined(ImapMboxHandle *handle)
+{
+  return handle->state == IMHS_SELECTED && handle->examined;
+}
+
+/* Weight of the latest fetch in the moving averages. */
+#define FETCH_STATS_WEIGHT 0.25
+
+/** Records that fetching envelopes of cnt messages took usecs
+    microseconds. */
+void
+imap_handle_add_fetch_sample(ImapMboxHandle *h, unsigned cnt, gint64 usecs)
+{
+  double w = h->fetch_stats.samples ? FETCH_STATS_WEIGHT : 1.0;
+  double n = cnt, t = usecs / 1e6;
+
+  h->fetch_stats.n  += w*(n   - h->fetch_stats.n);
+  h->fetch_stats.t  += w*(t   - h->fetch_stats.t);
+  h->fetch_stats.nn += w*(n*n - h->fetch_stats.nn);
+  h->fetch_stats.nt += w*(n*t - h->fetch_stats.nt);
+  h->fetch_stats.samples++;
+}
+
+void
+imap_mbox_handle_get_fetch_stats(ImapMboxHandle *handle,
+                                 ImapFetchStats *stats)
+{
+  double n = handle->fetch_stats.n, t = handle->fetch_stats.t;
+  double var = handle->fetch_stats.nn - n*n;
+
+  stats->samples = handle->fetch_stats.samples;
+  stats->per_message = 0;
+  /* Until the fetches differ enough in size, charge all the time to
+     the round trip. */
+  if(var > 1.0) {
+    stats->per_message = (handle->fetch_stats.nt - n*t)/var;
+    if(stats->per_message < 0)
+      stats->per_message = 0;
+  }
+  stats->rtt = t - stats->per_message*n;
+  if(stats->rtt < 0) {
+    stats->rtt = 0;
+    stats->per_message = n > 0 ? t/n : 0;
+  }
+}
+
+/** Sets the state the client has cached for the mailbox that is to be
+    selected next: SELECT will then use QRESYNC if enabled. */
+void
+imap_mbox_handle_set_qresync(ImapMboxHandle *handle,
+                             unsigned uidvalidity, guint64 modseq)
+{
+  handle->qresync.uidvalidity = uidvalidity;
+  handle->qresync.modseq = modseq;
+}
+
+/** Makes h, a handle that was never connected, stand for mailbox
+    mbox in the state it was last seen in, so that the messages can be
+    restored with imap_mbox_handle_msg_defer() from a cache and read
+    without a connection. Their cached flags are taken as the current
+    ones. Such a handle is never connected; commands fail. */
+void
+imap_mbox_handle_set_offline(ImapMboxHandle *h, const char *mbox,
+                             unsigned uidvalidity, ImapUID uidnext,
+                             unsigned exists, guint64 modseq)
+{
+  g_mutex_lock(&h->mutex);
+  h->offline = TRUE;
+  g_free(h->mbox);
+  h->mbox = g_strdup(mbox);
+  imap_mbox_resize_cache(h, exists);
+  h->uidval = uidvalidity;
+  h->uidnext = uidnext;
+  h->highestmodseq = modseq;
+  h->qresync.synced = 1;
+  g_mutex_unlock(&h->mutex);
+}
+
+gboolean
+imap_mbox_handle_is_offline(ImapMboxHandle *h)
+{
+  gboolean offline;
+
+  g_mutex_lock(&h->mutex);
+  offline = h->offline;
+  g_mutex_unlock(&h->mutex);
+  return offline;
+}
+
+/** Returns TRUE if the mailbox was selected with QRESYNC. In such a
+    case, vanished is set to UIDs of the messages expunged since the
+    state passed to imap_mbox_handle_set_qresync() and only messages
+    with changed flags have been reported by the server. The caller
+    is responsible for releasing vanished. */
+gboolean
+imap_mbox_handle_take_vanished(ImapMboxHandle *handle,
+                               ImapSequence *vanished)
+{
+  imap_sequence_init(vanished);
+  if(!handle->qresync.synced)
+    return FALSE;
+  vanished->ranges = handle->qresync.vanished;
+  vanished->uid_validity = handle->uidval;
+  handle->qresync.vanished = NULL;
+  return TRUE;
+}
+
 static void
 get_delim(ImapMboxHandle* handle, int delim, ImapMboxFlags flags,
           char *folder, int *my_delim)
@@ -934,11 +1109,12 @@ imap_mbox_handle_finalize(GObject* gobject)
 
   mbox_view_dispose(&handle->mbox_view);
   imap_mbox_resize_cache(handle, 0);
-  g_free(handle->msg_cache); handle->msg_cache = NULL;
-  g_array_free(handle->flag_cache, TRUE); handle->flag_cache = NULL;
+  imap_msg_store_dispose(&handle->msgs);
   g_list_foreach(handle->acls, (GFunc)imap_user_acl_free, NULL);
   g_list_free(handle->acls); handle->acls = NULL;
   g_free(handle->quota_root); handle->quota_root = NULL;
+  g_list_free_full(handle->qresync.vanished, g_free);
+  handle->qresync.vanished = NULL;
 
   g_mutex_unlock(&handle->mutex);
   g_mutex_clear(&handle->mutex);
@@ -979,6 +1155,11 @@ imap_handle_process_tasks(ImapMboxHandle* handle)
   g_slist_free(begin);
 }
     
+/* Longer sequence sets are fetched with several pipelined commands;
+ * RFC 7162, sect. 4 recommends keeping command lines below 8192
+ * octets. */
+#define FETCH_SET_LENGTH 4000
+
 ImapResponse
 imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq, 
                        const gchar* headers[])
@@ -987,6 +1168,7 @@ imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq,
   int i;
   GString* hdr;
   ImapResponse rc;
+  ImapPipeline *p;
   
   IMAP_REQUIRED_STATE1_U(handle, IMHS_SELECTED, IMR_BAD);
   hdr = g_string_new(headers[0]);
@@ -995,10 +1177,26 @@ imap_mbox_handle_fetch_unlocked(ImapMboxHandle* handle, const gchar *seq,
       g_string_append_c(hdr, ' ');
     g_string_append(hdr, headers[i]);
   }
-  cmd = g_strdup_printf("FETCH %s (%s)", seq, hdr->str);
+  p = imap_pipeline_new(handle);
+  while(*seq) {
+    /* Cut the set at a comma, long lines are not welcome. */
+    size_t len = strlen(seq);
+    if(len > FETCH_SET_LENGTH) {
+      const char *comma = seq + FETCH_SET_LENGTH;
+      while(comma > seq && *comma != ',')
+        comma--;
+      if(comma > seq)
+        len = comma - seq;
+    }
+    cmd = g_strdup_printf("FETCH %.*s (%s)", (int)len, seq, hdr->str);
+    imap_pipeline_add(p, cmd, NULL, NULL);
+    g_free(cmd);
+    seq += len;
+    if(*seq == ',')
+      seq++;
+  }
   g_string_free(hdr, TRUE);
-  rc = imap_cmd_exec(handle, cmd);
-  g_free(cmd);
+  rc = imap_pipeline_run(p);
   return rc;
 }
 
@@ -1021,7 +1219,8 @@ imap_mbox_handle_get_msg(ImapMboxHandle* h, unsigned seqno)
 {
   g_return_val_if_fail(h, 0);
   g_return_val_if_fail(seqno-1<h->exists, NULL);
-  return h->msg_cache[seqno-1];
+  imap_mbox_handle_materialize(h, seqno);
+  return imap_msg_store_get(&h->msgs, seqno);
 }
 
 const char*
@@ -1428,7 +1627,7 @@ imap_sequence_foreach(ImapSequence *i_seq,
 void
 imap_sequence_release(ImapSequence *i_seq)
 {
-  g_list_foreach(i_seq->ranges, (GFunc)g_free, NULL);
+  g_list_free_full(i_seq->ranges, g_free);
   i_seq->ranges = NULL;
 }
 
@@ -1698,12 +1897,142 @@ imap_message_free(ImapMessage *msg)
   g_free(msg);
 }
 
+/* After a QRESYNC select, the server would have reported changed
+   flags: the cached ones are current. */
+static void
+imap_handle_set_cached_flags(ImapMboxHandle *h, unsigned msgno,
+                             ImapMsgFlags cached)
+{
+  ImapFlagCache *flags = imap_msg_store_flags(&h->msgs, msgno);
+  flags->flag_values = cached & ~IMSGF_RECENT;
+  flags->known_flags = ~IMSGF_RECENT;
+}
+
+/* Puts the cached message imsg in place of whatever is known of
+   message msgno, which has no envelope. */
+static void
+imap_handle_msg_merge(ImapMboxHandle *h, unsigned msgno, ImapMessage *imsg)
+{
+  ImapMessage *fresh = imap_msg_store_get(&h->msgs, msgno);
+
+  if(fresh) {
+    /* Only UID and FLAGS have been fetched since selecting the
+       mailbox; they are more recent than what has been cached. */
+    if(fresh->uid != imsg->uid) {
+      imap_message_free(imsg);
+      return;
+    }
+    imsg->flags = fresh->flags;
+    imap_message_free(fresh);
+  }
+  imap_msg_store_set(&h->msgs, msgno, imsg);
+  imap_msg_store_set_uid(&h->msgs, msgno, imsg->uid);
+}
+
 void
 imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
                                  void *data)
 {
-  if(msgno>=1 && msgno <=h->exists && !h->msg_cache[msgno-1])
-    h->msg_cache[msgno-1] = imap_message_deserialize(data);
+  ImapMessage *imsg, *fresh;
+
+  if(msgno<1 || msgno>h->exists)
+    return;
+  fresh = imap_msg_store_get(&h->msgs, msgno);
+  if(fresh && fresh->envelope)
+    return;
+
+  imsg = imap_message_deserialize(data);
+  if(!fresh && h->qresync.synced)
+    imap_handle_set_cached_flags(h, msgno, imsg->flags);
+  imap_handle_msg_merge(h, msgno, imsg);
+}
+
+/** Like imap_mbox_handle_msg_deserialize(), but the message is
+    decoded only when it is first asked for, so that opening a large
+    mailbox does not decode all cached headers.  uid and flags must be
+    those recorded in data, which must stay valid until the mailbox
+    is selected again, or imap_mbox_handle_drop_deferred() is
+    called. */
+void
+imap_mbox_handle_msg_defer(ImapMboxHandle *h, unsigned msgno,
+                           ImapUID uid, ImapMsgFlags flags,
+                           const void *data)
+{
+  ImapMessage *fresh;
+  ImapDeferredMsg *dm;
+
+  if(msgno<1 || msgno>h->exists)
+    return;
+  fresh = imap_msg_store_get(&h->msgs, msgno);
+  if(fresh && (fresh->envelope || fresh->uid != uid))
+    return;
+
+  if(!fresh && h->qresync.synced)
+    imap_handle_set_cached_flags(h, msgno, flags);
+  imap_msg_store_set_uid(&h->msgs, msgno, uid);
+  dm = imap_msg_store_deferred(&h->msgs, msgno, TRUE);
+  dm->flags = flags;
+  dm->data  = data;
+}
+
+/** Returns the data of message msgno passed to
+    imap_mbox_handle_msg_defer(), if it is still not decoded and
+    nothing else is known of the message, and its UID and flags.
+    Returns NULL otherwise. */
+const void*
+imap_mbox_handle_get_deferred(ImapMboxHandle *h, unsigned msgno,
+                              ImapUID *uid, ImapMsgFlags *flags)
+{
+  ImapDeferredMsg *dm;
+
+  if(msgno<1 || msgno>h->exists || imap_msg_store_get(&h->msgs, msgno))
+    return NULL;
+  dm = imap_msg_store_deferred(&h->msgs, msgno, FALSE);
+  if(!dm || !dm->data)
+    return NULL;
+  *uid   = imap_msg_store_get_uid(&h->msgs, msgno);
+  *flags = dm->flags;
+  return dm->data;
+}
+
+/** Forgets the messages that were not decoded yet. */
+void
+imap_mbox_handle_drop_deferred(ImapMboxHandle *h)
+{
+  imap_msg_store_drop_deferred(&h->msgs);
+}
+
+/* Decodes the deferred message seqno, if any. */
+void
+imap_mbox_handle_materialize(ImapMboxHandle *h, unsigned seqno)
+{
+  ImapDeferredMsg *dm;
+  ImapMessage *fresh;
+
+  dm = imap_msg_store_deferred(&h->msgs, seqno, FALSE);
+  if(!dm || !dm->data)
+    return;
+  fresh = imap_msg_store_get(&h->msgs, seqno);
+  if(!fresh || !fresh->envelope)
+    imap_handle_msg_merge(h, seqno,
+                          imap_message_deserialize((void*)dm->data));
+  memset(dm, 0, sizeof(ImapDeferredMsg));
+}
+
+/* The UID of message seqno, if known, without decoding it. */
+ImapUID
+imap_mbox_handle_known_uid(ImapMboxHandle *h, unsigned seqno)
+{
+  return imap_msg_store_get_uid(&h->msgs, seqno);
+}
+
+/** Returns the sequence number of the message with given UID, if its
+    UID is known, or 0. */
+unsigned
+imap_mbox_handle_find_uid(ImapMboxHandle *h, ImapUID uid)
+{
+  g_return_val_if_fail(h, 0);
+  return imap_msg_store_find_uid(&h->msgs, uid);
 }
 /* Serialize message itself and the envelope, and the body structure
    if available. */
@@ -1870,8 +2199,10 @@ imap_cmd_step(ImapMboxHandle* handle, unsigned lastcmd)
   }
 
   /* server demands a continuation response from us */
-  if (strcmp(tag, "+") == 0)
+  if (strcmp(tag, "+") == 0) {
+    imap_handle_expunge_flush(handle);
     return IMR_RESPOND;
+  }
 
   /* tagged completion code is the only alternative. */
   /* our command tags are hexadecimal numbers, at most 7 chars */
@@ -1956,6 +2287,236 @@ imap_cmd_exec_cmdno(ImapMboxHandle* handle, const char* cmd,
   return rc;
 }
 
+/* Pipelined command execution.
+ *
+ * An ImapPipeline keeps up to IMAP_PIPELINE_DEPTH tagged commands in
+ * flight and collects their completions in the order the commands
+ * were queued.  RFC 3501, sect. 5.5 forbids sending a command that
+ * refers to message sequence numbers while a command that permits
+ * EXPUNGE responses is in progress, since the numbers could shift
+ * under it; the engine derives this from the command text and holds
+ * such commands back until it is safe. */
+#define IMAP_PIPELINE_DEPTH 16
+
+enum {
+  IMAP_PIPE_SEQNO      = 1 << 0, /**< uses message sequence numbers */
+  IMAP_PIPE_NO_EXPUNGE = 1 << 1, /**< server may not EXPUNGE meanwhile */
+  IMAP_PIPE_FENCE      = 1 << 2, /**< wait for all earlier commands */
+  IMAP_PIPE_EXCLUSIVE  = 1 << 3  /**< nothing else may be in flight */
+};
+
+struct PipelineCmd {
+  gchar *cmd;
+  unsigned flags;
+  unsigned cmdno;
+  ImapPipelineCb cb;
+  void *arg;
+};
+
+struct _ImapPipeline {
+  ImapMboxHandle *handle;
+  GQueue queued;    /**< commands not sent yet */
+  GQueue in_flight; /**< commands sent, oldest first */
+  unsigned fence:1; /**< next command must wait for the earlier ones */
+};
+
+static unsigned
+imap_pipeline_classify(const char *cmd)
+{
+  static const struct {
+    const char *name;
+    unsigned flags;
+  } cmds[] = {
+    { "FETCH ",        IMAP_PIPE_SEQNO | IMAP_PIPE_NO_EXPUNGE },
+    { "STORE ",        IMAP_PIPE_SEQNO | IMAP_PIPE_NO_EXPUNGE },
+    { "SEARCH ",       IMAP_PIPE_SEQNO | IMAP_PIPE_NO_EXPUNGE },
+    { "COPY ",         IMAP_PIPE_SEQNO },
+    { "MOVE ",         IMAP_PIPE_SEQNO },
+    { "SORT ",         IMAP_PIPE_SEQNO },
+    { "THREAD ",       IMAP_PIPE_SEQNO },
+    { "AUTHENTICATE ", IMAP_PIPE_EXCLUSIVE },
+    { "COMPRESS ",     IMAP_PIPE_EXCLUSIVE },
+    { "IDLE",          IMAP_PIPE_EXCLUSIVE },
+    { "LOGOUT",        IMAP_PIPE_EXCLUSIVE },
+    { "STARTTLS",      IMAP_PIPE_EXCLUSIVE }
+  };
+  unsigned i;
+
+  for(i=0; i<G_N_ELEMENTS(cmds); i++)
+    if(g_ascii_strncasecmp(cmd, cmds[i].name, strlen(cmds[i].name)) == 0)
+      return cmds[i].flags;
+  return 0; /* UID commands do not depend on sequence numbers. */
+}
+
+ImapPipeline*
+imap_pipeline_new(ImapMboxHandle *h)
+{
+  ImapPipeline *p = g_new0(ImapPipeline, 1);
+  p->handle = h;
+  g_queue_init(&p->queued);
+  g_queue_init(&p->in_flight);
+  return p;
+}
+
+/** Queues cmd for execution. cb, if not NULL, is called with
+    IMR_UNTAGGED just before the pipeline starts collecting responses
+    to the command - so that handlers of untagged responses can be
+    pointed at the right data - and once more with the final response
+    code.  Commands that were never completed get the code that
+    aborted the pipeline. */
+void
+imap_pipeline_add(ImapPipeline *p, const char *cmd,
+                  ImapPipelineCb cb, void *arg)
+{
+  struct PipelineCmd *pc = g_new(struct PipelineCmd, 1);
+  pc->cmd = g_strdup(cmd);
+  pc->flags = imap_pipeline_classify(cmd);
+  if(p->fence) {
+    pc->flags |= IMAP_PIPE_FENCE;
+    p->fence = 0;
+  }
+  pc->cmdno = 0;
+  pc->cb = cb;
+  pc->arg = arg;
+  g_queue_push_tail(&p->queued, pc);
+}
+
+/** Commands added after the barrier are sent only after all the
+    commands added before it have completed. */
+void
+imap_pipeline_barrier(ImapPipeline *p)
+{
+  p->fence = 1;
+}
+
+static gboolean
+imap_pipeline_may_issue(ImapPipeline *p, struct PipelineCmd *pc)
+{
+  GList *l;
+
+  if( (pc->flags & (IMAP_PIPE_FENCE|IMAP_PIPE_EXCLUSIVE)) &&
+      !g_queue_is_empty(&p->in_flight))
+    return FALSE;
+  for(l = p->in_flight.head; l; l = l->next) {
+    struct PipelineCmd *c = (struct PipelineCmd*)l->data;
+    if(c->flags & IMAP_PIPE_EXCLUSIVE)
+      return FALSE;
+    if( (pc->flags & IMAP_PIPE_SEQNO) && !(c->flags & IMAP_PIPE_NO_EXPUNGE))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+imap_pipeline_cmd_done(ImapMboxHandle *h, struct PipelineCmd *pc,
+                       ImapResponse rc)
+{
+  if(pc->cb)
+    pc->cb(h, rc, pc->arg);
+  g_free(pc->cmd);
+  g_free(pc);
+}
+
+/** Forgets the stored completion of a command that we stop waiting
+    for, or are going to wait for directly. */
+void
+imap_cmd_forget(ImapMboxHandle *h, unsigned cmdno)
+{
+  struct CmdInfo *ci = cmdi_find_by_no(h->cmd_info, cmdno);
+  if(ci) {
+    h->cmd_info = g_list_remove(h->cmd_info, ci);
+    g_free(ci);
+  }
+}
+
+/** Keeps the response code of command cmdno if it arrives while we
+    wait for another command, see imap_cmd_collect(). */
+void
+imap_cmd_keep(ImapMboxHandle *h, unsigned cmdno)
+{
+  cmdi_add_handler(&h->cmd_info, cmdno, cmdi_keep, NULL);
+}
+
+/** Returns the response code of command cmdno passed earlier to
+    imap_cmd_keep(), waiting for it if it has not arrived yet. */
+ImapResponse
+imap_cmd_collect(ImapMboxHandle *h, unsigned cmdno)
+{
+  struct CmdInfo *ci = cmdi_find_by_no(h->cmd_info, cmdno);
+  if(ci && !ci->completed)
+    imap_cmd_forget(h, cmdno);
+  return imap_cmd_process_untagged(h, cmdno);
+}
+
+/** Executes the queued commands and frees the pipeline. Returns
+    IMR_OK if all the commands succeeded, the first NO or BAD
+    response otherwise, or the code of a connection error that
+    aborted the execution. Called with handle locked. */
+ImapResponse
+imap_pipeline_run(ImapPipeline *p)
+{
+  ImapMboxHandle *h = p->handle;
+  ImapResponse rc, ret_rc = IMR_OK, abort_rc = IMR_OK;
+  unsigned depth = h->enable_pipelining ? IMAP_PIPELINE_DEPTH : 1;
+  struct PipelineCmd *pc;
+
+  if(g_queue_is_empty(&p->queued)) {
+    g_free(p);
+    return IMR_OK;
+  }
+  if (h->state == IMHS_DISCONNECTED || !imap_handle_idle_disable(h))
+    abort_rc = IMR_SEVERED;
+
+  while(abort_rc == IMR_OK && (!g_queue_is_empty(&p->queued) ||
+                               !g_queue_is_empty(&p->in_flight))) {
+    while( (pc = g_queue_peek_head(&p->queued)) != NULL &&
+           g_queue_get_length(&p->in_flight) < depth &&
+           imap_pipeline_may_issue(p, pc)) {
+      g_queue_pop_head(&p->queued);
+      if(imap_cmd_start(h, pc->cmd, &pc->cmdno)<0) {
+        abort_rc = IMR_SEVERED; /* irrecoverable connection error. */
+        imap_pipeline_cmd_done(h, pc, abort_rc);
+        break;
+      }
+      /* Keep the response code if it arrives out of order. */
+      imap_cmd_keep(h, pc->cmdno);
+      g_queue_push_tail(&p->in_flight, pc);
+    }
+    if(abort_rc != IMR_OK)
+      break;
+
+    pc = g_queue_pop_head(&p->in_flight);
+    if(pc->cb)
+      pc->cb(h, IMR_UNTAGGED, pc->arg);
+    rc = imap_cmd_collect(h, pc->cmdno);
+    imap_pipeline_cmd_done(h, pc, rc);
+    if(rc == IMR_NO || rc == IMR_BAD) {
+      if(ret_rc == IMR_OK)
+        ret_rc = rc;
+    } else if(rc != IMR_OK)
+      abort_rc = rc;
+  }
+
+  while( (pc = g_queue_pop_head(&p->in_flight)) != NULL) {
+    imap_cmd_forget(h, pc->cmdno);
+    imap_pipeline_cmd_done(h, pc, abort_rc);
+  }
+  while( (pc = g_queue_pop_head(&p->queued)) != NULL)
+    imap_pipeline_cmd_done(h, pc, abort_rc);
+  g_free(p);
+
+  imap_handle_idle_enable(h, IDLE_TIMEOUT);
+
+  return abort_rc != IMR_OK ? abort_rc : ret_rc;
+}
+
+static void
+exec_cmds_cb(ImapMboxHandle *h, ImapResponse rc, ImapResponse *cmd_rc)
+{
+  if(rc != IMR_UNTAGGED)
+    *cmd_rc = rc;
+}
+
 /** Executes a set of commands, and wait for the response from the
  * server.  Handles all untagged responses that arrive in meantime.
  * Returns ImapResponse.
@@ -1969,49 +2530,29 @@ imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
 		   unsigned rc_to_return)
 {
   unsigned cmd_count;
-  ImapResponse rc = IMR_OK, ret_rc = IMR_OK;
-  unsigned *cmdnos;
+  ImapResponse rc, *cmd_rcs;
+  ImapPipeline *p;
 
   g_return_val_if_fail(handle, IMR_BAD);
   if (handle->state == IMHS_DISCONNECTED)
     return IMR_SEVERED;
 
-  if (!imap_handle_idle_disable(handle)) return IMR_SEVERED;
-
   for (cmd_count=0; cmds[cmd_count]; ++cmd_count)
     ;
-  cmdnos = g_malloc(cmd_count*sizeof(unsigned));
-  
-  for (cmd_count=0; cmds[cmd_count]; ++cmd_count) {
-    if (imap_cmd_start(handle, cmds[cmd_count], &cmdnos[cmd_count])<0) {
-      rc = IMR_SEVERED;   /* irrecoverable connection error. */
-      break;
-    }
-  }
-  if (rc == IMR_OK) {
-    g_return_val_if_fail(handle->state != IMHS_DISCONNECTED && 1, IMR_BAD);
-    if(handle->state == IMHS_DISCONNECTED)
-      ret_rc = IMR_SEVERED;
-    else {
-      for (cmd_count=0; cmds[cmd_count]; ++cmd_count) {
-    	  rc = imap_cmd_process_untagged(handle, cmdnos[cmd_count]);
-
-	if ( !(rc == IMR_OK || rc == IMR_NO || rc == IMR_BAD) ) {
-	  ret_rc = rc;
-	  break;
-	}
+  cmd_rcs = g_new(ImapResponse, cmd_count);
 
-	if (cmd_count == rc_to_return)
-	  ret_rc = rc;
-
-      }
-    }
+  p = imap_pipeline_new(handle);
+  for (cmd_count=0; cmds[cmd_count]; ++cmd_count) {
+    cmd_rcs[cmd_count] = IMR_OK;
+    imap_pipeline_add(p, cmds[cmd_count], (ImapPipelineCb)exec_cmds_cb,
+                      &cmd_rcs[cmd_count]);
   }
-  g_free(cmdnos);
-      
-  imap_handle_idle_enable(handle, IDLE_TIMEOUT);
+  rc = imap_pipeline_run(p);
+  if (rc == IMR_OK || rc == IMR_NO || rc == IMR_BAD)
+    rc = rc_to_return < cmd_count ? cmd_rcs[rc_to_return] : IMR_OK;
+  g_free(cmd_rcs);
 
-  return ret_rc;
+  return rc;
 }
 
 static GString*
@@ -2019,12 +2560,10 @@ imap_get_string_with_lookahead(NetClientSioBuf *sio, int c)
 { /* string */  
   GString *res = NULL;
   if(c=='"') { /* quoted */
-    res = g_string_new("");
-    while( (c=sio_getc(sio)) != '"' && c != EOF) {
-      if(c== '\\')
-        c = sio_getc(sio);
-      g_string_append_c(res, c);
-    }
+    ImapSlice slice;
+    res = imap_scan_quoted(sio, &slice);
+    if(!res)
+      res = g_string_new_len(slice.str, slice.len);
   } else { /* this MUST be literal */
     char buf[15];
     int len;
@@ -2079,7 +2618,6 @@ imap_get_nstring(NetClientSioBuf *sio)
 }
 
 /* see the spec for the definition of astring */
-#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
 static char*
 imap_get_astring(NetClientSioBuf *sio, int* lookahead)
 {
@@ -2088,10 +2626,8 @@ imap_get_astring(NetClientSioBuf *sio, int* lookahead)
 
   if(IS_ASTRING_CHAR(c)) {
     GString *str = g_string_new("");
-    do {
-      g_string_append_c(str, c);
-      c = sio_getc(sio);
-    } while(IS_ASTRING_CHAR(c));
+    g_string_append_c(str, c);
+    c = imap_scan_append(sio, IMAP_SCAN_ASTRING, str);
     res = g_string_free(str, FALSE);
     *lookahead = c;
   } else {
@@ -2140,10 +2676,7 @@ ignore_bad_charset(NetClientSioBuf *sio, int c)
 static int
 ir_permanent_flags(ImapMboxHandle *h)
 {
-  int c;
-  while( (c=sio_getc(h->sio)) != EOF && c != ']')
-    ;
-  return c;
+  return imap_scan_skip_to(h->sio, ']');
 }
 
 static int
@@ -2154,9 +2687,11 @@ ir_capability_data(ImapMboxHandle *handle)
     "IMAP4", "IMAP4rev1", "STATUS",
     "AUTH=ANONYMOUS", "AUTH=CRAM-MD5", "AUTH=GSSAPI", "AUTH=PLAIN",
     "ACL", "RIGHTS=", "BINARY", "CHILDREN",
-    "COMPRESS=DEFLATE",
-    "ESEARCH", "IDLE", "LITERAL+",
-    "LOGINDISABLED", "MULTIAPPEND", "NAMESPACE", "QUOTA", "SASL-IR",
+    "COMPRESS=DEFLATE", "CONDSTORE", "CONTEXT=SORT", "ENABLE",
+    "ESEARCH", "ESORT", "IDLE", "LIST-STATUS", "LITERAL+", "LITERAL-",
+    "LOGINDISABLED", "MOVE", "MULTIAPPEND", "NAMESPACE", "NOTIFY",
+    "QRESYNC", "QUOTA",
+    "SASL-IR",
     "SCAN", "STARTTLS",
     "SORT", "THREAD=ORDEREDSUBJECT", "THREAD=REFERENCES",
     "UIDPLUS", "UNSELECT"
@@ -2276,7 +2811,8 @@ ir_resp_text_code(ImapMboxHandle *h)
   static const char* resp_text_code[] = {
     "ALERT", "BADCHARSET", "CAPABILITY","PARSE", "PERMANENTFLAGS",
     "READ-ONLY", "READ-WRITE", "TRYCREATE", "UIDNEXT", "UIDVALIDITY",
-    "UNSEEN", "APPENDUID", "COPYUID"
+    "UNSEEN", "APPENDUID", "COPYUID", "HIGHESTMODSEQ", "NOMODSEQ",
+    "NOTIFICATIONOVERFLOW"
   };
   unsigned o;
   char buf[128];
@@ -2319,7 +2855,16 @@ ir_resp_text_code(ImapMboxHandle *h)
       return rc;
     c = sio_getc(h->sio);
     break;
-  default: while( c != ']' && (c=sio_getc(h->sio)) != EOF) ; break;
+  case 13: /* HIGHESTMODSEQ */
+    c = imap_get_atom(h->sio, buf, sizeof(buf));
+    h->highestmodseq = g_ascii_strtoull(buf, NULL, 10);
+    break;
+  case 14: h->highestmodseq = 0; /* NOMODSEQ */ break;
+  case 15: /* NOTIFICATIONOVERFLOW, RFC 5465 */
+    if(h->status_cb)
+      h->status_cb(h, NULL, NULL, h->status_arg);
+    break;
+  default: if(c != ']') c = imap_scan_skip_to(h->sio, ']'); break;
   }
   if(c != ']')
     g_debug("ir_resp_text_code, on exit c=%c", c);
@@ -2511,37 +3056,56 @@ static ImapResponse
 ir_status(ImapMboxHandle *h)
 {
   int c;
-  char *name;
+  char *name, *utf8 = NULL;
   struct ImapStatusResult *resp;
+  struct ImapStatusResult notified[G_N_ELEMENTS(imap_status_item_names)+1];
+  unsigned n_notified = 0;
+  ImapResponse rc = IMR_OK;
 
   name = imap_get_astring(h->sio, &c);
+  if(!name) return IMR_PROTOCOL;
+  /* requests are keyed by UTF-8 names */
+  utf8 = imap_mailbox_to_utf8(name);
   resp = g_hash_table_lookup(h->status_resps, name);
-  if(c                != ' ') {g_free(name); return IMR_PROTOCOL;}
-  if(sio_getc(h->sio) != '(') {g_free(name); return IMR_PROTOCOL;}
+  if(!resp)
+    resp = g_hash_table_lookup(h->status_resps, utf8);
+  if(c != ' ' || sio_getc(h->sio) != '(') {
+    g_free(utf8); g_free(name);
+    return IMR_PROTOCOL;
+  }
   do {
     char item[13], count[13]; /* longest than UIDVALIDITY */
+    unsigned idx, i, value;
     c = imap_get_atom(h->sio, item, sizeof(item));
     if(c == ')') break;
-    if(c != ' ') {g_free(name); return IMR_PROTOCOL;}
+    if(c != ' ') { rc = IMR_PROTOCOL; break; }
     c = imap_get_atom(h->sio, count, sizeof(count));
-    /* FIXME: process the response */
+    for(idx=0; idx<G_N_ELEMENTS(imap_status_item_names); idx++)
+      if(g_ascii_strcasecmp(item, imap_status_item_names[idx]) == 0)
+        break;
+    if(idx == G_N_ELEMENTS(imap_status_item_names))
+      continue; /* an item we did not ask for */
+    if (sscanf(count, "%13u", &value) != 1) { rc = IMR_PROTOCOL; break; }
     if(resp) {
-      unsigned idx, i;
-      for(idx=0; idx<G_N_ELEMENTS(imap_status_item_names); idx++)
-        if(g_ascii_strcasecmp(item, imap_status_item_names[idx]) == 0)
-          break;
       for(i= 0; resp[i].item != IMSTAT_NONE; i++) {
         if(resp[i].item == idx) {
-          if (sscanf(count, "%13u", &resp[i].result) != 1) {
-            g_free(name);
-            return IMR_PROTOCOL;
-          }
+          resp[i].result = value;
           break;
         }
       }
+    } else if(n_notified < G_N_ELEMENTS(imap_status_item_names)) {
+      notified[n_notified].item = idx;
+      notified[n_notified++].result = value;
     }
   } while(c == ' ');
+  if(rc == IMR_OK && !resp && h->status_cb) {
+    notified[n_notified].item = IMSTAT_NONE;
+    h->status_cb(h, utf8, notified, h->status_arg);
+  }
+  g_free(utf8);
   g_free(name);
+  if(rc != IMR_OK)
+    return rc;
   /* g_return_val_if-fail(c == ')', IMR_BAD) */
   return ir_check_crlf(h, sio_getc(h->sio));
 }
@@ -2551,16 +3115,71 @@ esearch_cb(ImapUidRange *iur, void *arg)
 {
   ImapMboxHandle *h = (ImapMboxHandle*)arg;
   unsigned i;
-  for(i=iur->lo; i<= iur->hi; i++)
+  /* ESORT results come in sort order: ranges may descend. */
+  for(i=iur->lo; ; i = iur->lo <= iur->hi ? i+1 : i-1) {
     h->search_cb(h, i, h->search_arg);
+    if(i == iur->hi)
+      break;
+  }
+}
+
+struct EsearchUpdate {
+  ImapMboxHandle *h;
+  unsigned position;
+  gboolean added;
+};
+
+static void
+esearch_update_cb(ImapUidRange *iur, void *arg)
+{
+  struct EsearchUpdate *eu = (struct EsearchUpdate*)arg;
+  unsigned i;
+  for(i=iur->lo; ; i = iur->lo <= iur->hi ? i+1 : i-1) {
+    eu->h->sort_update_cb(eu->h, eu->position, i, eu->added,
+                          eu->h->sort_update_arg);
+    if(eu->position) /* the messages of a set follow each other */
+      eu->position++;
+    if(i == iur->hi)
+      break;
+  }
+}
+
+/* Reads ADDTO or REMOVEFROM return data of RFC5267: a list of
+   positions, each followed by the messages added at or removed from
+   it. */
+static ImapResponse
+ir_esearch_update(ImapMboxHandle *h, gboolean added, gboolean wanted)
+{
+  struct EsearchUpdate eu;
+  char atom[12];
+  ImapResponse rc;
+  int c;
+
+  if( (c=sio_getc(h->sio)) != '(')
+    return c == EOF ? IMR_SEVERED : IMR_PROTOCOL;
+  eu.h = h;
+  eu.added = added;
+  do {
+    c = imap_get_atom(h->sio, atom, sizeof(atom));
+    if(c != ' ')
+      return c == EOF ? IMR_SEVERED : IMR_PROTOCOL;
+    eu.position = strtoul(atom, NULL, 10);
+    if( (rc=imap_get_sequence(h, wanted ? esearch_update_cb : NULL, &eu))
+        != IMR_OK)
+      return rc;
+  } while( (c=sio_getc(h->sio)) == ' ');
+  if(c != ')')
+    return c == EOF ? IMR_SEVERED : IMR_PROTOCOL;
+  return IMR_OK;
 }
 
-/** Process ESEARCH response. Consult RFC4466 and RFC4731 before
-   modification.  */
+/** Process ESEARCH response. Consult RFC4466, RFC4731 and RFC5267
+   before modification.  */
 static ImapResponse
 ir_esearch(ImapMboxHandle *h)
 {
   char atom[LONG_STRING];
+  unsigned cmdno = 0;
   int c = sio_getc(h->sio);
   if(c == '(') { /* search correlator */
     gchar *str;
@@ -2574,6 +3193,8 @@ ir_esearch(ImapMboxHandle *h)
       return IMR_PROTOCOL;
     str = imap_get_string(h->sio);
     /* printf("ESearch response for tag %s\n", str); */
+    if(str)
+      cmdno = strtoul(str, NULL, 16);
     g_free(str);
     if( (c = sio_getc(h->sio)) != ')') {
       return c == EOF ? IMR_SEVERED : IMR_PROTOCOL;
@@ -2594,12 +3215,28 @@ ir_esearch(ImapMboxHandle *h)
   while(c == ' ') { /* search-return-data in rfc4466 speak */
     ImapResponse rc;
     /* atom contains search-modifier-name, time to fetch
-       search-return-value. In ESEARCH, it is always an
-       tagged-ext-simple=sequence-set/number, which are an atoms, so
-       we cut the corners here. We get values in chunks.  The chunk
-       size is pretty arbitrary as long as it can fit two largest
-       possible 32-bit unsigned numbers and a colon. */
-    if ( (rc=imap_get_sequence(h, esearch_cb, h)) != IMR_OK)
+       search-return-value. For ALL, it is a sequence-set, which is
+       an atom, so we cut the corners here. We get values in
+       chunks.  The chunk size is pretty arbitrary as long as it can
+       fit two largest possible 32-bit unsigned numbers and a
+       colon. ADDTO and REMOVEFROM report changes to the result of
+       a SORT that the server keeps up to date. We do not ask for
+       anything else. */
+    if(g_ascii_strcasecmp(atom, "ADDTO") == 0 ||
+       g_ascii_strcasecmp(atom, "REMOVEFROM") == 0)
+      rc = ir_esearch_update(h, g_ascii_strcasecmp(atom, "ADDTO") == 0,
+                             cmdno != 0 && cmdno == h->sort_update_cmdno &&
+                             h->sort_update_cb);
+    else if(g_ascii_strcasecmp(atom, "ALL") == 0 && h->search_cb)
+      rc = imap_get_sequence(h, esearch_cb, h);
+    else if( (c=sio_getc(h->sio)) == '(')
+      rc = imap_scan_skip_to(h->sio, ')') == ')' ? IMR_OK : IMR_SEVERED;
+    else {
+      if(c != EOF)
+        sio_ungetc(h->sio);
+      rc = imap_get_sequence(h, NULL, NULL);
+    }
+    if(rc != IMR_OK)
       return rc;
 
     if( (c=sio_getc(h->sio)) == ' ')
@@ -2669,25 +3306,238 @@ ir_recent(ImapMboxHandle *h, unsigned seqno)
   return ir_check_crlf(h, sio_getc(h->sio));
 }
 
+/* Expunged messages are collected and removed from the caches in one
+   pass when a response of another kind arrives, or before the caller
+   gets control back.  Shifting the caches for each EXPUNGE made
+   expunging many messages quadratic.
+
+   The seqno of each EXPUNGE counts the messages left by the previous
+   ones.  The Fenwick tree expunge.alive, in which alive[i] counts the
+   messages left among the (i & -i) messages ending with i, maps it to
+   the position in the caches in logarithmic time. */
+static void
+imap_handle_expunge_begin(ImapMboxHandle *h)
+{
+  unsigned i;
+
+  h->expunge.size = h->exists;
+  h->expunge.count = 0;
+  h->expunge.alive = g_new(unsigned, h->exists+1);
+  h->expunge.gone = g_new0(unsigned char, h->exists);
+  for(i=1; i<=h->exists; i++)
+    h->expunge.alive[i] = i & (~i+1);
+}
+
+/* Position in the caches of the seqno-th message left. */
+static unsigned
+imap_handle_expunge_locate(ImapMboxHandle *h, unsigned seqno)
+{
+  unsigned pos = 0, step = 1;
+
+  while(step*2 <= h->expunge.size)
+    step *= 2;
+  for(; step; step /= 2) {
+    if(pos+step <= h->expunge.size && h->expunge.alive[pos+step] < seqno) {
+      pos += step;
+      seqno -= h->expunge.alive[pos];
+    }
+  }
+  return pos+1;
+}
+
+/* Position in the caches of message seqno. */
+static unsigned
+imap_handle_cache_pos(ImapMboxHandle *h, unsigned seqno)
+{
+  return h->expunge.alive ? imap_handle_expunge_locate(h, seqno) : seqno;
+}
+
+static void
+imap_handle_expunge_seqno(ImapMboxHandle *h, unsigned seqno)
+{
+  unsigned i;
+
+  if(seqno == 0 || seqno > h->exists) {
+    g_debug("EXPUNGE of nonexistent message %u ignored", seqno);
+    return;
+  }
+  /* Later messages move down; err on the low side. */
+  if(h->flags_changed > seqno)
+    h->flags_changed = seqno;
+  if(!h->expunge.alive)
+    imap_handle_expunge_begin(h);
+  seqno = imap_handle_expunge_locate(h, seqno);
+  h->expunge.gone[seqno-1] = 1;
+  for(i=seqno; i<=h->expunge.size; i += i & (~i+1))
+    h->expunge.alive[i]--;
+  h->expunge.count++;
+  h->exists--;
+}
+
+/* Applies the collected EXPUNGEs. The "expunge-batch" handlers get the
+   old seqnos of the expunged messages in ascending order, and their
+   UIDs, or 0 where unknown; they see the caches as they were before
+   the batch. */
+static void
+imap_handle_expunge_flush(ImapMboxHandle *h)
+{
+  unsigned size = h->expunge.size, src, n;
+  unsigned *seqnos;
+  ImapUID *uids;
+
+  if(!h->expunge.alive)
+    return;
+
+  seqnos = g_new(unsigned, h->expunge.count);
+  uids = g_new(ImapUID, h->expunge.count);
+  for(src=n=0; src<size; src++) {
+    if(h->expunge.gone[src]) {
+      seqnos[n] = src+1;
+      uids[n] = imap_mbox_handle_known_uid(h, src+1);
+      n++;
+    }
+  }
+  g_free(h->expunge.alive); h->expunge.alive = NULL;
+  h->exists = size;
+  g_signal_emit(G_OBJECT(h), imap_mbox_handle_signals[EXPUNGE_BATCH],
+                0, seqnos, uids, n);
+
+  imap_msg_store_remove(&h->msgs, seqnos, n);
+  h->exists = h->msgs.size;
+  while(n>0)
+    mbox_view_expunge(&h->mbox_view, seqnos[--n]);
+
+  g_free(h->expunge.gone); h->expunge.gone = NULL;
+  g_free(seqnos);
+  g_free(uids);
+}
+
 static ImapResponse
 ir_expunge(ImapMboxHandle *h, unsigned seqno)
 {
   ImapResponse rc = ir_check_crlf(h, sio_getc(h->sio));
-  g_signal_emit(G_OBJECT(h), imap_mbox_handle_signals[EXPUNGE_NOTIFY],
-		0, seqno);
-  
-  g_array_remove_index(h->flag_cache, seqno-1);
-  if(h->msg_cache[seqno-1] != NULL)
-    imap_message_free(h->msg_cache[seqno-1]);
-  while(seqno<h->exists) {
-    h->msg_cache[seqno-1] = h->msg_cache[seqno];
-    seqno++;
-  }
-  h->exists--;
-  mbox_view_expunge(&h->mbox_view, seqno);
+  imap_handle_expunge_seqno(h, seqno);
   return rc;
 }
 
+static gboolean
+uid_ranges_contain(GList *ranges, ImapUID uid)
+{
+  for(; ranges; ranges = ranges->next) {
+    ImapUidRange *iur = ranges->data;
+    if(iur->lo <= uid && uid <= iur->hi)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* Counts UIDs of the ranges lying strictly between lo and hi. */
+static unsigned
+uid_ranges_count(GList *ranges, ImapUID lo, ImapUID hi)
+{
+  unsigned cnt = 0;
+  for(; ranges; ranges = ranges->next) {
+    ImapUidRange *iur = ranges->data;
+    ImapUID l = iur->lo > lo ? iur->lo : lo + 1;
+    ImapUID r = iur->hi < hi ? iur->hi : hi - 1;
+    if(l <= r)
+      cnt += r - l + 1;
+  }
+  return cnt;
+}
+
+/* With QRESYNC enabled the server reports expunged messages by UID
+   instead of sending EXPUNGE responses. Messages of unknown UID are
+   matched by counting the vanished UIDs that fall between their known
+   neighbours: nothing is cached for them, so removing the last ones of
+   each such run is equivalent, except for flags learned so far.
+   Going down keeps the seqnos below the expunged ones valid. */
+static ImapUID
+imap_handle_vanished_uid(ImapMboxHandle *h, unsigned seqno)
+{
+  return imap_mbox_handle_known_uid(h, imap_handle_cache_pos(h, seqno));
+}
+
+static void
+imap_handle_vanished(ImapMboxHandle *h, GList *ranges)
+{
+  unsigned seqno = h->exists;
+  ImapUID upper = (ImapUID)~0;
+
+  while(seqno > 0) {
+    ImapUID uid = imap_handle_vanished_uid(h, seqno);
+    if(uid) {
+      if(uid_ranges_contain(ranges, uid))
+        imap_handle_expunge_seqno(h, seqno);
+      upper = uid;
+      seqno--;
+    } else {
+      unsigned top = seqno, cnt, i;
+      ImapUID lower;
+      while(seqno > 0 && !imap_handle_vanished_uid(h, seqno))
+        seqno--;
+      lower = seqno > 0 ? imap_handle_vanished_uid(h, seqno) : 0;
+      cnt = uid_ranges_count(ranges, lower, upper);
+      if(cnt > top - seqno)
+        cnt = top - seqno;
+      for(i = seqno; i < top; i++)
+        imap_msg_store_flags(&h->msgs,
+                             imap_handle_cache_pos(h, i+1))->known_flags = 0;
+      for(; cnt > 0; cnt--)
+        imap_handle_expunge_seqno(h, top--);
+    }
+  }
+}
+
+static ImapResponse
+ir_vanished(ImapMboxHandle *h)
+{
+  GList *ranges = NULL;
+  gboolean earlier = FALSE;
+  ImapResponse rc;
+  char buf[LONG_STRING];
+  int c = sio_getc(h->sio);
+
+  if(c == '(') {
+    c = imap_get_atom(h->sio, buf, sizeof(buf));
+    if(c != ')' || g_ascii_strcasecmp(buf, "EARLIER") != 0 ||
+       sio_getc(h->sio) != ' ')
+      return IMR_PROTOCOL;
+    earlier = TRUE;
+  } else if(c == EOF)
+    return IMR_SEVERED;
+  else
+    sio_ungetc(h->sio);
+
+  rc = imap_get_sequence(h, (ImapUidRangeCb)append_uid_range, &ranges);
+  if(rc != IMR_OK) {
+    g_list_free_full(ranges, g_free);
+    return rc;
+  }
+  if(earlier) {
+    h->qresync.vanished = g_list_concat(h->qresync.vanished,
+                                        g_list_reverse(ranges));
+  } else {
+    imap_handle_vanished(h, ranges);
+    g_list_free_full(ranges, g_free);
+  }
+  return ir_check_crlf(h, sio_getc(h->sio));
+}
+
+static ImapResponse
+ir_enabled(ImapMboxHandle *h)
+{
+  char atom[LONG_STRING];
+  int c;
+
+  do {
+    c = imap_get_atom(h->sio, atom, sizeof(atom));
+    if(g_ascii_strcasecmp(atom, "QRESYNC") == 0)
+      h->qresync.enabled = 1;
+  } while(c == ' ');
+  return ir_check_crlf(h, c);
+}
+
 static void
 flags_tasklet(ImapMboxHandle *h, void *data)
 {
@@ -2696,10 +3546,6 @@ flags_tasklet(ImapMboxHandle *h, void *data)
     h->flags_cb(1, &seqno, h->flags_arg);
 }
 
-#define CREATE_IMSG_IF_NEEDED(h,seqno) \
-  if((h)->msg_cache[seqno-1] == NULL) \
-     (h)->msg_cache[(seqno)-1] = imap_message_new();
-
 static ImapResponse
 ir_msg_att_flags(ImapMboxHandle *h, int c, unsigned seqno)
 {
@@ -2708,8 +3554,7 @@ ir_msg_att_flags(ImapMboxHandle *h, int c, unsigned seqno)
   ImapFlagCache *flags;
 
   if(sio_getc(h->sio) != '(') return IMR_PROTOCOL;
-  CREATE_IMSG_IF_NEEDED(h, seqno);
-  msg = h->msg_cache[seqno-1];
+  msg = imap_msg_store_get_new(&h->msgs, seqno);
   msg->flags = 0;
 
   do {
@@ -2722,7 +3567,10 @@ ir_msg_att_flags(ImapMboxHandle *h, int c, unsigned seqno)
       }
   } while(c!=-1 && c != ')');
 
-  flags = &g_array_index(h->flag_cache, ImapFlagCache, seqno-1);
+  flags = imap_msg_store_flags(&h->msgs, seqno);
+  if(flags->known_flags != (guint8)~0 ||
+     flags->flag_values != (guint8)msg->flags)
+    imap_handle_flags_changed(h, seqno);
   flags->flag_values = msg->flags;
   flags->known_flags = ~0; /* all of them are known */
 
@@ -3169,8 +4017,7 @@ ir_msg_att_envelope(ImapMboxHandle *h, int c, unsigned seqno)
   ImapMessage *msg;
   ImapEnvelope *env;
 
-  CREATE_IMSG_IF_NEEDED(h, seqno);
-  msg = h->msg_cache[seqno-1];
+  msg = imap_msg_store_get_new(&h->msgs, seqno);
   if(msg->envelope) env = NULL;
   else {
     msg->envelope = env = imap_envelope_new();
@@ -3183,10 +4030,64 @@ ir_msg_att_internaldate(ImapMboxHandle *h, int c, unsigned seqno)
 {
   return IMR_OK;
 }
+/* Literals are passed to a chunked body_cb in pieces of this size. */
+#define IMAP_LITERAL_CHUNK (64*1024)
+
+/* Passes nstring or literal8 to a chunked body_cb.  A literal goes
+   from the read buffer to body_cb in pieces of at most
+   IMAP_LITERAL_CHUNK bytes, so that a large body never has to be
+   held in memory as a whole. */
+static ImapResponse
+ir_pass_body_string(ImapMboxHandle *h, unsigned seqno,
+                    ImapFetchBodyType body_type)
+{
+  NetClientSioBuf *sio = h->sio;
+  char buf[15], *chunk;
+  size_t left;
+  GString *str;
+  int c = sio_getc(sio), len;
+
+  if(toupper(c)=='N') { /* nil */
+    sio_getc(sio); sio_getc(sio); /* ignore i and l */
+  } else if(c=='"') {
+    str = imap_get_string_with_lookahead(sio, c);
+    if(str->len>0)
+      h->body_cb(seqno, body_type, str->str, str->len, h->body_arg);
+    g_string_free(str, TRUE);
+  } else {
+    if(c=='~') /* BINARY extension literal8 indicator */
+      c = sio_getc(sio);
+    if(c!='{')
+      return IMR_PROTOCOL;
+    c = imap_get_atom(sio, buf, sizeof(buf));
+    len = strlen(buf);
+    if(len==0 || buf[len-1] != '}' || c != 0x0d || sio_getc(sio) != 0x0a)
+      return IMR_PROTOCOL;
+    left = strtoul(buf, NULL, 10);
+    chunk = left>0 ? g_malloc(MIN(left, IMAP_LITERAL_CHUNK)) : NULL;
+    while(left>0) {
+      int got = sio_read(sio, chunk, MIN(left, IMAP_LITERAL_CHUNK));
+      if(got<=0) {
+        g_free(chunk);
+        return IMR_SEVERED;
+      }
+      h->body_cb(seqno, body_type, chunk, got, h->body_arg);
+      left -= got;
+    }
+    g_free(chunk);
+  }
+  h->body_cb(seqno, body_type, NULL, 0, h->body_arg);
+  return IMR_OK;
+}
+
 static ImapResponse
 ir_msg_att_rfc822(ImapMboxHandle *h, int c, unsigned seqno)
 {
-  gchar *str = imap_get_nstring(h->sio);
+  gchar *str;
+
+  if(h->body_cb && h->body_chunked)
+    return ir_pass_body_string(h, seqno, IMAP_BODY_TYPE_RFC822);
+  str = imap_get_nstring(h->sio);
   if(str && h->body_cb)
     h->body_cb(seqno, IMAP_BODY_TYPE_RFC822, str, strlen(str), h->body_arg);
   g_free(str);
@@ -3213,8 +4114,7 @@ ir_msg_att_rfc822_size(ImapMboxHandle *h, int c, unsigned seqno)
 
   if(c!= -1) sio_ungetc(h->sio);
 
-  CREATE_IMSG_IF_NEEDED(h, seqno);
-  msg = h->msg_cache[seqno-1];
+  msg = imap_msg_store_get_new(&h->msgs, seqno);
   
   msg->rfc822size = strtol(buf, NULL, 10);  
   return IMR_OK;
@@ -3871,10 +4771,10 @@ ir_body (NetClientSioBuf *sio, int c, ImapBody * body,
 
 /* read [section] and following string. FIXME: other kinds of body. */ 
 static ImapResponse
-ir_body_section(NetClientSioBuf *sio, unsigned seqno,
-		ImapFetchBodyType body_type,
-		ImapFetchBodyInternalCb body_cb, void *arg)
+ir_body_section(ImapMboxHandle *h, unsigned seqno,
+		ImapFetchBodyType body_type)
 {
+  NetClientSioBuf *sio = h->sio;
   char buf[80];
   GString *bs;
   int i, c = imap_get_atom(sio, buf, sizeof(buf));
@@ -3885,11 +4785,20 @@ ir_body_section(NetClientSioBuf *sio, unsigned seqno,
     body_type = IMAP_BODY_TYPE_HEADER;
 
   if(c != ']') { puts("] expected"); return IMR_PROTOCOL; }
-  if(sio_getc(sio) != ' ') { puts("space expected"); return IMR_PROTOCOL;}
+  c = sio_getc(sio);
+  if(c == '<') { /* origin octet of a partial fetch */
+    while(isdigit(c = sio_getc(sio)))
+      ;
+    if(c != '>') { puts("> expected"); return IMR_PROTOCOL; }
+    c = sio_getc(sio);
+  }
+  if(c != ' ') { puts("space expected"); return IMR_PROTOCOL;}
+  if(h->body_cb && h->body_chunked)
+    return ir_pass_body_string(h, seqno, body_type);
   bs = imap_get_binary_string(sio);
   if(bs) {
-    if(bs->str && body_cb)
-      body_cb(seqno, body_type, bs->str, bs->len, arg);
+    if(bs->str && h->body_cb)
+      h->body_cb(seqno, body_type, bs->str, bs->len, h->body_arg);
     g_string_free(bs, TRUE);
   }
   return IMR_OK;
@@ -3918,10 +4827,11 @@ ir_body_header_fields(ImapMboxHandle *h, unsigned seqno)
   if(h->body_cb) {
     if(tmp) h->body_cb(seqno, IMAP_BODY_TYPE_HEADER,
 		       tmp, strlen(tmp), h->body_arg);
+    if(h->body_chunked)
+      h->body_cb(seqno, IMAP_BODY_TYPE_HEADER, NULL, 0, h->body_arg);
     g_free(tmp);
   } else {
-    CREATE_IMSG_IF_NEEDED(h, seqno);
-    msg = h->msg_cache[seqno-1];
+    msg = imap_msg_store_get_new(&h->msgs, seqno);
     g_free(msg->fetched_header_fields);
     msg->fetched_header_fields = tmp;
   }
@@ -3940,8 +4850,7 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
     c = sio_getc (h->sio);
     sio_ungetc (h->sio);
     if(isdigit (c)) {
-      rc = ir_body_section(h->sio, seqno, IMAP_BODY_TYPE_BODY,
-			   h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, IMAP_BODY_TYPE_BODY);
       break;
     }
     c = imap_get_atom(h->sio, buf, sizeof buf);
@@ -3952,7 +4861,7 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
 	(g_ascii_strcasecmp(buf, "TEXT") == 0)
 	? IMAP_BODY_TYPE_TEXT : IMAP_BODY_TYPE_HEADER;
       sio_ungetc (h->sio); /* put the ']' back */
-      rc = ir_body_section(h->sio, seqno, body_type, h->body_cb, h->body_arg);
+      rc = ir_body_section(h, seqno, body_type);
     } else {
       if (c == ' ' && 
           (g_ascii_strcasecmp(buf, "HEADER.FIELDS") == 0 ||
@@ -3963,8 +4872,7 @@ ir_msg_att_body(ImapMboxHandle *h, int c, unsigned seqno)
     }
     break;
   case ' ':
-    CREATE_IMSG_IF_NEEDED(h, seqno);
-    msg = h->msg_cache[seqno-1];
+    msg = imap_msg_store_get_new(&h->msgs, seqno);
     rc = ir_body(h->sio, sio_getc(h->sio),
                  msg->body ? NULL : (msg->body = imap_body_new()), 
 		 IMB_NON_EXTENSIBLE);
@@ -3982,8 +4890,7 @@ ir_msg_att_bodystructure(ImapMboxHandle *h, int c, unsigned seqno)
 
   switch(c) {
   case ' ':
-    CREATE_IMSG_IF_NEEDED(h, seqno);
-    msg = h->msg_cache[seqno-1];
+    msg = imap_msg_store_get_new(&h->msgs, seqno);
     rc = ir_body(h->sio, sio_getc(h->sio),
                  msg->body ? NULL : (msg->body = imap_body_new()), 
 		 IMB_EXTENSIBLE);
@@ -3997,11 +4904,30 @@ static ImapResponse
 ir_msg_att_uid(ImapMboxHandle *h, int c, unsigned seqno)
 {
   char buf[12];
+  ImapMessage *msg;
   c = imap_get_atom(h->sio, buf, sizeof(buf));
 
   if(c!= -1) sio_ungetc(h->sio);
-  CREATE_IMSG_IF_NEEDED(h, seqno);
-  h->msg_cache[seqno-1]->uid = strtol(buf, NULL, 10);
+  msg = imap_msg_store_get_new(&h->msgs, seqno);
+  msg->uid = strtoul(buf, NULL, 10);
+  imap_msg_store_set_uid(&h->msgs, seqno, msg->uid);
+  if(msg->uid >= h->uidnext) /* keep UIDNEXT a valid lower bound */
+    h->uidnext = msg->uid + 1;
+  return IMR_OK;
+}
+
+/* The MODSEQ of a message says nothing about the changes to the
+   messages that were not fetched: only the OK [HIGHESTMODSEQ]
+   response code may advance h->highestmodseq (RFC 7162, 3.1.2.1). */
+static ImapResponse
+ir_msg_att_modseq(ImapMboxHandle *h, int c, unsigned seqno)
+{
+  char buf[24];
+
+  if(c != ' ' || sio_getc(h->sio) != '(')
+    return IMR_PROTOCOL;
+  if(imap_get_atom(h->sio, buf, sizeof(buf)) != ')')
+    return IMR_PROTOCOL;
   return IMR_OK;
 }
 
@@ -4022,7 +4948,8 @@ ir_fetch_seq(ImapMboxHandle *h, unsigned seqno)
     { "BINARY",        ir_msg_att_body }, 
     { "BODY",          ir_msg_att_body }, 
     { "BODYSTRUCTURE", ir_msg_att_bodystructure }, 
-    { "UID",           ir_msg_att_uid }
+    { "UID",           ir_msg_att_uid },
+    { "MODSEQ",        ir_msg_att_modseq }
   };
   char atom[LONG_STRING]; /* make sure LONG_STRING is longer than all */
                           /* strings above */
@@ -4175,7 +5102,9 @@ static const struct {
   { "MYRIGHTS",   8, ir_myrights },
   { "ACL",        3, ir_getacl },
   { "QUOTAROOT",  9, ir_quotaroot },
-  { "QUOTA",      5, ir_quota }
+  { "QUOTA",      5, ir_quota },
+  { "ENABLED",    7, ir_enabled },
+  { "VANISHED",   8, ir_vanished }
 };
 static const struct {
   const gchar *response;
@@ -4209,6 +5138,8 @@ ir_handle_response(ImapMboxHandle *h)
     for(i=0; i<G_N_ELEMENTS(NumHandlers); i++) {
       if(g_ascii_strncasecmp(atom, NumHandlers[i].response, 
                              NumHandlers[i].keyword_len) == 0) {
+        if(NumHandlers[i].handler != ir_expunge)
+          imap_handle_expunge_flush(h);
         rc = NumHandlers[i].handler(h, seqno);
         break;
       }
@@ -4221,6 +5152,8 @@ ir_handle_response(ImapMboxHandle *h)
     for(i=0; i<G_N_ELEMENTS(ResponseHandlers); i++) {
       if(g_ascii_strncasecmp(atom, ResponseHandlers[i].response, 
                              ResponseHandlers[i].keyword_len) == 0) {
+        if(ResponseHandlers[i].handler != ir_vanished)
+          imap_handle_expunge_flush(h);
         rc = ResponseHandlers[i].handler(h);
         break;
       }
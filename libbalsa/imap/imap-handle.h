@@ -66,12 +66,21 @@ typedef enum
   IMCAP_BINARY,                 /* RFC 3516 */
   IMCAP_CHILDREN,               /* RFC 3348 */
   IMCAP_COMPRESS_DEFLATE,       /* RFC 4978 */
+  IMCAP_CONDSTORE,              /* RFC 7162 */
+  IMCAP_CONTEXT_SORT,           /* RFC 5267 */
+  IMCAP_ENABLE,                 /* RFC 5161 */
   IMCAP_ESEARCH,                /* RFC 4731 */
+  IMCAP_ESORT,                  /* RFC 5267 */
   IMCAP_IDLE,                   /* RFC 2177 */
+  IMCAP_LIST_STATUS,            /* RFC 5819 */
   IMCAP_LITERAL,                /* RFC 2088 */
+  IMCAP_LITERAL_MINUS,          /* RFC 7888 */
   IMCAP_LOGINDISABLED,		/* RFC 2595 */
+  IMCAP_MOVE,                   /* RFC 6851 */
   IMCAP_MULTIAPPEND,            /* RFC 3502 */
   IMCAP_NAMESPACE,              /* RFC 2342: IMAP4 Namespace */
+  IMCAP_NOTIFY,                 /* RFC 5465 */
+  IMCAP_QRESYNC,                /* RFC 7162 */
   IMCAP_QUOTA,                  /* RFC 2087 */
   IMCAP_SASLIR,                 /* RFC 4959 */
   IMCAP_SCAN,                   /* FIXME: RFC? */
@@ -93,6 +102,7 @@ typedef enum {
   IMAP_OPT_BINARY,      /**< enable binary=no-transfer-encoding msg transfer */
   IMAP_OPT_IDLE,        /**< enable IDLE */
   IMAP_OPT_COMPRESS,    /**< enable COMPRESS */
+  IMAP_OPT_PIPELINING,  /**< keep several commands in flight */
 }  ImapOption;
 
 typedef struct _ImapMboxHandleClass ImapMboxHandleClass;
@@ -115,6 +125,31 @@ typedef void (*ImapMonitorCb)(const char *buffer, int length, int direction,
 
 typedef void (*ImapFlagsCb)(unsigned cnt, const unsigned seqno[], void *arg);
 typedef void (*ImapSearchCb)(ImapMboxHandle*handle, unsigned seqno, void *arg);
+/** Called when the server reports that message seqno was added to the
+    result of the last imap_mbox_sort_msgno() at the given position,
+    which counts from 1 and is 0 if unknown, or removed from it. */
+typedef void (*ImapSortUpdateCb)(ImapMboxHandle *handle, unsigned position,
+                                 unsigned seqno, gboolean added, void *arg);
+typedef enum {
+  IMSTAT_MESSAGES = 0,
+  IMSTAT_RECENT,
+  IMSTAT_UIDNEXT,
+  IMSTAT_UIDVALIDITY,
+  IMSTAT_UNSEEN,
+  IMSTAT_NONE
+} ImapStatusItem;
+struct ImapStatusResult {
+  ImapStatusItem item;
+  unsigned       result;
+};
+/** Called for STATUS responses that no command waits for, as sent
+    after imap_mbox_notify(). items holds what the server reported
+    and ends with IMSTAT_NONE. mbox is NULL if the server stopped
+    sending notifications: the client has to find out what changed
+    by itself. */
+typedef void (*ImapStatusCb)(ImapMboxHandle *handle, const char *mbox,
+                             const struct ImapStatusResult *items,
+                             void *arg);
 typedef void(*ImapListCb)(ImapMboxHandle*handle, int delim,
                           const char* mbox, gboolean *flags, void*);
 
@@ -123,6 +158,10 @@ ImapMboxHandle *imap_mbox_handle_new(void);
 void imap_handle_set_option(ImapMboxHandle *h, ImapOption opt, gboolean state);
 void imap_handle_set_infocb(ImapMboxHandle* h, ImapInfoCb cb, void*);
 void imap_handle_set_flagscb(ImapMboxHandle* h, ImapFlagsCb cb, void*);
+unsigned imap_mbox_handle_take_flags_changed(ImapMboxHandle *h);
+void imap_handle_set_sortupdatecb(ImapMboxHandle* h, ImapSortUpdateCb cb,
+                                  void*);
+void imap_handle_set_statuscb(ImapMboxHandle* h, ImapStatusCb cb, void*);
 void imap_handle_set_authcb(ImapMboxHandle* h, GCallback cb, void *arg);
 void imap_handle_set_certcb(ImapMboxHandle* h, GCallback cb);
 int imap_handle_set_timeout(ImapMboxHandle *, int milliseconds);
@@ -142,6 +181,8 @@ int      imap_mbox_handle_can_do(ImapMboxHandle* handle, ImapCapability cap);
 unsigned imap_mbox_handle_get_exists(ImapMboxHandle* handle);
 unsigned imap_mbox_handle_get_validity(ImapMboxHandle* handle);
 unsigned imap_mbox_handle_get_uidnext(ImapMboxHandle* handle);
+const char* imap_mbox_handle_get_mbox(ImapMboxHandle* handle);
+gboolean imap_mbox_handle_is_examined(ImapMboxHandle* handle);
 int      imap_mbox_handle_get_delim(ImapMboxHandle* handle,
                                     const char *namespace);
 char* imap_mbox_handle_get_last_msg(ImapMboxHandle *handle);
@@ -159,6 +200,8 @@ ImapResponse imap_mbox_handle_fetch_env(ImapMboxHandle* handle,
                                         const gchar *seq);
 
 ImapMessage* imap_mbox_handle_get_msg(ImapMboxHandle* handle, unsigned seqno);
+unsigned imap_mbox_handle_find_uid(ImapMboxHandle* handle, ImapUID uid);
+ImapUID imap_mbox_handle_known_uid(ImapMboxHandle *handle, unsigned seqno);
 
 unsigned imap_mbox_handle_first_unseen(ImapMboxHandle* handle);
 ImapResponse imap_mbox_find_all(ImapMboxHandle *h, const char *search_str,
@@ -201,6 +244,30 @@ void imap_sequence_foreach(ImapSequence *i_seq,
   do { (i_seq)->ranges = NULL; (i_seq)->uid_validity = 0; }while(0)
 void imap_sequence_release(ImapSequence *i_seq);
 
+/* ================ QRESYNC (RFC 7162) ================================= */
+guint64 imap_mbox_handle_get_highestmodseq(ImapMboxHandle *handle);
+void imap_mbox_handle_set_qresync(ImapMboxHandle *handle,
+                                  unsigned uidvalidity, guint64 modseq);
+gboolean imap_mbox_handle_take_vanished(ImapMboxHandle *handle,
+                                        ImapSequence *vanished);
+
+/* ================ offline handles =================================== */
+void imap_mbox_handle_set_offline(ImapMboxHandle *handle, const char *mbox,
+                                  unsigned uidvalidity, ImapUID uidnext,
+                                  unsigned exists, guint64 modseq);
+gboolean imap_mbox_handle_is_offline(ImapMboxHandle *handle);
+
+/* ================ envelope fetch statistics ========================= */
+/** Least-squares fit of envelope fetch times to rtt + n*per_message,
+    weighted towards recent fetches. */
+typedef struct {
+  unsigned samples;   /**< number of fetches measured */
+  double rtt;         /**< round trip time, in seconds */
+  double per_message; /**< transfer time per envelope, in seconds */
+} ImapFetchStats;
+void imap_mbox_handle_get_fetch_stats(ImapMboxHandle *handle,
+                                      ImapFetchStats *stats);
+
 /* ================ BEGIN OF MBOX_VIEW FUNCTIONS ======================= */
 typedef struct _MboxView MboxView;
 void mbox_view_init(MboxView *mv);
@@ -0,0 +1,427 @@
+/* libimap library.
+ * Copyright (C) 2003-2016 Pawel Salek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/* The message store of the handle. Arrays of pointers sized to
+   EXISTS cost memory and reallocation time in proportion to the size
+   of the mailbox, even if few of its messages are ever looked at.
+   Here, only the flags have a slot for every message; messages are
+   kept in pages that are allocated when the first message of the
+   page is stored, and UIDs, which in most mailboxes come in long runs
+   of consecutive numbers, are kept as such runs. Since UIDs ascend
+   with sequence numbers, the runs can be searched by either. */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "imap-msgstore.h"
+
+struct _ImapMsgPage {
+  ImapMessage *msgs[IMAP_MSG_STORE_PAGE];
+  ImapDeferredMsg *deferred; /* IMAP_MSG_STORE_PAGE entries, or NULL */
+};
+
+/* Messages seqno..seqno+len-1 have UIDs uid..uid+len-1. */
+typedef struct {
+  unsigned seqno;
+  ImapUID uid;
+  unsigned len;
+} ImapUidRun;
+
+#define PAGE_OF(seqno) (((seqno)-1)/IMAP_MSG_STORE_PAGE)
+#define SLOT_OF(seqno) (((seqno)-1)%IMAP_MSG_STORE_PAGE)
+#define N_PAGES(size)  (((size)+IMAP_MSG_STORE_PAGE-1)/IMAP_MSG_STORE_PAGE)
+#define RUN(store, i)  (&g_array_index((store)->uid_runs, ImapUidRun, (i)))
+
+void
+imap_msg_store_init(ImapMsgStore *store)
+{
+  store->size = 0;
+  store->pages = NULL;
+  store->flags = NULL;
+  store->uid_runs = g_array_new(FALSE, FALSE, sizeof(ImapUidRun));
+}
+
+static ImapMsgPage*
+imap_msg_store_page(ImapMsgStore *store, unsigned seqno)
+{
+  ImapMsgPage **page = &store->pages[PAGE_OF(seqno)];
+
+  if(!*page)
+    *page = g_new0(ImapMsgPage, 1);
+  return *page;
+}
+
+static void
+imap_msg_page_free(ImapMsgPage *page)
+{
+  unsigned i;
+
+  for(i=0; i<IMAP_MSG_STORE_PAGE; i++)
+    if(page->msgs[i])
+      imap_message_free(page->msgs[i]);
+  g_free(page->deferred);
+  g_free(page);
+}
+
+/* Drops the UIDs of messages above new_size. */
+static void
+imap_uid_runs_truncate(ImapMsgStore *store, unsigned new_size)
+{
+  GArray *runs = store->uid_runs;
+
+  while(runs->len > 0) {
+    ImapUidRun *r = RUN(store, runs->len-1);
+    if(r->seqno <= new_size) {
+      if(r->seqno + r->len - 1 > new_size)
+        r->len = new_size - r->seqno + 1;
+      break;
+    }
+    g_array_set_size(runs, runs->len-1);
+  }
+}
+
+void
+imap_msg_store_resize(ImapMsgStore *store, unsigned new_size)
+{
+  unsigned old_pages = N_PAGES(store->size);
+  unsigned new_pages = N_PAGES(new_size);
+  unsigned seqno, i;
+
+  if(new_size < store->size) {
+    /* clear the tail of the last page kept */
+    ImapMsgPage *page = new_pages>0 && new_size%IMAP_MSG_STORE_PAGE
+      ? store->pages[new_pages-1] : NULL;
+    if(page) {
+      for(seqno=new_size+1; PAGE_OF(seqno) == new_pages-1; seqno++) {
+        if(page->msgs[SLOT_OF(seqno)]) {
+          imap_message_free(page->msgs[SLOT_OF(seqno)]);
+          page->msgs[SLOT_OF(seqno)] = NULL;
+        }
+        if(page->deferred)
+          memset(&page->deferred[SLOT_OF(seqno)], 0,
+                 sizeof(ImapDeferredMsg));
+      }
+    }
+    for(i=new_pages; i<old_pages; i++)
+      if(store->pages[i])
+        imap_msg_page_free(store->pages[i]);
+    imap_uid_runs_truncate(store, new_size);
+  }
+
+  if(new_pages != old_pages) {
+    store->pages = g_renew(ImapMsgPage*, store->pages, new_pages);
+    for(i=old_pages; i<new_pages; i++)
+      store->pages[i] = NULL;
+  }
+  store->flags = g_renew(ImapFlagCache, store->flags, new_size);
+  if(new_size > store->size)
+    memset(&store->flags[store->size], 0,
+           (new_size-store->size)*sizeof(ImapFlagCache));
+  store->size = new_size;
+}
+
+void
+imap_msg_store_dispose(ImapMsgStore *store)
+{
+  imap_msg_store_resize(store, 0);
+  g_array_free(store->uid_runs, TRUE);
+  store->uid_runs = NULL;
+}
+
+ImapMessage*
+imap_msg_store_get(ImapMsgStore *store, unsigned seqno)
+{
+  ImapMsgPage *page = store->pages[PAGE_OF(seqno)];
+
+  return page ? page->msgs[SLOT_OF(seqno)] : NULL;
+}
+
+/** Puts msg in place of message seqno; the message that was there,
+    if any, is the caller's. */
+void
+imap_msg_store_set(ImapMsgStore *store, unsigned seqno, ImapMessage *msg)
+{
+  if(!msg && !store->pages[PAGE_OF(seqno)])
+    return;
+  imap_msg_store_page(store, seqno)->msgs[SLOT_OF(seqno)] = msg;
+}
+
+/** Returns message seqno, creating an empty one if there is none. */
+ImapMessage*
+imap_msg_store_get_new(ImapMsgStore *store, unsigned seqno)
+{
+  ImapMessage *msg = imap_msg_store_get(store, seqno);
+
+  if(!msg) {
+    msg = imap_message_new();
+    imap_msg_store_set(store, seqno, msg);
+  }
+  return msg;
+}
+
+ImapDeferredMsg*
+imap_msg_store_deferred(ImapMsgStore *store, unsigned seqno,
+                        gboolean create)
+{
+  ImapMsgPage *page = create
+    ? imap_msg_store_page(store, seqno) : store->pages[PAGE_OF(seqno)];
+
+  if(!page)
+    return NULL;
+  if(!page->deferred) {
+    if(!create)
+      return NULL;
+    page->deferred = g_new0(ImapDeferredMsg, IMAP_MSG_STORE_PAGE);
+  }
+  return &page->deferred[SLOT_OF(seqno)];
+}
+
+/** Forgets all deferred messages; pages left empty are freed. */
+void
+imap_msg_store_drop_deferred(ImapMsgStore *store)
+{
+  unsigned i, j;
+
+  for(i=0; i<N_PAGES(store->size); i++) {
+    ImapMsgPage *page = store->pages[i];
+    if(!page)
+      continue;
+    g_free(page->deferred);
+    page->deferred = NULL;
+    for(j=0; j<IMAP_MSG_STORE_PAGE && !page->msgs[j]; j++)
+      ;
+    if(j == IMAP_MSG_STORE_PAGE) {
+      g_free(page);
+      store->pages[i] = NULL;
+    }
+  }
+}
+
+/* The number of runs that begin at or below seqno. */
+static unsigned
+imap_uid_runs_upper(ImapMsgStore *store, unsigned seqno)
+{
+  unsigned lo = 0, hi = store->uid_runs->len;
+
+  while(lo < hi) {
+    unsigned mid = lo + (hi-lo)/2;
+    if(RUN(store, mid)->seqno <= seqno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+ImapUID
+imap_msg_store_get_uid(ImapMsgStore *store, unsigned seqno)
+{
+  unsigned i = imap_uid_runs_upper(store, seqno);
+  ImapUidRun *r;
+
+  if(i == 0)
+    return 0;
+  r = RUN(store, i-1);
+  return seqno < r->seqno + r->len ? r->uid + (seqno - r->seqno) : 0;
+}
+
+/* Takes seqno out of run i, which contains it. */
+static void
+imap_uid_runs_cut(ImapMsgStore *store, unsigned i, unsigned seqno)
+{
+  ImapUidRun *r = RUN(store, i);
+  unsigned left = seqno - r->seqno, right = r->len - left - 1;
+
+  if(left == 0 && right == 0)
+    g_array_remove_index(store->uid_runs, i);
+  else if(left == 0) {
+    r->seqno++; r->uid++; r->len--;
+  } else if(right == 0)
+    r->len--;
+  else {
+    ImapUidRun tail;
+    tail.seqno = seqno + 1;
+    tail.uid = r->uid + left + 1;
+    tail.len = right;
+    r->len = left;
+    g_array_insert_val(store->uid_runs, i+1, tail);
+  }
+}
+
+void
+imap_msg_store_set_uid(ImapMsgStore *store, unsigned seqno, ImapUID uid)
+{
+  ImapUidRun *prev, *next;
+  unsigned i;
+
+  if(uid == 0 || seqno < 1 || seqno > store->size)
+    return;
+  i = imap_uid_runs_upper(store, seqno);
+  if(i > 0) {
+    prev = RUN(store, i-1);
+    if(seqno < prev->seqno + prev->len) {
+      if(prev->uid + (seqno - prev->seqno) == uid)
+        return;
+      imap_uid_runs_cut(store, i-1, seqno);
+      i = imap_uid_runs_upper(store, seqno);
+    }
+  }
+
+  prev = i > 0 ? RUN(store, i-1) : NULL;
+  next = i < store->uid_runs->len ? RUN(store, i) : NULL;
+  if(prev && prev->seqno + prev->len == seqno && prev->uid + prev->len == uid) {
+    prev->len++;
+    if(next && next->seqno == seqno + 1 && next->uid == uid + 1) {
+      prev->len += next->len;
+      g_array_remove_index(store->uid_runs, i);
+    }
+  } else if(next && next->seqno == seqno + 1 && next->uid == uid + 1) {
+    next->seqno--; next->uid--; next->len++;
+  } else {
+    ImapUidRun run;
+    run.seqno = seqno;
+    run.uid = uid;
+    run.len = 1;
+    g_array_insert_val(store->uid_runs, i, run);
+  }
+}
+
+/** Returns the sequence number of the message with given UID, or 0 if
+    the UID is not known. */
+unsigned
+imap_msg_store_find_uid(ImapMsgStore *store, ImapUID uid)
+{
+  unsigned lo = 0, hi = store->uid_runs->len;
+  ImapUidRun *r;
+
+  while(lo < hi) {
+    unsigned mid = lo + (hi-lo)/2;
+    if(RUN(store, mid)->uid <= uid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == 0)
+    return 0;
+  r = RUN(store, lo-1);
+  return uid < r->uid + r->len ? r->seqno + (uid - r->uid) : 0;
+}
+
+/* Appends a run to runs, merging it with the last one if they are
+   consecutive. */
+static void
+imap_uid_runs_append(GArray *runs, unsigned seqno, ImapUID uid,
+                     unsigned len)
+{
+  ImapUidRun run;
+
+  if(runs->len > 0) {
+    ImapUidRun *last = &g_array_index(runs, ImapUidRun, runs->len-1);
+    if(last->seqno + last->len == seqno && last->uid + last->len == uid) {
+      last->len += len;
+      return;
+    }
+  }
+  run.seqno = seqno;
+  run.uid = uid;
+  run.len = len;
+  g_array_append_val(runs, run);
+}
+
+/** Removes the messages seqnos, which are in ascending order, and
+    renumbers the rest, in one pass. */
+void
+imap_msg_store_remove(ImapMsgStore *store, const unsigned *seqnos,
+                      unsigned n)
+{
+  GArray *runs;
+  unsigned src, dst, i, k;
+
+  if(n == 0)
+    return;
+
+  for(src=dst=1, k=0; src<=store->size; src++) {
+    ImapMessage *msg = imap_msg_store_get(store, src);
+    ImapDeferredMsg *dm = imap_msg_store_deferred(store, src, FALSE);
+
+    if(k<n && seqnos[k] == src) {
+      if(msg) {
+        imap_message_free(msg);
+        imap_msg_store_set(store, src, NULL);
+      }
+      if(dm)
+        memset(dm, 0, sizeof(ImapDeferredMsg));
+      k++;
+      continue;
+    }
+    if(dst != src) {
+      store->flags[dst-1] = store->flags[src-1];
+      if(msg) {
+        imap_msg_store_set(store, dst, msg);
+        imap_msg_store_set(store, src, NULL);
+      }
+      if(dm && dm->data) {
+        *imap_msg_store_deferred(store, dst, TRUE) = *dm;
+        memset(dm, 0, sizeof(ImapDeferredMsg));
+      }
+    }
+    dst++;
+  }
+
+  runs = g_array_sized_new(FALSE, FALSE, sizeof(ImapUidRun),
+                           store->uid_runs->len);
+  for(i=k=0; i<store->uid_runs->len; i++) {
+    ImapUidRun *r = RUN(store, i);
+    unsigned start = r->seqno, end = r->seqno + r->len;
+
+    while(k<n && seqnos[k] < start)
+      k++;
+    while(k<n && seqnos[k] < end) {
+      if(seqnos[k] > start)
+        imap_uid_runs_append(runs, start - k, r->uid + (start - r->seqno),
+                             seqnos[k] - start);
+      start = seqnos[k++] + 1;
+    }
+    if(start < end)
+      imap_uid_runs_append(runs, start - k, r->uid + (start - r->seqno),
+                           end - start);
+  }
+  g_array_free(store->uid_runs, TRUE);
+  store->uid_runs = runs;
+
+  imap_msg_store_resize(store, store->size - n);
+}
+
+/** Returns the number of bytes the store takes, not counting the
+    messages themselves. */
+size_t
+imap_msg_store_get_memory(ImapMsgStore *store)
+{
+  size_t total = N_PAGES(store->size)*sizeof(ImapMsgPage*)
+    + store->size*sizeof(ImapFlagCache)
+    + store->uid_runs->len*sizeof(ImapUidRun);
+  unsigned i;
+
+  for(i=0; i<N_PAGES(store->size); i++) {
+    if(store->pages[i]) {
+      total += sizeof(ImapMsgPage);
+      if(store->pages[i]->deferred)
+        total += IMAP_MSG_STORE_PAGE*sizeof(ImapDeferredMsg);
+    }
+  }
+  return total;
+}
@@ -0,0 +1,78 @@
+#ifndef __IMAP_MSGSTORE_H__
+#define __IMAP_MSGSTORE_H__ 1
+/* libimap library.
+ * Copyright (C) 2003-2016 Pawel Salek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#include "libimap.h"
+
+/* Number of messages per page of the store. */
+#define IMAP_MSG_STORE_PAGE 256
+
+/* ImapMsgFlag values fit in a byte. */
+typedef struct {
+  guint8 flag_values;
+  guint8 known_flags;
+} ImapFlagCache;
+
+/* A message known from a cache, to be decoded when first needed; see
+   imap_mbox_handle_msg_defer(). Its UID is in the UID column. */
+typedef struct {
+  ImapMsgFlags flags;
+  const void *data; /* serialized message; NULL if none */
+} ImapDeferredMsg;
+
+typedef struct _ImapMsgPage ImapMsgPage;
+
+/** What the handle knows of the messages of the selected mailbox,
+    by sequence number. The messages and the deferred messages are
+    kept in pages that are allocated when something is first stored
+    in them; the flags take two bytes per message, and the UIDs are
+    kept as runs of consecutive UIDs. */
+typedef struct {
+  unsigned size;        /**< number of messages */
+  ImapMsgPage **pages;  /**< NULL where nothing has been stored */
+  ImapFlagCache *flags; /**< one per message */
+  GArray *uid_runs;     /**< ImapUidRun's, in ascending order */
+} ImapMsgStore;
+
+void imap_msg_store_init(ImapMsgStore *store);
+void imap_msg_store_resize(ImapMsgStore *store, unsigned new_size);
+void imap_msg_store_dispose(ImapMsgStore *store);
+void imap_msg_store_remove(ImapMsgStore *store,
+                           const unsigned *seqnos, unsigned n);
+
+ImapMessage *imap_msg_store_get(ImapMsgStore *store, unsigned seqno);
+void imap_msg_store_set(ImapMsgStore *store, unsigned seqno,
+                        ImapMessage *msg);
+ImapMessage *imap_msg_store_get_new(ImapMsgStore *store, unsigned seqno);
+
+ImapDeferredMsg *imap_msg_store_deferred(ImapMsgStore *store,
+                                         unsigned seqno, gboolean create);
+void imap_msg_store_drop_deferred(ImapMsgStore *store);
+
+#define imap_msg_store_flags(store, seqno) (&(store)->flags[(seqno)-1])
+
+ImapUID imap_msg_store_get_uid(ImapMsgStore *store, unsigned seqno);
+void imap_msg_store_set_uid(ImapMsgStore *store, unsigned seqno,
+                            ImapUID uid);
+unsigned imap_msg_store_find_uid(ImapMsgStore *store, ImapUID uid);
+
+size_t imap_msg_store_get_memory(ImapMsgStore *store);
+
+#endif /* __IMAP_MSGSTORE_H__ */
@@ -0,0 +1,184 @@
+/* libimap library.
+ * Copyright (C) 2003-2016 Pawel Salek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+/* Tokenizer for server responses.  sio_getc() costs a function call
+   per byte; the functions here look at the line that NetClientSioBuf
+   has buffered, find the end of the token with a table lookup per
+   byte and consume the whole run at once.
+
+   The functions return the same characters as the byte-wise loops
+   they replace, including the byte that terminated the token and the
+   sign of bytes above 0x7f, which is what sio_getc() returns for
+   them.  test_scanner() in imap_tst.c compares the two. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "imap-scan.h"
+#include "imap_private.h"
+#include "siobuf-nc.h"
+
+static unsigned char imap_scan_classes[256];
+
+static void
+imap_scan_init(void)
+{
+  static gsize initialized = 0;
+
+  if(g_once_init_enter(&initialized)) {
+    unsigned i;
+    for(i=0; i<256; i++) {
+      int c = (gchar)i; /* as returned by sio_getc() */
+      unsigned cls = 0;
+      if(c>=0 && IS_ATOM_CHAR(c))    cls |= IMAP_SCAN_ATOM;
+      if(c>=0 && IS_FLAG_CHAR(c))    cls |= IMAP_SCAN_FLAG;
+      if(c>=0 && IS_TAG_CHAR(c))     cls |= IMAP_SCAN_TAG;
+      if(IS_ASTRING_CHAR(c))         cls |= IMAP_SCAN_ASTRING;
+      if(c != '"' && c != '\\' && c != EOF) cls |= IMAP_SCAN_QUOTED;
+      imap_scan_classes[i] = cls;
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+/** Returns the length of the longest prefix of s[0..len) that
+    consists of characters of class cls. */
+size_t
+imap_scan_span(const char *s, size_t len, unsigned cls)
+{
+  const unsigned char *p = (const unsigned char*)s;
+  size_t i;
+
+  imap_scan_init();
+  for(i=0; i<len && (imap_scan_classes[p[i]] & cls); i++)
+    ;
+  return i;
+}
+
+/** Reads characters of class cls to buf, which is always terminated.
+    Returns the character that ended the token (and was consumed),
+    EOF, or the last character stored if buf got full. */
+int
+imap_scan_token(NetClientSioBuf *sio, unsigned cls, char *buf, size_t len)
+{
+  const char *p;
+  gsize avail;
+  size_t i = 0, n;
+  int c = 0;
+
+  while(i<len-1) {
+    p = net_client_siobuf_peek(sio, &avail, NULL);
+    if(!p) {
+      c = EOF;
+      break;
+    }
+    n = imap_scan_span(p, MIN(avail, len-1-i), cls);
+    memcpy(buf+i, p, n);
+    i += n;
+    if(n<avail && i<len-1) {
+      c = (gchar)p[n];
+      net_client_siobuf_consume(sio, n+1);
+      break;
+    }
+    if(n>0)
+      c = (gchar)p[n-1];
+    net_client_siobuf_consume(sio, n);
+  }
+  buf[i] = '\0';
+  return c;
+}
+
+/** Appends characters of class cls to dest.  Returns the character
+    that ended the run (and was consumed), or EOF. */
+int
+imap_scan_append(NetClientSioBuf *sio, unsigned cls, GString *dest)
+{
+  const char *p;
+  gsize avail;
+  size_t n;
+  int c;
+
+  while( (p = net_client_siobuf_peek(sio, &avail, NULL)) != NULL) {
+    n = imap_scan_span(p, avail, cls);
+    g_string_append_len(dest, p, n);
+    if(n<avail) {
+      c = (gchar)p[n];
+      net_client_siobuf_consume(sio, n+1);
+      return c;
+    }
+    net_client_siobuf_consume(sio, n);
+  }
+  return EOF;
+}
+
+/** Reads the rest of a quoted string whose opening quote has been
+    consumed.  If the string has no escaped characters and ends in
+    the buffered line, NULL is returned and slice points to the
+    string in the read buffer.  Otherwise, the unescaped string is
+    returned; a string cut short by EOF is returned as it is. */
+GString*
+imap_scan_quoted(NetClientSioBuf *sio, ImapSlice *slice)
+{
+  GString *res = NULL;
+  const char *p;
+  gsize avail;
+  size_t n;
+  int c;
+
+  while( (p = net_client_siobuf_peek(sio, &avail, NULL)) != NULL) {
+    n = imap_scan_span(p, avail, IMAP_SCAN_QUOTED);
+    if(n<avail && p[n] == '"' && !res) {
+      slice->str = p;
+      slice->len = n;
+      net_client_siobuf_consume(sio, n+1);
+      return NULL;
+    }
+    if(!res)
+      res = g_string_sized_new(n+16);
+    g_string_append_len(res, p, n);
+    if(n == avail) {
+      net_client_siobuf_consume(sio, n);
+      continue;
+    }
+    net_client_siobuf_consume(sio, n+1);
+    if(p[n] != '\\') /* closing quote, or 0xff posing as EOF */
+      return res;
+    c = sio_getc(sio);
+    g_string_append_c(res, c);
+  }
+  return res ? res : g_string_new("");
+}
+
+/** Skips everything up to and including delim.  Returns delim, or EOF
+    if the server went away before. */
+int
+imap_scan_skip_to(NetClientSioBuf *sio, int delim)
+{
+  const char *p, *q;
+  gsize avail;
+
+  while( (p = net_client_siobuf_peek(sio, &avail, NULL)) != NULL) {
+    q = memchr(p, delim, avail);
+    if(q) {
+      net_client_siobuf_consume(sio, q-p+1);
+      return delim;
+    }
+    net_client_siobuf_consume(sio, avail);
+  }
+  return EOF;
+}
@@ -0,0 +1,47 @@
+#ifndef __IMAP_SCAN_H__
+#define __IMAP_SCAN_H__ 1
+/* libimap library.
+ * Copyright (C) 2003-2016 Pawel Salek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <glib.h>
+
+#include "net-client-siobuf.h"
+
+/* Character classes of the response syntax, see IS_ATOM_CHAR and
+   friends in imap_private.h. */
+#define IMAP_SCAN_ATOM    0x01
+#define IMAP_SCAN_FLAG    0x02
+#define IMAP_SCAN_TAG     0x04
+#define IMAP_SCAN_ASTRING 0x08
+#define IMAP_SCAN_QUOTED  0x10 /* anything but '"' and '\\' */
+
+/** A piece of the read buffer; valid until the next read. */
+typedef struct {
+  const char *str;
+  size_t len;
+} ImapSlice;
+
+size_t imap_scan_span(const char *s, size_t len, unsigned cls);
+
+int imap_scan_token(NetClientSioBuf *sio, unsigned cls,
+                    char *buf, size_t len);
+int imap_scan_append(NetClientSioBuf *sio, unsigned cls, GString *dest);
+GString *imap_scan_quoted(NetClientSioBuf *sio, ImapSlice *slice);
+int imap_scan_skip_to(NetClientSioBuf *sio, int delim);
+
+#endif /* __IMAP_SCAN_H__ */
@@ -26,6 +26,7 @@
 
 #include "imap-commands.h"
 #include "imap_compress.h"
+#include "imap-msgstore.h"
 
 typedef enum {
   IMAP_BODY_TYPE_RFC822, /**< as fetched with RFC822 */
@@ -47,11 +48,6 @@ struct _MboxView {
   char * filter_str;
 };
 
-typedef struct {
-  ImapMsgFlag flag_values;
-  ImapMsgFlag known_flags;
-} ImapFlagCache;
-
 struct _ImapMboxHandle {
   GObject object;
 
@@ -71,8 +67,14 @@ struct _ImapMboxHandle {
   ImapUID  uidval;
   gchar *last_msg; /* last server message; for error reporting purposes */
 
-  ImapMessage **msg_cache;
-  GArray       *flag_cache;
+  ImapMsgStore msgs;
+  struct {
+    unsigned *alive;     /**< Fenwick tree counting the messages left */
+    unsigned char *gone; /**< per cached message: expunged */
+    unsigned size;       /**< exists when the batch was started */
+    unsigned count;      /**< messages expunged so far */
+  } expunge;             /**< EXPUNGEs not applied to the caches yet;
+                          * alive is NULL if there are none */
   MboxView mbox_view;
   /** cmd_info is a list of commands that serves two-fold purpose. It
       can contain task to execute when certain command completes. It
@@ -90,8 +92,24 @@ struct _ImapMboxHandle {
     unsigned store_response:1;
   } uidplus;
 
+  guint64 highestmodseq; /**< RFC 7162; 0 if unknown or NOMODSEQ */
+  struct {
+    unsigned uidvalidity; /**< known state to pass with next SELECT */
+    guint64 modseq;
+    GList *vanished;      /**< ImapUidRange's from VANISHED (EARLIER) */
+    unsigned enabled:1;   /**< ENABLE QRESYNC succeeded */
+    unsigned synced:1;    /**< last SELECT was a QRESYNC one */
+  } qresync;
+
+  struct {
+    unsigned samples;
+    double n, t, nn, nt; /**< moving averages of n, t, n*n and n*t */
+  } fetch_stats;         /**< envelope fetch timing, see
+                          * imap_mbox_handle_get_fetch_stats() */
+
   /* BYE handling depends on the state */
   gboolean doing_logout;
+  gboolean offline; /* see imap_mbox_handle_set_offline() */
   ImapInfoCb info_cb;
   void *info_arg;
 
@@ -102,13 +120,23 @@ struct _ImapMboxHandle {
 
   ImapFlagsCb flags_cb;
   void *flags_arg;
+  unsigned flags_changed; /* lowest seqno whose cached flags changed,
+                           * see imap_mbox_handle_take_flags_changed() */
   ImapFetchBodyInternalCb body_cb;
   void *body_arg;
+  gboolean body_chunked; /* body_cb takes literals in pieces; a call
+                          * with NULL buf ends each of them */
 
   ImapSearchCb search_cb;
   void *search_arg;
+  ImapSortUpdateCb sort_update_cb;
+  void *sort_update_arg;
+  unsigned sort_update_cmdno; /* SORT whose result the server keeps up
+                               * to date (CONTEXT=SORT), or 0 */
 
   GHashTable *status_resps; /* A hash of STATUS responses that we wait for */
+  ImapStatusCb status_cb;   /* ...and where the other ones go */
+  void *status_arg;
 
   GSource *sock_source;
   GMutex mutex;
@@ -119,6 +147,7 @@ struct _ImapMboxHandle {
     idle_state; /*  IDLE State? */
   unsigned op_cancelled:1; /* last op timed out and was cancelled by user */
   unsigned readonly_mbox:1;
+  unsigned examined:1; /* the mailbox was opened with EXAMINE */
   unsigned can_fetch_body:1; /* set for servers that always respond
                               * correctly to FETCH x BODY[y]
                               * requests. */
@@ -127,6 +156,7 @@ struct _ImapMboxHandle {
   unsigned enable_client_sort:1; /**< client side sorting allowed */
   unsigned enable_compress:1; /**< enable compress extension */
   unsigned enable_idle:1;     /**< use IDLE - no problem with firewalls */
+  unsigned enable_pipelining:1; /**< keep several commands in flight */
   unsigned has_rights:1;      /**< whether rights are up-to-date. */
 
   ImapAclType rights;         /**< my rights (RFC 4314) */
@@ -162,6 +192,12 @@ struct _ImapMboxHandle {
 
 
 #define IS_ATOM_CHAR(c) (strchr("(){ %*\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+#define IS_FLAG_CHAR(c) (strchr("(){ %*\"]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+/* we include '+' in TAG_CHAR because we want to treat forced responses
+   in same code. This may be wrong. Reconsider.
+*/
+#define IS_TAG_CHAR(c) (strchr("(){ %\"\\]",(c))==NULL&&(c)>0x1f&&(c)!=0x7f)
+#define IS_ASTRING_CHAR(c) (strchr("(){ %*\"\\", (c))==0&&(c)>0x1F&&(c)!=0x7F)
 
 #define EAT_LINE(h, c) c = net_client_siobuf_discard_line(h->sio, NULL)
 
@@ -173,6 +209,8 @@ ImapResponse imap_mbox_select_unlocked(ImapMboxHandle* handle, const char *mbox,
 ImapResponse imap_mbox_fetch_my_rights_unlocked(ImapMboxHandle* handle);
 
 void imap_mbox_resize_cache(ImapMboxHandle *h, unsigned new_size);
+void imap_mbox_handle_materialize(ImapMboxHandle *h, unsigned seqno);
+void imap_handle_flags_changed(ImapMboxHandle *h, unsigned seqno);
 
 ImapResponse imap_cmd_exec_cmdno(ImapMboxHandle* handle, const char* cmd,
 				 unsigned *cmdno);
@@ -183,6 +221,14 @@ ImapResponse imap_cmd_exec_cmds(ImapMboxHandle* handle, const char** cmds,
 
 ImapResponse imap_cmd_issue(ImapMboxHandle* handle, const char* cmd);
 
+typedef struct _ImapPipeline ImapPipeline;
+typedef void (*ImapPipelineCb)(ImapMboxHandle *h, ImapResponse rc, void *arg);
+ImapPipeline *imap_pipeline_new(ImapMboxHandle *h);
+void imap_pipeline_add(ImapPipeline *p, const char *cmd,
+                       ImapPipelineCb cb, void *arg);
+void imap_pipeline_barrier(ImapPipeline *p);
+ImapResponse imap_pipeline_run(ImapPipeline *p);
+
 ImapResponse imap_write_key(ImapMboxHandle *handle, ImapSearchKey *s,
                             unsigned cmdno, int use_literal);
 ImapResponse imap_search_exec_unlocked(ImapMboxHandle *h, gboolean uid, 
@@ -208,7 +254,13 @@ gchar *imap_coalesce_set(int cnt, unsigned *seqnos);
 int imap_cmd_start(ImapMboxHandle* handle, const char* cmd, unsigned* cmdno);
 ImapResponse imap_cmd_step(ImapMboxHandle* handle, unsigned cmdno);
 ImapResponse imap_cmd_process_untagged(ImapMboxHandle* handle, unsigned cmdno);
+void imap_cmd_keep(ImapMboxHandle *h, unsigned cmdno);
+ImapResponse imap_cmd_collect(ImapMboxHandle *h, unsigned cmdno);
+void imap_cmd_forget(ImapMboxHandle *h, unsigned cmdno);
 unsigned imap_make_tag(ImapCmdTag tag);
+unsigned imap_get_tag_count(void);
+void imap_handle_add_fetch_sample(ImapMboxHandle *h, unsigned cnt,
+                                  gint64 usecs);
 void mbox_view_append_no(MboxView *mv, unsigned seqno);
 
 extern const char* imap_status_item_names[5];
@@ -550,6 +550,62 @@ imap_search_exec(ImapMboxHandle *h, gboolean uid,
   return rc;
 }
 
+/** Searches the messages with UID first_uid or higher, usually the
+    ones that arrived since an earlier search, and calls the specified
+    callback with the sequence numbers of the matching ones. Unlike
+    imap_search_exec(), this sends a single command: the UID range
+    keeps the search short. If no message has such a UID, the server
+    searches the last message instead; it is reported only if it
+    matches the key, so the callback never gets a false match. */
+ImapResponse
+imap_search_exec_from_uid(ImapMboxHandle *h, ImapUID first_uid,
+                          ImapSearchKey *s, ImapSearchCb cb, void *cb_arg)
+{
+  int can_do_literals;
+  ImapResponse ir;
+  ImapCmdTag tag;
+  ImapSearchCb ocb;
+  void *oarg;
+  unsigned cmdno;
+
+  if(!s)
+    return IMR_BAD;
+
+  g_object_ref(h);
+  g_mutex_lock(&h->mutex);
+  if(h->state != IMHS_SELECTED) {
+    g_mutex_unlock(&h->mutex);
+    g_object_unref(h);
+    return IMR_BAD;
+  }
+  if (!imap_handle_idle_disable(h)) {
+    g_mutex_unlock(&h->mutex);
+    g_object_unref(h);
+    return IMR_SEVERED;
+  }
+
+  can_do_literals = imap_mbox_handle_can_do(h, IMCAP_LITERAL);
+  ocb  = h->search_cb;  h->search_cb  = cb;
+  oarg = h->search_arg; h->search_arg = cb_arg;
+
+  cmdno = imap_make_tag(tag);
+  sio_printf(h->sio, "%s Search %sUID %u:* ", tag,
+             imap_mbox_handle_can_do(h, IMCAP_ESEARCH) ? "return (all) " : "",
+             (unsigned)first_uid);
+  if( (ir=imap_write_key(h, s, cmdno, can_do_literals)) == IMR_OK) {
+    net_client_siobuf_flush(h->sio, NULL);
+    ir = imap_cmd_process_untagged(h, cmdno);
+  }
+
+  h->search_cb  = ocb;
+  h->search_arg = oarg;
+  imap_handle_idle_enable(h, 30);
+  g_mutex_unlock(&h->mutex);
+  g_object_unref(h);
+
+  return ir;
+}
+
 /* == optimized branch for flag-only searches..  Since we know most of
    the flags most of the time, there is no point in repeating some
    flag-only searches over and over. We just run a search optimized
@@ -619,11 +675,10 @@ execute_flag_only_search(ImapMboxHandle *h, ImapSearchKey *s,
   if( (*rc = imap_assure_needed_flags(h, needed_flags)) != IMR_OK)
     return FALSE;
   
-  for(i=0; i<h->exists; i++) {
-    ImapFlagCache *f =
-      &g_array_index(h->flag_cache, ImapFlagCache, i);
+  for(i=1; i<=h->msgs.size; i++) {
+    ImapFlagCache *f = imap_msg_store_flags(&h->msgs, i);
     if(search_key_matches(s, f->flag_values))
-      cb(h, i+1, cb_arg);
+      cb(h, i, cb_arg);
   }
   return TRUE;
 }
@@ -50,5 +50,8 @@ void imap_search_key_free(ImapSearchKey *s);
 void imap_search_key_set_next(ImapSearchKey *list, ImapSearchKey *next);
 ImapResponse imap_search_exec(ImapMboxHandle *h, gboolean uid,
                               ImapSearchKey *s, ImapSearchCb cb, void *cb_arg);
+ImapResponse imap_search_exec_from_uid(ImapMboxHandle *h, ImapUID first_uid,
+                                       ImapSearchKey *s, ImapSearchCb cb,
+                                       void *cb_arg);
 
 #endif
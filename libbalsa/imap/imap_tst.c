@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -33,6 +34,9 @@
 #include "libimap.h"
 #include "imap-handle.h"
 #include "imap-commands.h"
+#include "imap_private.h"
+#include "imap-scan.h"
+#include "imap_search.h"
 #include "util.h"
 
 struct {
@@ -41,7 +45,9 @@ struct {
   NetClientCryptMode tls_mode;
   gboolean anonymous;
   gboolean compress;
-} TestContext = { NULL, NULL, NET_CLIENT_CRYPT_STARTTLS_OPT, FALSE, FALSE };
+  gboolean serial;
+} TestContext = { NULL, NULL, NET_CLIENT_CRYPT_STARTTLS_OPT, FALSE, FALSE,
+                  FALSE };
 
 
 static gchar*
@@ -129,6 +135,9 @@ get_handle(const char *host)
   if(TestContext.compress)
     imap_handle_set_option(h, IMAP_OPT_COMPRESS, TRUE);
 
+  if(TestContext.serial)
+    imap_handle_set_option(h, IMAP_OPT_PIPELINING, FALSE);
+
   imap_handle_set_authcb(h, G_CALLBACK(auth_cb), NULL);
   imap_handle_set_certcb(h, G_CALLBACK(cert_cb));
 
@@ -275,6 +284,7 @@ dump_mbox(const char *host, const char *mailbox,
 struct DumpfileState {
   FILE *fl;
   int error;
+  unsigned last_seqno;
 };
 
 static void
@@ -284,19 +294,21 @@ dumpfile_cb(unsigned seqno, const char *buf, size_t buflen, void *arg)
   static const char header[] =
     "From addr@example.com Thu Oct 18 00:50:45 2007\r\n";
   
-  if(fwrite(header, 1, sizeof(header)-1, dfs->fl) != sizeof(header)-1 ||
+  if((seqno != dfs->last_seqno &&
+      fwrite(header, 1, sizeof(header)-1, dfs->fl) != sizeof(header)-1) ||
      fwrite(buf, 1, buflen, dfs->fl) != buflen) {
     if(!dfs->error) {
       fprintf(stderr, "Cannot write\n");
       dfs->error = 1;
     }
   }
+  dfs->last_seqno = seqno;
 }
 
 static int
 test_mbox_dumpfile(int argc, char *argv[])
 {
-  struct DumpfileState state = { NULL, 0 };
+  struct DumpfileState state = { NULL, 0, 0 };
   int res = 1;
 
   if(argc<2) {
@@ -372,8 +384,10 @@ test_mbox_dumpdir(int argc, char *argv[])
 
 struct MsgIterator {
   const char *src_dir;
-  DIR *dir;
+  struct dirent **files; /* sorted, so that scripted tests can work */
+  int n_files, next;
   FILE *fh;
+  unsigned stored, refused;
 };
 
 static size_t
@@ -383,7 +397,6 @@ msg_iterator(char* buffer, size_t buffer_size, ImapAppendMultiStage stage,
   struct MsgIterator *mi = (struct MsgIterator*)arg;
   struct stat buf;
   size_t msg_size;
-  struct dirent *file;
 
   switch(stage) {
   case IMA_STAGE_NEW_MSG:
@@ -393,10 +406,10 @@ msg_iterator(char* buffer, size_t buffer_size, ImapAppendMultiStage stage,
       mi->fh = NULL;
     }
     
-    for(msg_size = 0;
-	msg_size == 0 &&
-	(file = readdir(mi->dir)) != NULL;) {
-      gchar *file_name = g_build_filename(mi->src_dir, file->d_name, NULL);
+    for(msg_size = 0; msg_size == 0 && mi->next < mi->n_files;) {
+      gchar *file_name = g_build_filename(mi->src_dir,
+                                          mi->files[mi->next++]->d_name,
+                                          NULL);
 
       if(stat(file_name, &buf) == 0) {
 	if(S_ISREG(buf.st_mode)) {
@@ -413,6 +426,13 @@ msg_iterator(char* buffer, size_t buffer_size, ImapAppendMultiStage stage,
 
   case IMA_STAGE_PASS_DATA:
     return fread(buffer, 1, buffer_size, mi->fh);
+
+  case IMA_STAGE_COMMITTED:
+    if(buffer_size)
+      mi->stored++;
+    else
+      mi->refused++;
+    return 0;
   }
 
   g_assert_not_reached();
@@ -465,11 +485,30 @@ test_mbox_append_common(gboolean multi, int argc, char *argv[])
   /* Now, keep appending... */
   if(multi) {
     struct MsgIterator mi;
+    ImapSequence uids;
+    int i;
 
+    closedir(dir);
     mi.src_dir = src_dir;
-    mi.dir = dir;
+    mi.n_files = scandir(src_dir, &mi.files, NULL, alphasort);
+    if(mi.n_files < 0) {
+      mi.files = NULL;
+      mi.n_files = 0;
+    }
+    mi.next = 0;
     mi.fh = NULL;
-    res = imap_mbox_append_multi(h, mailbox, msg_iterator, &mi, NULL);
+    mi.stored = mi.refused = 0;
+    imap_sequence_init(&uids);
+    res = imap_mbox_append_multi(h, mailbox, msg_iterator, &mi, &uids);
+    if(mi.fh)
+      fclose(mi.fh);
+    printf("%u messages stored, %u refused, %u UIDs (UIDVALIDITY %u)\n",
+           mi.stored, mi.refused, imap_sequence_length(&uids),
+           uids.uid_validity);
+    imap_sequence_release(&uids);
+    for(i=0; i<mi.n_files; i++)
+      free(mi.files[i]);
+    free(mi.files);
   } else {
     for(res = IMR_OK; res == IMR_OK && (file = readdir(dir)) != NULL;) {
       struct stat buf;
@@ -536,6 +575,807 @@ test_mbox_delete(int argc, char *argv[])
   return rc == IMR_OK ? 0 : 1;
 }
 
+static void
+print_uid(unsigned uid, void *arg)
+{
+  printf(" %u", uid);
+}
+
+/** Selects a mailbox with QRESYNC and prints what the server
+    reported as changed since given state.  With LO:HI, the flags of
+    these messages are fetched before HIGHESTMODSEQ is printed. */
+static int
+test_mbox_qresync(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  ImapSequence vanished;
+  gboolean read_only, synced;
+  unsigned i, cnt;
+
+  if(argc<4) {
+    fprintf(stderr, "qresync HOST MAILBOX UIDVALIDITY MODSEQ [LO:HI]\n");
+    return 1;
+  }
+
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+
+  imap_mbox_handle_set_qresync(h, strtoul(argv[2], NULL, 10),
+                               g_ascii_strtoull(argv[3], NULL, 10));
+  if(imap_mbox_select(h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    g_object_unref(h);
+    return 1;
+  }
+
+  synced = imap_mbox_handle_take_vanished(h, &vanished);
+  printf("VANISHED");
+  imap_sequence_foreach(&vanished, print_uid, NULL);
+  printf("\n");
+  imap_sequence_release(&vanished);
+
+  cnt = imap_mbox_handle_get_exists(h);
+  for(i=1; i<=cnt; i++) {
+    ImapMessage *imsg = imap_mbox_handle_get_msg(h, i);
+    if(imsg)
+      printf("CHANGED %u UID %u FLAGS 0x%x\n", i, imsg->uid, (unsigned)imsg->flags);
+  }
+  if(argc>4) {
+    unsigned lo = 0, hi = 0;
+    if(sscanf(argv[4], "%u:%u", &lo, &hi) != 2 ||
+       imap_mbox_handle_fetch_range(h, lo, hi, IMFETCH_FLAGS) != IMR_OK)
+      fprintf(stderr, "Fetching flags of %s failed.\n", argv[4]);
+  }
+  printf("HIGHESTMODSEQ %" G_GUINT64_FORMAT "\n",
+         imap_mbox_handle_get_highestmodseq(h));
+  g_object_unref(h);
+
+  return synced ? 0 : 1;
+}
+
+static void
+print_elapsed(const char *what, gint64 *start)
+{
+  gint64 now = g_get_monotonic_time();
+  printf("%-8s %6lu ms\n", what, (unsigned long)((now - *start) / 1000));
+  *start = now;
+}
+
+/** Measures how long it takes to open a mailbox, learn the flags of
+    its messages and fetch their envelopes.  Run it against
+    test/fake_imap_server.py --latency to see what pipelining buys on
+    a slow link; -P turns pipelining off for comparison. */
+static int
+test_mbox_bench(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  gboolean read_only;
+  gint64 start, total;
+  unsigned exists, i, *set;
+  ImapFetchStats stats;
+  ImapResponse rc;
+  int res = 1;
+
+  if(argc<2) {
+    fprintf(stderr, "bench HOST MAILBOX\n");
+    return 1;
+  }
+
+  total = start = g_get_monotonic_time();
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+  print_elapsed("connect", &start);
+
+  if(imap_mbox_select(h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    goto out;
+  }
+  print_elapsed("select", &start);
+
+  exists = imap_mbox_handle_get_exists(h);
+  if(exists > 0) {
+    imap_mbox_handle_msgno_has_flags(h, 1,
+                                     IMSGF_FLAGGED | IMSGF_ANSWERED,
+                                     IMSGF_SEEN | IMSGF_DELETED);
+    print_elapsed("flags", &start);
+    printf("%u messages, message store %lu bytes\n", exists,
+           (unsigned long)imap_msg_store_get_memory(&h->msgs));
+
+    set = g_new(unsigned, exists);
+    for(i=0; i<exists; i++)
+      set[i] = i+1;
+    rc = imap_mbox_handle_fetch_set(h, set, exists,
+                                    IMFETCH_ENV | IMFETCH_FLAGS |
+                                    IMFETCH_UID);
+    g_free(set);
+    if(rc != IMR_OK) {
+      fprintf(stderr, "Fetching headers failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto out;
+    }
+    print_elapsed("headers", &start);
+  }
+  imap_mbox_handle_get_fetch_stats(h, &stats);
+  printf("rtt %.1f ms, %.3f ms/envelope (%u fetches)\n",
+         stats.rtt * 1000, stats.per_message * 1000, stats.samples);
+  print_elapsed("total", &total);
+  res = 0;
+
+ out:
+  g_object_unref(h);
+  return res;
+}
+
+static void
+count_expunged(ImapMboxHandle *h, const unsigned *seqnos,
+               const ImapUID *uids, unsigned n, unsigned *counts)
+{
+  counts[0]++;
+  counts[1] += n;
+}
+
+/** Measures how long it takes to process the EXPUNGE responses for
+    the messages of a mailbox, see test/expunge.script. The UIDs are
+    fetched first, so that there is something to drop from the
+    caches. */
+static int
+test_mbox_expunge(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  gboolean read_only;
+  gint64 start, total;
+  unsigned exists, i, *set, counts[2] = { 0, 0 };
+  int res = 1;
+
+  if(argc<2) {
+    fprintf(stderr, "expunge HOST MAILBOX\n");
+    return 1;
+  }
+
+  total = start = g_get_monotonic_time();
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+  if(imap_mbox_select(h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    goto out;
+  }
+  print_elapsed("select", &start);
+
+  exists = imap_mbox_handle_get_exists(h);
+  if(exists > 0) {
+    set = g_new(unsigned, exists);
+    for(i=0; i<exists; i++)
+      set[i] = i+1;
+    if(imap_mbox_handle_fetch_set(h, set, exists, IMFETCH_UID) != IMR_OK) {
+      g_free(set);
+      fprintf(stderr, "Fetching UIDs failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto out;
+    }
+    g_free(set);
+    print_elapsed("uids", &start);
+  }
+
+  g_signal_connect(G_OBJECT(h), "expunge-batch",
+                   G_CALLBACK(count_expunged), counts);
+  if(imap_mbox_expunge(h) != IMR_OK) {
+    fprintf(stderr, "Expunging failed: %s\n",
+            imap_mbox_handle_get_last_msg(h));
+    goto out;
+  }
+  print_elapsed("expunge", &start);
+  printf("%u of %u messages expunged in %u batches\n",
+         counts[1], exists, counts[0]);
+  print_elapsed("total", &total);
+  res = 0;
+
+ out:
+  g_object_unref(h);
+  return res;
+}
+
+/* Wall clock, CPU time and command count at the start of a phase of
+   the benchmark suite. */
+typedef struct {
+  gint64 wall, cpu;
+  unsigned tags;
+} SuiteClock;
+
+static void
+suite_clock_read(SuiteClock *clock)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  clock->wall = g_get_monotonic_time();
+  clock->cpu = (gint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000000
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  clock->tags = imap_get_tag_count();
+}
+
+static void
+print_phase(const char *what, SuiteClock *start)
+{
+  SuiteClock now;
+  suite_clock_read(&now);
+  printf("%-9s %6lu ms %6lu ms cpu %5u cmds\n", what,
+         (unsigned long)((now.wall - start->wall) / 1000),
+         (unsigned long)((now.cpu - start->cpu) / 1000),
+         now.tags - start->tags);
+  *start = now;
+}
+
+static void
+count_hit(ImapMboxHandle *h, unsigned seqno, void *arg)
+{
+  (*(unsigned*)arg)++;
+}
+
+static void
+count_bytes(unsigned seqno, const char *buf, size_t buflen, void *arg)
+{
+  *(size_t*)arg += buflen;
+}
+
+#define SUITE_BODIES 50
+
+/** Runs the operations that opening and working with a mailbox
+    consists of: select, flags, envelopes, search, sort, bodies and
+    expunge, and prints for each of them the wall clock and CPU time
+    spent and the number of commands sent.  Run it against
+    "test/fake_imap_server.py --mock", which prints the round trips
+    and bytes the server saw; test/suite.sh checks the commands and
+    round trips against test/suite.limits. */
+static int
+test_mbox_suite(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  ImapSearchKey *key;
+  gboolean read_only;
+  SuiteClock start, total;
+  unsigned exists, i, cnt, hits, *set;
+  size_t bytes = 0;
+  int res = 1;
+
+  if(argc<2) {
+    fprintf(stderr, "suite HOST MAILBOX\n");
+    return 1;
+  }
+
+  suite_clock_read(&start);
+  total = start;
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+  /* Sort like Balsa does on servers without SORT. */
+  imap_handle_set_option(h, IMAP_OPT_CLIENT_SORT, TRUE);
+  print_phase("connect", &start);
+
+  if(imap_mbox_select(h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    goto out;
+  }
+  print_phase("select", &start);
+
+  exists = imap_mbox_handle_get_exists(h);
+  set = g_new(unsigned, exists ? exists : 1);
+  for(i=0; i<exists; i++)
+    set[i] = i+1;
+
+  if(exists > 0) {
+    imap_mbox_handle_msgno_has_flags(h, 1,
+                                     IMSGF_FLAGGED | IMSGF_ANSWERED,
+                                     IMSGF_SEEN | IMSGF_DELETED);
+    print_phase("flags", &start);
+
+    if(imap_mbox_handle_fetch_set(h, set, exists,
+                                  IMFETCH_ENV | IMFETCH_FLAGS |
+                                  IMFETCH_UID) != IMR_OK) {
+      fprintf(stderr, "Fetching envelopes failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto free_set;
+    }
+    print_phase("envelope", &start);
+
+    hits = 0;
+    key = imap_search_key_new_string(0, IMSE_S_SUBJECT, "topic 3", NULL);
+    imap_search_key_set_next(key, imap_search_key_new_flag(1,
+                                                           IMSGF_FLAGGED));
+    if(imap_search_exec(h, FALSE, key, count_hit, &hits) != IMR_OK) {
+      imap_search_key_free(key);
+      fprintf(stderr, "Searching failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto free_set;
+    }
+    imap_search_key_free(key);
+    print_phase("search", &start);
+
+    if(imap_mbox_sort_msgno(h, IMSO_DATE, FALSE, set, exists) != IMR_OK) {
+      fprintf(stderr, "Sorting failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto free_set;
+    }
+    print_phase("sort", &start);
+
+    cnt = exists < SUITE_BODIES ? exists : SUITE_BODIES;
+    for(i=0; i<cnt; i++)
+      set[i] = exists - i;
+    if(imap_mbox_handle_fetch_rfc822(h, cnt, set, TRUE, count_bytes,
+                                     &bytes) != IMR_OK) {
+      fprintf(stderr, "Fetching bodies failed: %s\n",
+              imap_mbox_handle_get_last_msg(h));
+      goto free_set;
+    }
+    print_phase("body", &start);
+
+    if(!read_only) {
+      for(cnt=0, i=1; i<=exists; i+=10)
+        set[cnt++] = i;
+      if(imap_mbox_store_flag(h, cnt, set, IMSGF_DELETED, TRUE) != IMR_OK
+         || imap_mbox_expunge(h) != IMR_OK) {
+        fprintf(stderr, "Expunging failed: %s\n",
+                imap_mbox_handle_get_last_msg(h));
+        goto free_set;
+      }
+      print_phase("expunge", &start);
+    }
+    printf("%u messages, %u search hits, %lu body bytes\n",
+           exists, hits, (unsigned long)bytes);
+  }
+  print_phase("total", &total);
+  res = 0;
+
+ free_set:
+  g_free(set);
+ out:
+  g_object_unref(h);
+  return res;
+}
+
+static void
+print_status(ImapMboxHandle *h, const char *mbox,
+             const struct ImapStatusResult *items, unsigned *counts)
+{
+  unsigned i;
+
+  if(!mbox) {
+    printf("OVERFLOW\n");
+    counts[1]++;
+    return;
+  }
+  printf("STATUS %s", mbox);
+  for(i=0; items[i].item != IMSTAT_NONE; i++)
+    printf(" %s %u", imap_status_item_names[items[i].item],
+           items[i].result);
+  printf("\n");
+  counts[0]++;
+}
+
+/** Asks the server to report changes to the given mailboxes with
+    NOTIFY and prints the STATUS responses that come; see
+    test/notify.script. A NOOP gives the server a chance to report
+    changes that happen after the initial status. */
+static int
+test_mbox_notify(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  unsigned counts[2] = { 0, 0 };
+  int res = 1;
+
+  if(argc<1) {
+    fprintf(stderr, "notify HOST [MAILBOX...]\n");
+    return 1;
+  }
+
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+
+  imap_handle_set_statuscb(h, (ImapStatusCb)print_status, counts);
+  if(imap_mbox_notify(h, argc-1, (const char**)argv+1) != IMR_OK) {
+    fprintf(stderr, "NOTIFY failed: %s\n",
+            imap_mbox_handle_get_last_msg(h));
+    goto out;
+  }
+  if(imap_mbox_handle_noop(h) != IMR_OK) {
+    fprintf(stderr, "NOOP failed: %s\n", imap_mbox_handle_get_last_msg(h));
+    goto out;
+  }
+  printf("%u notifications, %u overflows\n", counts[0], counts[1]);
+  res = 0;
+
+ out:
+  imap_handle_set_statuscb(h, NULL, NULL);
+  g_object_unref(h);
+  return res;
+}
+
+struct FlagChanges {
+  ImapMboxHandle *h;
+  unsigned changed;
+};
+
+static void
+note_flag_changes(unsigned cnt, const unsigned seqno[],
+                  struct FlagChanges *fc)
+{
+  unsigned changed = imap_mbox_handle_take_flags_changed(fc->h);
+  if(changed && (!fc->changed || changed < fc->changed))
+    fc->changed = changed;
+}
+
+static int
+check_flag_changes(struct FlagChanges *fc, const char *what,
+                   unsigned expected)
+{
+  unsigned changed = fc->changed;
+
+  fc->changed = 0;
+  printf("%-6s flags changed from %u, expected %u\n", what, changed,
+         expected);
+  return changed == expected ? 0 : 1;
+}
+
+/** Checks that changes to the cached flags are reported for messages
+    the client never looked at: flags learnt first, a silent STORE and
+    unsolicited FETCH FLAGS, while flags reported again unchanged do
+    not count; see test/flags.script. The mailbox must have four
+    messages, the last of them seen. */
+static int
+test_mbox_flags(int argc, char *argv[])
+{
+  struct FlagChanges fc;
+  gboolean read_only;
+  unsigned set[2] = { 3, 4 };
+  int res = 1;
+
+  if(argc<2) {
+    fprintf(stderr, "flags HOST MAILBOX\n");
+    return 1;
+  }
+
+  fc.h = get_handle(argv[0]);
+  fc.changed = 0;
+  if(!fc.h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+  imap_handle_set_flagscb(fc.h, (ImapFlagsCb)note_flag_changes, &fc);
+  if(imap_mbox_select(fc.h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    goto out;
+  }
+
+  if(imap_mbox_handle_fetch_range(fc.h, 1, 4, IMFETCH_FLAGS) != IMR_OK) {
+    fprintf(stderr, "Fetching flags failed.\n");
+    goto out;
+  }
+  res = check_flag_changes(&fc, "fetch", 1);
+
+  /* Message 4 is seen already and is left out of the STORE. */
+  if(imap_mbox_store_flag(fc.h, 2, set, IMSGF_SEEN, TRUE) != IMR_OK) {
+    fprintf(stderr, "Storing flags failed.\n");
+    res = 1;
+    goto out;
+  }
+  res |= check_flag_changes(&fc, "store", 3);
+
+  if(imap_mbox_handle_noop(fc.h) != IMR_OK) {
+    fprintf(stderr, "NOOP failed.\n");
+    res = 1;
+    goto out;
+  }
+  res |= check_flag_changes(&fc, "noop", 2);
+
+ out:
+  imap_handle_set_flagscb(fc.h, NULL, NULL);
+  g_object_unref(fc.h);
+  return res;
+}
+
+static void
+print_part_data(unsigned seqno, const char *buf, size_t buflen, void *arg)
+{
+  fwrite(buf, 1, buflen, stdout);
+}
+
+/** Fetches a body section in chunks of the given size with partial
+    fetches, the way large attachments are streamed, and prints it. */
+static int
+test_mbox_part(int argc, char *argv[])
+{
+  ImapMboxHandle *h;
+  gboolean read_only;
+  unsigned uid, chunks = 0;
+  size_t chunk, offset = 0, fetched;
+  int res = 1;
+
+  if(argc<4) {
+    fprintf(stderr, "part HOST MAILBOX UID SECTION [CHUNK]\n");
+    return 1;
+  }
+  uid = strtoul(argv[2], NULL, 10);
+  chunk = argc>4 ? strtoul(argv[4], NULL, 10) : 65536;
+  if(chunk == 0)
+    chunk = 1;
+
+  h = get_handle(argv[0]);
+  if(!h) {
+    fprintf(stderr, "Connection to %s failed.\n", argv[0]);
+    return 1;
+  }
+  if(imap_mbox_select(h, argv[1], &read_only) != IMR_OK) {
+    fprintf(stderr, "Selecting %s failed.\n", argv[1]);
+    goto out;
+  }
+
+  do {
+    if(imap_mbox_handle_fetch_body_partial(h, uid, argv[3], FALSE,
+                                           offset, chunk, print_part_data,
+                                           NULL, &fetched) != IMR_OK) {
+      fprintf(stderr, "\nFetching at %lu failed: %s\n",
+              (unsigned long)offset, imap_mbox_handle_get_last_msg(h));
+      goto out;
+    }
+    offset += fetched;
+    chunks++;
+  } while(fetched == chunk);
+  fprintf(stderr, "%lu bytes in %u chunks\n", (unsigned long)offset, chunks);
+  res = 0;
+
+ out:
+  g_object_unref(h);
+  return res;
+}
+
+/* Response data for the tokenizer tests: the byte-wise reference
+   reads it through a function pointer, as the parser used to call
+   sio_getc() for every byte. */
+typedef struct _ScanInput ScanInput;
+struct _ScanInput {
+  const char *p, *end;
+  int (*getc)(ScanInput *in);
+};
+
+static int
+scan_input_getc(ScanInput *in)
+{
+  return in->p < in->end ? (gchar)*in->p++ : EOF;
+}
+
+/* Splits data into tokens the way the byte-wise parser did. */
+static void
+scan_reference(const char *data, size_t len, GString *out)
+{
+  ScanInput in;
+  char buf[16];
+  unsigned i;
+  long n;
+  int c;
+
+  in.p = data; in.end = data + len; in.getc = scan_input_getc;
+  c = in.getc(&in);
+  while(c != EOF) {
+    if(c == '"') {
+      g_string_append(out, "Q ");
+      while( (c=in.getc(&in)) != '"' && c != EOF) {
+        if(c == '\\')
+          c = in.getc(&in);
+        g_string_append_c(out, c);
+      }
+      c = in.getc(&in);
+    } else if(c == '{') {
+      for(i=0; i<sizeof(buf)-1 && (c=in.getc(&in)) >=0 && IS_ATOM_CHAR(c);
+          i++)
+        buf[i] = c;
+      buf[i] = '\0';
+      g_string_append_printf(out, "L %s ", buf);
+      if(c == 0x0d && in.getc(&in) == 0x0a)
+        for(n = strtol(buf, NULL, 10); n>0 && in.p<in.end; n--)
+          g_string_append_c(out, *in.p++);
+      c = in.getc(&in);
+    } else if(c>=0 && IS_FLAG_CHAR(c)) {
+      g_string_append(out, "A ");
+      do {
+        g_string_append_c(out, c);
+      } while( (c=in.getc(&in)) >=0 && IS_FLAG_CHAR(c));
+    } else {
+      g_string_append_c(out, c);
+      c = in.getc(&in);
+    }
+    g_string_append_c(out, '\n');
+  }
+}
+
+/* Splits data into tokens with the functions of imap-scan.c. */
+static void
+scan_spans(const char *data, size_t len, GString *out)
+{
+  const char *p = data, *end = data + len;
+  char buf[16];
+  size_t n;
+  long l;
+  int c;
+
+  while(p < end && (c = (gchar)*p) != EOF) {
+    p++;
+    if(c == '"') {
+      g_string_append(out, "Q ");
+      for(;;) {
+        n = imap_scan_span(p, end-p, IMAP_SCAN_QUOTED);
+        g_string_append_len(out, p, n);
+        p += n;
+        if(p == end)
+          break;
+        if(*p++ != '\\')
+          break;
+        g_string_append_c(out, p < end ? *p++ : EOF);
+      }
+    } else if(c == '{') {
+      n = imap_scan_span(p, MIN((size_t)(end-p), sizeof(buf)-1),
+                         IMAP_SCAN_ATOM);
+      memcpy(buf, p, n);
+      buf[n] = '\0';
+      p += n;
+      g_string_append_printf(out, "L %s ", buf);
+      if(n < sizeof(buf)-1 && p < end && *p++ == 0x0d &&
+         p < end && *p++ == 0x0a) {
+        l = strtol(buf, NULL, 10);
+        if(l > end-p)
+          l = end-p;
+        if(l > 0) {
+          g_string_append_len(out, p, l);
+          p += l;
+        }
+      }
+    } else if(c>=0 && IS_FLAG_CHAR(c)) {
+      g_string_append(out, "A ");
+      n = imap_scan_span(p-1, end-p+1, IMAP_SCAN_FLAG);
+      g_string_append_len(out, p-1, n);
+      p += n-1;
+    } else {
+      g_string_append_c(out, c);
+    }
+    g_string_append_c(out, '\n');
+  }
+}
+
+/** Checks the tokenizer of imap-scan.c against the byte-wise
+    reading it replaces: the character classes for every byte, and
+    the tokens of some responses, with random bytes mixed in. */
+static int
+test_scanner()
+{
+  static const char *responses[] = {
+    "* 1 FETCH (UID 17 FLAGS (\\Seen $Junk) RFC822.SIZE 1834 ENVELOPE "
+    "(\"Mon, 7 Feb 1994 21:52:25 -0800\" \"Re: \\\"quoted\\\" \\\\ text\" "
+    "((\"Fred\" NIL \"fred\" \"example.com\")) NIL NIL NIL NIL NIL "
+    "\"<B27397-0100000@example.com>\" \"<id@example.com>\"))\r\n",
+    "* 2 FETCH (BODY[HEADER.FIELDS (SUBJECT)] {20}\r\nSubject: a {5}\r\n\r\n)\r\n",
+    "* OK [PERMANENTFLAGS (\\Answered \\*)] Limited\r\n",
+    "a1 OK [READ-WRITE] SELECT completed\r\n",
+    "* 3 FETCH (ENVELOPE (\"unterminated\r\n",
+    "* 4 FETCH (BODY {99}\r\nshort"
+  };
+  GString *ref = g_string_new(NULL), *span = g_string_new(NULL);
+  GString *data = g_string_new(NULL);
+  GRand *rand = g_rand_new_with_seed(4711);
+  unsigned i, j, cls, failures = 0;
+  int c;
+
+  for(i=0; i<256; i++) {
+    c = (gchar)i;
+    cls = 0;
+    if(c>=0 && IS_ATOM_CHAR(c)) cls |= IMAP_SCAN_ATOM;
+    if(c>=0 && IS_FLAG_CHAR(c)) cls |= IMAP_SCAN_FLAG;
+    if(c>=0 && IS_TAG_CHAR(c))  cls |= IMAP_SCAN_TAG;
+    if(IS_ASTRING_CHAR(c))      cls |= IMAP_SCAN_ASTRING;
+    if(c != '"' && c != '\\' && c != EOF) cls |= IMAP_SCAN_QUOTED;
+    for(j=1; j<=IMAP_SCAN_QUOTED; j <<= 1) {
+      char ch = i;
+      if( (imap_scan_span(&ch, 1, j) == 1) != ((cls & j) != 0) ) {
+        printf("scanner: class %x of byte %02x differs\n", j, i);
+        failures++;
+      }
+    }
+  }
+
+  for(i=0; i<1000; i++) {
+    const char *resp =
+      responses[i % (sizeof(responses)/sizeof(responses[0]))];
+    g_string_assign(data, resp);
+    if(i >= sizeof(responses)/sizeof(responses[0])) {
+      for(j=g_rand_int_range(rand, 1, 4); j>0; j--)
+        data->str[g_rand_int_range(rand, 0, data->len)] =
+          g_rand_int_range(rand, 1, 256);
+    }
+    g_string_truncate(ref, 0);
+    g_string_truncate(span, 0);
+    scan_reference(data->str, data->len, ref);
+    scan_spans(data->str, data->len, span);
+    if(ref->len != span->len || memcmp(ref->str, span->str, ref->len)) {
+      printf("scanner: tokens of '%s' differ:\n%s\n---\n%s\n",
+             data->str, ref->str, span->str);
+      failures++;
+    }
+  }
+  g_rand_free(rand);
+  g_string_free(data, TRUE);
+  g_string_free(ref, TRUE);
+  g_string_free(span, TRUE);
+  if(failures == 0)
+    printf("scanner: OK\n");
+  return failures;
+}
+
+/** Tokenizes captured responses, e.g. the output of a large UID FETCH
+    saved from a session log, byte-wise and with imap-scan.c, checks
+    that the tokens agree and prints the time each took. */
+static int
+test_scan_bench(int argc, char *argv[])
+{
+  gchar *data;
+  gsize len;
+  GString *ref, *span;
+  gint64 start, t_ref, t_span;
+  unsigned rounds, i;
+  GError *err = NULL;
+  int res;
+
+  if(argc<1) {
+    fprintf(stderr, "scan FILE [ROUNDS]\n");
+    return 1;
+  }
+  if(!g_file_get_contents(argv[0], &data, &len, &err)) {
+    fprintf(stderr, "%s\n", err->message);
+    g_error_free(err);
+    return 1;
+  }
+  rounds = argc>1 ? strtoul(argv[1], NULL, 10) : 10;
+  if(rounds == 0)
+    rounds = 1;
+
+  ref = g_string_sized_new(len + len/4);
+  span = g_string_sized_new(len + len/4);
+  start = g_get_monotonic_time();
+  for(i=0; i<rounds; i++) {
+    g_string_truncate(ref, 0);
+    scan_reference(data, len, ref);
+  }
+  t_ref = g_get_monotonic_time() - start;
+  start = g_get_monotonic_time();
+  for(i=0; i<rounds; i++) {
+    g_string_truncate(span, 0);
+    scan_spans(data, len, span);
+  }
+  t_span = g_get_monotonic_time() - start;
+
+  res = ref->len != span->len || memcmp(ref->str, span->str, ref->len);
+  printf("%lu bytes, %u rounds\n", (unsigned long)len, rounds);
+  printf("byte-wise %8.1f MB/s\n",
+         (double)len * rounds / (t_ref > 0 ? t_ref : 1));
+  printf("spans     %8.1f MB/s\n",
+         (double)len * rounds / (t_span > 0 ? t_span : 1));
+  printf("tokens %s\n", res ? "DIFFER" : "agree");
+
+  g_string_free(ref, TRUE);
+  g_string_free(span, TRUE);
+  g_free(data);
+  return res;
+}
+
 /** test mailbox name quoting. */
 static int
 test_mailbox_name_quoting()
@@ -585,6 +1425,8 @@ process_options(int argc, char *argv[])
       TestContext.anonymous = TRUE;
     } else if( strcmp(argv[first_arg], "-c") == 0) {
       TestContext.compress = TRUE;
+    } else if( strcmp(argv[first_arg], "-P") == 0) {
+      TestContext.serial = TRUE;
     } else if( strcmp(argv[first_arg], "-T") == 0) {
       TestContext.tls_mode = NET_CLIENT_CRYPT_STARTTLS;
     } else if( strcmp(argv[first_arg], "-t") == 0) {
@@ -602,6 +1444,7 @@ main(int argc, char *argv[]) {
     test_envelope_strings();
     test_body_strings();
     test_mailbox_name_quoting();
+    return test_scanner() ? 1 : 0;
   } else {
     static const struct {
       int (*func)(int argc, char *argv[]);
@@ -612,7 +1455,15 @@ main(int argc, char *argv[]) {
       { test_mbox_dumpdir, "dumpdir", "HOST MAILBOX DST_DIRECTORY" },
       { test_mbox_append, "append", "HOST MAILBOX SRC_DIRECTORY" },
       { test_mbox_append_multi, "multi", "HOST MAILBOX SRC_DIRECTORY" },
-      { test_mbox_delete, "delete", "HOST MAILBOX" }
+      { test_mbox_delete, "delete", "HOST MAILBOX" },
+      { test_mbox_qresync, "qresync", "HOST MAILBOX UIDVALIDITY MODSEQ [LO:HI]" },
+      { test_mbox_bench, "bench", "HOST MAILBOX" },
+      { test_mbox_expunge, "expunge", "HOST MAILBOX" },
+      { test_mbox_suite, "suite", "HOST MAILBOX" },
+      { test_mbox_notify, "notify", "HOST [MAILBOX...]" },
+      { test_mbox_flags, "flags", "HOST MAILBOX" },
+      { test_mbox_part, "part", "HOST MAILBOX UID SECTION [CHUNK]" },
+      { test_scan_bench, "scan", "FILE [ROUNDS]" }
     };
     unsigned i;
     int first_arg = process_options(argc, argv);
@@ -631,6 +1482,7 @@ main(int argc, char *argv[]) {
             "-a anonymous\n"
             "-c compress\n"
             "-m enable monitor\n"
+            "-P no command pipelining\n"
             "-s over ssl\n"
             "-T tls required\n"
             "-t tls disabled\n");
@@ -263,6 +263,13 @@ ImapMessage *imap_message_new(void);
 void imap_message_free(ImapMessage *);
 void imap_mbox_handle_msg_deserialize(ImapMboxHandle *h, unsigned msgno,
                                       void *data);
+void imap_mbox_handle_msg_defer(ImapMboxHandle *h, unsigned msgno,
+                                ImapUID uid, ImapMsgFlags flags,
+                                const void *data);
+const void *imap_mbox_handle_get_deferred(ImapMboxHandle *h, unsigned msgno,
+                                          ImapUID *uid,
+                                          ImapMsgFlags *flags);
+void imap_mbox_handle_drop_deferred(ImapMboxHandle *h);
 void*        imap_message_serialize(ImapMessage *);
 ImapMessage* imap_message_deserialize(void *data);
 size_t imap_serialized_message_size(void *data);
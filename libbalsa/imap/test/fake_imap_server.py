@@ -0,0 +1,1656 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# Fake IMAP server for testing libimap against server behaviour that
+# is hard to reproduce with a real server, and for counting what the
+# client costs against folders of any size.
+#
+# Usage: fake_imap_server.py [options] SCRIPT [PORT]
+#        fake_imap_server.py --mock [options] [PORT]
+#
+# The server listens at localhost:PORT (default 65143; 0 lets the
+# system pick a free port) and prints "port N" with the port it got
+# before it accepts the first connection.  It accepts any user and
+# password.  Options:
+# --latency MS       answer a command no earlier than MS milliseconds
+#                    after it arrived; this emulates the round trip time
+#                    of a slow link, while commands that a pipelining
+#                    client sends together are still answered together;
+# --connections N    serve N connections (default 1), then exit; 0
+#                    serves until interrupted in --mock mode.
+#
+# With a SCRIPT, the connections are served one after another and the
+# script is played once for every connection.  Script lines are:
+# - 'S: text' - send text to the client; '$' is replaced by the tag of
+#   the last command received, '%' by the tag of the oldest command
+#   not answered yet, for replies to pipelined commands;
+# - 'R: N text' - send text N times, with '#' replaced by 1, 2, ... N;
+#   for large responses, such as bursts of EXPUNGE;
+# - 'C: pattern' - read one command and check it against the
+#   fnmatch-style pattern; the tag is not part of the pattern;
+# - 'D: text' - read one line of literal data, which must be text;
+#   'D:' alone reads an empty line;
+# - '#' comments and empty lines are ignored.
+# The server exits with a non-zero status if the client deviates from
+# the script.
+#
+# With --mock, the server instead keeps folders of synthesized
+# messages and answers whatever the client asks, serving connections
+# in parallel, so that the same client code can be measured
+# reproducibly, see "imap_tst suite" and suite.sh.  More options:
+# --messages N       number of messages in INBOX (default 1000);
+# --folder NAME=N    another folder with N messages; may be repeated;
+# --attachment BYTES size of the attachment that every tenth message
+#                    carries (default 20000, 0 for none);
+# --extensions SPEC  comma separated: a preset, 'none', 'default' or
+#                    'all', then extensions to add, or to remove when
+#                    prefixed with '-', e.g. 'default,-SORT,BINARY';
+# --bandwidth KB     send no faster than KB kilobytes per second;
+# --max-commands N   fail if a connection sends more than N commands;
+# --max-round-trips N
+#                    fail if a connection needs more than N round trips;
+# --verbose          print the commands received.
+# Run with:
+#   ./fake_imap_server.py --mock --messages 5000 --latency 50 &
+#   ../imap_tst -t -u test -p secret suite localhost:65143 INBOX
+# When a connection ends, the mock prints a line like
+#   connection 1: 42 commands, 9 round trips, 2310 bytes in, 1048576 bytes out
+# where a round trip is counted every time the server has answered
+# everything it got and has to wait for the client.  It exits with a
+# non-zero status if it had to answer BAD to any command, that is, if
+# the client sent something it did not understand, or if a connection
+# exceeded --max-commands or --max-round-trips.
+#
+# Messages use CRLF line ends.  Changes made by one connection are not
+# announced to the other ones before they select the folder again.
+#
+# This script is free software; you can redistribute it and/or modify it under
+# the terms of the GNU Lesser General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.
+#
+# This script is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+# for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this script. If not, see <http://www.gnu.org/licenses/>.
+
+import argparse
+import base64
+import binascii
+import datetime
+import email.utils
+import fnmatch
+import queue
+import quopri
+import re
+import socket
+import sys
+import threading
+import time
+import zlib
+
+
+
+def load_script(path):
+    steps = []
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip('\r\n')
+            if not line or line.startswith('#'):
+                continue
+            if line == 'D:':
+                line = 'D: '
+            if line[:3] not in ('S: ', 'C: ', 'R: ', 'D: '):
+                raise ValueError('bad script line: ' + line)
+            steps.append((line[0], line[3:]))
+    return steps
+
+
+def read_commands(connection, commands):
+    """Timestamp the command lines as they arrive."""
+    reader = connection.makefile('rb')
+    for data in reader:
+        commands.put((time.monotonic(), data))
+    commands.put((time.monotonic(), b''))
+
+
+def play(connection, steps, latency):
+    commands = queue.Queue()
+    threading.Thread(target=read_commands, args=(connection, commands),
+                     daemon=True).start()
+    tag = '*'
+    pending = []
+    due = 0
+    for kind, text in steps:
+        if kind == 'S':
+            delay = due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            line = text.replace('$', tag)
+            if '$' in text and tag in pending:
+                pending.remove(tag)
+            if '%' in line:
+                line = line.replace('%', pending.pop(0))
+            print('S: ' + line)
+            connection.sendall((line + '\r\n').encode('utf-8'))
+        elif kind == 'R':
+            count, _, line = text.partition(' ')
+            line = line.replace('$', tag)
+            print('R: %s %s' % (count, line))
+            connection.sendall(''.join(
+                line.replace('#', str(i)) + '\r\n'
+                for i in range(1, int(count) + 1)).encode('utf-8'))
+        else:
+            arrival, data = commands.get()
+            if not data:
+                print('client disconnected, expected: ' + text)
+                return False
+            due = arrival + latency
+            data = data.decode('utf-8').rstrip('\r\n')
+            if kind == 'D':
+                print('D: ' + data)
+                if data != text:
+                    print('unexpected data, expected: ' + text)
+                    return False
+                continue
+            print('C: ' + data)
+            tag, _, command = data.partition(' ')
+            pending.append(tag)
+            if not fnmatch.fnmatchcase(command.upper(), text.upper()):
+                print('unexpected command, expected: ' + text)
+                return False
+    return True
+
+
+EXTENSIONS = ['ACL', 'AUTH=PLAIN', 'BINARY', 'CHILDREN', 'COMPRESS=DEFLATE',
+              'CONDSTORE', 'ENABLE', 'ESEARCH', 'ESORT', 'ID', 'IDLE',
+              'LITERAL+', 'LITERAL-', 'MOVE', 'MULTIAPPEND', 'NAMESPACE',
+              'QRESYNC', 'SASL-IR', 'SORT', 'UIDPLUS', 'UNSELECT']
+DEFAULT_EXTENSIONS = ['CHILDREN', 'CONDSTORE', 'ENABLE', 'ESEARCH', 'IDLE',
+                      'LITERAL+', 'MOVE', 'NAMESPACE', 'QRESYNC', 'SORT',
+                      'UIDPLUS', 'UNSELECT']
+SYSTEM_FLAGS = ['\\Answered', '\\Flagged', '\\Deleted', '\\Seen', '\\Draft']
+MONTHS = ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun',
+          'Jul', 'Aug', 'Sep', 'Oct', 'Nov', 'Dec']
+EPOCH = datetime.datetime(2024, 1, 1, tzinfo=datetime.timezone.utc)
+
+
+def parse_extensions(spec):
+    extensions = []
+    for item in spec.split(','):
+        item = item.strip().upper()
+        if not item:
+            continue
+        if item == 'NONE':
+            extensions = []
+        elif item == 'DEFAULT':
+            extensions = list(DEFAULT_EXTENSIONS)
+        elif item == 'ALL':
+            extensions = list(EXTENSIONS)
+        elif item.startswith('-'):
+            if item[1:] in extensions:
+                extensions.remove(item[1:])
+        elif item in EXTENSIONS:
+            if item not in extensions:
+                extensions.append(item)
+        else:
+            raise ValueError('unsupported extension: ' + item)
+    if 'QRESYNC' in extensions and 'CONDSTORE' not in extensions:
+        extensions.append('CONDSTORE')
+    return extensions
+
+
+# ------------------------------------------------------------------
+# Messages
+
+def synthesize(i, attachment):
+    """Returns message number i of a synthesized folder."""
+    sender = i % 37
+    sent = EPOCH + datetime.timedelta(seconds=(i * 2654435761) % 31536000)
+    header = ('From: User %d <user%d@example.com>\r\n'
+              'To: Test <test@example.com>\r\n'
+              'Subject: %sMessage %d about topic %d\r\n'
+              'Date: %s\r\n'
+              'Message-ID: <%d@mock.example.com>\r\n'
+              'MIME-Version: 1.0\r\n'
+              % (sender, sender, 'Re: ' if i % 5 == 0 else '', i, i % 11,
+                 email.utils.format_datetime(sent), i))
+    text = ''.join('Line %d of message %d, which is about topic %d.\r\n'
+                   % (j, i, i % 11) for j in range(3 + i % 20))
+    if attachment and i % 10 == 0:
+        boundary = 'mock-%d' % i
+        pattern = bytes(range(256))
+        data = (pattern[i % 256:] + pattern * (attachment // 256 + 2))
+        data = base64.encodebytes(data[:attachment]).replace(b'\n', b'\r\n')
+        return ((header +
+                 'Content-Type: multipart/mixed; boundary="%s"\r\n\r\n'
+                 '--%s\r\n'
+                 'Content-Type: text/plain; charset=us-ascii\r\n\r\n'
+                 '%s\r\n'
+                 '--%s\r\n'
+                 'Content-Type: application/octet-stream; name="file%d.bin"\r\n'
+                 'Content-Disposition: attachment; filename="file%d.bin"\r\n'
+                 'Content-Transfer-Encoding: base64\r\n\r\n'
+                 % (boundary, boundary, text, boundary, i, i)).encode('latin-1')
+                + data + ('--%s--\r\n' % boundary).encode('latin-1'))
+    return (header + 'Content-Type: text/plain; charset=us-ascii\r\n\r\n'
+            + text).encode('latin-1')
+
+
+class Part:
+    """A MIME part of a message, as offsets into its raw bytes."""
+
+    def __init__(self, raw, start, end, default_type=('TEXT', 'PLAIN')):
+        self.hdr_start = start
+        self.end = end
+        if raw.startswith(b'\r\n', start):
+            self.body_start = start + 2
+        else:
+            idx = raw.find(b'\r\n\r\n', start, end)
+            self.body_start = end if idx < 0 else idx + 4
+        self.headers = parse_header(raw[start:self.body_start])
+        self.type, self.subtype, self.params = default_type + ({},)
+        ctype = self.header('Content-Type')
+        if ctype:
+            self.type, self.subtype, self.params = parse_content_type(ctype)
+        if self.type == 'TEXT' and 'CHARSET' not in self.params:
+            self.params['CHARSET'] = 'us-ascii'
+        self.encoding = (self.header('Content-Transfer-Encoding')
+                         or '7BIT').upper()
+        self.lines = raw.count(b'\n', self.body_start, end)
+        self.children = []
+        self.message = None
+        if self.type == 'MULTIPART' and 'BOUNDARY' in self.params:
+            self.split(raw, self.params['BOUNDARY'].encode('latin-1'))
+        elif self.type == 'MESSAGE' and self.subtype == 'RFC822':
+            self.message = Part(raw, self.body_start, end)
+
+    def split(self, raw, boundary):
+        delimiter = b'\r\n--' + boundary
+        pos = self.body_start - 2
+        if raw[pos:pos + 2] != b'\r\n':
+            pos = raw.find(delimiter, self.body_start, self.end)
+        else:
+            pos = raw.find(delimiter, pos, self.end)
+        default = (('MESSAGE', 'RFC822') if self.subtype == 'DIGEST'
+                   else ('TEXT', 'PLAIN'))
+        while pos >= 0:
+            pos += len(delimiter)
+            if raw.startswith(b'--', pos):
+                break
+            start = raw.find(b'\r\n', pos, self.end)
+            if start < 0:
+                break
+            start += 2
+            nxt = raw.find(delimiter, start - 2, self.end)
+            end = self.end if nxt < 0 else nxt
+            self.children.append(Part(raw, start, end, default))
+            pos = nxt
+
+    def header(self, name):
+        for field, value in self.headers:
+            if field == name.upper():
+                return value
+        return None
+
+
+def parse_header(data):
+    fields = []
+    for line in data.decode('latin-1').split('\r\n'):
+        if line[:1] in (' ', '\t') and fields:
+            fields[-1][1] += ' ' + line.strip()
+        elif ':' in line:
+            name, _, value = line.partition(':')
+            fields.append([name.strip().upper(), value.strip()])
+    return fields
+
+
+def parse_content_type(value):
+    main, _, rest = value.partition(';')
+    ctype, _, subtype = main.strip().partition('/')
+    params = {}
+    for m in re.finditer(r'([^\s=;]+)\s*=\s*("(?:[^"\\]|\\.)*"|[^\s;]*)',
+                         rest):
+        v = m.group(2)
+        if v.startswith('"'):
+            v = re.sub(r'\\(.)', r'\1', v[1:-1])
+        params[m.group(1).upper()] = v
+    return ctype.upper() or 'TEXT', subtype.upper() or 'PLAIN', params
+
+
+class Message:
+    def __init__(self, uid, modseq, number=None, attachment=0, raw=None,
+                 flags=(), internal=None):
+        self.uid = uid
+        self.modseq = modseq
+        self.number = number
+        self.attachment = attachment
+        self.data = raw
+        self.flags = set(flags)
+        self.internal = internal
+        self.part = None
+        self.size = None
+
+    def raw(self):
+        if self.data is not None:
+            return self.data
+        return synthesize(self.number, self.attachment)
+
+    def structure(self):
+        """Parses the message once; the offsets stay valid because the
+        message is synthesized the same way every time."""
+        if self.part is None:
+            raw = self.raw()
+            self.size = len(raw)
+            self.part = Part(raw, 0, len(raw))
+        return self.part
+
+    def rfc822_size(self):
+        self.structure()
+        return self.size
+
+    def date(self):
+        value = self.structure().header('Date')
+        try:
+            return email.utils.parsedate_to_datetime(value)
+        except (TypeError, ValueError):
+            return self.internal
+
+
+class Folder:
+    def __init__(self, name, count, attachment):
+        self.name = name
+        self.uidvalidity = 1000 + len(name)
+        self.highestmodseq = 1
+        self.vanished = []      # (uid, modseq) of expunged messages
+        self.messages = []
+        for i in range(1, count + 1):
+            flags = []
+            if i % 4:
+                flags.append('\\Seen')
+            if i % 7 == 0:
+                flags.append('\\Answered')
+            if i % 17 == 0:
+                flags.append('\\Flagged')
+            internal = EPOCH + datetime.timedelta(minutes=37 * i)
+            self.messages.append(Message(i, 1, i, attachment,
+                                         flags=flags, internal=internal))
+        self.uidnext = count + 1
+
+    def add(self, raw, flags, internal):
+        self.highestmodseq += 1
+        msg = Message(self.uidnext, self.highestmodseq, raw=raw,
+                      flags=flags, internal=internal)
+        self.uidnext += 1
+        self.messages.append(msg)
+        return msg
+
+    def touch(self, msg):
+        self.highestmodseq += 1
+        msg.modseq = self.highestmodseq
+
+
+# ------------------------------------------------------------------
+# Formatting
+
+def quote(s):
+    if s is None:
+        return 'NIL'
+    if re.search(r'[\r\n\x80-\xff]', s):
+        return '{%d}\r\n%s' % (len(s.encode('latin-1')), s)
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+
+def param_list(params):
+    if not params:
+        return 'NIL'
+    return '(%s)' % ' '.join('%s %s' % (quote(k), quote(v))
+                             for k, v in params.items())
+
+
+def address_list(value):
+    if not value:
+        return 'NIL'
+    addresses = []
+    for name, addr in email.utils.getaddresses([value]):
+        mailbox, _, host = addr.partition('@')
+        addresses.append('(%s NIL %s %s)' % (quote(name or None),
+                                             quote(mailbox), quote(host)))
+    return '(%s)' % ''.join(addresses) if addresses else 'NIL'
+
+
+def envelope(part):
+    h = part.header
+    sender = h('Sender') or h('From')
+    reply_to = h('Reply-To') or h('From')
+    return '(%s %s %s %s %s %s %s %s %s %s)' % (
+        quote(h('Date')), quote(h('Subject')), address_list(h('From')),
+        address_list(sender), address_list(reply_to),
+        address_list(h('To')), address_list(h('Cc')), address_list(h('Bcc')),
+        quote(h('In-Reply-To')), quote(h('Message-ID')))
+
+
+def disposition(part):
+    value = part.header('Content-Disposition')
+    if not value:
+        return 'NIL'
+    kind, _, params = parse_content_type(value + '/x' if ';' not in value
+                                         else value.replace(';', '/x;', 1))
+    return '(%s %s)' % (quote(kind), param_list(params))
+
+
+def body_structure(part, extended):
+    if part.type == 'MULTIPART':
+        children = ''.join(body_structure(c, extended)
+                           for c in part.children) or '("TEXT" "PLAIN" NIL NIL NIL "7BIT" 0 0)'
+        ext = ''
+        if extended:
+            ext = ' %s %s NIL NIL' % (param_list(part.params),
+                                      disposition(part))
+        return '(%s %s%s)' % (children, quote(part.subtype), ext)
+    fields = [quote(part.type), quote(part.subtype), param_list(part.params),
+              quote(part.header('Content-ID')),
+              quote(part.header('Content-Description')),
+              quote(part.encoding), str(part.end - part.body_start)]
+    if part.message is not None:
+        fields += [envelope(part.message),
+                   body_structure(part.message, extended), str(part.lines)]
+    elif part.type == 'TEXT':
+        fields.append(str(part.lines))
+    if extended:
+        fields += ['NIL', disposition(part), 'NIL', 'NIL']
+    return '(%s)' % ' '.join(fields)
+
+
+def internal_date(msg):
+    d = msg.internal
+    return '"%02d-%s-%04d %02d:%02d:%02d +0000"' % (
+        d.day, MONTHS[d.month - 1], d.year, d.hour, d.minute, d.second)
+
+
+def sequence_string(numbers, keep_order=False):
+    if not keep_order:
+        numbers = sorted(numbers)
+    ranges = []
+    for n in numbers:
+        if ranges and ranges[-1][1] + 1 == n:
+            ranges[-1][1] = n
+        else:
+            ranges.append([n, n])
+    return ','.join(str(lo) if lo == hi else '%d:%d' % (lo, hi)
+                    for lo, hi in ranges)
+
+
+# ------------------------------------------------------------------
+# Parsing
+
+class ProtocolError(Exception):
+    pass
+
+
+class String(str):
+    """A quoted string or literal, as opposed to an atom."""
+
+
+def tokenize(s):
+    """Splits the arguments of a command into atoms, strings and
+    parenthesized lists. Brackets belong to the atom they are in, so
+    that BODY.PEEK[HEADER.FIELDS (A B)]<0.10> is one atom."""
+    stack = [[]]
+    i = 0
+    n = len(s)
+    while i < n:
+        c = s[i]
+        if c == ' ':
+            i += 1
+        elif c == '(':
+            stack.append([])
+            i += 1
+        elif c == ')':
+            if len(stack) == 1:
+                raise ProtocolError('unbalanced parenthesis')
+            done = stack.pop()
+            stack[-1].append(done)
+            i += 1
+        elif c == '"':
+            j = i + 1
+            value = []
+            while j < n and s[j] != '"':
+                if s[j] == '\\':
+                    j += 1
+                value.append(s[j])
+                j += 1
+            if j >= n:
+                raise ProtocolError('unterminated string')
+            stack[-1].append(String(''.join(value)))
+            i = j + 1
+        elif c in '{~' and re.match(r'~?\{\d+\+?\}\r\n', s[i:]):
+            m = re.match(r'~?\{(\d+)\+?\}\r\n', s[i:])
+            start = i + m.end()
+            stack[-1].append(String(s[start:start + int(m.group(1))]))
+            i = start + int(m.group(1))
+        else:
+            j = i
+            while j < n and s[j] not in ' ()':
+                if s[j] == '[':
+                    k = s.find(']', j)
+                    if k < 0:
+                        raise ProtocolError('unterminated section')
+                    j = k
+                j += 1
+            stack[-1].append(s[i:j])
+            i = j
+    if len(stack) != 1:
+        raise ProtocolError('unbalanced parenthesis')
+    return stack[0]
+
+
+def atom(tokens, what):
+    if not tokens or isinstance(tokens[0], list):
+        raise ProtocolError('missing ' + what)
+    return tokens.pop(0)
+
+
+def astring(tokens, what):
+    value = atom(tokens, what)
+    return str(value)
+
+
+def parse_date(s):
+    m = re.match(r'^(\d{1,2})-(\w{3})-(\d{4})$', s)
+    if not m or m.group(2).capitalize() not in MONTHS:
+        raise ProtocolError('bad date: ' + s)
+    return datetime.date(int(m.group(3)),
+                         MONTHS.index(m.group(2).capitalize()) + 1,
+                         int(m.group(1)))
+
+
+def parse_set(s, maximum):
+    """Yields (lo, hi) ranges of a sequence set."""
+    for item in s.split(','):
+        lo, _, hi = item.partition(':')
+        lo = maximum if lo == '*' else int(lo)
+        hi = lo if not hi else (maximum if hi == '*' else int(hi))
+        yield min(lo, hi), max(lo, hi)
+
+
+SEQUENCE_RE = re.compile(r'^(\d+|\*)(:(\d+|\*))?(,(\d+|\*)(:(\d+|\*))?)*$')
+
+
+# ------------------------------------------------------------------
+# The server
+
+class Server:
+    def __init__(self, args):
+        self.args = args
+        self.extensions = parse_extensions(args.extensions)
+        self.lock = threading.Lock()
+        self.folders = {'INBOX': Folder('INBOX', args.messages,
+                                        args.attachment)}
+        for spec in args.folder:
+            name, _, count = spec.partition('=')
+            self.folders[name] = Folder(name, int(count or 0),
+                                        args.attachment)
+        self.errors = 0
+
+    def capability(self, authenticated):
+        caps = ['IMAP4rev1'] + self.extensions
+        if authenticated:
+            caps = [c for c in caps if not c.startswith('AUTH=')
+                    and c != 'SASL-IR']
+        return ' '.join(caps)
+
+
+class Connection:
+    def __init__(self, server, sock, number):
+        self.server = server
+        self.sock = sock
+        self.number = number
+        self.args = server.args
+        self.buf = b''
+        self.arrival = 0
+        self.out = []
+        self.inflate = None
+        self.deflate = None
+        self.sent_since_read = False
+        self.commands = 0
+        self.round_trips = 0
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.authenticated = False
+        self.folder = None
+        self.readonly = False
+        self.condstore = False
+        self.qresync = False
+
+    def has(self, extension):
+        return extension in self.server.extensions
+
+    # -- I/O --------------------------------------------------------
+
+    def fill(self):
+        if not self.buf and self.sent_since_read:
+            self.round_trips += 1
+            self.sent_since_read = False
+        data = self.sock.recv(65536)
+        if not data:
+            raise EOFError
+        self.bytes_in += len(data)
+        self.arrival = time.monotonic()
+        if self.inflate:
+            data = self.inflate.decompress(data)
+        self.buf += data
+
+    def readline(self):
+        while b'\n' not in self.buf:
+            self.fill()
+        line, _, self.buf = self.buf.partition(b'\n')
+        return line + b'\n'
+
+    def read(self, n):
+        while len(self.buf) < n:
+            self.fill()
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def send(self, text):
+        if isinstance(text, str):
+            text = text.encode('latin-1')
+        self.out.append(text)
+
+    def flush(self, due=0):
+        data = b''.join(self.out)
+        self.out = []
+        if not data:
+            return
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        if self.deflate:
+            data = (self.deflate.compress(data) +
+                    self.deflate.flush(zlib.Z_SYNC_FLUSH))
+        if self.args.bandwidth:
+            rate = self.args.bandwidth * 1024.0
+            for i in range(0, len(data), 4096):
+                chunk = data[i:i + 4096]
+                self.sock.sendall(chunk)
+                time.sleep(len(chunk) / rate)
+        else:
+            self.sock.sendall(data)
+        self.bytes_out += len(data)
+        self.sent_since_read = True
+
+    def read_command(self):
+        line = self.readline()
+        arrival = self.arrival
+        command = line
+        while True:
+            m = re.search(rb'\{(\d+)(\+?)\}\r?\n$', command)
+            if not m:
+                break
+            if not m.group(2):
+                self.send('+ Ready for literal data\r\n')
+                self.flush()
+            command += self.read(int(m.group(1)))
+            command += self.readline()
+        command = command[:-2] if command.endswith(b'\r\n') else command[:-1]
+        return command.decode('latin-1'), arrival
+
+    # -- main loop --------------------------------------------------
+
+    def serve(self):
+        self.send('* OK [CAPABILITY %s] mock server ready\r\n'
+                  % self.server.capability(False))
+        self.flush()
+        try:
+            while True:
+                command, arrival = self.read_command()
+                due = arrival + self.args.latency / 1000.0
+                self.commands += 1
+                if self.args.verbose:
+                    print('C%d: %s' % (self.number, command[:200]))
+                tag, _, rest = command.partition(' ')
+                if not self.dispatch(tag, rest, due):
+                    self.flush(due)
+                    break
+                self.flush(due)
+        except (EOFError, ConnectionError):
+            pass
+        finally:
+            self.sock.close()
+            print('connection %d: %d commands, %d round trips, '
+                  '%d bytes in, %d bytes out'
+                  % (self.number, self.commands, self.round_trips,
+                     self.bytes_in, self.bytes_out))
+            self.check_limit('commands', self.commands,
+                             self.args.max_commands)
+            self.check_limit('round trips', self.round_trips,
+                             self.args.max_round_trips)
+            sys.stdout.flush()
+
+    def check_limit(self, what, count, limit):
+        if limit and count > limit:
+            print('connection %d: %d %s, expected at most %d'
+                  % (self.number, count, what, limit))
+            with self.server.lock:
+                self.server.errors += 1
+
+    def dispatch(self, tag, rest, due):
+        name, _, rest = rest.partition(' ')
+        name = name.upper()
+        uid = False
+        if name == 'UID':
+            uid = True
+            name, _, rest = rest.partition(' ')
+            name = name.upper()
+        handler = getattr(self, 'cmd_' + name.replace('-', '_'), None)
+        try:
+            if handler is None:
+                raise ProtocolError('unknown command ' + name)
+            if name not in ('CAPABILITY', 'NOOP', 'LOGOUT', 'LOGIN',
+                            'AUTHENTICATE', 'ID') and not self.authenticated:
+                raise ProtocolError('not authenticated')
+            with self.server.lock:
+                result = handler(tag, tokenize(rest), uid, due)
+        except ProtocolError as e:
+            with self.server.lock:
+                self.server.errors += 1
+            self.send('%s BAD %s\r\n' % (tag, e))
+            return True
+        if result is None:
+            result = 'OK done'
+        if result:
+            self.send('%s %s\r\n' % (tag, result))
+        return name != 'LOGOUT'
+
+    def selected(self):
+        if self.folder is None:
+            raise ProtocolError('no mailbox selected')
+        return self.folder
+
+    def folder_named(self, name):
+        if name.upper() == 'INBOX':
+            name = 'INBOX'
+        return self.server.folders.get(name)
+
+    def messages(self, set_string, uid):
+        """Returns (seqno, message) pairs for a sequence or UID set."""
+        msgs = self.selected().messages
+        if set_string == '$':
+            raise ProtocolError('SEARCHRES is not supported')
+        if not SEQUENCE_RE.match(set_string):
+            raise ProtocolError('bad sequence set: ' + set_string)
+        result = []
+        if uid:
+            if not msgs:
+                return result
+            maximum = msgs[-1].uid
+            wanted = list(parse_set(set_string, maximum))
+            for seqno, msg in enumerate(msgs, 1):
+                if any(lo <= msg.uid <= hi for lo, hi in wanted):
+                    result.append((seqno, msg))
+            if not result and any(hi >= maximum for lo, hi in wanted):
+                result.append((len(msgs), msgs[-1]))
+        else:
+            seen = set()
+            for lo, hi in parse_set(set_string, len(msgs)):
+                if lo < 1 or hi > len(msgs):
+                    raise ProtocolError('invalid message number')
+                seen.update(range(lo, hi + 1))
+            result = [(n, msgs[n - 1]) for n in sorted(seen)]
+        return result
+
+    # -- any state --------------------------------------------------
+
+    def cmd_CAPABILITY(self, tag, args, uid, due):
+        self.send('* CAPABILITY %s\r\n'
+                  % self.server.capability(self.authenticated))
+
+    def cmd_NOOP(self, tag, args, uid, due):
+        pass
+
+    def cmd_CHECK(self, tag, args, uid, due):
+        self.selected()
+
+    def cmd_LOGOUT(self, tag, args, uid, due):
+        self.send('* BYE logging out\r\n')
+
+    def cmd_ID(self, tag, args, uid, due):
+        if not self.has('ID'):
+            raise ProtocolError('ID is not enabled')
+        self.send('* ID ("name" "mock_imap_server")\r\n')
+
+    # -- not authenticated state --------------------------------------
+
+    def login_done(self):
+        self.authenticated = True
+        return 'OK [CAPABILITY %s] logged in' % self.server.capability(True)
+
+    def cmd_LOGIN(self, tag, args, uid, due):
+        astring(args, 'user')
+        astring(args, 'password')
+        return self.login_done()
+
+    def cmd_AUTHENTICATE(self, tag, args, uid, due):
+        mechanism = atom(args, 'mechanism').upper()
+        if mechanism != 'PLAIN' or not self.has('AUTH=PLAIN'):
+            return 'NO unsupported mechanism'
+        if args:
+            response = args[0]
+        else:
+            self.send('+ \r\n')
+            self.flush(due)
+            response = self.readline().decode('latin-1').strip()
+        if response == '*':
+            return 'BAD cancelled'
+        try:
+            base64.b64decode(response if response != '=' else '')
+        except binascii.Error:
+            raise ProtocolError('bad base64')
+        return self.login_done()
+
+    def cmd_COMPRESS(self, tag, args, uid, due):
+        if (atom(args, 'algorithm').upper() != 'DEFLATE'
+                or not self.has('COMPRESS=DEFLATE')):
+            return 'NO unsupported'
+        if self.deflate:
+            return 'NO [COMPRESSIONACTIVE] already'
+        self.send('%s OK DEFLATE active\r\n' % tag)
+        self.flush(due)
+        self.deflate = zlib.compressobj(wbits=-15)
+        self.inflate = zlib.decompressobj(wbits=-15)
+        self.buf = self.inflate.decompress(self.buf)
+        return ''
+
+    # -- authenticated state ------------------------------------------
+
+    def cmd_ENABLE(self, tag, args, uid, due):
+        if not self.has('ENABLE'):
+            raise ProtocolError('ENABLE is not supported')
+        enabled = []
+        for ext in args:
+            ext = str(ext).upper()
+            if ext == 'CONDSTORE' and self.has('CONDSTORE'):
+                self.condstore = True
+                enabled.append(ext)
+            elif ext == 'QRESYNC' and self.has('QRESYNC'):
+                self.condstore = self.qresync = True
+                enabled.append(ext)
+        self.send('* ENABLED %s\r\n' % ' '.join(enabled))
+
+    def cmd_NAMESPACE(self, tag, args, uid, due):
+        self.send('* NAMESPACE (("" "/")) NIL NIL\r\n')
+
+    def select(self, tag, args, readonly):
+        name = astring(args, 'mailbox')
+        folder = self.folder_named(name)
+        self.folder = None
+        if folder is None:
+            return 'NO no such mailbox'
+        qresync = None
+        if args and isinstance(args[0], list):
+            params = args.pop(0)
+            while params:
+                p = str(params.pop(0)).upper()
+                if p == 'CONDSTORE':
+                    self.condstore = True
+                elif p == 'QRESYNC' and self.qresync and params:
+                    qresync = params.pop(0)
+        self.folder = folder
+        self.readonly = readonly
+        msgs = folder.messages
+        self.send('* %d EXISTS\r\n* 0 RECENT\r\n'
+                  '* FLAGS (%s)\r\n'
+                  '* OK [PERMANENTFLAGS (%s \\*)] flags\r\n'
+                  '* OK [UIDVALIDITY %d] uids valid\r\n'
+                  '* OK [UIDNEXT %d] next uid\r\n'
+                  % (len(msgs), ' '.join(SYSTEM_FLAGS),
+                     ' '.join(SYSTEM_FLAGS), folder.uidvalidity,
+                     folder.uidnext))
+        if self.has('CONDSTORE'):
+            self.send('* OK [HIGHESTMODSEQ %d] modseq\r\n'
+                      % folder.highestmodseq)
+        if qresync and int(qresync[0]) == folder.uidvalidity:
+            since = int(qresync[1])
+            gone = [u for u, m in folder.vanished if m > since]
+            if gone:
+                self.send('* VANISHED (EARLIER) %s\r\n'
+                          % sequence_string(gone))
+            for seqno, msg in enumerate(msgs, 1):
+                if msg.modseq > since:
+                    self.send('* %d FETCH (UID %d FLAGS (%s) MODSEQ (%d))\r\n'
+                              % (seqno, msg.uid, ' '.join(sorted(msg.flags)),
+                                 msg.modseq))
+        return 'OK [%s] selected' % ('READ-ONLY' if readonly else 'READ-WRITE')
+
+    def cmd_SELECT(self, tag, args, uid, due):
+        return self.select(tag, args, False)
+
+    def cmd_EXAMINE(self, tag, args, uid, due):
+        return self.select(tag, args, True)
+
+    def cmd_CREATE(self, tag, args, uid, due):
+        name = astring(args, 'mailbox')
+        if self.folder_named(name) is not None:
+            return 'NO [ALREADYEXISTS] mailbox exists'
+        self.server.folders[name] = Folder(name, 0, 0)
+
+    def cmd_DELETE(self, tag, args, uid, due):
+        name = astring(args, 'mailbox')
+        folder = self.folder_named(name)
+        if folder is None or folder.name == 'INBOX':
+            return 'NO cannot delete'
+        del self.server.folders[folder.name]
+
+    def cmd_RENAME(self, tag, args, uid, due):
+        old = self.folder_named(astring(args, 'mailbox'))
+        new = astring(args, 'new name')
+        if old is None or old.name == 'INBOX' or self.folder_named(new):
+            return 'NO cannot rename'
+        del self.server.folders[old.name]
+        old.name = new
+        self.server.folders[new] = old
+
+    def cmd_SUBSCRIBE(self, tag, args, uid, due):
+        astring(args, 'mailbox')
+
+    cmd_UNSUBSCRIBE = cmd_SUBSCRIBE
+
+    def cmd_LIST(self, tag, args, uid, due):
+        if args and isinstance(args[0], list):
+            args.pop(0)         # LIST-EXTENDED selection options
+        reference = astring(args, 'reference')
+        pattern = reference + astring(args, 'pattern')
+        regex = re.compile('^%s$' % re.escape(pattern)
+                           .replace(r'\*', '.*').replace('%', '[^/]*'))
+        for name in sorted(self.server.folders):
+            if regex.match(name):
+                children = any(n.startswith(name + '/')
+                               for n in self.server.folders)
+                attrs = ''
+                if self.has('CHILDREN'):
+                    attrs = ('\\HasChildren' if children
+                             else '\\HasNoChildren')
+                self.send('* %s (%s) "/" %s\r\n'
+                          % ('LSUB' if self.listing_lsub else 'LIST',
+                             attrs, quote(name)))
+
+    listing_lsub = False
+
+    def cmd_LSUB(self, tag, args, uid, due):
+        self.listing_lsub = True
+        try:
+            return self.cmd_LIST(tag, args, uid, due)
+        finally:
+            self.listing_lsub = False
+
+    def cmd_STATUS(self, tag, args, uid, due):
+        folder = self.folder_named(astring(args, 'mailbox'))
+        if folder is None or not args or not isinstance(args[0], list):
+            return 'NO no such mailbox'
+        items = []
+        for item in args[0]:
+            item = str(item).upper()
+            if item == 'MESSAGES':
+                value = len(folder.messages)
+            elif item == 'RECENT':
+                value = 0
+            elif item == 'UIDNEXT':
+                value = folder.uidnext
+            elif item == 'UIDVALIDITY':
+                value = folder.uidvalidity
+            elif item == 'UNSEEN':
+                value = sum(1 for m in folder.messages
+                            if '\\Seen' not in m.flags)
+            elif item == 'HIGHESTMODSEQ' and self.has('CONDSTORE'):
+                value = folder.highestmodseq
+            else:
+                raise ProtocolError('unknown status item ' + item)
+            items.append('%s %d' % (item, value))
+        self.send('* STATUS %s (%s)\r\n' % (quote(folder.name),
+                                            ' '.join(items)))
+
+    def cmd_APPEND(self, tag, args, uid, due):
+        folder = self.folder_named(astring(args, 'mailbox'))
+        if folder is None:
+            return 'NO [TRYCREATE] no such mailbox'
+        uids = []
+        while args:
+            flags = []
+            internal = datetime.datetime.now(datetime.timezone.utc)
+            if isinstance(args[0], list):
+                flags = [str(f) for f in args.pop(0)]
+            if args and isinstance(args[0], String) and len(args) > 1:
+                args.pop(0)     # date-time
+            data = args.pop(0)
+            if not isinstance(data, String):
+                raise ProtocolError('message literal expected')
+            uids.append(folder.add(data.encode('latin-1'), flags,
+                                   internal).uid)
+            if uids and not self.has('MULTIAPPEND'):
+                break
+        if self.has('UIDPLUS'):
+            return 'OK [APPENDUID %d %s] appended' % (folder.uidvalidity,
+                                                      sequence_string(uids))
+
+    def cmd_MYRIGHTS(self, tag, args, uid, due):
+        if not self.has('ACL'):
+            raise ProtocolError('ACL is not supported')
+        name = astring(args, 'mailbox')
+        self.send('* MYRIGHTS %s lrswipkxtecda\r\n' % quote(name))
+
+    def cmd_GETACL(self, tag, args, uid, due):
+        if not self.has('ACL'):
+            raise ProtocolError('ACL is not supported')
+        name = astring(args, 'mailbox')
+        self.send('* ACL %s test lrswipkxtecda\r\n' % quote(name))
+
+    def cmd_IDLE(self, tag, args, uid, due):
+        if not self.has('IDLE'):
+            raise ProtocolError('IDLE is not supported')
+        self.send('+ idling\r\n')
+        self.server.lock.release()
+        try:
+            self.flush(due)
+            line = self.readline().decode('latin-1').strip()
+        finally:
+            self.server.lock.acquire()
+        if line.upper() != 'DONE':
+            raise ProtocolError('DONE expected')
+        return 'OK idle done'
+
+    # -- selected state -----------------------------------------------
+
+    def expunge(self, only=None, silent=False):
+        folder = self.selected()
+        kept = []
+        gone = []
+        offset = 0
+        for seqno, msg in enumerate(folder.messages, 1):
+            if '\\Deleted' in msg.flags and (only is None or msg in only):
+                folder.highestmodseq += 1
+                folder.vanished.append((msg.uid, folder.highestmodseq))
+                gone.append(msg.uid)
+                if not silent and not self.qresync:
+                    self.send('* %d EXPUNGE\r\n' % (seqno - offset))
+                offset += 1
+            else:
+                kept.append(msg)
+        folder.messages = kept
+        if gone and not silent and self.qresync:
+            self.send('* VANISHED %s\r\n' % sequence_string(gone))
+
+    def cmd_EXPUNGE(self, tag, args, uid, due):
+        if self.readonly:
+            return 'NO read-only mailbox'
+        only = None
+        if uid:
+            if not self.has('UIDPLUS'):
+                raise ProtocolError('UIDPLUS is not supported')
+            only = [m for _, m in self.messages(atom(args, 'set'), True)]
+        self.expunge(only)
+
+    def cmd_CLOSE(self, tag, args, uid, due):
+        self.selected()
+        if not self.readonly:
+            self.expunge(silent=True)
+        self.folder = None
+
+    def cmd_UNSELECT(self, tag, args, uid, due):
+        if not self.has('UNSELECT'):
+            raise ProtocolError('UNSELECT is not supported')
+        self.selected()
+        self.folder = None
+
+    def cmd_CANCELUPDATE(self, tag, args, uid, due):
+        pass
+
+    def cmd_STORE(self, tag, args, uid, due):
+        folder = self.selected()
+        msgs = self.messages(atom(args, 'set'), uid)
+        if args and isinstance(args[0], list):
+            args.pop(0)         # UNCHANGEDSINCE, not checked
+            self.condstore = True
+        what = atom(args, 'item').upper()
+        flags = []
+        for f in args:
+            flags.extend(f if isinstance(f, list) else [f])
+        flags = [str(f) for f in flags]
+        silent = what.endswith('.SILENT')
+        what = what.replace('.SILENT', '')
+        if what not in ('FLAGS', '+FLAGS', '-FLAGS'):
+            raise ProtocolError('bad store item ' + what)
+        if self.readonly:
+            return 'NO read-only mailbox'
+        for seqno, msg in msgs:
+            old = set(msg.flags)
+            if what == 'FLAGS':
+                msg.flags = set(flags)
+            elif what == '+FLAGS':
+                msg.flags.update(flags)
+            else:
+                msg.flags.difference_update(flags)
+            if msg.flags != old:
+                folder.touch(msg)
+            if not silent or self.condstore:
+                items = ['FLAGS (%s)' % ' '.join(sorted(msg.flags))]
+                if uid:
+                    items.insert(0, 'UID %d' % msg.uid)
+                if self.condstore:
+                    items.append('MODSEQ (%d)' % msg.modseq)
+                self.send('* %d FETCH (%s)\r\n' % (seqno, ' '.join(items)))
+
+    def copy(self, args, uid, move):
+        folder = self.selected()
+        msgs = self.messages(atom(args, 'set'), uid)
+        target = self.folder_named(astring(args, 'mailbox'))
+        if target is None:
+            return 'NO [TRYCREATE] no such mailbox'
+        src, dst = [], []
+        for _, msg in msgs:
+            copy = target.add(msg.raw(), msg.flags, msg.internal)
+            src.append(msg.uid)
+            dst.append(copy.uid)
+        code = ''
+        if self.has('UIDPLUS') and src:
+            code = '[COPYUID %d %s %s] ' % (target.uidvalidity,
+                                            sequence_string(src),
+                                            sequence_string(dst))
+        if move:
+            if code:
+                self.send('* OK %sstored\r\n' % code)
+                code = ''
+            moved = [m for _, m in msgs]
+            for msg in moved:
+                msg.flags.add('\\Deleted')
+            self.expunge(moved)
+        return 'OK %sdone' % code
+
+    def cmd_COPY(self, tag, args, uid, due):
+        return self.copy(args, uid, False)
+
+    def cmd_MOVE(self, tag, args, uid, due):
+        if not self.has('MOVE'):
+            raise ProtocolError('MOVE is not supported')
+        return self.copy(args, uid, True)
+
+    # FETCH
+
+    def section_data(self, msg, raw, section):
+        section = section.upper()
+        m = re.match(r'^((?:\d+\.)*\d+)?\.?(.*)$', section)
+        numbers = [int(n) for n in m.group(1).split('.')] if m.group(1) else []
+        rest = m.group(2)
+        node = top = msg.structure()
+        for n in numbers:
+            if node.message is not None:
+                node = node.message
+            if node.children:
+                if n > len(node.children):
+                    return b''
+                node = node.children[n - 1]
+            elif n != 1:
+                return b''
+        target = top if not numbers else node.message
+        if rest == '':
+            if not numbers:
+                return raw
+            return raw[node.body_start:node.end]
+        if rest == 'MIME':
+            if not numbers:
+                raise ProtocolError('MIME needs a part number')
+            return raw[node.hdr_start:node.body_start]
+        if target is None:
+            return b''
+        if rest == 'TEXT':
+            return raw[target.body_start:target.end]
+        header = raw[target.hdr_start:target.body_start]
+        if rest == 'HEADER':
+            return header
+        m = re.match(r'^HEADER\.FIELDS(\.NOT)?\s*\((.*)\)$', rest)
+        if not m:
+            raise ProtocolError('bad section ' + section)
+        names = set(m.group(2).split())
+        lines = []
+        keep = False
+        for line in header.split(b'\r\n'):
+            if not line:
+                continue
+            if line[:1] not in (b' ', b'\t'):
+                name = line.split(b':', 1)[0].decode('latin-1').upper()
+                keep = (name in names) != bool(m.group(1))
+            if keep:
+                lines.append(line + b'\r\n')
+        return b''.join(lines) + b'\r\n'
+
+    def decoded(self, msg, raw, section):
+        part = msg.structure()
+        data = self.section_data(msg, raw, section)
+        if section:
+            node = part
+            for n in [int(x) for x in section.split('.') if x.isdigit()]:
+                if node.message is not None:
+                    node = node.message
+                node = node.children[n - 1] if node.children else node
+            part = node
+        if part.encoding == 'BASE64':
+            return base64.b64decode(data)
+        if part.encoding == 'QUOTED-PRINTABLE':
+            return quopri.decodestring(data)
+        return data
+
+    def fetch_item(self, item, seqno, msg, state):
+        name = item.upper()
+        if name == 'UID':
+            return 'UID %d' % msg.uid
+        if name == 'FLAGS':
+            return 'FLAGS (%s)' % ' '.join(sorted(msg.flags))
+        if name == 'INTERNALDATE':
+            return 'INTERNALDATE %s' % internal_date(msg)
+        if name == 'RFC822.SIZE':
+            return 'RFC822.SIZE %d' % msg.rfc822_size()
+        if name == 'ENVELOPE':
+            return 'ENVELOPE %s' % envelope(msg.structure())
+        if name == 'BODYSTRUCTURE':
+            return 'BODYSTRUCTURE %s' % body_structure(msg.structure(), True)
+        if name == 'BODY':
+            return 'BODY %s' % body_structure(msg.structure(), False)
+        if name == 'MODSEQ':
+            if not self.has('CONDSTORE'):
+                raise ProtocolError('CONDSTORE is not supported')
+            self.condstore = True
+            return 'MODSEQ (%d)' % msg.modseq
+        aliases = {'RFC822': ('RFC822', '', False),
+                   'RFC822.HEADER': ('RFC822.HEADER', 'HEADER', True),
+                   'RFC822.TEXT': ('RFC822.TEXT', 'TEXT', False)}
+        if name in aliases:
+            key, section, peek = aliases[name]
+            if not peek:
+                state['seen'] = True
+            return key, self.section_data(msg, state['raw'](), section)
+        m = re.match(r'^(BODY|BINARY|BINARY\.SIZE)(\.PEEK)?\[([^\]]*)\]'
+                     r'(?:<(\d+)(?:\.(\d+))?>)?$', item, re.I)
+        if not m:
+            raise ProtocolError('unknown fetch item ' + item)
+        kind = m.group(1).upper()
+        section = m.group(3)
+        if kind != 'BODY':
+            if not self.has('BINARY'):
+                raise ProtocolError('BINARY is not supported')
+            data = self.decoded(msg, state['raw'](), section)
+            if kind == 'BINARY.SIZE':
+                return 'BINARY.SIZE[%s] %d' % (section, len(data))
+        else:
+            data = self.section_data(msg, state['raw'](), section)
+        if not m.group(2):
+            state['seen'] = True
+        key = '%s[%s]' % (kind, section)
+        if m.group(4) is not None:
+            origin = int(m.group(4))
+            data = data[origin:]
+            if m.group(5) is not None:
+                data = data[:int(m.group(5))]
+            key += '<%d>' % origin
+        return key, data
+
+    def cmd_FETCH(self, tag, args, uid, due):
+        folder = self.selected()
+        msgs = self.messages(atom(args, 'set'), uid)
+        if not args:
+            raise ProtocolError('missing fetch items')
+        items = args.pop(0)
+        if not isinstance(items, list):
+            macros = {'ALL': ['FLAGS', 'INTERNALDATE', 'RFC822.SIZE',
+                              'ENVELOPE'],
+                      'FAST': ['FLAGS', 'INTERNALDATE', 'RFC822.SIZE'],
+                      'FULL': ['FLAGS', 'INTERNALDATE', 'RFC822.SIZE',
+                               'ENVELOPE', 'BODY']}
+            items = macros.get(items.upper(), [items])
+        items = [str(i) for i in items]
+        changed_since = None
+        if args and isinstance(args[0], list):
+            modifiers = [str(x).upper() for x in args.pop(0)]
+            if 'CHANGEDSINCE' in modifiers:
+                changed_since = int(modifiers[modifiers.index('CHANGEDSINCE')
+                                              + 1])
+                self.condstore = True
+                if 'VANISHED' in modifiers and uid and self.qresync:
+                    wanted = set(u for _, m in msgs for u in [m.uid])
+                    gone = [u for u, m in folder.vanished
+                            if m > changed_since and
+                            any(lo <= u <= hi for lo, hi in
+                                parse_set(sequence_string(wanted) or '0',
+                                          folder.uidnext))]
+                    if gone:
+                        self.send('* VANISHED (EARLIER) %s\r\n'
+                                  % sequence_string(gone))
+        if uid and 'UID' not in [i.upper() for i in items]:
+            items.insert(0, 'UID')
+        if self.condstore and 'MODSEQ' not in [i.upper() for i in items]:
+            items.append('MODSEQ')
+        for seqno, msg in msgs:
+            if changed_since is not None and msg.modseq <= changed_since:
+                continue
+            cache = {}
+
+            def raw():
+                if 'raw' not in cache:
+                    cache['raw'] = msg.raw()
+                return cache['raw']
+            state = {'seen': False, 'raw': raw}
+            parts = []
+            for item in items:
+                value = self.fetch_item(item, seqno, msg, state)
+                if isinstance(value, tuple):
+                    key, data = value
+                    literal8 = key.upper().startswith('BINARY')
+                    parts.append(('%s %s{%d}\r\n' % (
+                        key, '~' if literal8 else '', len(data))
+                    ).encode('latin-1') + data)
+                else:
+                    parts.append(value.encode('latin-1'))
+            if (state['seen'] and not self.readonly and
+                    '\\Seen' not in msg.flags):
+                msg.flags.add('\\Seen')
+                folder.touch(msg)
+                if not any(i.upper() == 'FLAGS' for i in items):
+                    parts.append(('FLAGS (%s)' % ' '.join(sorted(msg.flags))
+                                  ).encode('latin-1'))
+            self.send(b'* %d FETCH (' % seqno + b' '.join(parts) + b')\r\n')
+
+    # SEARCH and SORT
+
+    def search_key(self, args, msgs):
+        """Consumes one search key from args and returns a predicate
+        taking (seqno, message)."""
+        key = args.pop(0) if args else None
+        if key is None:
+            raise ProtocolError('missing search key')
+        if isinstance(key, list):
+            preds = self.search_keys(list(key), msgs)
+            return lambda n, m: all(p(n, m) for p in preds)
+        if isinstance(key, String):
+            raise ProtocolError('unexpected string in search')
+        name = key.upper()
+        flag_keys = {'ANSWERED': '\\Answered', 'DELETED': '\\Deleted',
+                     'DRAFT': '\\Draft', 'FLAGGED': '\\Flagged',
+                     'SEEN': '\\Seen'}
+        if name == 'ALL':
+            return lambda n, m: True
+        if name in flag_keys:
+            f = flag_keys[name]
+            return lambda n, m: f in m.flags
+        if name.startswith('UN') and name[2:] in flag_keys:
+            f = flag_keys[name[2:]]
+            return lambda n, m: f not in m.flags
+        if name in ('RECENT', 'NEW'):
+            return lambda n, m: False
+        if name == 'OLD':
+            return lambda n, m: True
+        if name in ('KEYWORD', 'UNKEYWORD'):
+            kw = astring(args, 'keyword')
+            return ((lambda n, m: kw in m.flags) if name == 'KEYWORD'
+                    else (lambda n, m: kw not in m.flags))
+        if name == 'NOT':
+            pred = self.search_key(args, msgs)
+            return lambda n, m: not pred(n, m)
+        if name == 'OR':
+            a = self.search_key(args, msgs)
+            b = self.search_key(args, msgs)
+            return lambda n, m: a(n, m) or b(n, m)
+        if name in ('FROM', 'TO', 'CC', 'BCC', 'SUBJECT'):
+            s = astring(args, 'string').lower()
+            return lambda n, m: s in (m.structure().header(name)
+                                      or '').lower()
+        if name == 'HEADER':
+            field = astring(args, 'field')
+            s = astring(args, 'string').lower()
+            return lambda n, m: (m.structure().header(field) is not None
+                                 and s in m.structure().header(field).lower())
+        if name in ('BODY', 'TEXT'):
+            s = astring(args, 'string').lower().encode('latin-1')
+
+            def pred(n, m):
+                raw = m.raw()
+                start = m.structure().body_start if name == 'BODY' else 0
+                return s in raw[start:].lower()
+            return pred
+        if name in ('LARGER', 'SMALLER'):
+            size = int(atom(args, 'size'))
+            return ((lambda n, m: m.rfc822_size() > size) if name == 'LARGER'
+                    else (lambda n, m: m.rfc822_size() < size))
+        if name in ('BEFORE', 'ON', 'SINCE',
+                    'SENTBEFORE', 'SENTON', 'SENTSINCE'):
+            day = parse_date(atom(args, 'date'))
+            sent = name.startswith('SENT')
+            cmp = name[4:] if sent else name
+
+            def pred(n, m):
+                d = (m.date() if sent else m.internal).date()
+                return (d < day if cmp == 'BEFORE' else
+                        d == day if cmp == 'ON' else d >= day)
+            return pred
+        if name == 'UID':
+            wanted = list(parse_set(atom(args, 'set'),
+                                    msgs[-1].uid if msgs else 0))
+            last = msgs[-1] if msgs else None
+            return lambda n, m: (any(lo <= m.uid <= hi for lo, hi in wanted)
+                                 or (m is last and
+                                     any(hi >= m.uid for lo, hi in wanted)))
+        if name == 'MODSEQ':
+            if not self.has('CONDSTORE'):
+                raise ProtocolError('CONDSTORE is not supported')
+            self.condstore = True
+            while len(args) > 1 and isinstance(args[0], String):
+                args.pop(0)     # entry name and type
+            since = int(atom(args, 'modseq'))
+            return lambda n, m: m.modseq >= since
+        if SEQUENCE_RE.match(key):
+            wanted = list(parse_set(key, len(msgs)))
+            return lambda n, m: any(lo <= n <= hi for lo, hi in wanted)
+        raise ProtocolError('unknown search key ' + key)
+
+    def search_keys(self, args, msgs):
+        preds = []
+        while args:
+            preds.append(self.search_key(args, msgs))
+        return preds
+
+    def search_options(self, args):
+        """Parses RETURN (...) and CHARSET; returns the return options,
+        or None for a plain SEARCH response."""
+        options = None
+        if args and not isinstance(args[0], list) \
+                and args[0].upper() == 'RETURN':
+            args.pop(0)
+            if not args or not isinstance(args[0], list):
+                raise ProtocolError('RETURN needs options')
+            options = [str(o).upper() for o in args.pop(0)] or ['ALL']
+        if args and not isinstance(args[0], list) \
+                and args[0].upper() == 'CHARSET':
+            args.pop(0)
+            astring(args, 'charset')
+        return options
+
+    def matches(self, args):
+        msgs = self.selected().messages
+        preds = self.search_keys(args, msgs)
+        if not preds:
+            raise ProtocolError('missing search key')
+        return [(n, m) for n, m in enumerate(msgs, 1)
+                if all(p(n, m) for p in preds)]
+
+    def send_esearch(self, tag, uid, options, numbers, keep_order=False):
+        items = []
+        if numbers:
+            if 'MIN' in options:
+                items.append('MIN %d' % min(numbers))
+            if 'MAX' in options:
+                items.append('MAX %d' % max(numbers))
+            if 'ALL' in options:
+                items.append('ALL %s' % sequence_string(numbers, keep_order))
+        if 'COUNT' in options:
+            items.append('COUNT %d' % len(numbers))
+        self.send('* ESEARCH (TAG "%s")%s%s\r\n'
+                  % (tag, ' UID' if uid else '',
+                     ''.join(' ' + i for i in items)))
+
+    def cmd_SEARCH(self, tag, args, uid, due):
+        options = self.search_options(args)
+        found = self.matches(args)
+        numbers = [m.uid if uid else n for n, m in found]
+        if options is not None and self.has('ESEARCH'):
+            self.send_esearch(tag, uid, options, numbers)
+        else:
+            self.send('* SEARCH%s\r\n' % ''.join(' %d' % n for n in numbers))
+
+    def cmd_SORT(self, tag, args, uid, due):
+        if not self.has('SORT'):
+            raise ProtocolError('SORT is not supported')
+        options = None
+        if args and not isinstance(args[0], list) \
+                and args[0].upper() == 'RETURN':
+            args.pop(0)
+            options = [str(o).upper() for o in args.pop(0)] or ['ALL']
+            if not self.has('ESORT'):
+                raise ProtocolError('ESORT is not supported')
+            if 'UPDATE' in options:
+                return 'NO [NOUPDATE "%s"] no updates' % tag
+        if not args or not isinstance(args[0], list):
+            raise ProtocolError('missing sort criteria')
+        criteria = [str(c).upper() for c in args.pop(0)]
+        astring(args, 'charset')
+        found = self.matches(args)
+        keys = []
+        reverse = False
+        for c in criteria:
+            if c == 'REVERSE':
+                reverse = True
+                continue
+            keys.append((c, reverse))
+            reverse = False
+        for c, rev in reversed(keys):
+            found.sort(key=lambda nm: self.sort_value(c, nm), reverse=rev)
+        numbers = [m.uid if uid else n for n, m in found]
+        if options is not None:
+            self.send_esearch(tag, uid, options, numbers, True)
+        else:
+            self.send('* SORT%s\r\n' % ''.join(' %d' % n for n in numbers))
+
+    def sort_value(self, criterion, nm):
+        n, m = nm
+        if criterion == 'ARRIVAL':
+            return m.internal
+        if criterion == 'DATE':
+            return m.date() or m.internal
+        if criterion == 'SIZE':
+            return m.rfc822_size()
+        if criterion == 'SUBJECT':
+            s = (m.structure().header('Subject') or '').lower()
+            while True:
+                t = re.sub(r'^\s*(re|fwd?)\s*:\s*', '', s)
+                if t == s:
+                    return s
+                s = t
+        if criterion in ('FROM', 'TO', 'CC'):
+            value = m.structure().header(criterion) or ''
+            addrs = email.utils.getaddresses([value])
+            return addrs[0][1].split('@')[0].lower() if addrs else ''
+        raise ProtocolError('unknown sort criterion ' + criterion)
+
+
+def serve_script(sock, args):
+    steps = load_script(args.script)
+    ok = True
+    number = 0
+    while number < args.connections:
+        connection, client_address = sock.accept()
+        number += 1
+        try:
+            ok = play(connection, steps, args.latency / 1000.0) and ok
+        finally:
+            connection.close()
+    return 0 if ok else 1
+
+
+def serve_mock(sock, args):
+    server = Server(args)
+    threads = []
+    try:
+        number = 0
+        while args.connections == 0 or number < args.connections:
+            connection, client_address = sock.accept()
+            connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            number += 1
+            thread = threading.Thread(
+                target=Connection(server, connection, number).serve)
+            thread.start()
+            threads.append(thread)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        for thread in threads:
+            thread.join()
+    return 1 if server.errors else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Fake IMAP server')
+    parser.add_argument('--latency', type=int, default=0, metavar='MS',
+                        help='delay responses by MS milliseconds')
+    parser.add_argument('--connections', type=int, default=1, metavar='N',
+                        help='number of connections to serve, 0 for any')
+    parser.add_argument('--mock', action='store_true',
+                        help='answer from synthesized folders, no script')
+    parser.add_argument('--messages', type=int, default=1000, metavar='N',
+                        help='number of messages in INBOX')
+    parser.add_argument('--folder', action='append', default=[],
+                        metavar='NAME=N', help='add a folder of N messages')
+    parser.add_argument('--attachment', type=int, default=20000,
+                        metavar='BYTES',
+                        help='attachment size of every tenth message')
+    parser.add_argument('--extensions', default='default', metavar='SPEC',
+                        help='advertised extensions')
+    parser.add_argument('--bandwidth', type=int, default=0, metavar='KB',
+                        help='send at most KB kilobytes per second')
+    parser.add_argument('--max-commands', type=int, default=0, metavar='N',
+                        help='fail if a connection sends more commands')
+    parser.add_argument('--max-round-trips', type=int, default=0,
+                        metavar='N',
+                        help='fail if a connection needs more round trips')
+    parser.add_argument('--verbose', action='store_true',
+                        help='print the commands received')
+    parser.add_argument('operands', nargs='*', metavar='ARG',
+                        help='SCRIPT [PORT], or [PORT] with --mock')
+    args = parser.parse_args()
+    operands = args.operands
+    if not args.mock:
+        if not operands:
+            parser.error('a SCRIPT is needed without --mock')
+        args.script = operands.pop(0)
+    if len(operands) > 1:
+        parser.error('too many arguments')
+    try:
+        port = int(operands[0]) if operands else 65143
+    except ValueError:
+        parser.error('bad PORT: ' + operands[0])
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(('localhost', port))
+    sock.listen(8)
+    print('port %d' % sock.getsockname()[1])
+    sys.stdout.flush()
+    try:
+        if args.mock:
+            return serve_mock(sock, args)
+        return serve_script(sock, args)
+    finally:
+        sock.close()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Runs "imap_tst suite" against "fake_imap_server.py --mock" for every
+# combination of folder size, extension set and latency listed in
+# suite.limits, prints what both sides measured, one block per
+# combination, and fails if a run needed more commands or round trips
+# than suite.limits allows.  Combinations whose limits are "-", not
+# measured yet, are skipped.  With --update, all combinations are run
+# and not checked; suite.limits is rewritten with the measured counts
+# instead.
+#
+# Usage: suite.sh [--update] [IMAP_TST]
+#
+# IMAP_TST defaults to $IMAP_TST, then to ../imap_tst.  Exits with 77,
+# "skipped" to automake and meson, if there is no python3 or nothing
+# was checked.
+#
+# This script is free software; you can redistribute it and/or modify it under
+# the terms of the GNU Lesser General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.
+
+dir=$(dirname "$0")
+update=no
+if [ "$1" = --update ]; then
+    update=yes
+    shift
+fi
+imap_tst=${1:-${IMAP_TST:-$dir/../imap_tst}}
+limits=$dir/suite.limits
+command -v python3 >/dev/null 2>&1 || exit 77
+
+log=$(mktemp) || exit 1
+new=$(mktemp) || exit 1
+rows=$(mktemp) || exit 1
+trap 'rm -f "$log" "$new" "$rows"' EXIT
+status=0
+checked=0
+
+grep -v '^#' "$limits" > "$rows"
+while read -r messages extensions latency max_commands max_round_trips; do
+    [ -n "$messages" ] || continue
+    echo "== $messages messages, extensions $extensions," \
+         "latency $latency ms"
+    if [ $update = yes ]; then
+        max_commands=0
+        max_round_trips=0
+    elif [ "$max_commands" = - ] || [ "$max_round_trips" = - ]; then
+        echo "No limits measured, skipped."
+        continue
+    else
+        checked=$((checked + 1))
+    fi
+    python3 "$dir/fake_imap_server.py" --mock --messages "$messages" \
+            --extensions "$extensions" --latency "$latency" \
+            --max-commands "$max_commands" \
+            --max-round-trips "$max_round_trips" 0 > "$log" &
+    server=$!
+    # Wait for the server to report the port the system picked.
+    port=
+    tries=0
+    while [ -z "$port" ] && [ $tries -lt 100 ] \
+              && kill -0 $server 2>/dev/null; do
+        sleep 0.1
+        port=$(sed -n 's/^port //p' "$log")
+        tries=$((tries + 1))
+    done
+    if [ -z "$port" ]; then
+        echo "The server did not start."
+        kill $server 2>/dev/null
+        wait $server
+        status=1
+        continue
+    fi
+    "$imap_tst" -t -u test -p secret suite "localhost:$port" INBOX \
+        < /dev/null || status=1
+    wait $server || status=1
+    sed '/^port /d' "$log"
+    if [ $update = yes ]; then
+        sed -n 's/^connection 1: \([0-9]*\) commands, \([0-9]*\) round trips.*/\1 \2/p' \
+            "$log" | {
+            read -r commands round_trips
+            echo "$messages $extensions $latency $commands" \
+                 "$((round_trips + round_trips / 10 + 1))"
+        } >> "$new"
+    fi
+done < "$rows"
+
+if [ $update = yes ] && [ $status -eq 0 ]; then
+    { sed '/^[^#]/,$d' "$limits"; cat "$new"; } > "$limits.tmp" \
+        && mv "$limits.tmp" "$limits"
+fi
+[ $update = yes ] || [ $checked -gt 0 ] || [ $status -ne 0 ] || exit 77
+exit $status
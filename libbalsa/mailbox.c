@@ -34,6 +34,7 @@
 #include "message.h"
 #include "misc.h"
 #include "filter-funcs.h"
+#include "gzip-index.h"
 #include "libbalsa_private.h"
 #include <glib/gi18n.h>
 
@@ -49,6 +50,10 @@ static gboolean
 libbalsa_mailbox_real_messages_copy(LibBalsaMailbox * mailbox,
                                     GArray * msgnos,
                                     LibBalsaMailbox * dest, GError **err);
+static gboolean
+libbalsa_mailbox_real_messages_move(LibBalsaMailbox * mailbox,
+                                    GArray * msgnos,
+                                    LibBalsaMailbox * dest, GError **err);
 static gboolean libbalsa_mailbox_real_can_do(LibBalsaMailbox* mbox,
                                              enum LibBalsaMailboxCapability c);
 static void libbalsa_mailbox_real_sort(LibBalsaMailbox* mbox,
@@ -213,9 +218,11 @@ libbalsa_mailbox_class_init(LibBalsaMailboxClass * klass)
     klass->fetch_headers           = NULL;
     klass->release_message = libbalsa_mailbox_real_release_message;
     klass->get_message_part = NULL;
+    klass->get_part_stream = NULL;
     klass->get_message_stream = NULL;
     klass->messages_change_flags = NULL;
     klass->messages_copy  = libbalsa_mailbox_real_messages_copy;
+    klass->messages_move  = libbalsa_mailbox_real_messages_move;
     klass->can_do = libbalsa_mailbox_real_can_do;
     klass->set_threading = NULL;
     klass->update_view_filter = NULL;
@@ -1151,6 +1158,13 @@ libbalsa_mailbox_type_from_path(const gchar * path)
         if (access (tmp, F_OK) == 0)
             return LIBBALSA_TYPE_MAILBOX_MH;
 
+    } else if (g_str_has_suffix(path, ".gz")) {
+        /* Compressed mbox archive */
+        gchar buf[5];
+
+        if (libbalsa_gzip_peek(path, buf, sizeof buf) == sizeof buf
+            && strncmp(buf, "From ", sizeof buf) == 0)
+            return LIBBALSA_TYPE_MAILBOX_MBOX;
     } else {
         /* Minimal check for an mbox */
         gint fd;
@@ -1423,14 +1437,70 @@ decrease_post(GNode *node, gpointer data)
     return FALSE;
 }
 
+/* Destroy node, whose path is path, promoting its children to its
+ * parent, and tell the tree-view about it. */
+static void
+lbm_node_removed(LibBalsaMailbox * mailbox, GNode * node,
+                 GtkTreePath * path)
+{
+    GtkTreeIter iter;
+    GNode *child;
+    GNode *parent;
+
+    iter.stamp = mailbox->stamp;
+
+    /* First promote any children to the node's parent; we'll insert
+     * them all before the current node, to keep the path calculation
+     * simple. */
+    parent = node->parent;
+    while ((child = node->children)) {
+        /* No need to notify the tree-view about unlinking the child--it
+         * will assume we already did that when we notify it about
+         * destroying the parent. */
+        g_node_unlink(child);
+        g_node_insert_before(parent, node, child);
+
+        /* Notify the tree-view about the new location of the child. */
+        iter.user_data = child;
+        g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_INSERTED], 0,
+                      path, &iter);
+        if (child->children)
+            g_signal_emit(mailbox,
+                          libbalsa_mbox_model_signals[ROW_HAS_CHILD_TOGGLED],
+                          0, path, &iter);
+        gtk_tree_path_next(path);
+    }
+
+    /* Now it's safe to destroy the node. */
+    g_node_destroy(node);
+    g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_DELETED], 0, path);
+
+    if (parent->parent && !parent->children) {
+        gtk_tree_path_up(path);
+        iter.user_data = parent;
+        g_signal_emit(mailbox,
+                      libbalsa_mbox_model_signals[ROW_HAS_CHILD_TOGGLED], 0,
+                      path, &iter);
+    }
+}
+
+static void
+lbm_schedule_threading(LibBalsaMailbox * mailbox)
+{
+    libbalsa_lock_mailbox(mailbox);
+    if (mailbox->need_threading_idle_id == 0) {
+        mailbox->need_threading_idle_id =
+            g_idle_add((GSourceFunc) lbm_need_threading_idle_cb, mailbox);
+    }
+    libbalsa_unlock_mailbox(mailbox);
+}
+
 void
 libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
 {
     GtkTreeIter iter;
     GtkTreePath *path;
     struct remove_data dt;
-    GNode *child;
-    GNode *parent;
 
     g_signal_emit(mailbox, libbalsa_mailbox_signals[MESSAGE_EXPUNGED],
                   0, seqno);
@@ -1463,48 +1533,168 @@ libbalsa_mailbox_msgno_removed(LibBalsaMailbox * mailbox, guint seqno)
     iter.stamp = mailbox->stamp;
     path = gtk_tree_model_get_path(GTK_TREE_MODEL(mailbox), &iter);
 
-    /* First promote any children to the node's parent; we'll insert
-     * them all before the current node, to keep the path calculation
-     * simple. */
-    parent = dt.node->parent;
-    while ((child = dt.node->children)) {
-        /* No need to notify the tree-view about unlinking the child--it
-         * will assume we already did that when we notify it about
-         * destroying the parent. */
-        g_node_unlink(child);
-        g_node_insert_before(parent, dt.node, child);
+    lbm_schedule_threading(mailbox);
+    lbm_node_removed(mailbox, dt.node, path);
 
-        /* Notify the tree-view about the new location of the child. */
-        iter.user_data = child;
-        g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_INSERTED], 0,
-                      path, &iter);
-        if (child->children)
-            g_signal_emit(mailbox,
-                          libbalsa_mbox_model_signals[ROW_HAS_CHILD_TOGGLED],
-                          0, path, &iter);
-        gtk_tree_path_next(path);
+    gtk_tree_path_free(path);
+    mailbox->stamp++;
+}
+
+/*
+ * libbalsa_mailbox_msgnos_removed and helpers
+ *
+ * Removing the messages one by one costs a traversal of the whole tree
+ * and a renumbering of all later messages for each of them, so a
+ * backend that learns about many removals at once passes them all
+ * here.
+ */
+struct remove_batch_data {
+    LibBalsaMailbox *mailbox;
+    const guint *seqnos;
+    guint n;
+    GPtrArray *nodes;           /* of the removed messages, pre-order */
+    GHashTable *positions;      /* node -> position among its siblings */
+};
+
+/* The number of entries of the ascending array seqnos that are smaller
+ * than seqno; *found tells whether seqno itself is there. */
+static guint
+lbm_seqnos_below(const guint * seqnos, guint n, guint seqno,
+                 gboolean * found)
+{
+    guint lo = 0, hi = n;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (seqnos[mid] < seqno)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    *found = lo < n && seqnos[lo] == seqno;
 
-    libbalsa_lock_mailbox(mailbox);
-    if (mailbox->need_threading_idle_id == 0) {
-        mailbox->need_threading_idle_id =
-            g_idle_add((GSourceFunc) lbm_need_threading_idle_cb, mailbox);
+    return lo;
+}
+
+static gboolean
+lbm_remove_batch_pre(GNode * node, gpointer data)
+{
+    struct remove_batch_data *dt = data;
+    guint seqno = GPOINTER_TO_UINT(node->data);
+    guint below;
+    gboolean found;
+
+    if (!node->parent)
+        return FALSE;
+
+    /* The pre-order traversal visits the previous sibling first. */
+    g_hash_table_insert(dt->positions, node,
+                        GUINT_TO_POINTER(node->prev ?
+                                         GPOINTER_TO_UINT
+                                         (g_hash_table_lookup
+                                          (dt->positions, node->prev)) + 1 :
+                                         0));
+
+    below = lbm_seqnos_below(dt->seqnos, dt->n, seqno, &found);
+    if (found)
+        g_ptr_array_add(dt->nodes, node);
+    else if (below > 0) {
+        GtkTreeIter iter;
+
+        node->data = GUINT_TO_POINTER(seqno - below);
+        iter.user_data = node;
+        lbm_msgno_changed(dt->mailbox, seqno - below, &iter);
     }
-    libbalsa_unlock_mailbox(mailbox);
 
-    /* Now it's safe to destroy the node. */
-    g_node_destroy(dt.node);
-    g_signal_emit(mailbox, libbalsa_mbox_model_signals[ROW_DELETED], 0, path);
+    return FALSE;
+}
 
-    if (parent->parent && !parent->children) {
-        gtk_tree_path_up(path);
-        iter.user_data = parent;
-        g_signal_emit(mailbox,
-                      libbalsa_mbox_model_signals[ROW_HAS_CHILD_TOGGLED], 0,
-                      path, &iter);
+/* Path of node from the positions recorded before any removal; valid
+ * as long as only nodes that follow it in pre-order have been
+ * removed. */
+static GtkTreePath *
+lbm_remove_batch_path(struct remove_batch_data *dt, GNode * node)
+{
+    GtkTreePath *path = gtk_tree_path_new();
+
+    for (; node->parent; node = node->parent)
+        gtk_tree_path_prepend_index(path,
+                                    GPOINTER_TO_UINT(g_hash_table_lookup
+                                                     (dt->positions,
+                                                      node)));
+
+    return path;
+}
+
+/**
+ * libbalsa_mailbox_msgnos_removed:
+ * @mailbox: the mailbox
+ * @seqnos: the msgnos of the removed messages, in ascending order and
+ *   all numbered as before the removal
+ * @n: the number of entries of @seqnos
+ *
+ * Does what calling libbalsa_mailbox_msgno_removed() for each message,
+ * from the last one down, would do, in a single pass over the message
+ * tree and the index.  "message-expunged" is still emitted for each
+ * message, last one first.
+ */
+void
+libbalsa_mailbox_msgnos_removed(LibBalsaMailbox * mailbox,
+                                const guint * seqnos, guint n)
+{
+    struct remove_batch_data dt;
+    guint i, j, k;
+
+    if (n == 0)
+        return;
+
+    for (i = n; i > 0; i--)
+        g_signal_emit(mailbox, libbalsa_mailbox_signals[MESSAGE_EXPUNGED],
+                      0, seqnos[i - 1]);
+
+    if (!mailbox->msg_tree) {
+        return;
     }
-    
-    gtk_tree_path_free(path);
+
+    /* Compact the index first, so that the renumbered rows show the
+     * right entries. */
+    for (i = j = k = 0; i < mailbox->mindex->len; i++) {
+        gpointer entry = g_ptr_array_index(mailbox->mindex, i);
+
+        if (k < n && seqnos[k] == i + 1) {
+            lbm_index_entry_free(entry);
+            k++;
+        } else
+            g_ptr_array_index(mailbox->mindex, j++) = entry;
+    }
+    g_ptr_array_set_size(mailbox->mindex, j);
+
+    dt.mailbox = mailbox;
+    dt.seqnos = seqnos;
+    dt.n = n;
+    dt.nodes = g_ptr_array_new();
+    dt.positions = g_hash_table_new(NULL, NULL);
+    g_node_traverse(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                    lbm_remove_batch_pre, &dt);
+
+    mailbox->msg_tree_changed = TRUE;
+
+    if (dt.nodes->len > 0)
+        lbm_schedule_threading(mailbox);
+
+    /* Going backwards in pre-order, every node comes after the later
+     * siblings and the descendants of all nodes that remain to be
+     * removed, so their recorded positions stay valid. */
+    for (i = dt.nodes->len; i > 0; i--) {
+        GNode *node = g_ptr_array_index(dt.nodes, i - 1);
+        GtkTreePath *path = lbm_remove_batch_path(&dt, node);
+
+        lbm_node_removed(mailbox, node, path);
+        gtk_tree_path_free(path);
+    }
+
+    g_hash_table_destroy(dt.positions);
+    g_ptr_array_free(dt.nodes, TRUE);
     mailbox->stamp++;
 }
 
@@ -2031,6 +2221,25 @@ libbalsa_mailbox_get_message_part(LibBalsaMessage    *message,
         ->get_message_part(message, part, err);
 }
 
+GInputStream *
+libbalsa_mailbox_get_part_stream(LibBalsaMessage     *message,
+                                 LibBalsaMessageBody *part,
+                                 GError **err)
+{
+    LibBalsaMailboxClass *klass;
+
+    g_return_val_if_fail(message != NULL, NULL);
+    g_return_val_if_fail(message->mailbox != NULL, NULL);
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(message->mailbox), NULL);
+    g_return_val_if_fail(part != NULL, NULL);
+
+    klass = LIBBALSA_MAILBOX_GET_CLASS(message->mailbox);
+    if (!klass->get_part_stream)
+        return NULL;
+
+    return klass->get_part_stream(message, part, err);
+}
+
 GMimeStream *
 libbalsa_mailbox_get_message_stream(LibBalsaMailbox * mailbox, guint msgno,
 				    gboolean peek)
@@ -2129,18 +2338,16 @@ libbalsa_mailbox_messages_copy(LibBalsaMailbox * mailbox, GArray * msgnos,
     return retval;
 }
 
-/* Move messages with msgnos in the list from mailbox to dest. */
-gboolean
-libbalsa_mailbox_messages_move(LibBalsaMailbox * mailbox,
-                               GArray * msgnos,
-                               LibBalsaMailbox * dest, GError **err)
+/* Default method: copy, then flag the originals as deleted. The imap
+ * backend replaces it with a server-side move when possible. Called
+ * with mailbox locked. */
+static gboolean
+libbalsa_mailbox_real_messages_move(LibBalsaMailbox * mailbox,
+                                    GArray * msgnos,
+                                    LibBalsaMailbox * dest, GError ** err)
 {
     gboolean retval;
 
-    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
-    g_return_val_if_fail(msgnos->len > 0, TRUE);
-
-    libbalsa_lock_mailbox(mailbox);
     if (libbalsa_mailbox_messages_copy(mailbox, msgnos, dest, err)) {
         retval = libbalsa_mailbox_messages_change_flags
             (mailbox, msgnos, LIBBALSA_MESSAGE_FLAG_DELETED,
@@ -2151,6 +2358,24 @@ libbalsa_mailbox_messages_move(LibBalsaMailbox * mailbox,
 			_("Removing messages from source mailbox failed"));
     } else
         retval = FALSE;
+
+    return retval;
+}
+
+/* Move messages with msgnos in the list from mailbox to dest. */
+gboolean
+libbalsa_mailbox_messages_move(LibBalsaMailbox * mailbox,
+                               GArray * msgnos,
+                               LibBalsaMailbox * dest, GError **err)
+{
+    gboolean retval;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX(mailbox), FALSE);
+    g_return_val_if_fail(msgnos->len > 0, TRUE);
+
+    libbalsa_lock_mailbox(mailbox);
+    retval = LIBBALSA_MAILBOX_GET_CLASS(mailbox)->
+	messages_move(mailbox, msgnos, dest, err);
     libbalsa_unlock_mailbox(mailbox);
 
     return retval;
@@ -2295,6 +2520,7 @@ static LibBalsaMailboxView libbalsa_mailbox_view_default = {
     LB_MAILBOX_SORT_NO,         /* sort_field_prev      */
     LB_MAILBOX_SHOW_UNSET,	/* show                 */
     LB_MAILBOX_SUBSCRIBE_UNSET,	/* subscribe            */
+    0,				/* offline              */
     0,				/* exposed              */
     0,				/* open                 */
     1,				/* in_sync              */
@@ -2447,6 +2673,20 @@ libbalsa_mailbox_set_subscribe(LibBalsaMailbox * mailbox,
 	return FALSE;
 }
 
+gboolean
+libbalsa_mailbox_set_offline(LibBalsaMailbox * mailbox, gboolean offline)
+{
+    LibBalsaMailboxView *view = lbm_get_view(mailbox);
+
+    if (view->offline != offline) {
+	view->offline = offline ? 1 : 0;
+	if (mailbox)
+	    view->in_sync = 0;
+	return TRUE;
+    } else
+	return FALSE;
+}
+
 void
 libbalsa_mailbox_set_exposed(LibBalsaMailbox * mailbox, gboolean exposed)
 {
@@ -2629,6 +2869,13 @@ libbalsa_mailbox_get_subscribe(LibBalsaMailbox * mailbox)
 	mailbox->view->subscribe : libbalsa_mailbox_view_default.subscribe;
 }
 
+gboolean
+libbalsa_mailbox_get_offline(LibBalsaMailbox * mailbox)
+{
+    return (mailbox && mailbox->view) ?
+	mailbox->view->offline : libbalsa_mailbox_view_default.offline;
+}
+
 gboolean
 libbalsa_mailbox_get_exposed(LibBalsaMailbox * mailbox)
 {
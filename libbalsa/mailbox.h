@@ -165,6 +165,7 @@ struct _LibBalsaMailboxView {
     LibBalsaMailboxSortFields    sort_field_prev;
     LibBalsaMailboxShow          show;
     LibBalsaMailboxSubscribe     subscribe;
+    gboolean offline;		/* keep a copy for offline use */
     gboolean exposed;
     gboolean open;
     gboolean in_sync;		/* view is in sync with config */
@@ -290,6 +291,9 @@ struct _LibBalsaMailboxClass {
     gboolean (*get_message_part) (LibBalsaMessage *message,
 				  LibBalsaMessageBody *part,
                                   GError **err);
+    GInputStream *(*get_part_stream) (LibBalsaMessage *message,
+                                      LibBalsaMessageBody *part,
+                                      GError **err);
     GMimeStream *(*get_message_stream) (LibBalsaMailbox * mailbox,
                                         guint msgno, gboolean peek);
 
@@ -313,6 +317,8 @@ struct _LibBalsaMailboxClass {
 				       LibBalsaMessageFlag clear);
     gboolean (*messages_copy) (LibBalsaMailbox * mailbox, GArray *msgnos,
 			       LibBalsaMailbox * dest, GError **err);
+    gboolean (*messages_move) (LibBalsaMailbox * mailbox, GArray *msgnos,
+			       LibBalsaMailbox * dest, GError **err);
     /* Test message flags */
     gboolean(*msgno_has_flags) (LibBalsaMailbox * mailbox, guint msgno,
                                 LibBalsaMessageFlag set,
@@ -407,6 +413,14 @@ gboolean libbalsa_mailbox_get_message_part(LibBalsaMessage    *message,
 					   LibBalsaMessageBody *part,
                                            GError **err);
 
+/** libbalsa_mailbox_get_part_stream() returns the decoded content of
+    a single part as it is being fetched, or NULL if the mailbox
+    cannot stream parts.
+*/
+GInputStream *libbalsa_mailbox_get_part_stream(LibBalsaMessage     *message,
+                                               LibBalsaMessageBody *part,
+                                               GError **err);
+
 /** libbalsa_mailbox_get_message_stream() returns a message stream associated
     with full RFC822 text of the message.
 */
@@ -545,6 +559,8 @@ gboolean libbalsa_mailbox_set_show(LibBalsaMailbox * mailbox,
 gboolean libbalsa_mailbox_set_subscribe(LibBalsaMailbox * mailbox,
                                         LibBalsaMailboxSubscribe
                                         subscribe);
+gboolean libbalsa_mailbox_set_offline(LibBalsaMailbox * mailbox,
+                                      gboolean offline);
 void libbalsa_mailbox_set_exposed(LibBalsaMailbox * mailbox,
 				  gboolean exposed);
 void libbalsa_mailbox_set_open(LibBalsaMailbox * mailbox, gboolean open);
@@ -569,6 +585,7 @@ LibBalsaMailboxSortFields libbalsa_mailbox_get_sort_field(LibBalsaMailbox *
 LibBalsaMailboxShow libbalsa_mailbox_get_show(LibBalsaMailbox * mailbox);
 LibBalsaMailboxSubscribe libbalsa_mailbox_get_subscribe(LibBalsaMailbox *
                                                         mailbox);
+gboolean libbalsa_mailbox_get_offline(LibBalsaMailbox * mailbox);
 gboolean libbalsa_mailbox_get_exposed(LibBalsaMailbox * mailbox);
 gboolean libbalsa_mailbox_get_open(LibBalsaMailbox * mailbox);
 gint libbalsa_mailbox_get_filter(LibBalsaMailbox * mailbox);
@@ -586,6 +603,8 @@ void libbalsa_mailbox_msgno_inserted(LibBalsaMailbox * mailbox,
                                      guint seqno, GNode * parent,
                                      GNode ** sibling);
 void libbalsa_mailbox_msgno_removed(LibBalsaMailbox  *mailbox, guint seqno);
+void libbalsa_mailbox_msgnos_removed(LibBalsaMailbox * mailbox,
+                                     const guint * seqnos, guint n);
 void libbalsa_mailbox_msgno_filt_check(LibBalsaMailbox * mailbox,
 				       guint seqno,
 				       LibBalsaMailboxSearchIter
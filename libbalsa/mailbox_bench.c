@@ -0,0 +1,201 @@
+/* -*-mode:c; c-style:k&r; c-basic-offset:4; -*- */
+/* Balsa E-Mail Client
+ *
+ * Copyright (C) 1997-2016 Stuart Parmenter and others,
+ *                         See the file AUTHORS for a list.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Imports a synthetic corpus into an mbox, a maildir and an MH
+ * mailbox with libbalsa_mailbox_add_messages(), the way messages
+ * moved from another client arrive, and prints how long each backend
+ * takes.  Run it as:
+ *   ./mailbox_bench [-n MESSAGES] [-s BYTES] [-i INTERVAL] [-k] [DIR]
+ * The mailboxes are created in DIR, by default a new temporary
+ * directory, and removed afterwards unless -k is given.  INTERVAL is
+ * the number of messages between syncs to disk, see
+ * libbalsa_mailbox_local_set_add_sync_interval(). */
+
+#if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
+# include "config.h"
+#endif                          /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "libbalsa.h"
+#include "mailbox_local.h"
+#include "mailbox_mbox.h"
+#include "mailbox_maildir.h"
+#include "mailbox_mh.h"
+
+typedef struct {
+    guint next;
+    guint count;
+    gsize size;
+} BenchCorpus;
+
+/* Message i of the corpus: a plain text message of about size bytes;
+ * every other one is unread and every tenth flagged. */
+static gboolean
+bench_corpus_next(LibBalsaMessageFlag * flags, GMimeStream ** stream,
+                  BenchCorpus * corpus)
+{
+    GString *text;
+    guint i;
+
+    if (corpus->next >= corpus->count)
+        return FALSE;
+    i = corpus->next++;
+
+    text = g_string_sized_new(corpus->size + 256);
+    g_string_append_printf(text,
+                           "From: Sender %u <sender%u@example.org>\n"
+                           "To: Recipient <recipient@example.org>\n"
+                           "Subject: Message %u of the corpus\n"
+                           "Date: Mon, 1 Jan 2024 %02u:%02u:%02u +0000\n"
+                           "Message-ID: <%u.bench@example.org>\n"
+                           "MIME-Version: 1.0\n"
+                           "Content-Type: text/plain; charset=us-ascii\n"
+                           "\n", i % 97, i % 97, i, (i / 3600) % 24,
+                           (i / 60) % 60, i % 60, i);
+    while (text->len < corpus->size)
+        g_string_append(text, "From here on, the body of the message is "
+                        "the same line over and over.\n");
+
+    *flags = (i % 2 ? LIBBALSA_MESSAGE_FLAG_NEW : 0)
+        | (i % 10 ? 0 : LIBBALSA_MESSAGE_FLAG_FLAGGED);
+    *stream = g_mime_stream_mem_new_with_buffer(text->str, text->len);
+    g_string_free(text, TRUE);
+
+    return TRUE;
+}
+
+static void
+bench_remove(const gchar * path)
+{
+    GDir *dir;
+
+    if ((dir = g_dir_open(path, 0, NULL)) != NULL) {
+        const gchar *name;
+
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            gchar *child = g_build_filename(path, name, NULL);
+            bench_remove(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        g_rmdir(path);
+    } else
+        g_unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct {
+        const gchar *name;
+        LibBalsaMailbox *(*new_mailbox) (const gchar * path,
+                                         gboolean create);
+    } backends[] = {
+        { "mbox",    libbalsa_mailbox_mbox_new },
+        { "maildir", libbalsa_mailbox_maildir_new },
+        { "mh",      libbalsa_mailbox_mh_new }
+    };
+    gint count = 10000, size = 2000;
+    gint interval = LBML_ADD_SYNC_DEFAULT_INTERVAL;
+    gboolean keep = FALSE;
+    GOptionEntry entries[] = {
+        { "messages", 'n', 0, G_OPTION_ARG_INT, &count,
+          "Number of messages to import", "N" },
+        { "size", 's', 0, G_OPTION_ARG_INT, &size,
+          "Size of each message", "BYTES" },
+        { "interval", 'i', 0, G_OPTION_ARG_INT, &interval,
+          "Messages between syncs to disk, 0 for one per batch", "N" },
+        { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep,
+          "Keep the mailboxes", NULL },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *err = NULL;
+    gchar *dir;
+    guint i;
+    int res = 0;
+
+    context = g_option_context_new("[DIR]");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err)
+        || count < 0 || size < 0 || interval < 0) {
+        fprintf(stderr, "%s\n", err ? err->message : "Bad option value");
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc > 1)
+        dir = g_strdup(argv[1]);
+    else if (!(dir = g_dir_make_tmp("mailbox_bench-XXXXXX", &err))) {
+        fprintf(stderr, "%s\n", err->message);
+        return 1;
+    }
+
+    libbalsa_init();
+    libbalsa_mailbox_local_set_add_sync_interval(interval);
+    printf("%d messages of %d bytes, sync every %d\n", count, size,
+           interval);
+
+    for (i = 0; i < G_N_ELEMENTS(backends); i++) {
+        BenchCorpus corpus = { 0, count, size };
+        gchar *path = g_build_filename(dir, backends[i].name, NULL);
+        LibBalsaMailbox *mailbox;
+        gint64 start;
+        guint added;
+
+        mailbox = backends[i].new_mailbox(path, TRUE);
+        if (!mailbox) {
+            fprintf(stderr, "Could not create %s\n", path);
+            g_free(path);
+            res = 1;
+            continue;
+        }
+
+        start = g_get_monotonic_time();
+        added = libbalsa_mailbox_add_messages(mailbox,
+                                              (LibBalsaAddMessageIterator)
+                                              bench_corpus_next, &corpus,
+                                              &err);
+        printf("%-8s %6lu ms, %u messages added\n", backends[i].name,
+               (unsigned long) ((g_get_monotonic_time() - start) / 1000),
+               added);
+        if (err) {
+            fprintf(stderr, "%s: %s\n", backends[i].name, err->message);
+            g_clear_error(&err);
+        }
+        if (added != (guint) count)
+            res = 1;
+
+        g_object_unref(mailbox);
+        if (!keep)
+            bench_remove(path);
+        g_free(path);
+    }
+
+    if (!keep && argc <= 1)
+        g_rmdir(dir);
+    g_free(dir);
+
+    return res;
+}
@@ -43,8 +43,10 @@
 
 #include "filter-funcs.h"
 #include "filter.h"
+#include "imap-cache.h"
 #include "imap-commands.h"
 #include "imap-handle.h"
+#include "imap-part-stream.h"
 #include "imap-server.h"
 #include "libbalsa-conf.h"
 #include "libbalsa_private.h"
@@ -64,17 +66,31 @@ struct _LibBalsaMailboxImap {
     ImapMboxHandle *handle;     /* stream that has this mailbox selected */
     guint handle_refs;		/* reference counter */
     gint search_stamp;		/* search result validator */
+    GHashTable *search_results; /* LbmImapSearchResult by condition */
 
     gchar *path;		/* Imap local path (third part of URL) */
     ImapUID      uid_validity;
+    ImapUID      cache_uid_validity; /* state of the header cache,  */
+    guint64      cache_modseq;       /* passed to next SELECT       */
 
-    GArray* messages_info;
-    GPtrArray *msgids; /* message-ids */
+    struct message_info **info_pages; /* see message_info_from_msgno() */
+    guint n_messages;
+    GPtrArray *msgids; /* message-ids; NULL until duplicates are sought */
 
     GArray *sort_ranks;
     guint unread_update_id;
     LibBalsaMailboxSortFields sort_field;
     unsigned opened:1;
+    unsigned moving:1;      /* MOVE in progress */
+    unsigned has_status:1;  /* status_* set by check_list, for check */
+    unsigned offline_open:1; /* opened from the offline copy */
+    guint status_messages;
+    guint status_unseen;
+    guint fetch_window;     /* see mi_fetch_window() */
+    guint fetch_pos;        /* tree position of the last fetched msg */
+    struct lbm_imap_prefetch *prefetch; /* see lbm_imap_prefetch() */
+    struct lbm_imap_offline *offline;   /* see lbm_imap_offline_sync() */
+    struct ImapCacheManager *icm; /* header cache, while open */
 
     ImapAclType rights;     /* RFC 4314 'myrights' */
     GList *acls;            /* RFC 4314 acl's */
@@ -89,12 +105,44 @@ struct message_info {
     LibBalsaMessageFlag user_flags;
 };
 
+/* Number of messages per page of info_pages. */
+#define MESSAGE_INFO_PAGE 256
+
 static LibBalsaMailboxClass *parent_class = NULL;
 
+struct lbm_imap_prefetch;
+static void lbm_imap_prefetch_free(struct lbm_imap_prefetch *prefetch);
+static void lbm_imap_prefetch_cancel(LibBalsaMailboxImap *mimap);
+static void lbm_imap_unwatch(LibBalsaMailboxImap * mimap);
+struct lbm_imap_offline;
+static void lbm_imap_offline_free(struct lbm_imap_offline *offline);
+static struct lbm_imap_offline *lbm_imap_offline_get(LibBalsaMailboxImap *
+                                                     mimap);
+static void lbm_imap_offline_sync(LibBalsaMailboxImap * mimap,
+                                  gboolean now);
+static void lbm_imap_journal_replay(LibBalsaMailboxImap * mimap,
+                                    ImapMboxHandle * handle);
+
 static off_t ImapCacheSize = 30*1024*1024; /* 30MB */
+/* Bodies of the offline copies, kept on top of ImapCacheSize; each
+ * server bounds those of its mailboxes by its offline budget */
+static off_t ImapOfflineSize = 0;
+/* Protects ImapOfflineSize, the header cache files and the journals */
+static GMutex lbm_imap_cache_file_lock;
 
  /* issue message if downloaded part has more than this size */
 static unsigned SizeMsgThreshold = 50*1024;
+
+/* Envelopes are prefetched in windows sized from the fetch statistics
+ * of the handle: large enough that the round trip is a small share of
+ * the fetch, but not so large that the fetch exceeds
+ * FETCH_TIME_BUDGET.  Like TCP slow start, the window at most doubles
+ * from one fetch to the next. */
+#define FETCH_WINDOW_MIN    20
+#define FETCH_WINDOW_MAX  1000
+#define FETCH_RTT_SHARE      8    /* transfer time per round trip */
+#define FETCH_TIME_BUDGET    0.25 /* seconds */
+
 static void libbalsa_mailbox_imap_finalize(GObject * object);
 static void libbalsa_mailbox_imap_class_init(LibBalsaMailboxImapClass *
 					     klass);
@@ -141,6 +189,11 @@ static void libbalsa_mailbox_imap_fetch_headers(LibBalsaMailbox *mailbox,
 static gboolean libbalsa_mailbox_imap_get_msg_part(LibBalsaMessage *msg,
 						   LibBalsaMessageBody *,
                                                    GError **err);
+static GInputStream *libbalsa_mailbox_imap_get_part_stream(LibBalsaMessage *
+                                                           msg,
+                                                           LibBalsaMessageBody
+                                                           * part,
+                                                           GError ** err);
 static GArray *libbalsa_mailbox_imap_duplicate_msgnos(LibBalsaMailbox *
 						      mailbox);
 
@@ -171,6 +224,11 @@ static void libbalsa_mailbox_imap_sort(LibBalsaMailbox *mailbox,
                                        GArray *array);
 static guint libbalsa_mailbox_imap_total_messages(LibBalsaMailbox *
 						  mailbox);
+static gboolean libbalsa_mailbox_imap_messages_move(LibBalsaMailbox *
+                                                    mailbox,
+                                                    GArray * msgnos,
+                                                    LibBalsaMailbox * dest,
+                                                    GError **err);
 static gboolean libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox *
 						    mailbox,
 						    GArray * msgnos,
@@ -181,23 +239,65 @@ static gboolean libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox *
 static void server_host_settings_changed_cb(LibBalsaServer * server,
 					    LibBalsaMailbox * mailbox);
 
-static struct message_info *message_info_from_msgno(
-						  LibBalsaMailboxImap * mimap,
-						  guint msgno)
+/* The messages are kept in pages that are allocated when a message
+ * in them is first needed, so that an open mailbox costs a pointer
+ * per MESSAGE_INFO_PAGE messages until they are looked at.  Unless
+ * create is set, NULL is returned for a message whose page is not
+ * there yet: it has neither a LibBalsaMessage nor user flags. */
+static struct message_info *
+message_info_from_msgno(LibBalsaMailboxImap * mimap, guint msgno,
+                        gboolean create)
 {
-    struct message_info *msg_info;
+    struct message_info **page;
 
-    if (msgno > mimap->messages_info->len) {
-        printf("%s %s msgno %d > messages_info len %d\n", __func__,
-               LIBBALSA_MAILBOX(mimap)->name, msgno,
-               mimap->messages_info->len);
-        msg_info = NULL;
-    } else
-        msg_info =
-            &g_array_index(mimap->messages_info, struct message_info,
-                           msgno - 1);
+    if (msgno < 1 || msgno > mimap->n_messages) {
+        if (create)
+            printf("%s %s msgno %d > messages_info len %d\n", __func__,
+                   LIBBALSA_MAILBOX(mimap)->name, msgno,
+                   mimap->n_messages);
+        return NULL;
+    }
+
+    page = &mimap->info_pages[(msgno - 1) / MESSAGE_INFO_PAGE];
+    if (!*page) {
+        if (!create)
+            return NULL;
+        *page = g_new0(struct message_info, MESSAGE_INFO_PAGE);
+    }
+
+    return &(*page)[(msgno - 1) % MESSAGE_INFO_PAGE];
+}
+
+/* Sets the number of messages; those that are dropped must not have
+ * a LibBalsaMessage any more. */
+static void
+message_info_set_size(LibBalsaMailboxImap * mimap, guint n_messages)
+{
+    guint old_pages =
+        (mimap->n_messages + MESSAGE_INFO_PAGE - 1) / MESSAGE_INFO_PAGE;
+    guint new_pages = (n_messages + MESSAGE_INFO_PAGE - 1) / MESSAGE_INFO_PAGE;
+    guint i;
+
+    for (i = new_pages; i < old_pages; i++)
+        g_free(mimap->info_pages[i]);
+    mimap->info_pages =
+        g_renew(struct message_info *, mimap->info_pages, new_pages);
+    for (i = old_pages; i < new_pages; i++)
+        mimap->info_pages[i] = NULL;
+
+    if (n_messages < mimap->n_messages && n_messages % MESSAGE_INFO_PAGE
+        && mimap->info_pages[new_pages - 1]) {
+        guint first = n_messages % MESSAGE_INFO_PAGE;
+        memset(&mimap->info_pages[new_pages - 1][first], 0,
+               (MESSAGE_INFO_PAGE - first) * sizeof(struct message_info));
+    }
+    mimap->n_messages = n_messages;
 
-    return msg_info;
+    if (mimap->msgids) {
+        for (i = n_messages; i < mimap->msgids->len; i++)
+            g_free(g_ptr_array_index(mimap->msgids, i));
+        g_ptr_array_set_size(mimap->msgids, n_messages);
+    }
 }
 
 #define IMAP_MAILBOX_UID_VALIDITY(mailbox) (LIBBALSA_MAILBOX_IMAP(mailbox)->uid_validity)
@@ -268,6 +368,8 @@ libbalsa_mailbox_imap_class_init(LibBalsaMailboxImapClass * klass)
         libbalsa_mailbox_imap_fetch_headers;
     libbalsa_mailbox_class->get_message_part = 
         libbalsa_mailbox_imap_get_msg_part;
+    libbalsa_mailbox_class->get_part_stream =
+        libbalsa_mailbox_imap_get_part_stream;
     libbalsa_mailbox_class->get_message_stream =
 	libbalsa_mailbox_imap_get_message_stream;
     libbalsa_mailbox_class->duplicate_msgnos =
@@ -288,6 +390,8 @@ libbalsa_mailbox_imap_class_init(LibBalsaMailboxImapClass * klass)
 	libbalsa_mailbox_imap_total_messages;
     libbalsa_mailbox_class->messages_copy =
 	libbalsa_mailbox_imap_messages_copy;
+    libbalsa_mailbox_class->messages_move =
+	libbalsa_mailbox_imap_messages_move;
 }
 
 static void
@@ -296,8 +400,10 @@ libbalsa_mailbox_imap_init(LibBalsaMailboxImap * mailbox)
     mailbox->path = NULL;
     mailbox->handle = NULL;
     mailbox->handle_refs = 0;
+    mailbox->search_results = NULL;
     mailbox->sort_ranks = g_array_new(FALSE, FALSE, sizeof(guint));
     mailbox->sort_field = -1;	/* Initially invalid. */
+    mailbox->fetch_window = FETCH_WINDOW_MIN;
 }
 
 /* libbalsa_mailbox_imap_finalize:
@@ -318,6 +424,7 @@ libbalsa_mailbox_imap_finalize(GObject * object)
     g_assert(LIBBALSA_MAILBOX(mailbox)->open_ref == 0);
 
     remote = LIBBALSA_MAILBOX_REMOTE(object);
+    lbm_imap_unwatch(mailbox);
     g_free(mailbox->path); mailbox->path = NULL;
 
     if(remote->server) {
@@ -330,6 +437,10 @@ libbalsa_mailbox_imap_finalize(GObject * object)
     }
 
     g_array_free(mailbox->sort_ranks, TRUE); mailbox->sort_ranks = NULL;
+    if (mailbox->search_results) {
+        g_hash_table_destroy(mailbox->search_results);
+        mailbox->search_results = NULL;
+    }
     if(mailbox->unread_update_id) {
         g_source_remove(mailbox->unread_update_id);
         mailbox->unread_update_id = 0;
@@ -338,6 +449,9 @@ libbalsa_mailbox_imap_finalize(GObject * object)
     g_list_foreach(mailbox->acls, (GFunc)imap_user_acl_free, NULL);
     g_list_free(mailbox->acls);
 
+    lbm_imap_prefetch_free(mailbox->prefetch);
+    lbm_imap_offline_free(mailbox->offline);
+
     if (G_OBJECT_CLASS(parent_class)->finalize)
 	G_OBJECT_CLASS(parent_class)->finalize(object);
 }
@@ -368,6 +482,7 @@ void
 libbalsa_mailbox_imap_set_path(LibBalsaMailboxImap* mailbox, const gchar* path)
 {
     g_return_if_fail(mailbox);
+    lbm_imap_unwatch(mailbox);
     g_free(mailbox->path);
     mailbox->path = g_strdup(path);
     libbalsa_mailbox_imap_update_url(mailbox);
@@ -464,10 +579,11 @@ get_header_cache_path(LibBalsaMailboxImap *mimap)
 {
     LibBalsaServer *s = LIBBALSA_MAILBOX_REMOTE(mimap)->server;
     gchar *cache_dir = get_cache_dir(TRUE); /* FIXME */
-    gchar *header_file = g_strdup_printf("%s@%s-%s-%u-headers2",
+    /* The cache is read before the mailbox is selected, so the name
+       cannot depend on UIDVALIDITY; the file records it instead. */
+    gchar *header_file = g_strdup_printf("%s@%s-%s-headers4",
 					 s->user, s->host,
-					 (mimap->path ? mimap->path : "INBOX"),
-					 mimap->uid_validity);
+					 (mimap->path ? mimap->path : "INBOX"));
     gchar *encoded_path = libbalsa_urlencode(header_file);
     g_free(header_file);
     header_file = g_build_filename(cache_dir, encoded_path, NULL);
@@ -477,123 +593,154 @@ get_header_cache_path(LibBalsaMailboxImap *mimap)
     return header_file;
 }
 
-static gchar**
-get_cache_name_pair(LibBalsaMailboxImap* mailbox, const gchar *type,
-                    ImapUID uid)
+/* Removes the header cache files of the formats that preceded the
+ * one of get_header_cache_path(): "...-headers3", and
+ * "...-UIDVALIDITY-headers2", which cannot be named without knowing
+ * the UIDVALIDITY it was saved with. */
+static void
+lbm_imap_drop_old_header_caches(LibBalsaMailboxImap * mimap)
 {
-    LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-    LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-    gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(is);
-    gchar **res = g_malloc(3*sizeof(gchar*));
-    ImapUID uid_validity = LIBBALSA_MAILBOX_IMAP(mailbox)->uid_validity;
-    gchar *fname;
+    LibBalsaServer *s = LIBBALSA_MAILBOX_REMOTE(mimap)->server;
+    gchar *cache_dir = get_cache_dir(TRUE);
+    gchar *name, *prefix, *path;
+    GDir *dir;
 
-    res[0] = get_cache_dir(is_persistent);
-    fname = g_strdup_printf("%s@%s-%s-%u-%u-%s",
-                            s->user, s->host,
-                            (mailbox->path ? mailbox->path : "INBOX"),
-                            uid_validity, uid, type);
-    res[1] = libbalsa_urlencode(fname);
-    g_free(fname);
-    res[2] = NULL;
+    name = g_strdup_printf("%s@%s-%s-", s->user, s->host,
+                           mimap->path ? mimap->path : "INBOX");
+    prefix = libbalsa_urlencode(name);
+    g_free(name);
 
-    return res;
+    name = g_strconcat(prefix, "headers3", NULL);
+    path = g_build_filename(cache_dir, name, NULL);
+    unlink(path);
+    g_free(path);
+    g_free(name);
+
+    if ((dir = g_dir_open(cache_dir, 0, NULL)) != NULL) {
+        const gchar *entry;
+        gsize len = strlen(prefix);
+
+        while ((entry = g_dir_read_name(dir)) != NULL) {
+            const gchar *p = entry + len;
+
+            if (strncmp(entry, prefix, len) != 0
+                || !g_ascii_isdigit(*p))
+                continue;
+            while (g_ascii_isdigit(*p))
+                p++;
+            if (strcmp(p, "-headers2") != 0)
+                continue;
+            path = g_build_filename(cache_dir, entry, NULL);
+            unlink(path);
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+
+    g_free(prefix);
+    g_free(cache_dir);
 }
 
-/* clean_cache:
-   removes unused entries from the cache file.
-*/
-struct file_info {
-    char  *name;
-    off_t  size;
-    time_t time;
-};
-static gint
-cmp_by_time (gconstpointer  a, gconstpointer  b)
+/* The flag changes made while the server could not be reached. */
+static gchar *
+get_journal_path(LibBalsaMailboxImap * mimap)
 {
-    return ((const struct file_info*)b)->time
-        -((const struct file_info*)a)->time;
+    gchar *header_file = get_header_cache_path(mimap);
+    gchar *journal_file = g_strconcat(header_file, "-journal", NULL);
+
+    g_free(header_file);
+
+    return journal_file;
 }
 
-static void
-clean_dir(const char *dir_name, off_t cache_size)
+/* The cache of the bodies and parts of the messages in the mailbox. */
+static LibBalsaImapCache *
+get_cache(LibBalsaMailboxImap * mimap)
 {
-    GDir* dir;
-    const gchar *entry;
-    GList *list, *lst;
-    off_t sz;
+    LibBalsaServer *s = LIBBALSA_MAILBOX_REMOTE(mimap)->server;
+    gboolean is_persistent =
+        libbalsa_imap_server_has_persistent_cache(LIBBALSA_IMAP_SERVER(s));
+    gchar *dir = get_cache_dir(is_persistent);
+    LibBalsaImapCache *cache = libbalsa_imap_cache_get(dir);
 
-    dir = g_dir_open(dir_name, 0U, NULL);	/* do not notify the user about errors */
-    if (!dir)
-        return;
+    g_free(dir);
 
-    list = NULL;
-    while ((entry = g_dir_read_name(dir)) != NULL) {
-        struct stat st;
-        struct file_info *fi;
-        gchar *fname = g_build_filename(dir_name, entry, NULL);
+    return cache;
+}
 
-        if(stat(fname, &st) == -1 || !S_ISREG(st.st_mode)) {
-	    g_free(fname);
-            continue;
-	}
-        fi = g_new(struct file_info,1);
-        fi->name = fname;
-        fi->size = st.st_size;
-        fi->time = st.st_atime;
-        list = g_list_prepend(list, fi);
-    }
-    g_dir_close(dir);
-
-    list = g_list_sort(list, cmp_by_time);
-    sz = 0;
-    for(lst = list; lst; lst = lst->next) {
-        struct file_info *fi = (struct file_info*)(lst->data);
-        sz += fi->size;
-        if(sz>cache_size) {
-            /* printf("removing %s\n", fi->name); */
-            unlink(fi->name);
-        }
-        g_free(fi->name);
-        g_free(fi);
-    }
-    g_list_free(list);
+/* The name of a message of the mailbox in the cache. */
+static gchar *
+get_cache_key(LibBalsaMailboxImap * mimap, ImapUID uid_validity,
+              ImapUID uid)
+{
+    LibBalsaServer *s = LIBBALSA_MAILBOX_REMOTE(mimap)->server;
+    gchar *name, *key;
+
+    name = g_strdup_printf("%s@%s-%s-%u-%u", s->user, s->host,
+                           (mimap->path ? mimap->path : "INBOX"),
+                           uid_validity, uid);
+    key = libbalsa_urlencode(name);
+    g_free(name);
+
+    return key;
 }
 
+/* clean_cache:
+   evicts the least recently used entries from the cache, leaving room
+   for the offline copies.
+*/
 static gboolean
 clean_cache(LibBalsaMailbox* mailbox)
 {
-    LibBalsaServer *s= LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
-    gboolean is_persistent =
-        libbalsa_imap_server_has_persistent_cache(LIBBALSA_IMAP_SERVER(s));
-    gchar* dir;
+    off_t offline_size;
 
-    dir = get_cache_dir(is_persistent);
-    clean_dir(dir, ImapCacheSize);
-    g_free(dir);
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    offline_size = ImapOfflineSize;
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+    libbalsa_imap_cache_trim(get_cache(LIBBALSA_MAILBOX_IMAP(mailbox)),
+                             ImapCacheSize + offline_size);
  
     return TRUE;
 }
 struct ImapCacheManager;
 static struct ImapCacheManager*imap_cache_manager_new_from_file(const char *header_cache_path);
 static void imap_cache_manager_free(struct ImapCacheManager *icm);
-static struct ImapCacheManager *icm_store_cached_data(ImapMboxHandle *h);
+static struct ImapCacheManager *icm_store_cached_data(ImapMboxHandle *h,
+                                                      struct ImapCacheManager *prev);
 static void icm_restore_from_cache(ImapMboxHandle *h,
                                    struct ImapCacheManager *icm);
+static guint64 icm_get_modseq(struct ImapCacheManager *icm,
+                              ImapUID *uidvalidity);
 static gboolean icm_save_to_file(struct ImapCacheManager *icm,
 				 const gchar *path);
+static ImapMboxHandle *icm_new_offline_handle(struct ImapCacheManager *icm,
+                                              const gchar *mbox);
+static ImapMboxHandle *lbm_imap_get_offline_handle(LibBalsaMailboxImap *
+                                                   mimap,
+                                                   struct ImapCacheManager *
+                                                   icm);
 
 static ImapResult
 mi_reconnect(ImapMboxHandle *h)
 {
-    struct ImapCacheManager *icm = icm_store_cached_data(h);
+    struct ImapCacheManager *icm;
     ImapResult r;
     unsigned old_cnt = imap_mbox_handle_get_exists(h);
     unsigned old_next = imap_mbox_handle_get_uidnext(h);
 
+    /* A mailbox opened offline stays so until it is reopened. */
+    if(imap_mbox_handle_is_offline(h))
+        return IMAP_CONNECT_FAILED;
+    /* The messages restored from icm are decoded as needed, so it
+     * stays with the handle until the next reconnect; as it is
+     * stored with the previous one as prev, it does not borrow the
+     * data of the latter. */
+    icm = icm_store_cached_data(h, g_object_get_data(G_OBJECT(h),
+                                                     "cache-manager"));
     r = imap_mbox_handle_reconnect(h, NULL);
     if(r==IMAP_SUCCESS) icm_restore_from_cache(h, icm);
-    imap_cache_manager_free(icm);
+    g_object_set_data_full(G_OBJECT(h), "cache-manager", icm,
+                           (GDestroyNotify) imap_cache_manager_free);
     if(imap_mbox_handle_get_exists(h) != old_cnt ||
        imap_mbox_handle_get_uidnext(h) != old_next)
 	g_signal_emit_by_name(h, "exists-notify", 0);
@@ -673,34 +820,67 @@ lbimap_update_flags(LibBalsaMessage *message, ImapMessage *imsg)
 	message->flags |= LIBBALSA_MESSAGE_FLAG_RECENT;
 }
 
+static unsigned
+mi_fetch_window(LibBalsaMailboxImap *mimap)
+{
+    ImapFetchStats stats;
+    double target = FETCH_WINDOW_MAX;
+    unsigned window;
+
+    imap_mbox_handle_get_fetch_stats(mimap->handle, &stats);
+    if (stats.samples == 0)
+        return mimap->fetch_window;
+    if (stats.per_message > 0)
+        target = MIN(FETCH_RTT_SHARE * stats.rtt, FETCH_TIME_BUDGET)
+            / stats.per_message;
+    window = CLAMP(target, FETCH_WINDOW_MIN, FETCH_WINDOW_MAX);
+    if (window > 2 * mimap->fetch_window)
+        window = 2 * mimap->fetch_window;
+    g_debug("%s: rtt %.1f ms, %.3f ms/message after %u fetches; "
+            "window %u -> %u", __func__, stats.rtt * 1000,
+            stats.per_message * 1000, stats.samples,
+            mimap->fetch_window, window);
+    mimap->fetch_window = window;
+
+    return window;
+}
+
 /* mi_get_imsg is a thin wrapper around imap_mbox_handle_get_msg().
    We wrap around imap_mbox_handle_get_msg() in case the libimap data
    was invalidated by eg. disconnect.
 */
 struct collect_seq_data {
     unsigned *msgno_arr;
+    unsigned window;
     unsigned cnt;
     unsigned needed_msgno;
     unsigned has_it;
+    unsigned after;    /* how many messages to get after the needed one */
+    unsigned last_pos; /* position of the previously needed message */
 };
 
-static const unsigned MAX_CHUNK_LENGTH = 20; 
 static gboolean
 collect_seq_cb(GNode *node, gpointer data)
 {
     /* We prefetch envelopes in chunks to save on RTTs.
-     * Try to get the messages both before and after the message. */
+     * Try to get the messages both before and after the message,
+     * more of them in the direction the user scrolls. */
     struct collect_seq_data *csd = (struct collect_seq_data*)data;
     unsigned msgno = GPOINTER_TO_UINT(node->data);
     if(msgno==0) /* root node */
         return FALSE;
-    csd->msgno_arr[(csd->cnt++) % MAX_CHUNK_LENGTH] = msgno;
+    csd->msgno_arr[(csd->cnt++) % csd->window] = msgno;
     if(csd->has_it>0) csd->has_it++;
-    if(csd->needed_msgno == msgno)
+    if(csd->needed_msgno == msgno) {
         csd->has_it = 1;
-    /* quit if we have enough messages and at least half of them are
-     * after message in question. */
-    return csd->cnt >= MAX_CHUNK_LENGTH && csd->has_it*2>MAX_CHUNK_LENGTH;
+        if (csd->last_pos > 0 && csd->cnt != csd->last_pos)
+            csd->after = csd->cnt > csd->last_pos
+                ? csd->window * 3 / 4 : csd->window / 4;
+        csd->last_pos = csd->cnt;
+    }
+    /* quit if we have enough messages and enough of them are after
+     * message in question. */
+    return csd->cnt >= csd->window && csd->has_it > csd->after;
 }
 
 static int
@@ -721,15 +901,19 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
      * structure but message size or UID etc will not be available. */
     if( (imsg = imap_mbox_handle_get_msg(mimap->handle, msgno)) 
         != NULL && imsg->envelope) return imsg;
+    csd.window       = mi_fetch_window(mimap);
     csd.needed_msgno = msgno;
-    csd.msgno_arr    = g_malloc(MAX_CHUNK_LENGTH*sizeof(csd.msgno_arr[0]));
+    csd.msgno_arr    = g_new(unsigned, csd.window);
     csd.cnt          = 0;
     csd.has_it       = 0;
+    csd.after        = csd.window / 2;
+    csd.last_pos     = mimap->fetch_pos;
     if(LIBBALSA_MAILBOX(mimap)->msg_tree) {
         g_node_traverse(LIBBALSA_MAILBOX(mimap)->msg_tree,
                         G_PRE_ORDER, G_TRAVERSE_ALL, -1, collect_seq_cb,
                         &csd);
-        if(csd.cnt>MAX_CHUNK_LENGTH) csd.cnt = MAX_CHUNK_LENGTH;
+        mimap->fetch_pos = csd.last_pos;
+        if(csd.cnt>csd.window) csd.cnt = csd.window;
         qsort(csd.msgno_arr, csd.cnt, sizeof(csd.msgno_arr[0]), cmp_msgno);
     } else {
         /* It may happen that we want to perform an automatic
@@ -738,9 +922,9 @@ mi_get_imsg(LibBalsaMailboxImap *mimap, unsigned msgno)
            current eg. _copy() instructions will require that
            LibBalsaMessage object are present, and these require that
            some basic information is fetched from the server.  */
-        unsigned i, total_msgs = mimap->messages_info->len;
-        csd.cnt = msgno+MAX_CHUNK_LENGTH>total_msgs
-            ? total_msgs-msgno+1 : MAX_CHUNK_LENGTH;
+        unsigned i, total_msgs = mimap->n_messages;
+        csd.cnt = msgno+csd.window>total_msgs
+            ? total_msgs-msgno+1 : csd.window;
         for(i=0; i<csd.cnt; i++) csd.msgno_arr[i] = msgno+i;
     }
     II(rc,mimap->handle,
@@ -782,16 +966,114 @@ idle_unread_update_cb(LibBalsaMailbox *mailbox)
     return FALSE;
 }
 
+/* Server-side search results (see "Search iters" below) are kept per
+ * condition while the mailbox is open, so that switching view filters
+ * back and forth does not search the server again.  New messages are
+ * searched separately and expunged ones are dropped locally; only a
+ * change of flags can make a result stale, and only if the condition
+ * tests flags. */
+typedef struct {
+    GArray *msgnos;       /* matching messages, ascending */
+    guint covered;        /* messages 1..covered have been searched */
+    ImapUID uidnext;      /* UIDNEXT when they were */
+    guint64 modseq;       /* HIGHESTMODSEQ when they were */
+    gboolean uses_flags;  /* the condition tests message flags */
+} LbmImapSearchResult;
+
+static void
+lbm_imap_search_result_free(LbmImapSearchResult * res)
+{
+    g_array_free(res->msgnos, TRUE);
+    g_free(res);
+}
+
+static void
+lbm_imap_searches_clear(LibBalsaMailboxImap * mimap)
+{
+    if (mimap->search_results
+        && g_hash_table_size(mimap->search_results) > 0) {
+        g_hash_table_remove_all(mimap->search_results);
+        ++mimap->search_stamp;
+    }
+}
+
+/* Drops the expunged messages seqnos, ascending, from the search
+ * results. */
+static void
+lbm_imap_searches_remove(LibBalsaMailboxImap * mimap, const guint * seqnos,
+                         guint n)
+{
+    GHashTableIter iter;
+    LbmImapSearchResult *res;
+
+    if (!mimap->search_results)
+        return;
+
+    g_hash_table_iter_init(&iter, mimap->search_results);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & res)) {
+        guint i, j, k;
+
+        for (i = j = k = 0; i < res->msgnos->len; i++) {
+            guint msgno = g_array_index(res->msgnos, guint, i);
+
+            while (k < n && seqnos[k] < msgno)
+                k++;
+            if (k < n && seqnos[k] == msgno)
+                continue;
+            g_array_index(res->msgnos, guint, j++) = msgno - k;
+        }
+        g_array_set_size(res->msgnos, j);
+
+        for (k = 0; k < n && seqnos[k] <= res->covered; k++)
+            ;
+        res->covered -= k;
+    }
+}
+
+/* Drops the results that flag changes of messages from seqno on may
+ * have made stale.  Flags that are merely fetched again do not count:
+ * either the flag cache of the handle changed, which covers messages
+ * not loaded in libbalsa too, or the server reported a change, which
+ * raised HIGHESTMODSEQ. */
+static void
+lbm_imap_searches_flags(LibBalsaMailboxImap * mimap, guint seqno,
+                        gboolean changed)
+{
+    GHashTableIter iter;
+    LbmImapSearchResult *res;
+    guint64 modseq;
+    gboolean removed = FALSE;
+
+    if (!mimap->search_results)
+        return;
+
+    modseq = imap_mbox_handle_get_highestmodseq(mimap->handle);
+    g_hash_table_iter_init(&iter, mimap->search_results);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & res)) {
+        if (res->uses_flags && seqno <= res->covered
+            && (changed || (modseq != 0 && modseq != res->modseq))) {
+            g_hash_table_iter_remove(&iter);
+            removed = TRUE;
+        }
+    }
+    if (removed)
+        ++mimap->search_stamp;
+}
+
 static void
 imap_flags_cb(unsigned cnt, const unsigned seqno[], LibBalsaMailboxImap *mimap)
 {
     LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
-    unsigned i;
+    unsigned i, lowest = G_MAXUINT, changed_from;
+    gboolean changed = FALSE;
 
     libbalsa_lock_mailbox(mailbox);
+    /* Also set for messages that are not loaded, e.g. after a silent
+     * STORE or unsolicited FETCH FLAGS without CONDSTORE. */
+    changed_from = imap_mbox_handle_take_flags_changed(mimap->handle);
     for(i=0; i<cnt; i++) {
         struct message_info *msg_info = 
-            message_info_from_msgno(mimap, seqno[i]);
+            message_info_from_msgno(mimap, seqno[i], FALSE);
         if(msg_info && msg_info->message) {
             LibBalsaMessageFlag flags;
             /* since we are talking here about updating just received,
@@ -810,14 +1092,200 @@ imap_flags_cb(unsigned cnt, const unsigned seqno[], LibBalsaMailboxImap *mimap)
 	    libbalsa_mailbox_index_set_flags(mailbox, seqno[i],
 					     msg_info->message->flags);
 	    ++mimap->search_stamp;
+            changed = TRUE;
         }
     }
+    for(i=0; i<cnt; i++)
+        if(seqno[i] < lowest)
+            lowest = seqno[i];
+    if (changed_from > 0) {
+        if (changed_from < lowest)
+            lowest = changed_from;
+        changed = TRUE;
+    }
+    lbm_imap_searches_flags(mimap, lowest, changed);
     if(!mimap->unread_update_id)
         mimap->unread_update_id =
             g_idle_add((GSourceFunc)idle_unread_update_cb, mailbox);
     libbalsa_unlock_mailbox(mailbox);
 }
 
+/* The sort ranks (see "Sorting" below) are kept up to date as messages
+ * come and go, so that the mailbox need not be sorted again.  They are
+ * dense: the n ranked messages have ranks 0..n-1. */
+#define LBM_IMAP_UNRANKED G_MAXUINT
+
+static ImapSortKey lbmi_get_imap_sort_key(LibBalsaMailbox *mbox);
+
+/* Gives message seqno the rank, moving the messages at or below it. */
+static void
+lbm_imap_rank_insert(LibBalsaMailboxImap * mimap, guint seqno, guint rank)
+{
+    GArray *ranks = mimap->sort_ranks;
+    guint i, n = 0, unranked = LBM_IMAP_UNRANKED;
+
+    if (seqno <= ranks->len
+        && g_array_index(ranks, guint, seqno - 1) != LBM_IMAP_UNRANKED)
+        return;                 /* Already placed. */
+    while (ranks->len < seqno)
+        g_array_append_val(ranks, unranked);
+    for (i = 0; i < ranks->len; i++) {
+        guint *r = &g_array_index(ranks, guint, i);
+
+        if (*r == LBM_IMAP_UNRANKED)
+            continue;
+        n++;
+        if (*r >= rank)
+            ++*r;
+    }
+    g_array_index(ranks, guint, seqno - 1) = MIN(rank, n);
+}
+
+/* Called with the handle locked when the server (CONTEXT=SORT) places
+ * a new message in the sorted mailbox. */
+static void
+imap_sort_update_cb(ImapMboxHandle * handle, guint position, guint seqno,
+                    gboolean added, LibBalsaMailboxImap * mimap)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+
+    if (!added)  /* imap_expunge_batch_cb() takes care of these. */
+        return;
+
+    libbalsa_lock_mailbox(mailbox);
+    if (mimap->sort_field != (LibBalsaMailboxSortFields) -1
+        && mimap->sort_field != LB_MAILBOX_SORT_NO) {
+        if (position > 0)
+            lbm_imap_rank_insert(mimap, seqno, position - 1);
+        else
+            mimap->sort_field = -1;	/* Invalidate. */
+    }
+    libbalsa_unlock_mailbox(mailbox);
+}
+
+/* Drops the expunged messages seqnos, ascending, from the ranks. */
+static void
+lbm_imap_ranks_remove(LibBalsaMailboxImap * mimap, const guint * seqnos,
+                      guint n)
+{
+    GArray *ranks = mimap->sort_ranks;
+    guint *gone, i, j, k, m;
+
+    if (mimap->sort_field == (LibBalsaMailboxSortFields) -1)
+        return;
+
+    gone = g_new(guint, n);
+    for (k = m = 0; k < n && seqnos[k] <= ranks->len; k++) {
+        guint r = g_array_index(ranks, guint, seqnos[k] - 1);
+
+        if (r != LBM_IMAP_UNRANKED)
+            gone[m++] = r;
+    }
+    qsort(gone, m, sizeof(guint), cmp_msgno);
+
+    for (i = j = k = 0; i < ranks->len; i++) {
+        guint r = g_array_index(ranks, guint, i);
+
+        if (k < n && seqnos[k] == i + 1) {
+            k++;
+            continue;
+        }
+        if (r != LBM_IMAP_UNRANKED) {
+            guint lo = 0, hi = m;
+
+            while (lo < hi) {
+                guint mid = (lo + hi) / 2;
+
+                if (gone[mid] < r)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            r -= lo;
+        }
+        g_array_index(ranks, guint, j++) = r;
+    }
+    g_array_set_size(ranks, j);
+    g_free(gone);
+}
+
+/* Ranks the messages that arrived since the mailbox was sorted and
+ * were not placed by the server, by merging them into the sorted
+ * mailbox; if that fails, the ranks are invalidated. */
+static void
+lbm_imap_ranks_extend(LibBalsaMailboxImap * mimap)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+    GArray *ranks = mimap->sort_ranks;
+    guint total = mimap->n_messages;
+    guint i, cnt, new_cnt, unranked = LBM_IMAP_UNRANKED;
+    guint *order, *new_msgno, *pos;
+    ImapResponse rc;
+
+    if (mimap->sort_field == (LibBalsaMailboxSortFields) -1)
+        return;
+    if (mimap->sort_field != mailbox->view->sort_field
+        || ranks->len > total) {
+        mimap->sort_field = -1;	/* Invalidate. */
+        return;
+    }
+    while (ranks->len < total)
+        g_array_append_val(ranks, unranked);
+
+    new_msgno = g_new(guint, total);
+    for (i = new_cnt = 0; i < total; i++)
+        if (g_array_index(ranks, guint, i) == LBM_IMAP_UNRANKED)
+            new_msgno[new_cnt++] = i + 1;
+    if (new_cnt == 0) {
+        g_free(new_msgno);
+        return;
+    }
+
+    cnt = total - new_cnt;
+    order = g_new(guint, cnt);
+    for (i = 0; i < total; i++) {
+        guint r = g_array_index(ranks, guint, i);
+
+        if (r != LBM_IMAP_UNRANKED)
+            order[r] = i + 1;
+    }
+    pos = g_new(guint, new_cnt);
+    II(rc, mimap->handle,
+       imap_mbox_sort_merge(mimap->handle,
+                            mimap->sort_field == LB_MAILBOX_SORT_NO
+                            ? IMSO_MSGNO : lbmi_get_imap_sort_key(mailbox),
+                            order, cnt, new_msgno, new_cnt, pos));
+    g_free(order);
+
+    if (rc == IMR_OK) {
+        /* new_msgno is now sorted, and pos ascends with it.  A message
+         * of rank r moves down by the number of new messages that go
+         * before it. */
+        for (i = 0; i < total; i++) {
+            guint *r = &g_array_index(ranks, guint, i);
+            guint lo = 0, hi = new_cnt;
+
+            if (*r == LBM_IMAP_UNRANKED)
+                continue;
+            while (lo < hi) {
+                guint mid = (lo + hi) / 2;
+
+                if (pos[mid] <= *r)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            *r += lo;
+        }
+        for (i = 0; i < new_cnt; i++)
+            g_array_index(ranks, guint, new_msgno[i] - 1) = pos[i] + i;
+    } else
+        mimap->sort_field = -1;	/* Invalidate. */
+
+    g_free(pos);
+    g_free(new_msgno);
+}
+
 static gboolean
 imap_exists_idle(gpointer data)
 {
@@ -827,54 +1295,48 @@ imap_exists_idle(gpointer data)
 
     libbalsa_lock_mailbox(mailbox);
 
-    mimap->sort_field = -1;	/* Invalidate. */
-
     if(mimap->handle && /* was it closed in meantime? */
        (cnt = imap_mbox_handle_get_exists(mimap->handle))
-       != mimap->messages_info->len) {
-        unsigned i;
-        struct message_info a = {0};
+       != mimap->n_messages) {
+        unsigned i, old_cnt = mimap->n_messages;
         GNode *sibling = NULL;
 
-        if(cnt<mimap->messages_info->len) {
+        if(cnt<mimap->n_messages) {
             /* remove messages; we probably missed some EXPUNGE responses
                - the only sensible scenario is that the connection was
                severed. Still, we need to recover from this somehow... -
                We invalidate all the cache now. */
             printf("%s: expunge ignored? Had %u messages and now only %u. "
                    "Bug in the program or broken connection\n",
-                   __func__, mimap->messages_info->len, cnt);
-            for(i=0; i<mimap->messages_info->len; i++) {
-                gchar *msgid;
+                   __func__, mimap->n_messages, cnt);
+            mimap->sort_field = -1;	/* Invalidate. */
+            lbm_imap_searches_clear(mimap);
+            for(i=0; i<mimap->n_messages; i++) {
                 struct message_info *msg_info =
-                    message_info_from_msgno(mimap, i+1);
-                if(!msg_info)
-                    continue;
-                if(msg_info->message)
+                    message_info_from_msgno(mimap, i+1, FALSE);
+                if(msg_info && msg_info->message) {
                     g_object_unref(msg_info->message);
-                msg_info->message = NULL;
-                msgid = g_ptr_array_index(mimap->msgids, i);
-                if(msgid) { 
-                    g_free(msgid);
+                    msg_info->message = NULL;
+                }
+                if(mimap->msgids) {
+                    g_free(g_ptr_array_index(mimap->msgids, i));
                     g_ptr_array_index(mimap->msgids, i) = NULL;
                 }
                 libbalsa_mailbox_index_entry_clear(mailbox, i + 1);
             }
-            for(i=mimap->messages_info->len; i>cnt; i--) {
-                g_array_remove_index(mimap->messages_info, i-1);
-                g_ptr_array_remove_index(mimap->msgids, i-1);
+            message_info_set_size(mimap, cnt);
+            for(i=old_cnt; i>cnt; i--)
                 libbalsa_mailbox_msgno_removed(mailbox, i);
-            }
         } 
 
         if (mailbox->msg_tree)
             sibling = g_node_last_child(mailbox->msg_tree);
-        for(i=mimap->messages_info->len+1; i <= cnt; i++) {
-            g_array_append_val(mimap->messages_info, a);
-            g_ptr_array_add(mimap->msgids, NULL);
+        old_cnt = mimap->n_messages;
+        message_info_set_size(mimap, cnt);
+        for(i=old_cnt+1; i <= cnt; i++)
             libbalsa_mailbox_msgno_inserted(mailbox, i, mailbox->msg_tree,
                                             &sibling);
-        }
+        lbm_imap_ranks_extend(mimap);
         ++mimap->search_stamp;
         
 	libbalsa_mailbox_run_filters_on_reception(mailbox);
@@ -894,57 +1356,109 @@ imap_exists_cb(ImapMboxHandle *handle, LibBalsaMailboxImap *mimap)
     g_idle_add(imap_exists_idle, mimap);
 }
 
+/* Drops the body and parts of the message from the cache. */
 static void
-imap_expunge_cb(ImapMboxHandle *handle, unsigned seqno,
-                LibBalsaMailboxImap *mimap)
+lbm_imap_remove_cache(LibBalsaMailboxImap * mimap, ImapUID uid)
+{
+    gchar *key = get_cache_key(mimap, mimap->uid_validity, uid);
+    libbalsa_imap_cache_remove(get_cache(mimap), key, NULL);
+    g_free(key);
+}
+
+/* Cached items of expunged messages are dropped in a thread of their
+ * own, as an expunge may leave many files to unlink. */
+struct lbm_imap_remove_info {
+    LibBalsaImapCache *cache;
+    GPtrArray *keys;
+};
+
+static gpointer
+lbm_imap_remove_cache_thread(struct lbm_imap_remove_info *info)
 {
-    ImapMessage *imsg;
     guint i;
 
+    for (i = 0; i < info->keys->len; i++)
+        libbalsa_imap_cache_remove(info->cache,
+                                   g_ptr_array_index(info->keys, i), NULL);
+    g_ptr_array_free(info->keys, TRUE);
+    g_free(info);
+
+    return NULL;
+}
+
+/* The handle reports the expunged messages in batches; seqnos are
+ * ascending and numbered as before the expunge, uids are 0 where
+ * unknown. */
+static void
+imap_expunge_batch_cb(ImapMboxHandle * handle, const unsigned *seqnos,
+                      const ImapUID * uids, unsigned n,
+                      LibBalsaMailboxImap * mimap)
+{
     LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
-    struct message_info *msg_info;
+    GPtrArray *keys;
+    guint i, j, k;
 
     libbalsa_lock_mailbox(mailbox);
 
-    libbalsa_mailbox_msgno_removed(mailbox, seqno);
+    libbalsa_mailbox_msgnos_removed(mailbox, seqnos, n);
     ++mimap->search_stamp;
-    mimap->sort_field = -1;	/* Invalidate. */
-
-    /* Use imap_mbox_handle_get_msg(mimap->handle, seqno)->uid, not
-     * IMAP_MESSAGE_UID(msg_info->message), as the latter may try to
-     * fetch the message from the server. */
-    if ((imsg = imap_mbox_handle_get_msg(mimap->handle, seqno))) {
-	gchar **pair = get_cache_name_pair(mimap, "body", imsg->uid);
-        gchar *fn = g_build_filename(pair[0], pair[1], NULL);
-        unlink(fn); /* ignore error; perhaps the message 
-                     * was not in the cache.  */
-        g_free(fn);
-        g_strfreev(pair);
-    }
-
-    msg_info = message_info_from_msgno(mimap, seqno);
-    if (msg_info) {
-        if (msg_info->message)
-            g_object_unref(msg_info->message);
-        g_array_remove_index(mimap->messages_info, seqno-1);
-    }
-
-    if (seqno <= mimap->msgids->len) {
-        gchar *msgid;
-
-        msgid = g_ptr_array_index(mimap->msgids, seqno - 1);
-        g_free(msgid);
-        g_ptr_array_remove_index(mimap->msgids, seqno - 1);
+    lbm_imap_ranks_remove(mimap, seqnos, n);
+    lbm_imap_searches_remove(mimap, seqnos, n);
+
+    keys = g_ptr_array_new_with_free_func(g_free);
+    for (k = 0; k < n && !mimap->moving; k++)
+        if (uids[k])
+            g_ptr_array_add(keys, get_cache_key(mimap, mimap->uid_validity,
+                                                uids[k]));
+    if (keys->len > 0) {
+        struct lbm_imap_remove_info *info =
+            g_new(struct lbm_imap_remove_info, 1);
+
+        info->cache = get_cache(mimap);
+        info->keys = keys;
+        g_thread_unref(g_thread_new("lbm_imap_remove_cache",
+                                    (GThreadFunc)
+                                    lbm_imap_remove_cache_thread, info));
+    } else
+        g_ptr_array_free(keys, TRUE);
+
+    /* Pages that have not been allocated stay so, unless a message
+     * moves into them. */
+    for (i = j = k = 0; i < mimap->n_messages; i++) {
+        struct message_info *info =
+            message_info_from_msgno(mimap, i + 1, FALSE);
+
+        if (k < n && seqnos[k] == i + 1) {
+            if (info && info->message)
+                g_object_unref(info->message);
+            k++;
+            continue;
+        }
+        if (info && info->message)
+            info->message->msgno = j + 1;
+        if (j != i) {
+            if (info && (info->message || info->user_flags))
+                *message_info_from_msgno(mimap, j + 1, TRUE) = *info;
+            else if ((info = message_info_from_msgno(mimap, j + 1, FALSE)))
+                memset(info, 0, sizeof *info);
+        }
+        j++;
     }
 
-    for (i = seqno - 1; i < mimap->messages_info->len; i++) {
-	struct message_info *info =
-	    &g_array_index(mimap->messages_info, struct message_info, i);
+    if (mimap->msgids) {
+        for (i = j = k = 0; i < mimap->msgids->len; i++) {
+            gchar *msgid = g_ptr_array_index(mimap->msgids, i);
 
-        g_assert(info != NULL);
-	if (info->message)
-	    info->message->msgno = i + 1;
+            if (k < n && seqnos[k] == i + 1) {
+                g_free(msgid);
+                k++;
+                continue;
+            }
+            g_ptr_array_index(mimap->msgids, j++) = msgid;
+        }
+        g_ptr_array_set_size(mimap->msgids, j);
     }
+    message_info_set_size(mimap, j);
 
     libbalsa_unlock_mailbox(mailbox);
 }
@@ -962,7 +1476,13 @@ libbalsa_mailbox_imap_release_handle(LibBalsaMailboxImap * mimap)
 					     G_SIGNAL_MATCH_DATA,
 					     0, 0, NULL, NULL, mimap);
         imap_handle_set_flagscb(mimap->handle, NULL, NULL);
-	RELEASE_HANDLE(mimap, mimap->handle);
+        imap_handle_set_sortupdatecb(mimap->handle, NULL, NULL);
+        if (mimap->offline_open) {
+            /* not from the server pool */
+            g_object_unref(mimap->handle);
+            mimap->offline_open = 0;
+        } else
+	    RELEASE_HANDLE(mimap, mimap->handle);
 	mimap->handle = NULL;
     }
 }
@@ -984,11 +1504,17 @@ libbalsa_mailbox_imap_get_selected_handle(LibBalsaMailboxImap *mimap,
     imap_server = LIBBALSA_IMAP_SERVER(server);
     if(!mimap->handle) {
         mimap->handle = 
-	    libbalsa_imap_server_get_handle_with_user(imap_server,
-						      mimap, err);
+	    libbalsa_imap_server_get_handle_with_mbox(imap_server, mimap,
+						      mimap->path, err);
         if (!mimap->handle)
             return NULL;
     }
+    if (mimap->cache_modseq) {
+        imap_mbox_handle_set_qresync(mimap->handle,
+                                     mimap->cache_uid_validity,
+                                     mimap->cache_modseq);
+        mimap->cache_modseq = 0;
+    }
     II(rc,mimap->handle,
        imap_mbox_select(mimap->handle, mimap->path,
                         &(LIBBALSA_MAILBOX(mimap)->readonly)));
@@ -1019,11 +1545,14 @@ libbalsa_mailbox_imap_get_selected_handle(LibBalsaMailboxImap *mimap,
     }
 
     imap_handle_set_flagscb(mimap->handle, (ImapFlagsCb)imap_flags_cb, mimap);
+    imap_handle_set_sortupdatecb(mimap->handle,
+                                 (ImapSortUpdateCb) imap_sort_update_cb,
+                                 mimap);
     g_signal_connect(G_OBJECT(mimap->handle),
                      "exists-notify", G_CALLBACK(imap_exists_cb),
                      mimap);
     g_signal_connect(G_OBJECT(mimap->handle),
-                     "expunge-notify", G_CALLBACK(imap_expunge_cb),
+                     "expunge-batch", G_CALLBACK(imap_expunge_batch_cb),
                      mimap);
     mimap->handle_refs = 1;
     return mimap->handle;
@@ -1066,7 +1595,6 @@ static gboolean
 libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
 {
     LibBalsaMailboxImap *mimap;
-    unsigned i;
     guint total_messages;
     struct ImapCacheManager *icm;
     gboolean from_file = FALSE;
@@ -1074,39 +1602,53 @@ libbalsa_mailbox_imap_open(LibBalsaMailbox * mailbox, GError **err)
     g_return_val_if_fail(LIBBALSA_IS_MAILBOX_IMAP(mailbox), FALSE);
 
     mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    mimap->has_status = 0;
+    lbm_imap_unwatch(mimap);
+
+    icm = g_object_steal_data(G_OBJECT(mailbox), "cache-manager");
+    if(!icm) { /* Try restoring from file... */
+	gchar *header_cache_path = get_header_cache_path(mimap);
+        g_mutex_lock(&lbm_imap_cache_file_lock);
+	icm = imap_cache_manager_new_from_file(header_cache_path);
+        g_mutex_unlock(&lbm_imap_cache_file_lock);
+        if (!icm)
+            lbm_imap_drop_old_header_caches(mimap);
+	g_free(header_cache_path);
+        from_file = TRUE;
+    }
+    /* Let the server tell what changed since the cache was saved. */
+    mimap->cache_modseq = icm_get_modseq(icm, &mimap->cache_uid_validity);
 
     mimap->handle = libbalsa_mailbox_imap_get_selected_handle(mimap, err);
+    mimap->cache_modseq = 0;
+    if (!mimap->handle && icm && libbalsa_mailbox_get_offline(mailbox)
+        && (mimap->handle = lbm_imap_get_offline_handle(mimap, icm)))
+        g_clear_error(err);
     if (!mimap->handle) {
         mimap->opened         = FALSE;
 	mailbox->disconnected = TRUE;
+        if (icm && from_file)
+            imap_cache_manager_free(icm);
+        else if (icm)
+            g_object_set_data_full(G_OBJECT(mailbox), "cache-manager", icm,
+                                   (GDestroyNotify) imap_cache_manager_free);
 	return FALSE;
     }
 
     mimap->opened         = TRUE;
-    mailbox->disconnected = FALSE;
+    mailbox->disconnected = mimap->offline_open;
     total_messages = imap_mbox_handle_get_exists(mimap->handle);
-    mimap->messages_info = g_array_sized_new(FALSE, TRUE,
-					     sizeof(struct message_info),
-					     total_messages);
-    mimap->msgids = g_ptr_array_sized_new(total_messages);
-    for(i=0; i < total_messages; i++) {
-	struct message_info a = {0};
-	g_array_append_val(mimap->messages_info, a);
-	g_ptr_array_add(mimap->msgids, NULL);
-    }
-    icm = g_object_get_data(G_OBJECT(mailbox), "cache-manager");
-    if(!icm) { /* Try restoring from file... */
-	gchar *header_cache_path = get_header_cache_path(mimap);
-	icm = imap_cache_manager_new_from_file(header_cache_path);
-	g_free(header_cache_path);
-        from_file = TRUE;
-    }
+    message_info_set_size(mimap, total_messages);
     if (icm) {
+        /* The handle decodes the cached messages as needed; keep
+         * their data until the mailbox is closed. */
         icm_restore_from_cache(mimap->handle, icm);
-        if (from_file)
-            imap_cache_manager_free(icm);
-        else
-            g_object_set_data(G_OBJECT(mailbox), "cache-manager", NULL);
+        mimap->icm = icm;
+    }
+    if (libbalsa_mailbox_get_offline(mailbox)) {
+        lbm_imap_offline_get(mimap);
+        if (!mimap->offline_open && !mailbox->readonly)
+            lbm_imap_journal_replay(mimap, mimap->handle);
     }
 
     mailbox->first_unread = imap_mbox_handle_first_unseen(mimap->handle);
@@ -1128,25 +1670,21 @@ static void
 free_messages_info(LibBalsaMailboxImap * mbox)
 {
     guint i;
-    GArray *messages_info = mbox->messages_info;
 
-    if(messages_info->len != mbox->msgids->len)
-	g_warning("free_messages_info: array sizes do not match.");
-    for (i = 0; i < messages_info->len; i++) {
-	gchar *msgid;
+    for (i = 0; i < mbox->n_messages; i++) {
 	struct message_info *msg_info =
-	    &g_array_index(messages_info, struct message_info, i);
-	if (msg_info->message) {
+	    message_info_from_msgno(mbox, i + 1, FALSE);
+	if (msg_info && msg_info->message) {
 	    msg_info->message->mailbox = NULL;
 	    g_object_unref(msg_info->message);
+	    msg_info->message = NULL;
 	}
-	msgid = g_ptr_array_index(mbox->msgids, i);
-	if(msgid) g_free(msgid);
     }
-    g_array_free(mbox->messages_info, TRUE);
-    mbox->messages_info = NULL;
-    g_ptr_array_free(mbox->msgids, TRUE);
-    mbox->msgids = NULL;
+    message_info_set_size(mbox, 0);
+    if (mbox->msgids) {
+        g_ptr_array_free(mbox->msgids, TRUE);
+        mbox->msgids = NULL;
+    }
 }
 
 static void
@@ -1156,9 +1694,11 @@ libbalsa_mailbox_imap_close(LibBalsaMailbox * mailbox, gboolean expunge)
     LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
     gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(is);
     LibBalsaMailboxImap *mbox = LIBBALSA_MAILBOX_IMAP(mailbox);
-    struct ImapCacheManager *icm = icm_store_cached_data(mbox->handle);
+    struct ImapCacheManager *icm =
+        icm_store_cached_data(mbox->handle, mbox->icm);
 
     mbox->opened = FALSE;
+    lbm_imap_prefetch_cancel(mbox);
     g_object_set_data_full(G_OBJECT(mailbox), "cache-manager", icm,
                            (GDestroyNotify) imap_cache_manager_free);
 
@@ -1177,65 +1717,865 @@ libbalsa_mailbox_imap_close(LibBalsaMailbox * mailbox, gboolean expunge)
 	/* Implement only for persistent. Cache dir is shared for all
 	   non-persistent caches. */
 	gchar *header_file = get_header_cache_path(mbox);
+        g_mutex_lock(&lbm_imap_cache_file_lock);
 	icm_save_to_file(icm, header_file);
+        g_mutex_unlock(&lbm_imap_cache_file_lock);
 	g_free(header_file);
     }
     clean_cache(mailbox);
 
+    if (mbox->handle)
+        imap_mbox_handle_drop_deferred(mbox->handle);
+    if (mbox->icm) {
+        imap_cache_manager_free(mbox->icm);
+        mbox->icm = NULL;
+    }
 
     free_messages_info(mbox);
     libbalsa_mailbox_imap_release_handle(mbox);
     mbox->sort_field = -1;	/* Invalidate. */
+    lbm_imap_searches_clear(mbox);
+}
+
+/* Bodies go from the connection straight to the cache file.  II()
+ * runs a fetch again after a reconnect, so every attempt first drops
+ * whatever an earlier one left in the file after start. */
+static GMimeStream *
+lbm_imap_file_stream(FILE * fp, off_t start)
+{
+    GMimeStream *stream;
+
+    if (fseeko(fp, start, SEEK_SET) != 0
+        || ftruncate(fileno(fp), start) != 0)
+        return NULL;
+    stream = g_mime_stream_file_new(fp);
+    g_mime_stream_file_set_owner(GMIME_STREAM_FILE(stream), FALSE);
+
+    return stream;
+}
+
+static ImapResponse
+lbm_imap_fetch_rfc822_to_file(ImapMboxHandle * handle, ImapUID uid,
+                              gboolean peek, FILE * fp)
+{
+    GMimeStream *stream;
+    ImapResponse rc;
+
+    if (!(stream = lbm_imap_file_stream(fp, 0)))
+        return IMR_NO;
+    rc = imap_mbox_handle_fetch_rfc822_uid(handle, uid, peek, stream);
+    g_object_unref(stream);
+
+    return rc;
+}
+
+static ImapResponse
+lbm_imap_fetch_part_to_file(ImapMboxHandle * handle, guint msgno,
+                            const gchar * section,
+                            ImapFetchBodyOptions ifbo, FILE * fp,
+                            off_t start)
+{
+    GMimeStream *stream;
+    ImapResponse rc;
+
+    if (!(stream = lbm_imap_file_stream(fp, start)))
+        return IMR_NO;
+    rc = imap_mbox_handle_fetch_body_to_stream(handle, msgno, section,
+                                               FALSE, ifbo, stream);
+    g_object_unref(stream);
+
+    return rc;
 }
 
 static FILE*
 get_cache_stream(LibBalsaMailboxImap *mimap, guint uid, gboolean peek)
 {
     FILE *stream;
-    gchar **pair, *path;
+    LibBalsaImapCache *cache = get_cache(mimap);
+    gchar *key, *path;
 
-    pair = get_cache_name_pair(mimap, "body", uid);
-    path = g_build_filename(pair[0], pair[1], NULL);
-    stream = fopen(path, "rb");
+    key = get_cache_key(mimap, mimap->uid_validity, uid);
+    path = libbalsa_imap_cache_lookup(cache, key, "body");
+    stream = path ? fopen(path, "rb") : NULL;
+    g_free(path);
     if(!stream) {
-        FILE *cache;
+        FILE *cache_fp;
+        gchar *tmp;
 	ImapResponse rc;
 
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
 #if 0
         if(msg->length>(signed)SizeMsgThreshold)
             libbalsa_information(LIBBALSA_INFORMATION_MESSAGE, 
                                  _("Downloading %ld kB"),
                                  msg->length/1024);
 #endif
-        cache = fopen(path, "wb");
-        if(cache) {
+        path = NULL;
+        cache_fp = libbalsa_imap_cache_create(cache, &tmp);
+        if(cache_fp) {
 	    int ferr;
             II(rc,mimap->handle,
-               imap_mbox_handle_fetch_rfc822_uid(mimap->handle, uid, peek,
-						 cache));
-	    ferr = ferror(cache);
-            fclose(cache);
-	    if(ferr || rc != IMR_OK) {
+               lbm_imap_fetch_rfc822_to_file(mimap->handle, uid, peek,
+                                             cache_fp));
+	    ferr = ferror(cache_fp);
+            if(fclose(cache_fp) != 0 || ferr || rc != IMR_OK) {
 		printf("Error fetching RFC822 message, removing cache.\n");
-		unlink(path);
-	    }
+		unlink(tmp);
+	    } else
+                path = libbalsa_imap_cache_store(cache, key, "body", tmp);
+            g_free(tmp);
         }
-	stream = fopen(path,"rb");
+	stream = path ? fopen(path,"rb") : NULL;
+        g_free(path);
     }
-    g_free(path); 
-    g_strfreev(pair);
+    g_free(key);
     return stream;
 }
 
-/* libbalsa_mailbox_imap_get_message_stream: 
-   Fetch data from cache first, if available.
-   When calling imap_fetch_message(), we make use of fact that
-   imap_fetch_message doesn't set msg->path field.
-*/
-static GMimeStream *
-libbalsa_mailbox_imap_get_message_stream(LibBalsaMailbox * mailbox,
-					 guint msgno, gboolean peek)
+/* Body prefetching.  When a message is shown, the bodies of the
+ * PREFETCH_COUNT messages that follow it in the view are downloaded to
+ * the body cache on a spare connection from the server pool, at most
+ * PREFETCH_BUDGET bytes in all and skipping messages larger than
+ * PREFETCH_SIZE_LIMIT.  Showing another message replaces the list, so
+ * jumping elsewhere cancels the pending downloads; a download already
+ * under way is completed. */
+#define PREFETCH_COUNT      5
+#define PREFETCH_BUDGET     (1024*1024)
+#define PREFETCH_SIZE_LIMIT (256*1024)
+
+struct prefetch_item {
+    ImapUID uid;
+    gchar *key;   /* in the body cache */
+};
+
+struct lbm_imap_prefetch {
+    GMutex lock;
+    GSList *items;          /* struct prefetch_item, to be fetched */
+    ImapUID uid_validity;   /* of the items */
+    LibBalsaImapCache *cache;
+    GHashTable *done;       /* UIDs prefetched, but not shown yet */
+    ImapUID current;        /* being fetched; 0 if none */
+    gboolean running;       /* a worker thread exists */
+    LibBalsaImapPrefetchStats stats;
+};
+
+static void
+prefetch_item_free(struct prefetch_item *item)
+{
+    g_free(item->key);
+    g_free(item);
+}
+
+static void
+lbm_imap_prefetch_free(struct lbm_imap_prefetch *prefetch)
+{
+    if (!prefetch)
+        return;
+    g_slist_free_full(prefetch->items, (GDestroyNotify) prefetch_item_free);
+    g_hash_table_destroy(prefetch->done);
+    g_mutex_clear(&prefetch->lock);
+    g_free(prefetch);
+}
+
+/* Drops the pending downloads. */
+static void
+lbm_imap_prefetch_cancel(LibBalsaMailboxImap * mimap)
+{
+    struct lbm_imap_prefetch *prefetch = mimap->prefetch;
+
+    if (!prefetch)
+        return;
+    g_mutex_lock(&prefetch->lock);
+    g_slist_free_full(prefetch->items, (GDestroyNotify) prefetch_item_free);
+    prefetch->items = NULL;
+    g_hash_table_remove_all(prefetch->done);
+    g_mutex_unlock(&prefetch->lock);
+}
+
+/* Downloads one body to a temporary file, which is stored in the
+ * cache when complete, so that nobody reads a partial cache file. */
+static gboolean
+lbm_imap_prefetch_body(ImapMboxHandle * handle, LibBalsaImapCache * cache,
+                       struct prefetch_item *item, off_t * size)
+{
+    gchar *tmp, *path;
+    FILE *fp;
+    ImapResponse rc;
+    gboolean ok;
+
+    fp = libbalsa_imap_cache_create(cache, &tmp);
+    if (!fp)
+        return FALSE;
+    rc = lbm_imap_fetch_rfc822_to_file(handle, item->uid, TRUE, fp);
+    ok = rc == IMR_OK && !ferror(fp);
+    *size = ftello(fp);
+    if (fclose(fp) == 0 && ok) {
+        path = libbalsa_imap_cache_store(cache, item->key, "body", tmp);
+        ok = path != NULL;
+        g_free(path);
+    } else {
+        unlink(tmp);
+        ok = FALSE;
+    }
+    g_free(tmp);
+
+    return ok;
+}
+
+static gpointer
+lbm_imap_prefetch_thread(LibBalsaMailboxImap * mimap)
+{
+    struct lbm_imap_prefetch *prefetch = mimap->prefetch;
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    ImapMboxHandle *handle;
+    struct prefetch_item *item;
+    gboolean selected = FALSE;
+
+    handle = libbalsa_imap_server_get_handle_with_user(is, prefetch, NULL);
+
+    while (TRUE) {
+        off_t size;
+
+        g_mutex_lock(&prefetch->lock);
+        item = NULL;
+        if (handle && prefetch->items) {
+            item = prefetch->items->data;
+            prefetch->items =
+                g_slist_delete_link(prefetch->items, prefetch->items);
+        }
+        prefetch->current = item ? item->uid : 0;
+        if (!item) {
+            g_slist_free_full(prefetch->items,
+                              (GDestroyNotify) prefetch_item_free);
+            prefetch->items = NULL;
+            prefetch->running = FALSE;
+            g_mutex_unlock(&prefetch->lock);
+            break;
+        }
+        g_mutex_unlock(&prefetch->lock);
+
+        if (!selected) {
+            selected = imap_mbox_examine(handle, mimap->path ?
+                                         mimap->path : "INBOX") == IMR_OK
+                && imap_mbox_handle_get_validity(handle)
+                == prefetch->uid_validity;
+            if (!selected) {
+                prefetch_item_free(item);
+                lbm_imap_prefetch_cancel(mimap);
+                continue;
+            }
+        }
+
+        if (lbm_imap_prefetch_body(handle, prefetch->cache, item, &size)) {
+            g_mutex_lock(&prefetch->lock);
+            g_hash_table_add(prefetch->done, GUINT_TO_POINTER(item->uid));
+            prefetch->stats.fetched++;
+            prefetch->stats.bytes += size;
+            g_mutex_unlock(&prefetch->lock);
+        }
+        prefetch_item_free(item);
+    }
+
+    if (handle) {
+        if (selected)
+            imap_mbox_unselect(handle);
+        libbalsa_imap_server_release_handle(is, handle);
+    }
+    g_object_unref(mimap);
+
+    return NULL;
+}
+
+/* Returns the node following node in the pre-order, ie. view, order. */
+static GNode *
+lbm_imap_next_node(GNode * node)
+{
+    if (node->children)
+        return node->children;
+    while (node && !node->next)
+        node = node->parent;
+
+    return node ? node->next : NULL;
+}
+
+/* Called when the message msgno is shown: updates the counters and
+ * queues the following messages. */
+static void
+lbm_imap_prefetch(LibBalsaMailboxImap * mimap, guint msgno)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(mimap);
+    LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_SERVER(mimap);
+    struct lbm_imap_prefetch *prefetch;
+    LibBalsaImapCache *cache;
+    ImapMessage *imsg;
+    GNode *node;
+    GSList *items = NULL;
+    off_t budget = PREFETCH_BUDGET;
+    ImapUID current;
+    guint cnt;
+
+    if (!mimap->prefetch) {
+        mimap->prefetch = g_new0(struct lbm_imap_prefetch, 1);
+        g_mutex_init(&mimap->prefetch->lock);
+        mimap->prefetch->done = g_hash_table_new(NULL, NULL);
+    }
+    prefetch = mimap->prefetch;
+
+    imsg = imap_mbox_handle_get_msg(mimap->handle, msgno);
+    if (!imsg)
+        return;
+
+    g_mutex_lock(&prefetch->lock);
+    prefetch->stats.shown++;
+    if (g_hash_table_remove(prefetch->done, GUINT_TO_POINTER(imsg->uid)))
+        prefetch->stats.hits++;
+    current = prefetch->current;
+    g_mutex_unlock(&prefetch->lock);
+
+    if (!mailbox->msg_tree
+        || libbalsa_imap_server_is_offline(LIBBALSA_IMAP_SERVER(server))
+        || !libbalsa_imap_server_has_free_handles(LIBBALSA_IMAP_SERVER(server)))
+        return;
+
+    node = g_node_find(mailbox->msg_tree, G_PRE_ORDER, G_TRAVERSE_ALL,
+                       GUINT_TO_POINTER(msgno));
+    cache = get_cache(mimap);
+    for (cnt = 0; node && cnt < PREFETCH_COUNT; cnt++) {
+        struct prefetch_item *item;
+
+        node = lbm_imap_next_node(node);
+        if (!node)
+            break;
+        imsg = imap_mbox_handle_get_msg(mimap->handle,
+                                        GPOINTER_TO_UINT(node->data));
+        /* Without the envelope, we do not know the size. */
+        if (!imsg || !imsg->envelope || imsg->rfc822size < 0
+            || imsg->rfc822size > PREFETCH_SIZE_LIMIT)
+            continue;
+        if (imsg->rfc822size > budget)
+            break;
+
+        item = g_new(struct prefetch_item, 1);
+        item->uid = imsg->uid;
+        item->key = get_cache_key(mimap, mimap->uid_validity, imsg->uid);
+        if (item->uid == current
+            || libbalsa_imap_cache_contains(cache, item->key, "body")) {
+            prefetch_item_free(item);
+            continue;
+        }
+        budget -= imsg->rfc822size;
+        items = g_slist_prepend(items, item);
+    }
+
+    g_mutex_lock(&prefetch->lock);
+    g_slist_free_full(prefetch->items, (GDestroyNotify) prefetch_item_free);
+    prefetch->items = g_slist_reverse(items);
+    prefetch->uid_validity = mimap->uid_validity;
+    prefetch->cache = cache;
+    if (prefetch->items && !prefetch->running) {
+        prefetch->running = TRUE;
+        g_thread_unref(g_thread_new("lbm_imap_prefetch",
+                                    (GThreadFunc) lbm_imap_prefetch_thread,
+                                    g_object_ref(mimap)));
+    }
+    g_debug("%s: %u shown, %u hits, %u prefetched (%" G_GUINT64_FORMAT
+            " bytes), %u queued", __func__, prefetch->stats.shown,
+            prefetch->stats.hits, prefetch->stats.fetched,
+            prefetch->stats.bytes, g_slist_length(prefetch->items));
+    g_mutex_unlock(&prefetch->lock);
+}
+
+/**
+ * libbalsa_mailbox_imap_get_prefetch_stats:
+ * @mimap: A #LibBalsaMailboxImap
+ * @stats: location for the counters
+ *
+ * Reports how well body prefetching works for the mailbox.
+ **/
+void
+libbalsa_mailbox_imap_get_prefetch_stats(LibBalsaMailboxImap * mimap,
+                                         LibBalsaImapPrefetchStats * stats)
+{
+    if (!mimap->prefetch) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    g_mutex_lock(&mimap->prefetch->lock);
+    *stats = mimap->prefetch->stats;
+    g_mutex_unlock(&mimap->prefetch->lock);
+}
+
+/* Offline copies.  The mailboxes with the offline option set are
+ * copied in the background on a spare connection from the server
+ * pool, every OFFLINE_SYNC_INTERVAL at most: the header cache is
+ * brought up to date as on opening, with all envelopes, and the
+ * bodies, newest first, are downloaded to the body cache as far as
+ * the disk budget of the server goes, at the rate it allows; the
+ * copies of all mailboxes on a server share its budget.  When
+ * the server cannot be reached, such a mailbox is opened from the
+ * copy, and the flag changes are kept in a journal that is sent on
+ * the next connection. */
+#define OFFLINE_SYNC_INTERVAL (5*60) /* seconds */
+
+struct lbm_imap_offline {
+    GMutex lock;
+    LibBalsaImapServer *server; /* whose budget the copy draws on */
+    gboolean running;       /* a worker thread exists */
+    gboolean cancelled;     /* ...and should stop */
+    gint64 last_run;        /* monotonic time of the last start */
+    off_t size;             /* of the copy, see lbm_imap_offline_set_size() */
+};
+
+/* Keeps the bodies of the copy from being evicted by clean_cache();
+ * the size only shrinks here, see lbm_imap_offline_reserve(). */
+static void
+lbm_imap_offline_set_size(struct lbm_imap_offline *offline, off_t size)
+{
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    if (size < offline->size) {
+        libbalsa_imap_server_reserve_offline(offline->server,
+                                             size - offline->size);
+        ImapOfflineSize += size - offline->size;
+        offline->size = size;
+    }
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+}
+
+/* Grows the copy to size, if the budget of the server has room. */
+static gboolean
+lbm_imap_offline_reserve(struct lbm_imap_offline *offline, off_t size)
+{
+    gboolean ok = TRUE;
+
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    if (size > offline->size) {
+        ok = libbalsa_imap_server_reserve_offline(offline->server,
+                                                  size - offline->size);
+        if (ok) {
+            ImapOfflineSize += size - offline->size;
+            offline->size = size;
+        }
+    }
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+
+    return ok;
+}
+
+static void
+lbm_imap_offline_free(struct lbm_imap_offline *offline)
+{
+    if (!offline)
+        return;
+    lbm_imap_offline_set_size(offline, 0);
+    g_object_unref(offline->server);
+    g_mutex_clear(&offline->lock);
+    g_free(offline);
+}
+
+/* Returns the offline state of the mailbox, creating it if needed;
+ * the copy takes no space until a run has measured it. */
+static struct lbm_imap_offline *
+lbm_imap_offline_get(LibBalsaMailboxImap * mimap)
+{
+    if (!mimap->offline) {
+        mimap->offline = g_new0(struct lbm_imap_offline, 1);
+        g_mutex_init(&mimap->offline->lock);
+        mimap->offline->server =
+            g_object_ref(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    }
+
+    return mimap->offline;
+}
+
+static gboolean
+lbm_imap_offline_cancelled(struct lbm_imap_offline *offline)
+{
+    gboolean cancelled;
+
+    g_mutex_lock(&offline->lock);
+    cancelled = offline->cancelled;
+    g_mutex_unlock(&offline->lock);
+
+    return cancelled;
+}
+
+/* The flag changes the server has not been told of are kept, one per
+ * line, as "+ FLAGS UID" or "- FLAGS UID", after a line with the
+ * UIDVALIDITY they refer to. */
+static gboolean
+lbm_imap_journal_add(LibBalsaMailboxImap * mimap, GArray * seqno,
+                     ImapMsgFlag flag_set, ImapMsgFlag flag_clr)
+{
+    gchar *path = get_journal_path(mimap);
+    FILE *fp;
+    guint i, pass;
+    gboolean ok;
+
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    fp = fopen(path, "a");
+    ok = fp != NULL && fseeko(fp, 0, SEEK_END) == 0;
+    if (ok && ftello(fp) == 0)
+        fprintf(fp, "UIDVALIDITY %u\n", mimap->uid_validity);
+    /* All set flags first, so that they make one command. */
+    for (pass = 0; ok && pass < 2; pass++) {
+        ImapMsgFlag flags = pass == 0 ? flag_set : flag_clr;
+
+        for (i = 0; flags && i < seqno->len; i++) {
+            ImapMessage *imsg =
+                imap_mbox_handle_get_msg(mimap->handle,
+                                         g_array_index(seqno, guint, i));
+            if (imsg && imsg->uid)
+                fprintf(fp, "%c %u %u\n", pass == 0 ? '+' : '-',
+                        (unsigned) flags, imsg->uid);
+        }
+    }
+    if (fp)
+        ok = fclose(fp) == 0 && ok;
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+    g_free(path);
+
+    return ok;
+}
+
+/* Sends the flag changes of the journal over handle, which has the
+ * mailbox selected, and drops the journal once the server has taken
+ * them.  Consecutive changes of the same flags make one command.  The
+ * file lock is not held while talking to the server; changes added to
+ * the journal in the meantime are kept for the next replay. */
+static void
+lbm_imap_journal_replay(LibBalsaMailboxImap * mimap,
+                        ImapMboxHandle * handle)
+{
+    gchar *path = get_journal_path(mimap);
+    gchar *contents;
+    gsize length;
+    gchar **lines;
+    GArray *uids;
+    ImapResponse rc = IMR_OK;
+    guint validity, flags = 0, i;
+    gchar sign = 0;
+
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        g_mutex_unlock(&lbm_imap_cache_file_lock);
+        g_free(path);
+        return;
+    }
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+    lines = g_strsplit(contents, "\n", -1);
+    uids = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    /* Changes made under another UIDVALIDITY are lost. */
+    if (lines[0] && sscanf(lines[0], "UIDVALIDITY %u", &validity) == 1
+        && validity == imap_mbox_handle_get_validity(handle)) {
+        for (i = 1; rc == IMR_OK; i++) {
+            gchar s = 0;
+            guint f = 0, uid = 0;
+            gboolean valid = lines[i]
+                && sscanf(lines[i], "%c %u %u", &s, &f, &uid) == 3
+                && (s == '+' || s == '-') && uid > 0;
+
+            if (uids->len > 0 && (!valid || s != sign || f != flags)) {
+                g_array_sort(uids, cmp_msgno);
+                rc = imap_mbox_store_flag_uid(handle, uids->len,
+                                              (unsigned *) uids->data,
+                                              flags, sign == '+');
+                g_array_set_size(uids, 0);
+            }
+            if (valid) {
+                sign = s;
+                flags = f;
+                g_array_append_val(uids, uid);
+            } else if (!lines[i])
+                break;
+        }
+    }
+
+    g_mutex_lock(&lbm_imap_cache_file_lock);
+    if (rc == IMR_OK) {
+        gchar *current = NULL;
+        gsize current_length;
+
+        /* lbm_imap_journal_add() only appends, so whatever follows
+         * the part replayed is new; a journal that does not start with
+         * it anymore is left alone, the stores can be repeated. */
+        if (g_file_get_contents(path, &current, &current_length, NULL)
+            && length > 0 && current_length >= length
+            && memcmp(current, contents, length) == 0) {
+            if (current_length == length)
+                unlink(path);
+            else {
+                gchar *rest = g_strconcat(lines[0], "\n",
+                                          current + length, NULL);
+
+                g_file_set_contents(path, rest, -1, NULL);
+                g_free(rest);
+            }
+        }
+        g_free(current);
+    } else
+        g_debug("%s: %s: kept for the next connection", __func__,
+                LIBBALSA_MAILBOX(mimap)->name);
+    g_mutex_unlock(&lbm_imap_cache_file_lock);
+
+    g_array_free(uids, TRUE);
+    g_strfreev(lines);
+    g_free(contents);
+    g_free(path);
+}
+
+/* Fetches the envelopes that the header cache does not have. */
+static gboolean
+lbm_imap_offline_headers(struct lbm_imap_offline *offline,
+                         ImapMboxHandle * handle)
+{
+    unsigned exists = imap_mbox_handle_get_exists(handle);
+    unsigned *msgnos = g_new(unsigned, FETCH_WINDOW_MAX);
+    unsigned msgno, cnt = 0;
+    ImapResponse rc = IMR_OK;
+
+    for (msgno = 1; msgno <= exists && rc == IMR_OK; msgno++) {
+        ImapMessage *imsg;
+        ImapUID uid;
+        ImapMsgFlags flags;
+
+        if (!imap_mbox_handle_get_deferred(handle, msgno, &uid, &flags)
+            && (!(imsg = imap_mbox_handle_get_msg(handle, msgno))
+                || !imsg->envelope))
+            msgnos[cnt++] = msgno;
+        if (cnt == FETCH_WINDOW_MAX || (msgno == exists && cnt > 0)) {
+            rc = lbm_imap_offline_cancelled(offline) ? IMR_NO :
+                imap_mbox_handle_fetch_set(handle, msgnos, cnt,
+                                           IMFETCH_FLAGS |
+                                           IMFETCH_UID |
+                                           IMFETCH_ENV |
+                                           IMFETCH_RFC822SIZE |
+                                           IMFETCH_CONTENT_TYPE);
+            cnt = 0;
+        }
+    }
+    g_free(msgnos);
+
+    return rc == IMR_OK;
+}
+
+/* Waits until bytes downloaded since start are within rate, in kB/s;
+ * returns FALSE if the copy was cancelled meanwhile. */
+static gboolean
+lbm_imap_offline_throttle(struct lbm_imap_offline *offline, gint64 start,
+                          guint64 bytes, guint rate)
+{
+    gint64 due, now;
+
+    if (rate == 0)
+        return !lbm_imap_offline_cancelled(offline);
+    due = start + (gint64) (bytes * G_USEC_PER_SEC / (rate * 1024));
+    while (!lbm_imap_offline_cancelled(offline)) {
+        now = g_get_monotonic_time();
+        if (now >= due)
+            return TRUE;
+        g_usleep(MIN(due - now, G_USEC_PER_SEC));
+    }
+
+    return FALSE;
+}
+
+/* Downloads the bodies of the messages, newest first, as long as the
+ * budget of the server has room for them, along with those already
+ * cached.  Returns the size of the copy. */
+static off_t
+lbm_imap_offline_bodies(LibBalsaMailboxImap * mimap,
+                        ImapMboxHandle * handle, guint rate)
+{
+    struct lbm_imap_offline *offline = mimap->offline;
+    LibBalsaImapCache *cache = get_cache(mimap);
+    ImapUID uid_validity = imap_mbox_handle_get_validity(handle);
+    gint64 start = g_get_monotonic_time();
+    guint64 fetched = 0;
+    off_t size = 0;
+    unsigned msgno;
+
+    for (msgno = imap_mbox_handle_get_exists(handle); msgno > 0; msgno--) {
+        ImapMessage *imsg = imap_mbox_handle_get_msg(handle, msgno);
+        struct prefetch_item item;
+        off_t got;
+        gboolean ok = TRUE;
+
+        if (!imsg || !imsg->uid || imsg->rfc822size < 0)
+            continue;
+        if (!lbm_imap_offline_reserve(offline, size + imsg->rfc822size))
+            break;
+        size += imsg->rfc822size;
+
+        item.uid = imsg->uid;
+        item.key = get_cache_key(mimap, uid_validity, imsg->uid);
+        if (!libbalsa_imap_cache_contains(cache, item.key, "body")) {
+            ok = lbm_imap_offline_throttle(offline, start, fetched, rate);
+            if (ok && lbm_imap_prefetch_body(handle, cache, &item, &got))
+                fetched += got;
+            else if (imap_mbox_is_disconnected(handle))
+                ok = FALSE;
+        }
+        g_free(item.key);
+        if (!ok)
+            break;
+    }
+    g_debug("%s: %s: %" G_GUINT64_FORMAT " bytes fetched, %lu kept",
+            __func__, LIBBALSA_MAILBOX(mimap)->name, fetched,
+            (unsigned long) size);
+
+    return size;
+}
+
+static gpointer
+lbm_imap_offline_thread(LibBalsaMailboxImap * mimap)
+{
+    struct lbm_imap_offline *offline = mimap->offline;
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    ImapMboxHandle *handle;
+    guint budget, rate;
+    off_t size = offline->size;
+
+    libbalsa_imap_server_get_offline_limits(is, &budget, &rate);
+    handle = libbalsa_imap_server_get_handle_with_user(is, offline, NULL);
+    if (handle) {
+        gchar *header_file = get_header_cache_path(mimap);
+        struct ImapCacheManager *icm, *fresh;
+        ImapUID uidvalidity = 0;
+        guint64 modseq;
+        gboolean readonly;
+
+        g_mutex_lock(&lbm_imap_cache_file_lock);
+        icm = imap_cache_manager_new_from_file(header_file);
+        g_mutex_unlock(&lbm_imap_cache_file_lock);
+        if ((modseq = icm_get_modseq(icm, &uidvalidity)) != 0)
+            imap_mbox_handle_set_qresync(handle, uidvalidity, modseq);
+
+        if (imap_mbox_select(handle, mimap->path ? mimap->path : "INBOX",
+                             &readonly) == IMR_OK) {
+            if (!readonly)
+                lbm_imap_journal_replay(mimap, handle);
+            icm_restore_from_cache(handle, icm);
+            if (lbm_imap_offline_headers(offline, handle)) {
+                fresh = icm_store_cached_data(handle, icm);
+                g_mutex_lock(&lbm_imap_cache_file_lock);
+                icm_save_to_file(fresh, header_file);
+                g_mutex_unlock(&lbm_imap_cache_file_lock);
+                imap_cache_manager_free(fresh);
+            }
+            if (!lbm_imap_offline_cancelled(offline))
+                size = lbm_imap_offline_bodies(mimap, handle, rate);
+            imap_mbox_handle_drop_deferred(handle);
+            imap_mbox_unselect(handle);
+        }
+        if (icm)
+            imap_cache_manager_free(icm);
+        g_free(header_file);
+        libbalsa_imap_server_release_handle(is, handle);
+    }
+
+    g_mutex_lock(&offline->lock);
+    offline->running = FALSE;
+    if (offline->cancelled)
+        size = 0;
+    g_mutex_unlock(&offline->lock);
+    lbm_imap_offline_set_size(offline, size);
+    g_object_unref(mimap);
+
+    return NULL;
+}
+
+/* Starts updating the offline copy, unless it was done recently. */
+static void
+lbm_imap_offline_sync(LibBalsaMailboxImap * mimap, gboolean now)
+{
+    LibBalsaImapServer *is =
+        LIBBALSA_IMAP_SERVER(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap));
+    struct lbm_imap_offline *offline;
+    gint64 time_now;
+
+    if (!libbalsa_mailbox_get_offline(LIBBALSA_MAILBOX(mimap)))
+        return;
+    offline = lbm_imap_offline_get(mimap);
+    if (libbalsa_imap_server_is_offline(is)
+        || !libbalsa_imap_server_has_free_handles(is))
+        return;
+
+    time_now = g_get_monotonic_time();
+    g_mutex_lock(&offline->lock);
+    if (!offline->running
+        && (now || offline->last_run == 0
+            || time_now - offline->last_run >=
+            (gint64) OFFLINE_SYNC_INTERVAL * G_USEC_PER_SEC)) {
+        offline->running = TRUE;
+        offline->cancelled = FALSE;
+        offline->last_run = time_now;
+        g_thread_unref(g_thread_new("lbm_imap_offline",
+                                    (GThreadFunc) lbm_imap_offline_thread,
+                                    g_object_ref(mimap)));
+    }
+    g_mutex_unlock(&offline->lock);
+}
+
+/**
+ * libbalsa_mailbox_imap_update_offline:
+ * @mimap: A #LibBalsaMailboxImap
+ *
+ * Starts copying the mailbox for offline use at once, or stops it and
+ * lets the copy be evicted from the cache, after the offline option
+ * of the mailbox has changed.
+ **/
+void
+libbalsa_mailbox_imap_update_offline(LibBalsaMailboxImap * mimap)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX_IMAP(mimap));
+
+    if (libbalsa_mailbox_get_offline(LIBBALSA_MAILBOX(mimap))) {
+        lbm_imap_offline_sync(mimap, TRUE);
+        return;
+    }
+    if (!mimap->offline)
+        return;
+    g_mutex_lock(&mimap->offline->lock);
+    mimap->offline->cancelled = TRUE;
+    g_mutex_unlock(&mimap->offline->lock);
+    lbm_imap_offline_set_size(mimap->offline, 0);
+}
+
+/* Opens the mailbox from its offline copy: the handle stands for the
+ * mailbox as icm has it, and does not come from the server pool. */
+static ImapMboxHandle *
+lbm_imap_get_offline_handle(LibBalsaMailboxImap * mimap,
+                            struct ImapCacheManager *icm)
+{
+    ImapMboxHandle *handle;
+
+    handle = icm_new_offline_handle(icm, mimap->path ?
+                                    mimap->path : "INBOX");
+    if (!handle)
+        return NULL;
+
+    mimap->uid_validity = imap_mbox_handle_get_validity(handle);
+    mimap->offline_open = 1;
+    mimap->handle_refs = 1;
+    imap_handle_set_flagscb(handle, (ImapFlagsCb) imap_flags_cb, mimap);
+    libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                         _("Cannot connect to the server of mailbox “%s”; "
+                           "showing its offline copy."),
+                         LIBBALSA_MAILBOX(mimap)->name);
+
+    return handle;
+}
+
+/* libbalsa_mailbox_imap_get_message_stream: 
+   Fetch data from cache first, if available.
+   When calling imap_fetch_message(), we make use of fact that
+   imap_fetch_message doesn't set msg->path field.
+*/
+static GMimeStream *
+libbalsa_mailbox_imap_get_message_stream(LibBalsaMailbox * mailbox,
+					 guint msgno, gboolean peek)
 {
     FILE *stream;
     ImapMessage *imsg;
@@ -1275,9 +2615,559 @@ lbm_imap_list_cb(ImapMboxHandle * handle, int delim, ImapMboxFlags flags,
 {
     struct mark_info *info = data;
 
-    if (strcmp(folder, info->path) == 0
-        && IMAP_MBOX_HAS_FLAG(flags, IMLIST_MARKED))
-        info->marked = TRUE;
+    if (strcmp(folder, info->path) == 0
+        && IMAP_MBOX_HAS_FLAG(flags, IMLIST_MARKED))
+        info->marked = TRUE;
+}
+
+static gboolean
+lbm_imap_set_status(LibBalsaMailbox * mailbox, guint messages, guint unseen)
+{
+    libbalsa_mailbox_set_total(mailbox, messages);
+    libbalsa_mailbox_set_unread(mailbox, unseen);
+
+    return unseen > 0;
+}
+
+/* Change notifications for closed mailboxes.
+ *
+ * One pooled connection per server asks for the STATUS of the
+ * checked mailboxes to be pushed with NOTIFY (RFC 5465); pushed
+ * counts are used by libbalsa_mailbox_check() until the notifications
+ * stop. Servers without NOTIFY get IDLE on a few mailboxes, each
+ * EXAMINEd on a connection of its own. Mailboxes covered neither way
+ * are polled with STATUS as before.
+ *
+ * Lock order: handle, lbm_imap_watch_lock, mailbox. Nothing is sent
+ * to the server and no connection is released with
+ * lbm_imap_watch_lock held. */
+
+#define LBM_IMAP_NOTIFY_MAILBOXES_MAX 100 /* more: watch all personal */
+#define LBM_IMAP_IDLE_WATCHES 3
+
+struct lbm_imap_watch;
+
+struct lbm_imap_idle_slot {
+    struct lbm_imap_watch *watch;
+    ImapMboxHandle *handle;     /* EXAMINEs path, or NULL */
+    gchar *path;
+};
+
+struct lbm_imap_watched {
+    LibBalsaMailboxImap *mimap;
+    guint messages;
+    guint unseen;
+    unsigned has_status:1;      /* messages and unseen are current */
+    unsigned notified:1;        /* changed since the last check */
+};
+
+struct lbm_imap_watch {
+    LibBalsaImapServer *server;
+    ImapMboxHandle *handle;     /* NOTIFY connection, or NULL */
+    GHashTable *mailboxes;      /* path -> struct lbm_imap_watched */
+    struct lbm_imap_idle_slot idle[LBM_IMAP_IDLE_WATCHES];
+    guint check_id;
+    unsigned no_notify:1;       /* server has no NOTIFY */
+    unsigned no_idle:1;         /* ... nor IDLE */
+    unsigned notify_stale:1;    /* NOTIFY must be sent again */
+};
+
+static GMutex lbm_imap_watch_lock;
+static GHashTable *lbm_imap_watches; /* server -> struct lbm_imap_watch */
+
+/* Watches are never freed: callbacks of connections that are being
+ * released may still refer to them. */
+static struct lbm_imap_watch *
+lbm_imap_watch_get(LibBalsaServer * server, gboolean create)
+{
+    struct lbm_imap_watch *watch;
+    unsigned i;
+
+    if (!lbm_imap_watches) {
+        if (!create)
+            return NULL;
+        lbm_imap_watches = g_hash_table_new(NULL, NULL);
+    }
+    watch = g_hash_table_lookup(lbm_imap_watches, server);
+    if (!watch && create) {
+        watch = g_new0(struct lbm_imap_watch, 1);
+        watch->server = LIBBALSA_IMAP_SERVER(server);
+        watch->mailboxes =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        for (i = 0; i < LBM_IMAP_IDLE_WATCHES; i++)
+            watch->idle[i].watch = watch;
+        g_hash_table_insert(lbm_imap_watches, server, watch);
+    }
+
+    return watch;
+}
+
+/* Is the status of the mailbox at path pushed to us? */
+static gboolean
+lbm_imap_watch_covers(struct lbm_imap_watch *watch, const gchar * path)
+{
+    unsigned i;
+
+    if (watch->handle && !watch->notify_stale)
+        return TRUE;
+    for (i = 0; i < LBM_IMAP_IDLE_WATCHES; i++)
+        if (watch->idle[i].path && strcmp(watch->idle[i].path, path) == 0)
+            return TRUE;
+
+    return FALSE;
+}
+
+static void
+lbm_imap_watched_invalidate(gpointer key, struct lbm_imap_watched *w,
+                            gpointer data)
+{
+    w->has_status = 0;
+}
+
+/* The status of mimap, if it is known without asking the server. */
+static gboolean
+lbm_imap_watch_get_status(LibBalsaMailboxImap * mimap, guint * messages,
+                          guint * unseen)
+{
+    struct lbm_imap_watch *watch;
+    struct lbm_imap_watched *w = NULL;
+    gboolean retval = FALSE;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    watch = lbm_imap_watch_get(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap), FALSE);
+    if (watch && mimap->path)
+        w = g_hash_table_lookup(watch->mailboxes, mimap->path);
+    if (w && w->mimap == mimap && w->has_status) {
+        *messages = w->messages;
+        *unseen = w->unseen;
+        retval = TRUE;
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    return retval;
+}
+
+/* Shows the pushed counts; no need to ask the server. */
+static gboolean
+lbm_imap_watch_check_idle(struct lbm_imap_watch *watch)
+{
+    GHashTableIter iter;
+    struct lbm_imap_watched *w;
+    GSList *mailboxes = NULL, *list;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    watch->check_id = 0;
+    g_hash_table_iter_init(&iter, watch->mailboxes);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & w)) {
+        if (w->notified && w->has_status)
+            mailboxes = g_slist_prepend(mailboxes, g_object_ref(w->mimap));
+        w->notified = 0;
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    for (list = mailboxes; list; list = list->next) {
+        LibBalsaMailbox *mailbox = list->data;
+        guint messages, unseen;
+
+        libbalsa_lock_mailbox(mailbox);
+        if (!MAILBOX_OPEN(mailbox)
+            && lbm_imap_watch_get_status(LIBBALSA_MAILBOX_IMAP(mailbox),
+                                         &messages, &unseen))
+            libbalsa_mailbox_set_unread_messages_flag(mailbox,
+                lbm_imap_set_status(mailbox, messages, unseen));
+        libbalsa_unlock_mailbox(mailbox);
+        g_object_unref(mailbox);
+    }
+    g_slist_free(mailboxes);
+
+    return FALSE;
+}
+
+/* Called with lbm_imap_watch_lock held. */
+static void
+lbm_imap_watch_changed(struct lbm_imap_watch *watch,
+                       struct lbm_imap_watched *w)
+{
+    w->notified = 1;
+    if (!watch->check_id)
+        watch->check_id =
+            g_idle_add((GSourceFunc) lbm_imap_watch_check_idle, watch);
+}
+
+/* Unsolicited STATUS on the NOTIFY connection. Without UNSEEN the
+ * mailbox is polled at the next check. */
+static void
+lbm_imap_watch_status_cb(ImapMboxHandle * handle, const char *mbox,
+                         const struct ImapStatusResult *items, void *arg)
+{
+    struct lbm_imap_watch *watch = arg;
+    struct lbm_imap_watched *w;
+    gboolean has_messages = FALSE, has_unseen = FALSE;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    if (!mbox) {
+        /* Notifications were lost; ask for them again. */
+        g_hash_table_foreach(watch->mailboxes,
+                             (GHFunc) lbm_imap_watched_invalidate, NULL);
+        watch->notify_stale = 1;
+    } else if ((w = g_hash_table_lookup(watch->mailboxes, mbox))) {
+        for (; items->item != IMSTAT_NONE; items++) {
+            switch (items->item) {
+            case IMSTAT_MESSAGES:
+                w->messages = items->result;
+                has_messages = TRUE;
+                break;
+            case IMSTAT_UNSEEN:
+                w->unseen = items->result;
+                has_unseen = TRUE;
+                break;
+            default:
+                break;
+            }
+        }
+        w->has_status = has_messages && has_unseen
+            && handle == watch->handle;
+        lbm_imap_watch_changed(watch, w);
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+}
+
+/* EXISTS, EXPUNGE or FETCH FLAGS on an IDLE connection: the counts
+ * are stale and the mailbox is polled at the next check. */
+static void
+lbm_imap_watch_idle_changed(struct lbm_imap_idle_slot *slot)
+{
+    struct lbm_imap_watched *w;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    if (slot->path
+        && (w = g_hash_table_lookup(slot->watch->mailboxes, slot->path)))
+        w->has_status = 0;
+    g_mutex_unlock(&lbm_imap_watch_lock);
+}
+
+static void
+lbm_imap_watch_exists_cb(ImapMboxHandle * handle,
+                         struct lbm_imap_idle_slot *slot)
+{
+    lbm_imap_watch_idle_changed(slot);
+}
+
+static void
+lbm_imap_watch_expunge_cb(ImapMboxHandle * handle, const unsigned *seqnos,
+                          const ImapUID * uids, unsigned n,
+                          struct lbm_imap_idle_slot *slot)
+{
+    lbm_imap_watch_idle_changed(slot);
+}
+
+static void
+lbm_imap_watch_flags_cb(unsigned cnt, const unsigned seqno[],
+                        struct lbm_imap_idle_slot *slot)
+{
+    lbm_imap_watch_idle_changed(slot);
+}
+
+/* Hands a connection taken from slot back to the pool.  The mailbox
+ * was opened with EXAMINE; CLOSE leaves it without expunging, so
+ * that the handle is not taken for one selected read-write. */
+static void
+lbm_imap_watch_release_idle(struct lbm_imap_watch *watch,
+                            struct lbm_imap_idle_slot *slot,
+                            ImapMboxHandle * handle)
+{
+    g_signal_handlers_disconnect_matched(handle, G_SIGNAL_MATCH_DATA,
+                                         0, 0, NULL, NULL, slot);
+    imap_handle_set_flagscb(handle, NULL, NULL);
+    if (!imap_mbox_is_disconnected(handle))
+        imap_mbox_close(handle);
+    libbalsa_imap_server_release_handle(watch->server, handle);
+    g_object_unref(handle);
+}
+
+static void
+lbm_imap_watch_release_notify(struct lbm_imap_watch *watch,
+                              ImapMboxHandle * handle)
+{
+    imap_handle_set_statuscb(handle, NULL, NULL);
+    libbalsa_imap_server_release_handle(watch->server, handle);
+    g_object_unref(handle);
+}
+
+/* Stops watching mimap, because it is opened, renamed or destroyed. */
+static void
+lbm_imap_unwatch(LibBalsaMailboxImap * mimap)
+{
+    LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_SERVER(mimap);
+    struct lbm_imap_watch *watch;
+    struct lbm_imap_watched *w;
+    struct lbm_imap_idle_slot *slot = NULL;
+    ImapMboxHandle *handle = NULL;
+    unsigned i;
+
+    if (!mimap->path || !server)
+        return;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    watch = lbm_imap_watch_get(server, FALSE);
+    if (watch
+        && (w = g_hash_table_lookup(watch->mailboxes, mimap->path))
+        && w->mimap == mimap) {
+        g_hash_table_remove(watch->mailboxes, mimap->path);
+        watch->notify_stale = 1;
+        for (i = 0; i < LBM_IMAP_IDLE_WATCHES; i++) {
+            if (watch->idle[i].path
+                && strcmp(watch->idle[i].path, mimap->path) == 0) {
+                slot = &watch->idle[i];
+                handle = slot->handle;
+                slot->handle = NULL;
+                g_free(slot->path);
+                slot->path = NULL;
+            }
+        }
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    if (handle)
+        lbm_imap_watch_release_idle(watch, slot, handle);
+}
+
+/* Sends NOTIFY for the watched mailboxes, if needed. */
+static void
+lbm_imap_watch_notify(struct lbm_imap_watch *watch)
+{
+    ImapMboxHandle *handle, *drop = NULL;
+    GHashTableIter iter;
+    gpointer path;
+    const char **paths;
+    unsigned size, cnt = 0;
+    ImapResponse rc;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    handle = watch->handle;
+    if (!handle || !watch->notify_stale) {
+        g_mutex_unlock(&lbm_imap_watch_lock);
+        return;
+    }
+    g_object_ref(handle);
+    size = g_hash_table_size(watch->mailboxes);
+    paths = g_new(const char *, size);
+    if (size <= LBM_IMAP_NOTIFY_MAILBOXES_MAX) {
+        g_hash_table_iter_init(&iter, watch->mailboxes);
+        while (g_hash_table_iter_next(&iter, &path, NULL))
+            paths[cnt++] = g_strdup(path);
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    rc = size > 0 ? imap_mbox_notify(handle, cnt, paths)
+        : imap_mbox_notify_none(handle);
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    if (rc == IMR_OK)
+        watch->notify_stale = 0;
+    else if (watch->handle == handle) {
+        /* Disconnected, or the server refused: poll. */
+        drop = watch->handle;
+        watch->handle = NULL;
+        g_hash_table_foreach(watch->mailboxes,
+                             (GHFunc) lbm_imap_watched_invalidate, NULL);
+        if (!imap_mbox_is_disconnected(handle))
+            watch->no_notify = 1;
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    if (drop)
+        lbm_imap_watch_release_notify(watch, drop);
+    g_object_unref(handle);
+    while (cnt > 0)
+        g_free((gchar *) paths[--cnt]);
+    g_free(paths);
+}
+
+/* Drops the NOTIFY connection if it was severed. */
+static void
+lbm_imap_watch_check_notify(struct lbm_imap_watch *watch)
+{
+    ImapMboxHandle *handle = NULL;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    if (watch->handle && imap_mbox_is_disconnected(watch->handle)) {
+        handle = watch->handle;
+        watch->handle = NULL;
+        g_hash_table_foreach(watch->mailboxes,
+                             (GHFunc) lbm_imap_watched_invalidate, NULL);
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    if (handle)
+        lbm_imap_watch_release_notify(watch, handle);
+}
+
+/* Fills the free IDLE slots with mailboxes from mboxes. */
+static void
+lbm_imap_watch_idle(struct lbm_imap_watch *watch, GPtrArray * mboxes)
+{
+    LibBalsaImapServer *server = watch->server;
+    unsigned i, j = 0;
+
+    for (i = 0; i < LBM_IMAP_IDLE_WATCHES; i++) {
+        struct lbm_imap_idle_slot *slot = &watch->idle[i];
+        LibBalsaMailboxImap *mimap = NULL;
+        ImapMboxHandle *handle = NULL;
+        struct lbm_imap_watched *w;
+
+        g_mutex_lock(&lbm_imap_watch_lock);
+        if (slot->handle && imap_mbox_is_disconnected(slot->handle)) {
+            handle = slot->handle;
+            slot->handle = NULL;
+            if ((w = g_hash_table_lookup(watch->mailboxes, slot->path)))
+                w->has_status = 0;
+            g_free(slot->path);
+            slot->path = NULL;
+        }
+        while (!slot->path && !watch->no_idle && j < mboxes->len) {
+            LibBalsaMailboxImap *m = g_ptr_array_index(mboxes, j++);
+
+            if (!MAILBOX_OPEN(m)
+                && !lbm_imap_watch_covers(watch, m->path)) {
+                mimap = m;
+                break;
+            }
+        }
+        g_mutex_unlock(&lbm_imap_watch_lock);
+
+        if (handle)
+            lbm_imap_watch_release_idle(watch, slot, handle);
+        if (!mimap)
+            continue;
+
+        /* Tagged with the slot: the handle must not be taken for the
+         * one mimap opens. */
+        handle =
+            libbalsa_imap_server_get_handle_with_user(server, slot, NULL);
+        if (!handle)
+            break;
+        if (!imap_mbox_handle_can_do(handle, IMCAP_IDLE)) {
+            libbalsa_imap_server_release_handle(server, handle);
+            g_mutex_lock(&lbm_imap_watch_lock);
+            watch->no_idle = 1;
+            g_mutex_unlock(&lbm_imap_watch_lock);
+            break;
+        }
+        g_object_ref(handle);
+        if (imap_mbox_examine(handle, mimap->path) == IMR_OK) {
+            g_signal_connect(G_OBJECT(handle), "exists-notify",
+                             G_CALLBACK(lbm_imap_watch_exists_cb), slot);
+            g_signal_connect(G_OBJECT(handle), "expunge-batch",
+                             G_CALLBACK(lbm_imap_watch_expunge_cb), slot);
+            imap_handle_set_flagscb(handle,
+                                    (ImapFlagsCb) lbm_imap_watch_flags_cb,
+                                    slot);
+            g_mutex_lock(&lbm_imap_watch_lock);
+            w = g_hash_table_lookup(watch->mailboxes, mimap->path);
+            if (w && w->mimap == mimap && !slot->path) {
+                slot->handle = handle;
+                slot->path = g_strdup(mimap->path);
+                handle = NULL;
+            }
+            g_mutex_unlock(&lbm_imap_watch_lock);
+        }
+        if (handle)
+            lbm_imap_watch_release_idle(watch, slot, handle);
+    }
+}
+
+/* Adds the mailboxes to the watch of their server and starts or
+ * refreshes NOTIFY, or IDLE if the server has no NOTIFY. Called from
+ * the check thread. */
+static void
+lbm_imap_watch_sync(LibBalsaImapServer * server, GPtrArray * mboxes)
+{
+    struct lbm_imap_watch *watch;
+    ImapMboxHandle *handle;
+    gboolean get_notify, use_idle;
+    guint i;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    watch = lbm_imap_watch_get(LIBBALSA_SERVER(server), TRUE);
+    for (i = 0; i < mboxes->len; i++) {
+        LibBalsaMailboxImap *mimap = g_ptr_array_index(mboxes, i);
+        struct lbm_imap_watched *w;
+
+        if (MAILBOX_OPEN(mimap)
+            || g_hash_table_lookup(watch->mailboxes, mimap->path))
+            continue;
+        w = g_new0(struct lbm_imap_watched, 1);
+        w->mimap = mimap;
+        g_hash_table_insert(watch->mailboxes, g_strdup(mimap->path), w);
+        watch->notify_stale = 1;
+    }
+    get_notify = !watch->handle && !watch->no_notify;
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    lbm_imap_watch_check_notify(watch);
+    if (get_notify
+        && (handle = libbalsa_imap_server_get_handle(server, NULL))) {
+        if (imap_mbox_handle_can_do(handle, IMCAP_NOTIFY)) {
+            g_object_ref(handle);
+            imap_handle_set_statuscb(handle, lbm_imap_watch_status_cb,
+                                     watch);
+            g_mutex_lock(&lbm_imap_watch_lock);
+            if (!watch->handle) {
+                watch->handle = handle;
+                watch->notify_stale = 1;
+                handle = NULL;
+            }
+            g_mutex_unlock(&lbm_imap_watch_lock);
+            if (handle)
+                lbm_imap_watch_release_notify(watch, handle);
+        } else {
+            libbalsa_imap_server_release_handle(server, handle);
+            g_mutex_lock(&lbm_imap_watch_lock);
+            watch->no_notify = 1;
+            g_mutex_unlock(&lbm_imap_watch_lock);
+        }
+    }
+    lbm_imap_watch_notify(watch);
+
+    use_idle = libbalsa_imap_server_get_use_idle(server);
+    g_mutex_lock(&lbm_imap_watch_lock);
+    if ((handle = watch->handle))
+        g_object_ref(handle);
+    g_mutex_unlock(&lbm_imap_watch_lock);
+
+    if (handle) {
+        /* Without IDLE, pending notifications come with NOOP. */
+        if (!use_idle || !imap_mbox_handle_can_do(handle, IMCAP_IDLE))
+            imap_mbox_handle_noop(handle);
+        g_object_unref(handle);
+        lbm_imap_watch_check_notify(watch);
+    } else if (use_idle && watch->no_notify
+               && libbalsa_imap_server_get_max_connections(server) >
+               LBM_IMAP_IDLE_WATCHES + 2)
+        lbm_imap_watch_idle(watch, mboxes);
+}
+
+/* Records a polled status; it stays valid while changes of mimap are
+ * pushed to us. */
+static void
+lbm_imap_watch_set_status(LibBalsaMailboxImap * mimap, guint messages,
+                          guint unseen)
+{
+    struct lbm_imap_watch *watch;
+    struct lbm_imap_watched *w = NULL;
+
+    g_mutex_lock(&lbm_imap_watch_lock);
+    watch = lbm_imap_watch_get(LIBBALSA_MAILBOX_REMOTE_SERVER(mimap), FALSE);
+    if (watch && mimap->path)
+        w = g_hash_table_lookup(watch->mailboxes, mimap->path);
+    if (w && w->mimap == mimap
+        && lbm_imap_watch_covers(watch, mimap->path)) {
+        w->messages = messages;
+        w->unseen = unseen;
+        w->has_status = 1;
+    }
+    g_mutex_unlock(&lbm_imap_watch_lock);
 }
 
 static gboolean
@@ -1287,20 +3177,32 @@ lbm_imap_check(LibBalsaMailbox * mailbox)
     LibBalsaServer *server = LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
     ImapMboxHandle *handle;
     gulong id;
+    guint messages, unseen;
+
+    if (lbm_imap_watch_get_status(mimap, &messages, &unseen))
+        return lbm_imap_set_status(mailbox, messages, unseen);
+
+    if (mimap->has_status) {
+        /* Fetched along with other mailboxes. */
+        mimap->has_status = 0;
+        return lbm_imap_set_status(mailbox, mimap->status_messages,
+                                   mimap->status_unseen);
+    }
 
     handle = libbalsa_mailbox_imap_get_handle(mimap, NULL);
     if (!handle)
 	return FALSE;
 
     if(libbalsa_imap_server_get_use_status(LIBBALSA_IMAP_SERVER(server))) {
-        static struct ImapStatusResult info[] = {
-            { IMSTAT_UNSEEN, 0 }, { IMSTAT_NONE, 0 } };
+        struct ImapStatusResult info[] = {
+            { IMSTAT_MESSAGES, 0 }, { IMSTAT_UNSEEN, 0 }, { IMSTAT_NONE, 0 } };
         /* cannot do status on an open mailbox */
         g_return_val_if_fail(!mimap->opened, FALSE);
         if(imap_mbox_status(handle, mimap->path, info) != IMR_OK)
             return FALSE;
         libbalsa_mailbox_imap_release_handle(mimap);
-        return info[0].result > 0;
+        lbm_imap_watch_set_status(mimap, info[0].result, info[1].result);
+        return lbm_imap_set_status(mailbox, info[0].result, info[1].result);
     } else {
         struct mark_info info;
         info.path = mimap->path;
@@ -1321,11 +3223,134 @@ lbm_imap_check(LibBalsaMailbox * mailbox)
     }
 }
 
+#define LBM_IMAP_STATUS_UNKNOWN G_MAXUINT
+
+/* Ask one server for the status of the mailboxes in the array. */
+static void
+lbm_imap_check_server(LibBalsaImapServer * server, GPtrArray * mboxes)
+{
+    ImapMboxHandle *handle;
+    guint i, cnt = mboxes->len;
+    const char **paths;
+    struct ImapStatusResult **res;
+    struct ImapStatusResult *info;
+    ImapResponse *rcs;
+    guint messages, unseen;
+
+    lbm_imap_watch_sync(server, mboxes);
+    /* Only ask for what was not pushed to us. */
+    for (i = cnt = 0; i < mboxes->len; i++) {
+        LibBalsaMailboxImap *mimap = g_ptr_array_index(mboxes, i);
+
+        if (!lbm_imap_watch_get_status(mimap, &messages, &unseen))
+            g_ptr_array_index(mboxes, cnt++) = mimap;
+    }
+    g_ptr_array_set_size(mboxes, cnt);
+    if (cnt == 0)
+        return;
+
+    handle = libbalsa_imap_server_get_handle(server, NULL);
+    if (!handle)
+        return;
+
+    paths = g_new(const char *, cnt);
+    res = g_new(struct ImapStatusResult *, cnt);
+    info = g_new(struct ImapStatusResult, 3 * cnt);
+    for (i = 0; i < cnt; i++) {
+        LibBalsaMailboxImap *mimap = g_ptr_array_index(mboxes, i);
+
+        paths[i] = mimap->path;
+        res[i] = &info[3 * i];
+        res[i][0].item = IMSTAT_MESSAGES;
+        res[i][0].result = LBM_IMAP_STATUS_UNKNOWN;
+        res[i][1].item = IMSTAT_UNSEEN;
+        res[i][1].result = LBM_IMAP_STATUS_UNKNOWN;
+        res[i][2].item = IMSTAT_NONE;
+    }
+
+    rcs = g_new(ImapResponse, cnt);
+    imap_mbox_status_many(handle, cnt, paths, res, rcs);
+    for (i = 0; i < cnt; i++) {
+        LibBalsaMailboxImap *mimap = g_ptr_array_index(mboxes, i);
+        gboolean known = rcs[i] == IMR_OK
+            && res[i][0].result != LBM_IMAP_STATUS_UNKNOWN
+            && res[i][1].result != LBM_IMAP_STATUS_UNKNOWN;
+
+        /* A status from an earlier check must not outlive one that
+         * did not report on the mailbox. */
+        libbalsa_lock_mailbox(LIBBALSA_MAILBOX(mimap));
+        if (known) {
+            mimap->status_messages = res[i][0].result;
+            mimap->status_unseen = res[i][1].result;
+        }
+        mimap->has_status = known;
+        libbalsa_unlock_mailbox(LIBBALSA_MAILBOX(mimap));
+        if (known)
+            lbm_imap_watch_set_status(mimap, res[i][0].result,
+                                      res[i][1].result);
+    }
+    libbalsa_imap_server_release_handle(server, handle);
+
+    g_free(rcs);
+    g_free(info);
+    g_free(res);
+    g_free(paths);
+}
+
+static void
+lbm_imap_check_server_cb(LibBalsaImapServer * server, GPtrArray * mboxes,
+                         gpointer data)
+{
+    lbm_imap_check_server(server, mboxes);
+    g_ptr_array_free(mboxes, TRUE);
+}
+
+/* libbalsa_mailbox_imap_check_list:
+   gets the status of all closed IMAP mailboxes in the list with one
+   exchange per server, instead of one per mailbox. The following
+   libbalsa_mailbox_check() of each mailbox uses the result.
+*/
+void
+libbalsa_mailbox_imap_check_list(GSList * mailboxes)
+{
+    GHashTable *servers = g_hash_table_new(NULL, NULL);
+    GSList *list;
+
+    for (list = mailboxes; list; list = list->next) {
+        LibBalsaMailbox *mailbox = list->data;
+        LibBalsaMailboxImap *mimap;
+        LibBalsaServer *server;
+        GPtrArray *mboxes;
+
+        if (!LIBBALSA_IS_MAILBOX_IMAP(mailbox) || MAILBOX_OPEN(mailbox)
+            || libbalsa_mailbox_get_subscribe(mailbox) ==
+            LB_MAILBOX_SUBSCRIBE_NO)
+            continue;
+        mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+        server = LIBBALSA_MAILBOX_REMOTE_SERVER(mailbox);
+        if (!mimap->path || !LIBBALSA_IS_IMAP_SERVER(server)
+            || !libbalsa_imap_server_get_use_status(LIBBALSA_IMAP_SERVER
+                                                    (server)))
+            continue;
+
+        mboxes = g_hash_table_lookup(servers, server);
+        if (!mboxes) {
+            mboxes = g_ptr_array_new();
+            g_hash_table_insert(servers, server, mboxes);
+        }
+        g_ptr_array_add(mboxes, mimap);
+    }
+
+    g_hash_table_foreach(servers, (GHFunc) lbm_imap_check_server_cb, NULL);
+    g_hash_table_destroy(servers);
+}
+
 static void
 libbalsa_mailbox_imap_check(LibBalsaMailbox * mailbox)
 {
     g_assert(LIBBALSA_IS_MAILBOX_IMAP(mailbox));
 
+    lbm_imap_offline_sync(LIBBALSA_MAILBOX_IMAP(mailbox), FALSE);
     if (!MAILBOX_OPEN(mailbox)) {
         libbalsa_mailbox_set_unread_messages_flag(mailbox,
                                                   lbm_imap_check(mailbox));
@@ -1343,16 +3368,162 @@ libbalsa_mailbox_imap_check(LibBalsaMailbox * mailbox)
 
 static ImapSearchKey *lbmi_build_imap_query(const LibBalsaCondition * cond,
 					    ImapSearchKey * last);
+
+/* More distinct conditions than this are not worth keeping. */
+#define LBM_IMAP_SEARCH_RESULTS_MAX 16
+
+static gboolean
+lbmi_condition_uses_flags(const LibBalsaCondition * cond)
+{
+    switch (cond->type) {
+    case CONDITION_FLAG:
+        return TRUE;
+    case CONDITION_AND:
+    case CONDITION_OR:
+        return lbmi_condition_uses_flags(cond->match.andor.left)
+            || lbmi_condition_uses_flags(cond->match.andor.right);
+    default:
+        return FALSE;
+    }
+}
+
+static void
+lbm_imap_search_append(ImapMboxHandle * handle, unsigned seqno,
+                       GArray * msgnos)
+{
+    g_array_append_val(msgnos, seqno);
+}
+
+/* Sorts the matches and drops the duplicates that a delta search or
+ * a search repeated after a reconnect may have added. */
+static void
+lbm_imap_search_normalize(GArray * msgnos)
+{
+    guint i, j;
+
+    g_array_sort(msgnos, cmp_msgno);
+    for (i = j = 0; i < msgnos->len; i++)
+        if (j == 0 || g_array_index(msgnos, guint, i)
+            != g_array_index(msgnos, guint, j - 1))
+            g_array_index(msgnos, guint, j++) =
+                g_array_index(msgnos, guint, i);
+    g_array_set_size(msgnos, j);
+}
+
+/* Returns the server-side search result for cond, searching only as
+ * much as needed to bring it up to date: nothing if it still is, the
+ * messages that arrived since if it was computed earlier, or the whole
+ * mailbox.  Returns NULL if the search fails. */
+static LbmImapSearchResult *
+lbm_imap_search_get(LibBalsaMailboxImap * mimap,
+                    LibBalsaCondition * cond)
+{
+    ImapMboxHandle *handle = mimap->handle;
+    LbmImapSearchResult *res;
+    ImapSearchKey *query;
+    ImapResponse rc;
+    gchar *key;
+    guint exists;
+    ImapUID uidnext;
+    guint64 modseq;
+
+    if (!mimap->search_results)
+        mimap->search_results =
+            g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)
+                                  lbm_imap_search_result_free);
+
+    key = libbalsa_condition_to_string(cond);
+    res = g_hash_table_lookup(mimap->search_results, key);
+    exists = imap_mbox_handle_get_exists(handle);
+    if (res && res->covered >= exists) {
+        g_free(key);
+        return res;
+    }
+
+    query = lbmi_build_imap_query(cond, NULL);
+    if (!query) { /* nothing the server can check */
+        g_free(key);
+        return NULL;
+    }
+
+    uidnext = imap_mbox_handle_get_uidnext(handle);
+    modseq = imap_mbox_handle_get_highestmodseq(handle);
+    if (res && res->uidnext) {
+        /* The flags of the messages searched earlier may change while
+         * the new ones are searched; keep the old modseq to notice. */
+        modseq = res->modseq;
+        II(rc, handle,
+           imap_search_exec_from_uid(handle, res->uidnext, query,
+                                     (ImapSearchCb) lbm_imap_search_append,
+                                     res->msgnos));
+    } else {
+        if (!res) {
+            if (g_hash_table_size(mimap->search_results)
+                >= LBM_IMAP_SEARCH_RESULTS_MAX)
+                lbm_imap_searches_clear(mimap);
+            res = g_new(LbmImapSearchResult, 1);
+            res->msgnos = g_array_new(FALSE, FALSE, sizeof(guint));
+            res->uses_flags = lbmi_condition_uses_flags(cond);
+            g_hash_table_insert(mimap->search_results, g_strdup(key),
+                                res);
+        } else
+            g_array_set_size(res->msgnos, 0);
+        II(rc, handle,
+           imap_search_exec(handle, FALSE, query,
+                            (ImapSearchCb) lbm_imap_search_append,
+                            res->msgnos));
+    }
+    imap_search_key_free(query);
+
+    if (rc != IMR_OK) {
+        g_hash_table_remove(mimap->search_results, key);
+        g_free(key);
+        ++mimap->search_stamp;
+        return NULL;
+    }
+    g_free(key);
+    lbm_imap_search_normalize(res->msgnos);
+    res->covered = exists;
+    res->uidnext = uidnext;
+    res->modseq  = modseq;
+
+    return res;
+}
+
+/* Whether the offline copy of the mailbox has the body of message
+ * msgno. */
+static gboolean
+lbm_imap_offline_has_body(LibBalsaMailboxImap * mimap, guint msgno)
+{
+    ImapMessage *imsg;
+    gchar *key;
+    gboolean has_body;
+
+    if (!mimap->offline_open
+        && !libbalsa_mailbox_get_offline(LIBBALSA_MAILBOX(mimap)))
+        return FALSE;
+    imsg = imap_mbox_handle_get_msg(mimap->handle, msgno);
+    if (!imsg || !imsg->uid)
+        return FALSE;
+    key = get_cache_key(mimap, mimap->uid_validity, imsg->uid);
+    has_body = libbalsa_imap_cache_contains(get_cache(mimap), key, "body");
+    g_free(key);
+
+    return has_body;
+}
+
 static gboolean
 libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
 				    LibBalsaMailboxSearchIter * search_iter)
 {
     LibBalsaMailboxImap *mimap;
     struct message_info *msg_info;
-    GHashTable *matchings;
+    LbmImapSearchResult *res;
+    guint lo, hi;
 
     mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
-    msg_info = message_info_from_msgno(mimap, msgno);
+    msg_info = message_info_from_msgno(mimap, msgno, TRUE);
     if (!msg_info)
         return FALSE;
 
@@ -1364,54 +3535,69 @@ libbalsa_mailbox_imap_message_match(LibBalsaMailbox* mailbox, guint msgno,
         * convert it to LibBalsaMessage. */
         libbalsa_mailbox_imap_get_message(mailbox, msgno);
     if (msg_info->message) {
+        /* The offline copy has the bodies to match. */
+        gboolean refed = !libbalsa_condition_can_match(search_iter->condition,
+                                                       msg_info->message)
+            && lbm_imap_offline_has_body(mimap, msgno)
+            && libbalsa_message_body_ref(msg_info->message, FALSE, FALSE);
+
         if (libbalsa_condition_can_match(search_iter->condition,
                                          msg_info->message)) {
             gboolean retval =
                 libbalsa_condition_matches(search_iter->condition,
                                            msg_info->message);
+            if (refed)
+                libbalsa_message_body_unref(msg_info->message);
             g_object_unref(msg_info->message);
             return retval;
         }
+        if (refed)
+            libbalsa_message_body_unref(msg_info->message);
         g_object_unref(msg_info->message);
     }
 
+    if (mimap->offline_open)
+        return FALSE; /* there is no server to ask */
+
     if (search_iter->stamp != mimap->search_stamp && search_iter->mailbox
 	&& LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
 	search_iter_free)
 	LIBBALSA_MAILBOX_GET_CLASS(search_iter->mailbox)->
 	    search_iter_free(search_iter);
 
-    matchings = search_iter->user_data;
-    if (!matchings) {
-	ImapSearchKey* query;
-	ImapResponse rc;
-
-	matchings = g_hash_table_new(NULL, NULL);
-	query = lbmi_build_imap_query(search_iter->condition, NULL);
-	II(rc,mimap->handle,
-           imap_mbox_filter_msgnos(mimap->handle, query, matchings));
-	imap_search_key_free(query);
-	if (rc != IMR_OK) {
-	    g_hash_table_destroy(matchings);
+    res = search_iter->user_data;
+    if (!res) {
+	res = lbm_imap_search_get(mimap, search_iter->condition);
+	if (!res)
 	    return FALSE;
-	}
-	search_iter->user_data = matchings;
+	search_iter->user_data = res;
 	search_iter->mailbox = mailbox;
 	search_iter->stamp = mimap->search_stamp;
     }
 
-    return g_hash_table_lookup(matchings, GUINT_TO_POINTER(msgno)) != NULL;
+    lo = 0;
+    hi = res->msgnos->len;
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        guint m = g_array_index(res->msgnos, guint, mid);
+
+        if (m == msgno)
+            return TRUE;
+        if (m < msgno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return FALSE;
 }
 
 static void
 libbalsa_mailbox_imap_search_iter_free(LibBalsaMailboxSearchIter * iter)
 {
-    GHashTable *matchings = iter->user_data;
-
-    if (matchings) {
-	g_hash_table_destroy(matchings);
-	iter->user_data = NULL;
-    }
+    /* The result belongs to mimap->search_results; any change that
+     * frees it also bumps search_stamp, so the iter lets go of it
+     * before it could be used again. */
+    iter->user_data = NULL;
     /* iter->condition and iter are freed in the LibBalsaMailbox method. */
 }
 
@@ -2042,7 +4228,7 @@ libbalsa_mailbox_imap_get_message(LibBalsaMailbox * mailbox, guint msgno)
     LibBalsaMailboxImap *mimap = (LibBalsaMailboxImap *) mailbox;
 
     libbalsa_lock_mailbox(mailbox);
-    msg_info = message_info_from_msgno(mimap, msgno);
+    msg_info = message_info_from_msgno(mimap, msgno, TRUE);
     if (!msg_info) {
         libbalsa_unlock_mailbox(mailbox);
         return NULL;
@@ -2143,7 +4329,7 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
                       LibBalsaFetchFlag flags)
 {
     if (!message->mime_msg) {
-        gchar **pair, *filename;
+        gchar *key, *filename;
         int fd;
         GMimeStream *stream, *fstream;
         GMimeFilter *filter;
@@ -2154,11 +4340,10 @@ get_struct_from_cache(LibBalsaMailbox *mailbox, LibBalsaMessage *message,
 	if (!imsg)
 	    return FALSE;
 
-        pair = get_cache_name_pair(mimap, "body", imsg->uid);
-
-        filename = g_build_filename(pair[0], pair[1], NULL);
-        g_strfreev(pair);
-        fd = open(filename, O_RDONLY);
+        key = get_cache_key(mimap, mimap->uid_validity, imsg->uid);
+        filename = libbalsa_imap_cache_lookup(get_cache(mimap), key, "body");
+        g_free(key);
+        fd = filename ? open(filename, O_RDONLY) : -1;
         g_free(filename);
         if (fd == -1)
             return FALSE;
@@ -2209,6 +4394,10 @@ libbalsa_mailbox_imap_fetch_structure(LibBalsaMailbox *mailbox,
     ImapFetchType ift = 0;
     g_return_val_if_fail(mimap->opened, FALSE);
 
+    libbalsa_lock_mailbox(mailbox);
+    lbm_imap_prefetch(mimap, message->msgno);
+    libbalsa_unlock_mailbox(mailbox);
+
     /* Work around some server bugs by fetching the RFC2822 form of
        the message. This is used also to save one RTT for one part
        messages with a part that can certainly be displayed, there is
@@ -2364,50 +4553,523 @@ get_section_for(LibBalsaMessage *msg, LibBalsaMessageBody *part)
 #endif
     return g_string_free(section, FALSE);
 }
-struct part_data { char *block; unsigned pos; ImapBody *body; };
+static const char*
+encoding_names(ImapBodyEncoding enc)
+{
+    switch(enc) {
+    case IMBENC_7BIT:   return "7bit";
+    default:
+    case IMBENC_8BIT:   return "8bit";
+    case IMBENC_BINARY: return "binary";
+    case IMBENC_BASE64: return "base64";
+    case IMBENC_QUOTED: return "quoted-printable";
+    }
+}
+static LibBalsaMessageBody*
+get_parent(LibBalsaMessageBody *root, LibBalsaMessageBody *part,
+           LibBalsaMessageBody *parent)
+{
+    while(root) {
+        LibBalsaMessageBody *res;
+        if(root == part)
+            return parent;
+        if(root->parts &&
+           (res = get_parent(root->parts, part, root)) != NULL)
+            return res;
+        root = root->next;
+    }
+    return NULL;
+}
+/* How a part is fetched: after the MIME header of its section, after
+ * the header of the message it is the body of, or, for the body of
+ * the message itself, with no header at all. */
+static ImapFetchBodyOptions
+lbm_imap_part_options(LibBalsaMessage * msg, LibBalsaMessageBody * part)
+{
+    LibBalsaMessageBody *parent = get_parent(msg->body_list, part, NULL);
+
+    if (parent == NULL)
+        return IMFB_NONE;
+    return parent->body_type == LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE
+        ? IMFB_HEADER : IMFB_MIME;
+}
+
+/* Streaming of large parts.  Parts larger than SizeMsgThreshold are
+ * fetched in chunks with BODY.PEEK[section]<offset.length>, or with
+ * BINARY.PEEK when the server can decode them, and every piece is
+ * appended to a partial file in the cache as it arrives.  Readers of
+ * libbalsa_mailbox_imap_get_part_stream() follow the file while it
+ * grows; it is stored as the part when complete.  The mailbox is
+ * locked for one chunk at a time, and the chunk size is adapted so
+ * that a chunk takes about LBM_IMAP_CHUNK_USEC.  A transfer that
+ * fails leaves the partial file behind, and the next attempt goes on
+ * from where it stopped. */
+#define LBM_IMAP_CHUNK_MIN     (16*1024)
+#define LBM_IMAP_CHUNK_INITIAL (64*1024)
+#define LBM_IMAP_CHUNK_MAX     (4*1024*1024)
+#define LBM_IMAP_CHUNK_USEC    (G_USEC_PER_SEC/2)
+
+struct lbm_imap_part_fetch {
+    gchar *id;                  /* key and item */
+    LibBalsaMailboxImap *mimap;
+    LibBalsaImapCache *cache;
+    gchar *key;
+    gchar *item;
+    ImapUID uid_validity;
+    ImapUID uid;
+    gchar *section;
+    ImapFetchBodyOptions ifbo;
+    gboolean binary;            /* the content arrives decoded */
+    guint octets;               /* of the section, unless binary */
+    gchar *header;              /* made up, or NULL to fetch it */
+    gchar *path;                /* of the partial file */
+    FILE *fp;
+    off_t start;                /* of the content in the file */
+    size_t offset;              /* of the chunk being fetched */
+    size_t chunk;               /* size of the next chunk */
+    gboolean complete;
+    gboolean failed;            /* the file cannot be written */
+    gboolean stale;             /* the UIDVALIDITY changed */
+    LibBalsaImapPartFeed *feed;
+};
+
+/* The transfers under way, by id.  The lock also keeps a transfer
+ * from being stored while a reader opens its file. */
+static GHashTable *lbm_imap_part_fetches;
+G_LOCK_DEFINE_STATIC(lbm_imap_part_fetches);
+
+static void
+lbm_imap_part_fetch_free(struct lbm_imap_part_fetch *fetch)
+{
+    if (fetch->fp)
+        fclose(fetch->fp);
+    libbalsa_imap_part_feed_unref(fetch->feed);
+    g_object_unref(fetch->mimap);
+    g_free(fetch->id);
+    g_free(fetch->key);
+    g_free(fetch->item);
+    g_free(fetch->section);
+    g_free(fetch->header);
+    g_free(fetch->path);
+    g_free(fetch);
+}
+
+/* Creates the transfer of a part, taking over the partial file of an
+ * interrupted one.  Called with the mailbox locked. */
+static struct lbm_imap_part_fetch *
+lbm_imap_part_fetch_new(LibBalsaMailboxImap * mimap, LibBalsaMessage * msg,
+                        LibBalsaMessageBody * part, ImapUID uid,
+                        ImapBody * body, const gchar * section,
+                        const gchar * key, const gchar * item)
+{
+    struct lbm_imap_part_fetch *fetch;
+    gchar *partial;
+
+    fetch = g_new0(struct lbm_imap_part_fetch, 1);
+    fetch->ifbo = lbm_imap_part_options(msg, part);
+    /* As in imap_mbox_handle_fetch_body(), only parts with a MIME
+     * header are fetched decoded. */
+    fetch->binary = fetch->ifbo == IMFB_MIME
+        && imap_mbox_handle_can_fetch_binary(mimap->handle);
+    fetch->cache = get_cache(mimap);
+    partial = g_strconcat(item, fetch->binary ? "-binary" : "", NULL);
+    fetch->fp = libbalsa_imap_cache_resume(fetch->cache, key, partial,
+                                           &fetch->path);
+    g_free(partial);
+    if (!fetch->fp) {
+        g_free(fetch);
+        return NULL;
+    }
+
+    fetch->id = g_strconcat(key, " ", item, NULL);
+    fetch->mimap = g_object_ref(mimap);
+    fetch->key = g_strdup(key);
+    fetch->item = g_strdup(item);
+    fetch->uid_validity = mimap->uid_validity;
+    fetch->uid = uid;
+    fetch->section = g_strdup(section);
+    fetch->octets = body->octets;
+    if (fetch->binary) {
+        gchar *content_type = imap_body_get_content_type(body);
+        fetch->header =
+            g_strdup_printf("Content-Type: %s\r\n"
+                            "Content-Transfer-Encoding: binary\r\n\r\n",
+                            content_type);
+        g_free(content_type);
+    } else if (fetch->ifbo == IMFB_NONE)
+        fetch->header =
+            g_strdup_printf("MIME-version: 1.0\r\ncontent-type: %s\r\n"
+                            "Content-Transfer-Encoding: %s\r\n\r\n",
+                            part->content_type ?
+                            part->content_type : "text/plain",
+                            encoding_names(body->encoding));
+    fetch->chunk = LBM_IMAP_CHUNK_INITIAL;
+    fetch->feed = libbalsa_imap_part_feed_new(0);
+
+    return fetch;
+}
+
+static void
+lbm_imap_part_header_cb(unsigned seqno, const char *buf, size_t buflen,
+                        void *arg)
+{
+    g_string_append_len((GString *) arg, buf, buflen);
+}
+
+static ImapResponse
+lbm_imap_fetch_part_header(ImapMboxHandle * handle,
+                           struct lbm_imap_part_fetch *fetch,
+                           GString * header)
+{
+    g_string_truncate(header, 0);
+    return imap_mbox_handle_fetch_body_header(handle, fetch->uid,
+                                              fetch->section, fetch->ifbo,
+                                              lbm_imap_part_header_cb,
+                                              header);
+}
+
+/* Starts the file with the header, unless an earlier attempt left the
+ * same header there, and notes where the content starts.  Readers see
+ * nothing until there is some content. */
+static gboolean
+lbm_imap_part_fetch_begin(struct lbm_imap_part_fetch *fetch)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(fetch->mimap);
+    GString *header;
+    gchar *buf;
+    off_t size;
+    ImapResponse rc = IMR_OK;
+
+    header = g_string_new(fetch->header);
+    if (!fetch->header) {
+        libbalsa_lock_mailbox(mailbox);
+        if (!fetch->mimap->handle)
+            rc = IMR_NO;
+        else
+            II(rc, fetch->mimap->handle,
+               lbm_imap_fetch_part_header(fetch->mimap->handle, fetch,
+                                          header));
+        libbalsa_unlock_mailbox(mailbox);
+        if (header->len == 0)
+            g_string_assign(header, "\r\n");
+    }
+    if (rc != IMR_OK) {
+        g_string_free(header, TRUE);
+        return FALSE;
+    }
+
+    size = ftello(fetch->fp);
+    buf = g_malloc(header->len);
+    if (size < (off_t) header->len
+        || fseeko(fetch->fp, 0, SEEK_SET) != 0
+        || fread(buf, 1, header->len, fetch->fp) != header->len
+        || memcmp(buf, header->str, header->len) != 0) {
+        /* Nothing to continue. */
+        if (fseeko(fetch->fp, 0, SEEK_SET) != 0
+            || ftruncate(fileno(fetch->fp), 0) != 0
+            || fwrite(header->str, 1, header->len, fetch->fp) != header->len
+            || fflush(fetch->fp) != 0)
+            fetch->failed = TRUE;
+    }
+    g_free(buf);
+    fetch->start = header->len;
+    g_string_free(header, TRUE);
+    if (fetch->failed || fseeko(fetch->fp, 0, SEEK_END) != 0)
+        return FALSE;
+
+    size = ftello(fetch->fp);
+    if (size > fetch->start)
+        libbalsa_imap_part_feed_grow(fetch->feed, size);
+
+    return TRUE;
+}
+
 static void
-append_str(unsigned seqno, const char *buf, size_t buflen, void *arg)
+lbm_imap_part_fetch_write(unsigned seqno, const char *buf, size_t buflen,
+                          void *arg)
+{
+    struct lbm_imap_part_fetch *fetch = arg;
+
+    if (fetch->failed)
+        return;
+    if (fwrite(buf, 1, buflen, fetch->fp) != buflen
+        || fflush(fetch->fp) != 0) {
+        fetch->failed = TRUE;
+        return;
+    }
+    libbalsa_imap_part_feed_grow(fetch->feed, ftello(fetch->fp));
+}
+
+/* Fetches the next chunk, going on after whatever an interrupted
+ * attempt wrote, and sizes the following one by the time this one
+ * took. */
+static ImapResponse
+lbm_imap_part_fetch_chunk(ImapMboxHandle * handle,
+                          struct lbm_imap_part_fetch *fetch)
+{
+    off_t end;
+    size_t fetched;
+    gint64 elapsed;
+    gdouble next;
+    ImapResponse rc;
+
+    if (fetch->mimap->uid_validity != fetch->uid_validity) {
+        fetch->stale = TRUE;
+        return IMR_NO;
+    }
+    if (fseeko(fetch->fp, 0, SEEK_END) != 0
+        || (end = ftello(fetch->fp)) < fetch->start) {
+        fetch->failed = TRUE;
+        return IMR_NO;
+    }
+    fetch->offset = end - fetch->start;
+    if (!fetch->binary && fetch->offset >= fetch->octets) {
+        fetch->complete = TRUE;
+        return IMR_OK;
+    }
+
+    elapsed = g_get_monotonic_time();
+    rc = imap_mbox_handle_fetch_body_partial(handle, fetch->uid,
+                                             fetch->section, fetch->binary,
+                                             fetch->offset, fetch->chunk,
+                                             lbm_imap_part_fetch_write,
+                                             fetch, &fetched);
+    elapsed = g_get_monotonic_time() - elapsed;
+    if (rc != IMR_OK)
+        return rc;
+    if (fetch->failed)
+        return IMR_NO;
+
+    if (fetched < fetch->chunk) {
+        /* The end of the section, unless the message is gone. */
+        if (fetched == 0 && (!fetch->binary || fetch->offset == 0))
+            return IMR_NO;
+        fetch->complete = TRUE;
+        return IMR_OK;
+    }
+
+    next = (gdouble) fetch->chunk * LBM_IMAP_CHUNK_USEC / MAX(elapsed, 1);
+    next = CLAMP(next, fetch->chunk / 2, fetch->chunk * 2);
+    fetch->chunk = CLAMP((size_t) next, LBM_IMAP_CHUNK_MIN,
+                         LBM_IMAP_CHUNK_MAX);
+
+    return IMR_OK;
+}
+
+/* Fetches the rest of the part. */
+static gboolean
+lbm_imap_part_fetch_run(struct lbm_imap_part_fetch *fetch)
+{
+    LibBalsaMailbox *mailbox = LIBBALSA_MAILBOX(fetch->mimap);
+    ImapResponse rc = IMR_OK;
+
+    while (!fetch->complete) {
+        libbalsa_lock_mailbox(mailbox);
+        if (!fetch->mimap->handle)
+            rc = IMR_NO;
+        else
+            II(rc, fetch->mimap->handle,
+               lbm_imap_part_fetch_chunk(fetch->mimap->handle, fetch));
+        libbalsa_unlock_mailbox(mailbox);
+
+        if (rc == IMR_NO && fetch->binary && fetch->offset == 0
+            && !fetch->failed && !fetch->stale) {
+            /* The server cannot decode this part: fetch it as it is,
+             * after its own MIME header. */
+            fetch->binary = FALSE;
+            g_free(fetch->header);
+            fetch->header = NULL;
+            if (lbm_imap_part_fetch_begin(fetch))
+                continue;
+        }
+        if (rc != IMR_OK)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Runs the transfer and ends it: a complete part is stored in the
+ * cache, and what an interrupted one got is kept for the next
+ * attempt.  Frees fetch. */
+static gboolean
+lbm_imap_part_fetch_do(struct lbm_imap_part_fetch *fetch, GError ** err)
+{
+    GError *error = NULL;
+    gboolean ok;
+
+    ok = lbm_imap_part_fetch_begin(fetch) && lbm_imap_part_fetch_run(fetch);
+
+    G_LOCK(lbm_imap_part_fetches);
+    if (fclose(fetch->fp) != 0)
+        ok = FALSE;
+    fetch->fp = NULL;
+    if (ok) {
+        gchar *path = libbalsa_imap_cache_store(fetch->cache, fetch->key,
+                                                fetch->item, fetch->path);
+        ok = path != NULL;
+        g_free(path);
+    } else if (fetch->failed || fetch->stale)
+        unlink(fetch->path);
+    g_hash_table_remove(lbm_imap_part_fetches, fetch->id);
+    G_UNLOCK(lbm_imap_part_fetches);
+
+    if (!ok)
+        g_set_error(&error, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_ACCESS_ERROR, "%s",
+                    fetch->failed ?
+                    _("Cannot write the message part to the cache") :
+                    _("Error fetching message part from IMAP server"));
+    libbalsa_imap_part_feed_done(fetch->feed, error);
+    if (error)
+        g_propagate_error(err, error);
+    lbm_imap_part_fetch_free(fetch);
+
+    return ok;
+}
+
+static gpointer
+lbm_imap_part_fetch_thread(struct lbm_imap_part_fetch *fetch)
+{
+    lbm_imap_part_fetch_do(fetch, NULL);
+
+    return NULL;
+}
+
+/* Finds a part in the cache or among the transfers under way, and
+ * opens a stream on it if stream is not NULL.  If the part is in
+ * neither, a transfer is created and returned in *fetch, to be run by
+ * the caller with lbm_imap_part_fetch_do(); otherwise *feed, if feed
+ * is not NULL, is set to the transfer under way, if any.  Returns
+ * FALSE if the part cannot be streamed, as when the message structure
+ * is not known. */
+static gboolean
+lbm_imap_part_find(LibBalsaMessage * msg, LibBalsaMessageBody * part,
+                   GInputStream ** stream, LibBalsaImapPartFeed ** feed,
+                   struct lbm_imap_part_fetch **fetch, GError ** err)
+{
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
+    struct lbm_imap_part_fetch *current;
+    LibBalsaImapCache *cache;
+    ImapMessage *imsg;
+    ImapBody *body;
+    gchar *section, *key, *item, *id, *path;
+
+    *fetch = NULL;
+    if (feed)
+        *feed = NULL;
+
+    libbalsa_lock_mailbox(msg->mailbox);
+    imsg = mimap->handle ? mi_get_imsg(mimap, msg->msgno) : NULL;
+    section = get_section_for(msg, part);
+    body = imsg ? imap_message_get_body_from_section(imsg, section) : NULL;
+    if (!body) {
+        libbalsa_unlock_mailbox(msg->mailbox);
+        g_free(section);
+        return FALSE;
+    }
+
+    cache = get_cache(mimap);
+    key = get_cache_key(mimap, mimap->uid_validity, imsg->uid);
+    item = g_strconcat("part-", section, NULL);
+    id = g_strconcat(key, " ", item, NULL);
+
+    G_LOCK(lbm_imap_part_fetches);
+    if (!lbm_imap_part_fetches)
+        lbm_imap_part_fetches = g_hash_table_new(g_str_hash, g_str_equal);
+    current = g_hash_table_lookup(lbm_imap_part_fetches, id);
+    if (current) {
+        if (stream)
+            *stream = libbalsa_imap_part_stream_new(current->path,
+                                                    current->feed, err);
+        if (feed)
+            *feed = libbalsa_imap_part_feed_ref(current->feed);
+    } else if ((path = libbalsa_imap_cache_lookup(cache, key, item))) {
+        if (stream)
+            *stream = libbalsa_imap_part_stream_new(path, NULL, err);
+        g_free(path);
+    } else if ((current =
+                lbm_imap_part_fetch_new(mimap, msg, part, imsg->uid, body,
+                                        section, key, item))) {
+        g_hash_table_insert(lbm_imap_part_fetches, current->id, current);
+        if (stream)
+            *stream = libbalsa_imap_part_stream_new(current->path,
+                                                    current->feed, err);
+        *fetch = current;
+    } else
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_ACCESS_ERROR,
+                    _("Cannot create temporary file"));
+    G_UNLOCK(lbm_imap_part_fetches);
+    libbalsa_unlock_mailbox(msg->mailbox);
+
+    g_free(section);
+    g_free(key);
+    g_free(item);
+    g_free(id);
+
+    return TRUE;
+}
+
+/* Fetches a large part with the streaming transfer, or waits for the
+ * one under way, and opens the cached file. */
+static FILE *
+lbm_imap_part_fetch_wait(LibBalsaMessage * msg, LibBalsaMessageBody * part,
+                         LibBalsaImapCache * cache, const gchar * key,
+                         const gchar * item, GError ** err)
 {
-    struct part_data *dt = (struct part_data*)arg;
+    struct lbm_imap_part_fetch *fetch;
+    LibBalsaImapPartFeed *feed;
+    gchar *path;
+    FILE *fp;
+
+    if (!lbm_imap_part_find(msg, part, NULL, &feed, &fetch, err)) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_ACCESS_ERROR,
+                    _("Error fetching message part from IMAP server"));
+        return NULL;
+    }
+    if (fetch) {
+        if (!lbm_imap_part_fetch_do(fetch, err))
+            return NULL;
+    } else if (feed) {
+        gboolean ok = libbalsa_imap_part_feed_wait(feed, err);
+        libbalsa_imap_part_feed_unref(feed);
+        if (!ok)
+            return NULL;
+    } else if (err && *err)
+        return NULL;
+
+    path = libbalsa_imap_cache_lookup(cache, key, item);
+    fp = path ? fopen(path, "rb") : NULL;
+    g_free(path);
+    if (!fp)
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_ACCESS_ERROR,
+                    _("Error fetching message part from IMAP server"));
 
-    if(dt->pos + buflen > dt->body->octets) {
-        /* 
-        fprintf(stderr, "IMAP server sends too much data but we just "
-                "reallocate the block.\n"); */
-	dt->body->octets = dt->pos + buflen;
-	dt->block = g_realloc(dt->block, dt->body->octets);
-    }
-    memcpy(dt->block + dt->pos, buf, buflen);
-    dt->pos += buflen;
+    return fp;
 }
 
-static const char*
-encoding_names(ImapBodyEncoding enc)
-{
-    switch(enc) {
-    case IMBENC_7BIT:   return "7bit";
-    default:
-    case IMBENC_8BIT:   return "8bit";
-    case IMBENC_BINARY: return "binary";
-    case IMBENC_BASE64: return "base64";
-    case IMBENC_QUOTED: return "quoted-printable";
-    }
-}
-static LibBalsaMessageBody*
-get_parent(LibBalsaMessageBody *root, LibBalsaMessageBody *part,
-           LibBalsaMessageBody *parent)
+/* Whether the part is large enough to be streamed. */
+static gboolean
+lbm_imap_part_is_large(LibBalsaMailboxImap * mimap, ImapMessage * imsg,
+                       const gchar * section)
 {
-    while(root) {
-        LibBalsaMessageBody *res;
-        if(root == part)
-            return parent;
-        if(root->parts &&
-           (res = get_parent(root->parts, part, root)) != NULL)
-            return res;
-        root = root->next;
-    }
-    return NULL;
+    ImapBody *body;
+    gboolean large;
+
+    libbalsa_lock_mailbox(LIBBALSA_MAILBOX(mimap));
+    body = imap_message_get_body_from_section(imsg, section);
+    large = body && body->octets > SizeMsgThreshold;
+    if (large)
+        libbalsa_information(LIBBALSA_INFORMATION_MESSAGE,
+                             _("Downloading %u kB"), body->octets / 1024);
+    libbalsa_unlock_mailbox(LIBBALSA_MAILBOX(mimap));
+
+    return large;
 }
+
 static gboolean
 lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
                                  LibBalsaMessageBody * part,
@@ -2415,8 +5077,9 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
 {
     GMimeStream *partstream = NULL;
 
-    gchar **pair,  *part_name;
+    gchar *key, *item, *part_name;
     LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
+    LibBalsaImapCache *cache;
     FILE *fp;
     gchar *section;
     ImapMessage *imsg = mi_get_imsg(mimap, msg->msgno);
@@ -2431,108 +5094,96 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
 
    /* look for a part cache */
     section = get_section_for(msg, part);
-    pair = get_cache_name_pair(mimap, "part", imsg->uid);
-    part_name   = g_strconcat(pair[0], G_DIR_SEPARATOR_S,
-                              pair[1], "-", section, NULL);
-    fp = fopen(part_name,"rb+");
+    cache = get_cache(mimap);
+    key = get_cache_key(mimap, mimap->uid_validity, imsg->uid);
+    item = g_strconcat("part-", section, NULL);
+    part_name = libbalsa_imap_cache_lookup(cache, key, item);
+    fp = part_name ? fopen(part_name, "rb") : NULL;
+    g_free(part_name);
+    part_name = NULL;
+
+    if (!fp && lbm_imap_part_is_large(mimap, imsg, section)) {
+        fp = lbm_imap_part_fetch_wait(msg, part, cache, key, item, err);
+        if (!fp) {
+            g_free(section);
+            g_free(key);
+            g_free(item);
+            return FALSE;
+        }
+    }
     
     if(!fp) { /* no cache element */
-        struct part_data dt;
+        ImapBody *body;
         ImapFetchBodyOptions ifbo;
         ImapResponse rc;
-        LibBalsaMessageBody *parent;
+        off_t start;
 
         libbalsa_lock_mailbox(msg->mailbox);
         mimap = LIBBALSA_MAILBOX_IMAP(msg->mailbox);
         
-        dt.body  = imap_message_get_body_from_section(imsg, section);
-        if(!dt.body) {
+        body = imap_message_get_body_from_section(imsg, section);
+        if(!body) {
             /* This may happen if we reconnect the data dropping the
                body structures but still try refetching the
                message. This can be simulated by randomly
                disconnecting from the IMAP server. */
+            libbalsa_unlock_mailbox(msg->mailbox);
             fprintf(stderr, "Cannot find data for section %s\n", section);
-            g_strfreev(pair);
+            g_free(section);
+            g_free(key);
+            g_free(item);
             return FALSE;
         }
-        dt.block = g_malloc(dt.body->octets+1);
-        dt.pos   = 0;
-        if(dt.body->octets>SizeMsgThreshold)
-            libbalsa_information(LIBBALSA_INFORMATION_MESSAGE, 
-                                 _("Downloading %u kB"),
-                                 dt.body->octets/1024);
 	/* Imap_mbox_handle_fetch_body fetches the MIME headers of the
          * section, followed by the text. We write this unfiltered to
          * the cache. The probably only exception is the main body
          * which has no headers. In this case, we have to fake them.
          * We could and probably should dump there first the headers 
          * that we have already fetched... */
-        parent = get_parent(msg->body_list, part, NULL);
-        if(parent == NULL)
-            ifbo = IMFB_NONE;
-        else {
-            if(parent->body_type == LIBBALSA_MESSAGE_BODY_TYPE_MESSAGE)
-                ifbo = IMFB_HEADER;
-            else
-                ifbo = IMFB_MIME;
-        }
-        rc = IMR_OK;
-        if (dt.body->octets > 0)
-        II(rc,mimap->handle,
-           imap_mbox_handle_fetch_body(mimap->handle, msg->msgno,
-                                       section, FALSE, ifbo, append_str, &dt));
-        libbalsa_unlock_mailbox(msg->mailbox);
-        if(rc != IMR_OK) {
-            fprintf(stderr, "Error fetching imap message no %lu section %s\n",
-                    msg->msgno, section);
-            g_set_error(err,
-                        LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
-                        _("Error fetching message from IMAP server: %s"), 
-                        imap_mbox_handle_get_last_msg(mimap->handle));
-            g_free(dt.block);
-            g_free(section);
-            g_free(part_name);
-            g_strfreev(pair);
-            return FALSE;
-        }
-        g_mkdir_with_parents(pair[0], S_IRUSR|S_IWUSR|S_IXUSR);
-        fp = fopen(part_name, "wb+");
+        ifbo = lbm_imap_part_options(msg, part);
+        fp = libbalsa_imap_cache_create(cache, &part_name);
         if(!fp) {
+            libbalsa_unlock_mailbox(msg->mailbox);
             g_set_error(err,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
                         _("Cannot create temporary file"));
-            g_free(dt.block);
             g_free(section);
-            g_free(part_name);
-            g_strfreev(pair);
+            g_free(key);
+            g_free(item);
             return FALSE;
         }
-        if(ifbo == IMFB_NONE || dt.body->octets == 0) {
+        if(ifbo == IMFB_NONE || body->octets == 0) {
             fprintf(fp,"MIME-version: 1.0\r\ncontent-type: %s\r\n"
                     "Content-Transfer-Encoding: %s\r\n\r\n",
                     part->content_type ? part->content_type : "text/plain",
-                    encoding_names(dt.body->encoding));
+                    encoding_names(body->encoding));
         }
-        /* Carefully save number of bytes actually read from the file. */
-	if (dt.pos) {
-            if(fwrite(dt.block, 1, dt.pos, fp) != dt.pos
-               || fflush(fp) != 0) {
-            fclose(fp);
+        start = ftello(fp);
+        rc = IMR_OK;
+        if (body->octets > 0)
+        II(rc,mimap->handle,
+           lbm_imap_fetch_part_to_file(mimap->handle, msg->msgno, section,
+                                       ifbo, fp, start));
+        libbalsa_unlock_mailbox(msg->mailbox);
+        if(rc != IMR_OK || fflush(fp) != 0 || ferror(fp)) {
             /* we do not want to have an incomplete part in the cache
                so that the user still can try again later when the
                problem with writing (disk space?) is removed */
+            fclose(fp);
             unlink(part_name);
+            fprintf(stderr, "Error fetching imap message no %lu section %s\n",
+                    msg->msgno, section);
             g_set_error(err,
                         LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_ACCESS_ERROR,
-                        _("Cannot write to temporary file %s"), part_name);
-            g_free(dt.block);
+                        _("Error fetching message from IMAP server: %s"), 
+                        imap_mbox_handle_get_last_msg(mimap->handle));
             g_free(section);
             g_free(part_name);
-            g_strfreev(pair);
-            return FALSE; /* something better ? */
-            }
+            g_free(key);
+            g_free(item);
+            return FALSE;
         }
-        g_free(dt.block);
+        g_free(libbalsa_imap_cache_store(cache, key, item, part_name));
 	fseek(fp, 0, SEEK_SET);
     }
     partstream = g_mime_stream_file_new (fp);
@@ -2546,7 +5197,8 @@ lbm_imap_get_msg_part_from_cache(LibBalsaMessage * msg,
     g_object_unref (partstream);
     g_free(section);
     g_free(part_name);
-    g_strfreev(pair);
+    g_free(key);
+    g_free(item);
 
     return TRUE;
 }
@@ -2625,6 +5277,26 @@ libbalsa_mailbox_imap_get_msg_part(LibBalsaMessage *msg,
     return lbm_imap_get_msg_part(msg, part, FALSE, NULL, err);
 }
 
+/* Returns the content of a part; if it is not cached, it is fetched
+ * in the background while the stream is read. */
+static GInputStream *
+libbalsa_mailbox_imap_get_part_stream(LibBalsaMessage * msg,
+                                      LibBalsaMessageBody * part,
+                                      GError ** err)
+{
+    struct lbm_imap_part_fetch *fetch;
+    GInputStream *stream = NULL;
+
+    if (!lbm_imap_part_find(msg, part, &stream, NULL, &fetch, err))
+        return NULL;
+    if (fetch)
+        g_thread_unref(g_thread_new("lbm_imap_part_fetch",
+                                    (GThreadFunc) lbm_imap_part_fetch_thread,
+                                    fetch));
+
+    return stream;
+}
+
 /* libbalsa_mailbox_imap_duplicate_msgnos: identify messages with same
    non-empty message-ids. An efficient implementation requires that a
    list of msgids is maintained client side. The algorithm consists of
@@ -2644,6 +5316,11 @@ libbalsa_mailbox_imap_duplicate_msgnos(LibBalsaMailbox *mailbox)
     GHashTable *dupes;
     GArray     *res;
     unsigned i;
+
+    if (!mimap->msgids) {
+        mimap->msgids = g_ptr_array_new();
+        g_ptr_array_set_size(mimap->msgids, mimap->n_messages);
+    }
     /* a+b. */
     for(i=mimap->msgids->len; i>=1; i--) {
 	ImapMessage *imsg;
@@ -2780,10 +5457,13 @@ libbalsa_mailbox_imap_add_messages(LibBalsaMailbox * mailbox,
 struct MultiAppendCbData {
     LibBalsaAddMessageIterator msg_iterator;
     void *iterator_data;
+    LibBalsaImapCache *cache;
     GMimeStream *outstream;
-    GList *outfiles;
+    GPtrArray *outfiles;    /* copies staged in the cache, in upload
+                             * order; NULL once refused by the server */
+    guint committed;        /* outfiles answered by the server */
     GError **err;
-    guint copied;
+    guint copied;           /* messages stored by the server */
 };
 
 static void
@@ -2798,12 +5478,16 @@ macd_clear(struct MultiAppendCbData *macd)
 static void
 macd_destroy(struct MultiAppendCbData *macd)
 {
-    GList *outmsgs;
-    for(outmsgs = macd->outfiles; outmsgs; outmsgs = outmsgs->next) {
-	unlink(outmsgs->data);
-	g_free(outmsgs->data);
+    guint i;
+
+    for (i = 0; i < macd->outfiles->len; i++) {
+        gchar *outf = g_ptr_array_index(macd->outfiles, i);
+        if (outf) {
+            unlink(outf);
+            g_free(outf);
+        }
     }
-    g_list_free(macd->outfiles);
+    g_ptr_array_free(macd->outfiles, TRUE);
 }
 
 static size_t
@@ -2818,11 +5502,10 @@ multi_append_cb(char * buf, size_t buflen,
 	ImapMsgFlags imap_flags = IMAP_FLAGS_EMPTY;
 	GMimeStream *tmpstream;
 	GMimeFilter *crlffilter;
-	gint outfd;
+	FILE *outfp;
 	GMimeStream *stream = NULL;
 	gint64 len;
 	LibBalsaMessageFlag flags;
-	GError**err = macd->err;
 	gchar *outf = NULL;
 
 	macd_clear(macd);
@@ -2851,16 +5534,21 @@ multi_append_cb(char * buf, size_t buflen,
 	g_mime_stream_filter_add(GMIME_STREAM_FILTER(tmpstream), crlffilter);
 	g_object_unref(crlffilter);
 
-	outfd = g_file_open_tmp("balsa-tmp-file-XXXXXX", &outf, err);
-	if (outfd < 0) {
-	    g_warning("Could not create temporary file: %s", (*err)->message);
+	/* Stage the upload in the cache: once the server tells the
+	 * UID, the copy becomes the cached body without being copied
+	 * again. */
+	outfp = libbalsa_imap_cache_create(macd->cache, &outf);
+	if (!outfp) {
+	    g_set_error(macd->err, LIBBALSA_MAILBOX_ERROR,
+			LIBBALSA_MAILBOX_APPEND_ERROR,
+			_("Could not create temporary file"));
 	    g_object_unref(tmpstream);
 	    g_object_unref(stream);
 	    return 0;
 	}
 
-	macd->outstream = g_mime_stream_fs_new(outfd);
-	macd->outfiles = g_list_append(macd->outfiles, outf);
+	macd->outstream = g_mime_stream_file_new(outfp);
+	g_ptr_array_add(macd->outfiles, outf);
 	libbalsa_mime_stream_shared_lock(stream);
 	g_mime_stream_write_to_stream(tmpstream, macd->outstream);
 	libbalsa_mime_stream_shared_unlock(stream);
@@ -2876,70 +5564,58 @@ multi_append_cb(char * buf, size_t buflen,
                                  (long int) ((len + 512) / 1024));
 
 	*return_flags = imap_flags;
-	macd->copied++;
 	return g_mime_stream_length(macd->outstream);
     }
 	break;
     case IMA_STAGE_PASS_DATA:
 	return g_mime_stream_read(macd->outstream, buf, buflen);
+    case IMA_STAGE_COMMITTED:
+        if (buflen > 0)
+            macd->copied++;
+        else {
+            gchar *outf = g_ptr_array_index(macd->outfiles,
+                                            macd->committed);
+            unlink(outf);
+            g_free(outf);
+            g_ptr_array_index(macd->outfiles, macd->committed) = NULL;
+        }
+        macd->committed++;
+        return 0;
     }
     g_assert_not_reached();
     return 0;
 }
 
 struct append_to_cache_data {
-    const gchar *user, *host, *path, *cache_dir;
-    GList *curr_name;
+    LibBalsaMailboxImap *mimap;
+    LibBalsaImapCache *cache;
+    GPtrArray *outfiles;
+    guint curr;
     unsigned uid_validity;
 };
 
-static void
-create_cache_copy(const gchar *src, const gchar *cache_dir, const gchar *name)
-{
-    gchar *fname = libbalsa_urlencode(name);
-    gchar *dst = g_build_filename(cache_dir, fname, NULL);
-    if(link(src, dst) != 0) {
-	/* Link failed possibly because the two caches reside on
-	   different file systems. We attempt to copy the cache instead. */
-	FILE *in  = fopen(src, "r");
-
-	if(in) {
-	    FILE *out = fopen(dst, "w");
-	    if(out) {
-	        size_t sz;
-	        char buf[65536];
-		gboolean err;
-		while( (sz=fread(buf, 1, sizeof(buf), in)) > 0)
-		    if(fwrite(buf, 1, sz, out) != sz)
-			break;
-		err = ferror(in) || ferror(out);
-		fclose(out);
-		if(err)
-		    unlink(dst);
-	    }
-	    fclose(in);
-	}
-    }
-    g_free(fname);
-    g_free(dst);
-}
-
+/* Moves the next staged upload to the cache, as the body of the
+ * message with the UID. */
 static void
 append_to_cache(unsigned uid, void *arg)
 {
     struct append_to_cache_data *atcd = (struct append_to_cache_data*)arg;
-    gchar *name = g_strdup_printf("%s@%s-%s-%u-%u-%s",
-				  atcd->user, atcd->host, atcd->path,
-				  atcd->uid_validity,
-				  uid, "body");
-    gchar *msg = atcd->curr_name->data;
-
-    atcd->curr_name = g_list_next(atcd->curr_name);
-
-    g_return_if_fail(msg);
+    gchar *key = get_cache_key(atcd->mimap, atcd->uid_validity, uid);
+    gchar *msg;
+
+    while (atcd->curr < atcd->outfiles->len
+           && !g_ptr_array_index(atcd->outfiles, atcd->curr))
+        atcd->curr++;   /* refused by the server */
+    if (atcd->curr == atcd->outfiles->len) {
+        g_free(key);
+        return;
+    }
+    msg = g_ptr_array_index(atcd->outfiles, atcd->curr);
+    g_ptr_array_index(atcd->outfiles, atcd->curr++) = NULL;
 
-    create_cache_copy(msg, atcd->cache_dir, name);
-    g_free(name);
+    g_free(libbalsa_imap_cache_store(atcd->cache, key, "body", msg));
+    g_free(msg);
+    g_free(key);
 }
 
 static guint
@@ -2962,39 +5638,41 @@ libbalsa_mailbox_imap_add_messages(LibBalsaMailbox * mailbox,
 
     macd.msg_iterator = msg_iterator;
     macd.iterator_data = arg;
+    macd.cache = get_cache(mimap);
     macd.outstream = NULL;
-    macd.outfiles = NULL;
+    macd.outfiles = g_ptr_array_new();
+    macd.committed = 0;
     macd.err = err;
     macd.copied = 0;
     imap_sequence_init(&uid_sequence);
     rc = imap_mbox_append_multi(handle,	mimap->path,
 				multi_append_cb, &macd, &uid_sequence);
+    if (rc != IMR_OK && err && !*err) {
+        gchar *msg = imap_mbox_handle_get_last_msg(handle);
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR, "%s", msg);
+        g_free(msg);
+    }
     libbalsa_mailbox_imap_release_handle(mimap);
     macd_clear(&macd);
 
     if(!imap_sequence_empty(&uid_sequence) &&
-       g_list_length(macd.outfiles) == imap_sequence_length(&uid_sequence)) {
+       macd.copied == imap_sequence_length(&uid_sequence)) {
 	/* Hurray, server returned UID data on appended messages! */
-	LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-	LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-	gboolean is_persistent = libbalsa_imap_server_has_persistent_cache(is);
 	struct append_to_cache_data atcd;
-	gchar *cache_dir;
 
-	atcd.user = s->user;
-	atcd.host = s->host;
-	atcd.path = mimap->path ? mimap->path : "INBOX";
-	atcd.cache_dir = cache_dir = get_cache_dir(is_persistent);
-	atcd.curr_name = macd.outfiles;
+	atcd.mimap = mimap;
+	atcd.cache = macd.cache;
+	atcd.outfiles = macd.outfiles;
+	atcd.curr = 0;
 	atcd.uid_validity = uid_sequence.uid_validity;
 
 	imap_sequence_foreach(&uid_sequence, append_to_cache, &atcd);
-	imap_sequence_release(&uid_sequence);
-	g_free(cache_dir);
     }
+    imap_sequence_release(&uid_sequence);
 
     macd_destroy(&macd);
-    return rc == IMR_OK ? macd.copied : 0;
+    return macd.copied;
 }
 #endif
 
@@ -3039,7 +5717,7 @@ lbm_imap_change_user_flags(LibBalsaMailbox * mailbox, GArray * seqno,
     for (i = seqno->len; --i >= 0;) {
 	guint msgno = g_array_index(seqno, guint, i);
         struct message_info *msg_info = 
-            message_info_from_msgno(mimap, msgno);
+            message_info_from_msgno(mimap, msgno, TRUE);
         if (msg_info) {
             msg_info->user_flags |= set;
             msg_info->user_flags &= ~clear;
@@ -3054,7 +5732,8 @@ lbm_imap_messages_change_flags(LibBalsaMailbox * mailbox, GArray * seqno,
 {
     ImapMsgFlag flag_set, flag_clr;
     ImapResponse rc = IMR_OK;
-    ImapMboxHandle *handle = LIBBALSA_MAILBOX_IMAP(mailbox)->handle;
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    ImapMboxHandle *handle = mimap->handle;
 
     if(seqno->len == 0) return TRUE;
     lbm_imap_change_user_flags(mailbox, seqno, set, clear);
@@ -3069,17 +5748,31 @@ lbm_imap_messages_change_flags(LibBalsaMailbox * mailbox, GArray * seqno,
        to unsolicited EXPUNGE responses are resolved. The issues are
        pretty much of a theoretical character but we do not want to
        risk the mail store integrity, do we? */
+    if (!mimap->offline_open) {
+        if (flag_set)
+            II(rc, handle,
+               imap_mbox_store_flag(handle,
+                                    seqno->len, (guint *) seqno->data,
+                                    flag_set, TRUE));
+        if (rc && flag_clr)
+            II(rc, handle,
+               imap_mbox_store_flag(handle,
+                                    seqno->len, (guint *) seqno->data,
+                                    flag_clr, FALSE));
+        if (rc == IMR_OK || !libbalsa_mailbox_get_offline(mailbox)
+            || !imap_mbox_is_disconnected(handle))
+            return rc == IMR_OK;
+    }
+
+    /* The server cannot be reached: change the flags here, and tell
+     * the server on the next connection. */
     if (flag_set)
-        II(rc, handle,
-           imap_mbox_store_flag(handle,
-                                seqno->len, (guint *) seqno->data,
-                                flag_set, TRUE));
-    if (rc && flag_clr)
-        II(rc, handle,
-           imap_mbox_store_flag(handle,
-                                seqno->len, (guint *) seqno->data,
-                                flag_clr, FALSE));
-    return rc == IMR_OK;
+        imap_mbox_store_flag_local(handle, seqno->len, (guint *) seqno->data,
+                                   flag_set, TRUE);
+    if (flag_clr)
+        imap_mbox_store_flag_local(handle, seqno->len, (guint *) seqno->data,
+                                   flag_clr, FALSE);
+    return lbm_imap_journal_add(mimap, seqno, flag_set, flag_clr);
 }
 
 static gboolean
@@ -3096,7 +5789,7 @@ libbalsa_mailbox_imap_msgno_has_flags(LibBalsaMailbox * m, unsigned msgno,
     user_unset = unset & ~LIBBALSA_MESSAGE_FLAGS_REAL;
     if (user_set || user_unset) {
         struct message_info *msg_info =
-            message_info_from_msgno(mimap, msgno);
+            message_info_from_msgno(mimap, msgno, TRUE);
         if (!msg_info ||
             (msg_info->user_flags & user_set) != user_set ||
             (msg_info->user_flags & user_unset) != 0)
@@ -3191,7 +5884,7 @@ libbalsa_mailbox_imap_set_threading(LibBalsaMailbox *mailbox,
         }
         if(!new_tree) { /* fall back */
             new_tree = g_node_new(NULL);
-            for(msgno = 1; msgno <= mimap->messages_info->len; msgno++)
+            for(msgno = 1; msgno <= mimap->n_messages; msgno++)
                 g_node_append_data(new_tree, GUINT_TO_POINTER(msgno));
         }
         break;
@@ -3246,12 +5939,13 @@ libbalsa_mailbox_imap_sort(LibBalsaMailbox *mbox, GArray *array)
     LibBalsaMailboxImap *mimap;
 
     mimap = LIBBALSA_MAILBOX_IMAP(mbox);
-    if (mimap->sort_field != mbox->view->sort_field) {
+    if (mimap->sort_field != mbox->view->sort_field
+        || mimap->sort_ranks->len != mimap->n_messages) {
 	/* Cached ranks are invalid. */
         unsigned *msgno_arr;
         guint i, len;
 
-        len = mimap->messages_info->len;
+        len = mimap->n_messages;
         msgno_arr = g_malloc(len * sizeof(unsigned));
         for (i = 0; i < len; i++)
             msgno_arr[i] = i + 1;
@@ -3280,10 +5974,64 @@ libbalsa_mailbox_imap_total_messages(LibBalsaMailbox * mailbox)
     LibBalsaMailboxImap *mimap = (LibBalsaMailboxImap *) mailbox;
     guint cnt;
 
-    cnt = mimap->messages_info ? mimap->messages_info->len : 0;
+    cnt = mimap->n_messages;
     return cnt;
 }
 
+/* Give the destination messages, whose UIDs are reported by UIDPLUS,
+ * the cache entries of the source messages.  The cached files are
+ * shared, not copied. */
+static void
+lbm_imap_copy_cache(LibBalsaMailboxImap * mimap, LibBalsaMailboxImap * dst_imap,
+                    unsigned *uids, unsigned cnt, ImapSequence * uid_sequence)
+{
+    LibBalsaImapCache *cache = get_cache(mimap);
+    GList *l = uid_sequence->ranges;
+    ImapUID nth = l ? ((ImapUidRange *) l->data)->lo : 0;
+    unsigned im;
+
+    /* The destination UIDs are walked along with the source ones. */
+    for(im = 0; im<cnt && l; im++) {
+        ImapUID dst_uid = nth;
+        gchar *src_key, *dst_key;
+
+        if(nth++ == ((ImapUidRange *) l->data)->hi
+           && (l = l->next) != NULL)
+            nth = ((ImapUidRange *) l->data)->lo;
+        if(!uids[im])
+            continue;
+        src_key = get_cache_key(mimap, mimap->uid_validity, uids[im]);
+        dst_key = get_cache_key(dst_imap, uid_sequence->uid_validity,
+                                dst_uid);
+        libbalsa_imap_cache_copy(cache, src_key, dst_key);
+        g_free(src_key);
+        g_free(dst_key);
+    }
+}
+
+/* Collect UIDs of the messages to be copied or moved. */
+static unsigned *
+lbm_imap_get_uids(ImapMboxHandle * handle, GArray * msgnos)
+{
+    unsigned *seqno = (unsigned*)msgnos->data, *uids;
+    unsigned im;
+
+    g_array_sort(msgnos, cmp_msgno);
+    uids = g_new(unsigned, msgnos->len);
+    /* The UIDs are known without decoding the messages. */
+    for(im=0; im<msgnos->len; im++)
+	uids[im] = imap_mbox_handle_known_uid(handle, seqno[im]);
+    return uids;
+}
+
+static gboolean
+lbm_imap_same_server(LibBalsaMailbox * mailbox, LibBalsaMailbox * dest)
+{
+    return LIBBALSA_IS_MAILBOX_IMAP(dest) &&
+	LIBBALSA_MAILBOX_REMOTE(dest)->server ==
+	LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
+}
+
 /* Copy messages in the list to dest; use server-side copy if mailbox
  * and dest are on the same server, fall back to parent method
  * otherwise.
@@ -3293,25 +6041,17 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
 				    GArray * msgnos,
 				    LibBalsaMailbox * dest, GError **err)
 {
-    if (LIBBALSA_IS_MAILBOX_IMAP(dest) &&
-	LIBBALSA_MAILBOX_REMOTE(dest)->server ==
-	LIBBALSA_MAILBOX_REMOTE(mailbox)->server) {
+    if (lbm_imap_same_server(mailbox, dest)) {
         gboolean ret;
 	LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
 	ImapMboxHandle *handle = LIBBALSA_MAILBOX_IMAP(mailbox)->handle;
 	ImapSequence uid_sequence;
-	unsigned *seqno = (unsigned*)msgnos->data, *uids;
-	unsigned im;
+	unsigned *uids;
 	g_return_val_if_fail(handle, FALSE);
 	
 	imap_sequence_init(&uid_sequence);
 	/* User server-side copy. */
-	g_array_sort(msgnos, cmp_msgno);
-	uids = g_new(unsigned, msgnos->len);
-	for(im=0; im<msgnos->len; im++) {
-	    ImapMessage * imsg = imap_mbox_handle_get_msg(handle, seqno[im]);
-	    uids[im] = imsg ? imsg->uid : 0;
-	}
+	uids = lbm_imap_get_uids(handle, msgnos);
 	    
 	ret = imap_mbox_handle_copy(handle, msgnos->len,
                                     (guint *) msgnos->data,
@@ -3326,55 +6066,8 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
             g_free(msg);
         } else if(!imap_sequence_empty(&uid_sequence)) {
 	    /* Copy cache files. */
-	    GDir *dir;
-	    LibBalsaServer *s      = LIBBALSA_MAILBOX_REMOTE(mailbox)->server;
-	    LibBalsaImapServer *is = LIBBALSA_IMAP_SERVER(s);
-	    LibBalsaMailboxImap *dst_imap = LIBBALSA_MAILBOX_IMAP(dest);
-	    gboolean is_persistent =
-		libbalsa_imap_server_has_persistent_cache(is);
-	    gchar *dir_name = get_cache_dir(is_persistent);
-	    gchar *src_prefix = g_strdup_printf("%s@%s-%s-%u-",
-						s->user, s->host,
-						(mimap->path 
-						 ? mimap->path : "INBOX"),
-						mimap->uid_validity);
-	    gchar *encoded_path = libbalsa_urlencode(src_prefix);
-	    g_free(src_prefix);
-	    dir = g_dir_open(dir_name, 0, NULL);
-	    if(dir) {
-		const gchar *filename;
-		size_t prefix_length = strlen(encoded_path);
-		unsigned nth;
-		while ((filename = g_dir_read_name(dir)) != NULL) {
-		    unsigned msg_uid;
-		    gchar *tail;
-		    if(strncmp(encoded_path, filename, prefix_length))
-			continue;
-		    msg_uid = strtol(filename + prefix_length, &tail, 10);
-		    for(im = 0; im<msgnos->len; im++) {
-			if(uids[im]>msg_uid) break;
-			else if(uids[im]==msg_uid &&
-				(nth = imap_sequence_nth(&uid_sequence, im))
-				 ) {
-			    gchar *src =
-				g_build_filename(dir_name, filename, NULL);
-			    gchar *dst_prefix =
-				g_strdup_printf("%s@%s-%s-%u-%u%s",
-						s->user, s->host,
-						(dst_imap->path 
-						 ? dst_imap->path : "INBOX"),
-						uid_sequence.uid_validity,
-						nth, tail);
-
-			    create_cache_copy(src, dir_name, dst_prefix);
-			    g_free(dst_prefix);
-			    break;
-			}
-		    }
-		}
-		g_dir_close(dir);
-	    }
-	    g_free(dir_name);
+	    lbm_imap_copy_cache(mimap, LIBBALSA_MAILBOX_IMAP(dest),
+	                        uids, msgnos->len, &uid_sequence);
 	}
 	g_free(uids);
 	imap_sequence_release(&uid_sequence);
@@ -3385,6 +6078,57 @@ libbalsa_mailbox_imap_messages_copy(LibBalsaMailbox * mailbox,
     return parent_class->messages_copy(mailbox, msgnos, dest, err);
 }
 
+/* Move messages in the list to dest with a single MOVE command if the
+ * server supports it; fall back to copy and delete otherwise.
+ */
+static gboolean
+libbalsa_mailbox_imap_messages_move(LibBalsaMailbox * mailbox,
+				    GArray * msgnos,
+				    LibBalsaMailbox * dest, GError **err)
+{
+    LibBalsaMailboxImap *mimap = LIBBALSA_MAILBOX_IMAP(mailbox);
+    ImapMboxHandle *handle = mimap->handle;
+
+    if (handle && lbm_imap_same_server(mailbox, dest) &&
+        imap_mbox_handle_can_do(handle, IMCAP_MOVE)) {
+        gboolean ret;
+	ImapSequence uid_sequence;
+	unsigned *uids;
+	unsigned im, cnt = msgnos->len;
+
+	imap_sequence_init(&uid_sequence);
+	uids = lbm_imap_get_uids(handle, msgnos);
+
+        /* The moved messages are expunged before the command
+         * completes; keep their cache files until they are copied. */
+        mimap->moving = 1;
+	ret = imap_mbox_handle_move(handle, cnt, (guint *) msgnos->data,
+                                    LIBBALSA_MAILBOX_IMAP(dest)->path,
+				    &uid_sequence)
+	    == IMR_OK;
+        mimap->moving = 0;
+        if(!ret) {
+            gchar *msg = imap_mbox_handle_get_last_msg(handle);
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_COPY_ERROR,
+                        "%s", msg);
+            g_free(msg);
+        } else {
+            if(!imap_sequence_empty(&uid_sequence))
+                lbm_imap_copy_cache(mimap, LIBBALSA_MAILBOX_IMAP(dest),
+                                    uids, cnt, &uid_sequence);
+            for(im=0; im<cnt; im++)
+                if(uids[im])
+                    lbm_imap_remove_cache(mimap, uids[im]);
+        }
+	g_free(uids);
+	imap_sequence_release(&uid_sequence);
+        return ret;
+    }
+
+    return parent_class->messages_move(mailbox, msgnos, dest, err);
+}
+
 void
 libbalsa_imap_set_cache_size(off_t cache_size)
 {
@@ -3397,7 +6141,7 @@ void
 libbalsa_imap_purge_temp_dir(off_t cache_size)
 {
     gchar *dir_name = get_cache_dir(FALSE);
-    clean_dir(dir_name, cache_size);
+    libbalsa_imap_cache_trim(libbalsa_imap_cache_get(dir_name), cache_size);
     g_free(dir_name);
 }
 
@@ -3424,16 +6168,60 @@ libbalsa_imap_purge_temp_dir(off_t cache_size)
      ImapMboxHandle and can be potentially used in future sessions -
      mostly all ImapMessage and ImapEnvelope structures.
 
-     Current implementation stores the information in memory but an
-     implementation storing data on disk is possible, too.
-
+   The header cache file is mapped into memory, and the messages are
+   handed to the ImapMboxHandle undecoded: only those that are looked
+   at, for display or sorting, are ever decoded.  The file consists
+   of a header, the serialized messages, each aligned to 8 bytes, and
+   a table giving UID, flags, size and offset of each message in
+   msgno, ie. UID, order.  When the mailbox is closed, the messages
+   that are new or have changed are appended to the file, followed by
+   a new table, and only then the header is updated to point to the
+   new table; the file is rewritten when it holds more stale data
+   than live data.
  */
+#define ICM_MAGIC      "BalsaHC4"
+#define ICM_VERSION    1
+#define ICM_BYTE_ORDER 0x01020304
+#define ICM_ALIGN(n)   (((n) + 7) & ~(uint64_t) 7)
+
+struct icm_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;   /* ICM_BYTE_ORDER, as written */
+    uint32_t uidvalidity;
+    uint32_t uidnext;
+    uint32_t exists;
+    uint32_t table_length; /* entries */
+    uint64_t modseq;
+    uint64_t table_offset;
+};
+
+struct icm_file_entry {
+    uint32_t uid;          /* 0 if not known */
+    uint32_t flags;
+    uint32_t size;         /* of the serialized message; 0 if none */
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+struct icm_record {
+    uint32_t     uid;
+    ImapMsgFlags flags;
+    uint32_t     size;     /* of data; 0 if the headers are not known */
+    const void  *data;     /* the serialized message */
+    uint64_t     offset;   /* of data in file; 0 if not there */
+};
+
 struct ImapCacheManager {
-    GHashTable *headers;
-    GArray     *uidmap;
+    GMappedFile *file;     /* the header cache file, or NULL */
+    dev_t        dev;      /* ...and its identity */
+    ino_t        ino;
+    GArray      *records;  /* struct icm_record, in msgno order */
+    GPtrArray   *blobs;    /* data owned by the icm */
     uint32_t    uidvalidity;
     uint32_t    uidnext;
     uint32_t    exists;
+    uint64_t    modseq;  /* HIGHESTMODSEQ (RFC 7162) or 0 */
 };
 
 static struct ImapCacheManager*
@@ -3441,57 +6229,112 @@ imap_cache_manager_new(guint cnt)
 {
     struct ImapCacheManager *icm = g_new0(struct ImapCacheManager, 1);
     icm->exists = cnt;
-    icm->headers = 
-        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
-    icm->uidmap = g_array_sized_new(FALSE,  TRUE, sizeof(uint32_t), cnt);
+    icm->records = g_array_sized_new(FALSE, TRUE,
+                                     sizeof(struct icm_record), cnt);
+    icm->blobs = g_ptr_array_new_with_free_func(g_free);
     return icm;
 }
 
+/* Points the records at the messages in file, mapped from
+   header_cache_path, dropping the messages the icm owns.  Takes over
+   the reference to file. */
+static gboolean
+icm_attach_file(struct ImapCacheManager *icm, GMappedFile *file,
+                const char *header_cache_path)
+{
+    const gchar *contents;
+    gsize length;
+    struct stat st;
+    unsigned i;
+
+    if(stat(header_cache_path, &st) != 0) {
+        g_mapped_file_unref(file);
+        return FALSE;
+    }
+    contents = g_mapped_file_get_contents(file);
+    length   = g_mapped_file_get_length(file);
+    for(i=0; i<icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i);
+        if(rec->size) {
+            if(rec->offset == 0 || rec->offset + rec->size > length) {
+                g_mapped_file_unref(file);
+                return FALSE;
+            }
+            rec->data = contents + rec->offset;
+        }
+    }
+
+    if(icm->file)
+        g_mapped_file_unref(icm->file);
+    icm->file = file;
+    icm->dev  = st.st_dev;
+    icm->ino  = st.st_ino;
+    g_ptr_array_set_size(icm->blobs, 0);
+    return TRUE;
+}
+
+static gboolean
+icm_map_file(struct ImapCacheManager *icm, const char *header_cache_path)
+{
+    GMappedFile *file = g_mapped_file_new(header_cache_path, FALSE, NULL);
+
+    return file && icm_attach_file(icm, file, header_cache_path);
+}
+
 static struct ImapCacheManager*
 imap_cache_manager_new_from_file(const char *header_cache_path)
 {
-    /* The cache data should be transferable between 32- and 64-bit
-       systems. */
-    uint32_t i;
-    ImapUID uid;
+    GMappedFile *file;
+    const gchar *contents;
+    gsize length;
+    struct icm_file_header hdr;
+    const struct icm_file_entry *table;
     struct ImapCacheManager *icm;
-    FILE *f = fopen(header_cache_path, "rb");
-    if(!f) {
-	return NULL;
-    }
-    if(fread(&i, sizeof(i), 1, f) != 1) {
-	printf("Could not read cache table size.\n");
-        fclose(f);
+    uint32_t i;
+
+    file = g_mapped_file_new(header_cache_path, FALSE, NULL);
+    if(!file)
 	return NULL;
+    contents = g_mapped_file_get_contents(file);
+    length   = g_mapped_file_get_length(file);
+    if(length < sizeof(hdr)) {
+        g_mapped_file_unref(file);
+        return NULL;
     }
-    
-    icm = imap_cache_manager_new(i);
-    if(fread(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-       fread(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
-	imap_cache_manager_free(icm);
+    memcpy(&hdr, contents, sizeof(hdr));
+    if(memcmp(hdr.magic, ICM_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != ICM_VERSION || hdr.byte_order != ICM_BYTE_ORDER ||
+       hdr.table_offset % 8 != 0 || hdr.table_offset > length ||
+       (length - hdr.table_offset) / sizeof(struct icm_file_entry)
+       < hdr.table_length) {
 	printf("Couldn't read cache - aborting…\n");
-        fclose(f);
+        g_mapped_file_unref(file);
 	return NULL;
     }
 
-    i = 0;
-    while(fread(&uid, sizeof(uid), 1, f) == 1) {
-	if(uid) {
-	    uint32_t slen; /* Architecture-independent size */
-	    gchar *s;
-	    if(fread(&slen, sizeof(slen), 1, f) != 1)
-		break;
-	    s = g_malloc(slen+1); /* slen would be sufficient? */
-	    if(fread(s, 1, slen, f) != slen)
-                break;
-	    s[slen] = '\0'; /* Unneeded? */
-	    g_hash_table_insert(icm->headers, GUINT_TO_POINTER(uid), s);
-	}
-        g_array_append_val(icm->uidmap, uid);
-	i++;
+    icm = imap_cache_manager_new(hdr.table_length);
+    icm->uidvalidity = hdr.uidvalidity;
+    icm->uidnext     = hdr.uidnext;
+    icm->exists      = hdr.exists;
+    icm->modseq      = hdr.modseq;
+    /* Only the table is read; the messages are read when decoded. */
+    table = (const struct icm_file_entry *) (contents + hdr.table_offset);
+    for(i=0; i<hdr.table_length; i++) {
+        struct icm_record rec;
+        rec.uid    = table[i].uid;
+        rec.flags  = table[i].flags;
+        rec.size   = table[i].uid ? table[i].size : 0;
+        rec.offset = rec.size ? table[i].offset : 0;
+        rec.data   = NULL;
+        g_array_append_val(icm->records, rec);
+    }
+
+    if(!icm_attach_file(icm, file, header_cache_path)) {
+	printf("Couldn't read cache - aborting…\n");
+        imap_cache_manager_free(icm);
+        return NULL;
     }
-    fclose(f);
 
     return icm;
 }
@@ -3499,8 +6342,10 @@ imap_cache_manager_new_from_file(const char *header_cache_path)
 static void
 imap_cache_manager_free(struct ImapCacheManager *icm)
 {
-    g_hash_table_destroy(icm->headers);
-    g_array_free(icm->uidmap, TRUE);
+    if(icm->file)
+        g_mapped_file_unref(icm->file);
+    g_array_free(icm->records, TRUE);
+    g_ptr_array_free(icm->blobs, TRUE);
     g_free(icm);
 }
 
@@ -3511,11 +6356,49 @@ imap_cache_manager_free(struct ImapCacheManager *icm)
    nothing has changed - feed entire cache.
    else fetch the message numbers for the UIDs in cache.
 */
-static void
-set_uid(ImapMboxHandle *handle, unsigned seqno, void *arg)
+static guint64
+icm_get_modseq(struct ImapCacheManager *icm, ImapUID *uidvalidity)
+{
+    if(!icm)
+        return 0;
+    *uidvalidity = icm->uidvalidity;
+    return icm->modseq;
+}
+
+/* After a QRESYNC select, the old msgno->UID map less the UIDs that
+   vanished is the new one, with new messages following. That works
+   only if all UIDs were known. */
+static gboolean
+icm_apply_vanished(struct ImapCacheManager *icm, ImapSequence *vanished,
+                   unsigned exists)
 {
-    GArray *a = (GArray*)arg;
-    g_array_append_val(a, seqno);
+    GArray *records = g_array_sized_new(FALSE, TRUE,
+                                        sizeof(struct icm_record),
+                                        icm->records->len);
+    unsigned i;
+
+    for(i=0; i<icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i);
+        gboolean gone = FALSE;
+        GList *l;
+
+        if(!rec->uid)
+            break;
+        for(l = vanished->ranges; l && !gone; l = l->next) {
+            ImapUidRange *iur = l->data;
+            gone = iur->lo <= rec->uid && rec->uid <= iur->hi;
+        }
+        if(!gone)
+            g_array_append_val(records, *rec);
+    }
+    if(i < icm->records->len || records->len > exists) {
+        g_array_free(records, TRUE);
+        return FALSE;
+    }
+    g_array_free(icm->records, TRUE); icm->records = records;
+    icm->exists = records->len;
+    return TRUE;
 }
 
 static void
@@ -3523,6 +6406,8 @@ icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
 {
     unsigned exists, uidvalidity, uidnext;
     unsigned i;
+    ImapSequence vanished;
+    gboolean synced;
 
     if(!icm || ! h)
         return;
@@ -3535,54 +6420,77 @@ icm_restore_from_cache(ImapMboxHandle *h, struct ImapCacheManager *icm)
         return;
     }
 
+    synced = imap_mbox_handle_take_vanished(h, &vanished) && icm->modseq &&
+        icm_apply_vanished(icm, &vanished, exists);
+    imap_sequence_release(&vanished);
+
     /* There were some modifications to the mailbox but the situation
      * is not hopeless, we just need to get the seqnos of messages in
      * the cache. */
-    if(exists - icm->exists !=  uidnext - icm->uidnext) {
-        ImapResponse rc;
-        GArray *uidmap = g_array_sized_new(FALSE, TRUE,
-                                           sizeof(uint32_t), icm->exists);
-        ImapSearchKey *k;
-        unsigned lo = icm->uidmap->len+1, hi = 0;
-        /* printf("UIDSYNC:Searching range [1:%u]\n", icm->uidmap->len); */
-        for(i=1; i<=icm->uidmap->len; i++)
-            if(g_array_index(icm->uidmap, uint32_t, i-1)) {lo=i; break; }
-        for(i=icm->uidmap->len; i>=lo; i--)
-            if(g_array_index(icm->uidmap, uint32_t, i-1)) {hi=i; break; }
-
-        k = imap_search_key_new_range(FALSE, FALSE, lo, hi);
+    if(!synced && exists - icm->exists !=  uidnext - icm->uidnext) {
+        unsigned lo = icm->records->len+1, hi = 0;
+        /* printf("UIDSYNC:Searching range [1:%u]\n", icm->records->len); */
+        for(i=1; i<=icm->records->len; i++)
+            if(g_array_index(icm->records, struct icm_record, i-1).uid)
+                {lo=i; break; }
+        for(i=icm->records->len; i>=lo; i--)
+            if(g_array_index(icm->records, struct icm_record, i-1).uid)
+                {hi=i; break; }
+        if(hi > exists) /* expunges only move the messages down */
+            hi = exists;
+
         /* printf("UIDSYNC: Old vs new: exists: %u %u uidnext: %u %u "
                "- syncing uid map for msgno [%u:%u].\n",
                icm->exists, exists, icm->uidnext, uidnext, lo, hi); */
-        if(k) {
-            uidmap->len = lo-1;
-            rc = imap_search_exec(h, TRUE, k, set_uid, uidmap);
-            imap_search_key_free(k);
-        } else rc = IMR_NO;
-        if(rc != IMR_OK) {
-            g_array_free(uidmap, TRUE);
+        if(imap_mbox_handle_learn_uids(h, lo, hi) != IMR_OK)
             return;
+        /* The handle maps the UIDs to the new seqnos now. */
+        for(i=0; i<icm->records->len; i++) {
+            struct icm_record *rec =
+                &g_array_index(icm->records, struct icm_record, i);
+            unsigned seqno;
+            if(rec->data &&
+               (seqno = imap_mbox_handle_find_uid(h, rec->uid)) != 0)
+                imap_mbox_handle_msg_defer(h, seqno, rec->uid, rec->flags,
+                                           rec->data);
         }
-        g_array_free(icm->uidmap, TRUE); icm->uidmap = uidmap;
-        /* printf("New uidmap has length: %u\n", icm->uidmap->len); */
+        return;
     }
-    /* One way or another, we have a valid uid->seqno map now;
-     * The mailbox data can be resynced easily. */
 
-    for(i=1; i<=icm->exists; i++) {
-        uint32_t uid = g_array_index(icm->uidmap, uint32_t, i-1);
-        void *data = g_hash_table_lookup(icm->headers,
-                                         GUINT_TO_POINTER(uid));
-        if(data) /* if uid known */
-            imap_mbox_handle_msg_deserialize(h, i, data);
+    /* The seqnos of the records are valid; the mailbox data can be
+     * resynced easily. */
+    for(i=1; i<=icm->exists && i<=icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i-1);
+        if(rec->data) /* if uid known */
+            imap_mbox_handle_msg_defer(h, i, rec->uid, rec->flags,
+                                       rec->data);
     }
 }
 
+/* The offset of data in the file of icm, or 0. */
+static uint64_t
+icm_file_offset(struct ImapCacheManager *icm, const void *data)
+{
+    const gchar *contents;
+
+    if(!icm || !icm->file)
+        return 0;
+    contents = g_mapped_file_get_contents(icm->file);
+    if((const gchar *) data < contents ||
+       (const gchar *) data >= contents + g_mapped_file_get_length(icm->file))
+        return 0;
+    return (const gchar *) data - contents;
+}
+
 /** Stores (possibly persistently) data associated with given handle.
     This allows for quick restore between IMAP sessions and reduces
-    synchronization overhead. */
+    synchronization overhead.  Messages that the handle has not
+    decoded are taken from prev, the icm they were restored from; if
+    prev is NULL, the new icm borrows their data, and must not outlive
+    the one they come from. */
 static struct ImapCacheManager*
-icm_store_cached_data(ImapMboxHandle *handle)
+icm_store_cached_data(ImapMboxHandle *handle, struct ImapCacheManager *prev)
 {
     struct ImapCacheManager *icm;
     unsigned cnt, i;
@@ -3594,61 +6502,181 @@ icm_store_cached_data(ImapMboxHandle *handle)
     icm = imap_cache_manager_new(cnt);
     icm->uidvalidity = imap_mbox_handle_get_validity(handle);
     icm->uidnext     = imap_mbox_handle_get_uidnext(handle);
+    icm->modseq      = imap_mbox_handle_get_highestmodseq(handle);
+    if(prev && prev->file) {
+        icm->file = g_mapped_file_ref(prev->file);
+        icm->dev  = prev->dev;
+        icm->ino  = prev->ino;
+    }
 
     for(i=0; i<cnt; i++) {
-        void *ptr;
-        ImapMessage *imsg = imap_mbox_handle_get_msg(handle, i+1);
-        unsigned uid;
-        if(imsg && (ptr = imap_message_serialize(imsg)) != NULL) {
-            g_hash_table_insert(icm->headers,
-                                GUINT_TO_POINTER(imsg->uid), ptr);
-            uid = imsg->uid;
-        } else uid = 0;
-        g_array_append_val(icm->uidmap, uid);
+        struct icm_record rec = { 0 };
+        const void *data =
+            imap_mbox_handle_get_deferred(handle, i+1, &rec.uid, &rec.flags);
+
+        if(data) {
+            /* Not looked at: it is as it was cached. */
+            rec.size   = imap_serialized_message_size((void *) data);
+            rec.offset = icm_file_offset(prev, data);
+            if(prev && !rec.offset) {
+                data = g_memdup(data, rec.size);
+                g_ptr_array_add(icm->blobs, (gpointer) data);
+            }
+            rec.data = data;
+        } else {
+            ImapMessage *imsg = imap_mbox_handle_get_msg(handle, i+1);
+            if(imsg) {
+                /* Known UIDs help QRESYNC even without the headers. */
+                rec.uid   = imsg->uid;
+                rec.flags = imsg->flags;
+                if(rec.uid &&
+                   (rec.data = imap_message_serialize(imsg)) != NULL) {
+                    rec.size =
+                        imap_serialized_message_size((void *) rec.data);
+                    g_ptr_array_add(icm->blobs, (gpointer) rec.data);
+                }
+            }
+        }
+        g_array_append_val(icm->records, rec);
     }
     return icm;
 }
 
+/* A handle that is not connected, for mailbox mbox in the state icm
+   has, to which icm can then be restored. */
+static ImapMboxHandle *
+icm_new_offline_handle(struct ImapCacheManager *icm, const gchar *mbox)
+{
+    ImapMboxHandle *handle;
+
+    if(!icm || !icm->uidvalidity)
+        return NULL;
+    handle = imap_mbox_handle_new();
+    imap_mbox_handle_set_offline(handle, mbox, icm->uidvalidity,
+                                 icm->uidnext, icm->exists, icm->modseq);
+    return handle;
+}
+
+/* Writes the messages that are not in the file yet at offset *end,
+   followed by the table, and fills in hdr. */
 static gboolean
-icm_save_header(uint32_t uid, gpointer value, FILE *f)
+icm_write_data(struct ImapCacheManager *icm, FILE *f, uint64_t *end,
+               struct icm_file_header *hdr)
 {
-    if(fwrite(&uid, sizeof(uid), 1, f) != 1) return FALSE;
-    if(uid) {
-	uint32_t slen = imap_serialized_message_size(value);
-	if(fwrite(&slen, sizeof(slen), 1, f) != 1 ||
-           fwrite(value, 1, slen, f) != slen)
+    static const gchar zeros[8];
+    unsigned i;
+
+    if(fseeko(f, *end, SEEK_SET) != 0)
+        return FALSE;
+    for(i=0; i<icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i);
+        if(rec->size && !rec->offset) {
+            size_t pad = ICM_ALIGN(rec->size) - rec->size;
+            if(fwrite(rec->data, 1, rec->size, f) != rec->size ||
+               fwrite(zeros, 1, pad, f) != pad)
+                return FALSE;
+            rec->offset = *end;
+            *end += rec->size + pad;
+        }
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, ICM_MAGIC, sizeof(hdr->magic));
+    hdr->version      = ICM_VERSION;
+    hdr->byte_order   = ICM_BYTE_ORDER;
+    hdr->uidvalidity  = icm->uidvalidity;
+    hdr->uidnext      = icm->uidnext;
+    hdr->exists       = icm->exists;
+    hdr->modseq       = icm->modseq;
+    hdr->table_offset = *end;
+    hdr->table_length = icm->records->len;
+    for(i=0; i<icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i);
+        struct icm_file_entry entry = { 0 };
+        entry.uid    = rec->uid;
+        entry.flags  = rec->flags;
+        entry.size   = rec->size;
+        entry.offset = rec->offset;
+        if(fwrite(&entry, sizeof(entry), 1, f) != 1)
             return FALSE;
     }
-    return TRUE;
+    *end += icm->records->len * sizeof(struct icm_file_entry);
+
+    return fflush(f) == 0;
 }
 
+/* Appends to the existing file, if it is the one the data was mapped
+   from and is not mostly stale. */
+static gboolean
+icm_append_to_file(struct ImapCacheManager *icm, const gchar *file_name)
+{
+    FILE *f;
+    struct stat st;
+    struct icm_file_header hdr;
+    uint64_t end, live = sizeof(hdr);
+    unsigned i;
+    gboolean success;
+
+    if(!icm->file)
+        return FALSE;
+    for(i=0; i<icm->records->len; i++) {
+        struct icm_record *rec =
+            &g_array_index(icm->records, struct icm_record, i);
+        live += ICM_ALIGN(rec->size) + sizeof(struct icm_file_entry);
+    }
+    f = fopen(file_name, "r+b");
+    if(!f)
+        return FALSE;
+    if(fstat(fileno(f), &st) != 0 || st.st_dev != icm->dev ||
+       st.st_ino != icm->ino || (uint64_t) st.st_size > 2 * live ||
+       fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+       memcmp(hdr.magic, ICM_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.uidvalidity != icm->uidvalidity) {
+        fclose(f);
+        return FALSE;
+    }
+
+    end = ICM_ALIGN((uint64_t) st.st_size);
+    success = icm_write_data(icm, f, &end, &hdr) &&
+        fsync(fileno(f)) == 0 &&
+        fseeko(f, 0, SEEK_SET) == 0 &&
+        fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    success = fclose(f) == 0 && success;
+    return success;
+}
 
 static gboolean
 icm_save_to_file(struct ImapCacheManager *icm, const gchar *file_name)
 {
     gboolean success;
-    FILE *f = fopen(file_name, "wb");
-
-    success = f != NULL;
-    if(success) {
-	uint32_t i = icm->uidmap->len;
-	if(fwrite(&i, sizeof(i), 1, f) != 1                       ||
-           fwrite(&icm->uidvalidity, sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->uidnext,     sizeof(uint32_t), 1, f) != 1 ||
-           fwrite(&icm->exists,      sizeof(uint32_t), 1, f) != 1) {
-            success = FALSE;
-        } else {
-            for(i = 0; i<icm->uidmap->len; i++) {
-                uint32_t uid = g_array_index(icm->uidmap, uint32_t, i);
-                gpointer value = g_hash_table_lookup(icm->headers,
-                                                     GUINT_TO_POINTER(uid));
-                if(!icm_save_header(uid, value, f)) {
-                    success = FALSE;
-                    break;
-                }
-            }
+    unsigned i;
+
+    success = icm_append_to_file(icm, file_name);
+    if(!success) {
+        gchar *tmp_name = g_strconcat(file_name, ".new", NULL);
+        FILE *f = fopen(tmp_name, "wb");
+
+        for(i=0; i<icm->records->len; i++)
+            g_array_index(icm->records, struct icm_record, i).offset = 0;
+        success = f != NULL;
+        if(success) {
+            struct icm_file_header hdr;
+            uint64_t end = sizeof(hdr);
+            success = icm_write_data(icm, f, &end, &hdr) &&
+                fseeko(f, 0, SEEK_SET) == 0 &&
+                fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+            success = fclose(f) == 0 && success &&
+                rename(tmp_name, file_name) == 0;
+            if(!success)
+                unlink(tmp_name);
         }
-	fclose(f);
+        g_free(tmp_name);
     }
+
+    /* Let the records refer to the file, rather than to copies. */
+    if(success && !icm_map_file(icm, file_name))
+        success = FALSE;
     return success;
 }
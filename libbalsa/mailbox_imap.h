@@ -54,6 +54,18 @@ GHashTable * libbalsa_mailbox_imap_get_matchings(LibBalsaMailboxImap* mbox,
 						 gboolean * err);
 
 void libbalsa_mailbox_imap_noop(LibBalsaMailboxImap* mbox);
+void libbalsa_mailbox_imap_check_list(GSList * mailboxes);
+
+typedef struct {
+    guint shown;    /* messages shown */
+    guint hits;     /* shown messages whose body had been prefetched */
+    guint fetched;  /* bodies prefetched */
+    guint64 bytes;  /* size of the bodies prefetched */
+} LibBalsaImapPrefetchStats;
+void libbalsa_mailbox_imap_get_prefetch_stats(LibBalsaMailboxImap * mimap,
+                                              LibBalsaImapPrefetchStats *
+                                              stats);
+void libbalsa_mailbox_imap_update_offline(LibBalsaMailboxImap * mimap);
 
 void libbalsa_mailbox_imap_force_disconnect(LibBalsaMailboxImap* mimap);
 gboolean libbalsa_mailbox_imap_is_connected(LibBalsaMailboxImap* mimap);
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "libbalsa.h"
 #include "libbalsa_private.h"
@@ -38,6 +39,9 @@
 
 
 static LibBalsaMailboxClass *parent_class = NULL;
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static GMemoryMonitor *lbml_memory_monitor = NULL;
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
 
 static void libbalsa_mailbox_local_class_init(LibBalsaMailboxLocalClass *klass);
 static void libbalsa_mailbox_local_init(LibBalsaMailboxLocal * mailbox);
@@ -110,6 +114,13 @@ static void libbalsa_mailbox_local_test_can_reach(LibBalsaMailbox          * mai
 /* LibBalsaMailboxLocal class method: */
 static void lbm_local_real_remove_files(LibBalsaMailboxLocal * local);
 
+static void lbml_pool_clear(LibBalsaMailboxLocalPool * pool);
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static void lbml_low_memory_warning_cb(GMemoryMonitor * monitor,
+                                       GMemoryMonitorWarningLevel level,
+                                       LibBalsaMailboxLocal * local);
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
+
 GType
 libbalsa_mailbox_local_get_type(void)
 {
@@ -189,6 +200,10 @@ libbalsa_mailbox_local_class_init(LibBalsaMailboxLocalClass * klass)
     klass->check_files  = NULL;
     klass->set_path     = NULL;
     klass->remove_files = lbm_local_real_remove_files;
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    lbml_memory_monitor = g_memory_monitor_dup_default();
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
 }
 
 static void
@@ -199,6 +214,14 @@ libbalsa_mailbox_local_init(LibBalsaMailboxLocal * mailbox)
     mailbox->sync_cnt  = 0;
     mailbox->thread_id = 0;
     mailbox->save_tree_id = 0;
+
+    g_queue_init(&mailbox->message_pool.lru);
+    mailbox->message_pool.items = g_hash_table_new(NULL, NULL);
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    mailbox->low_memory_id =
+        g_signal_connect(lbml_memory_monitor, "low-memory-warning",
+                         G_CALLBACK(lbml_low_memory_warning_cb), mailbox);
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
 }
 
 LibBalsaMailbox *
@@ -273,30 +296,253 @@ libbalsa_mailbox_local_remove_files(LibBalsaMailboxLocal * local)
     LIBBALSA_MAILBOX_LOCAL_GET_CLASS(local)->remove_files(local);
 }
 
-/* libbalsa_mailbox_load_message:
-   MAKE sure the mailbox is LOCKed before entering this routine.
-*/
+/*
+ * The message pool: a byte-budgeted LRU cache of messages and their
+ * parsed MIME structure.
+ * MAKE sure the mailbox is LOCKed before calling any of these.
+ */
+
+typedef struct {
+    LibBalsaMessage *message;   /* we hold a reference */
+    GMimeMessage *mime_msg;     /* parsed structure, or NULL */
+    gsize size;                 /* estimated size of this item */
+} LibBalsaMailboxLocalPoolItem;
+
+/* Rough size of a message that has only its envelope loaded. */
+#define LBML_POOL_ENVELOPE_SIZE 1024
+
+static gsize lbml_pool_budget = LBML_POOL_DEFAULT_BUDGET;
+
+void
+libbalsa_mailbox_local_set_pool_budget(gsize budget)
+{
+    lbml_pool_budget = budget;
+}
+
+gsize
+libbalsa_mailbox_local_get_pool_budget(void)
+{
+    return lbml_pool_budget;
+}
+
+static gsize
+lbml_pool_item_size(LibBalsaMailboxLocalPoolItem * item)
+{
+    gsize size = LBML_POOL_ENVELOPE_SIZE;
+
+    if (item->mime_msg != NULL) {
+        glong length = LIBBALSA_MESSAGE_GET_LENGTH(item->message);
+
+        if (length > 0)
+            size += length;
+    }
+
+    return size;
+}
+
+static void
+lbml_pool_remove_link(LibBalsaMailboxLocalPool * pool, GList * link)
+{
+    LibBalsaMailboxLocalPoolItem *item = link->data;
+
+    g_hash_table_remove(pool->items, item->message);
+    g_queue_delete_link(&pool->lru, link);
+    pool->size -= item->size;
+
+    if (item->mime_msg != NULL)
+        g_object_unref(item->mime_msg);
+    g_object_unref(item->message);
+    g_free(item);
+}
+
+/* Find the pool item for message, and make it the most recently used
+ * one. */
+static GList *
+lbml_pool_touch(LibBalsaMailboxLocalPool * pool, LibBalsaMessage * message)
+{
+    GList *link = g_hash_table_lookup(pool->items, message);
+
+    if (link != NULL && link != pool->lru.head) {
+        g_queue_unlink(&pool->lru, link);
+        g_queue_push_head_link(&pool->lru, link);
+    }
+
+    return link;
+}
+
+/* Drop least recently used items until the pool fits in the budget;
+ * the most recently used item is always kept, however large. */
+static void
+lbml_pool_enforce_budget(LibBalsaMailboxLocalPool * pool)
+{
+    while (pool->size > lbml_pool_budget && pool->lru.length > 1)
+        lbml_pool_remove_link(pool, pool->lru.tail);
+}
+
+static gint
+lbml_pool_cmp_size(gconstpointer a, gconstpointer b)
+{
+    const LibBalsaMailboxLocalPoolItem *item_a =
+        (*(GList * const *) a)->data;
+    const LibBalsaMailboxLocalPoolItem *item_b =
+        (*(GList * const *) b)->data;
+
+    /* Largest first. */
+    return item_a->size < item_b->size ? 1 :
+        item_a->size > item_b->size ? -1 : 0;
+}
+
+/* Drop the largest items until the pool has shrunk to target bytes. */
+static void
+lbml_pool_shrink(LibBalsaMailboxLocalPool * pool, gsize target)
+{
+    GPtrArray *links;
+    GList *link;
+    guint i;
+
+    if (pool->size <= target)
+        return;
+
+    links = g_ptr_array_sized_new(pool->lru.length);
+    for (link = pool->lru.head; link != NULL; link = link->next)
+        g_ptr_array_add(links, link);
+    g_ptr_array_sort(links, lbml_pool_cmp_size);
+
+    for (i = 0; i < links->len && pool->size > target; i++)
+        lbml_pool_remove_link(pool, g_ptr_array_index(links, i));
+    g_ptr_array_free(links, TRUE);
+}
+
+static void
+lbml_pool_clear(LibBalsaMailboxLocalPool * pool)
+{
+    while (pool->lru.head != NULL)
+        lbml_pool_remove_link(pool, pool->lru.head);
+}
 
 static void
 lbml_message_pool_take_message(LibBalsaMailboxLocal * local,
                                LibBalsaMessage * message)
 {
-    LibBalsaMailboxLocalPool *item, *oldest;
+    LibBalsaMailboxLocalPool *pool = &local->message_pool;
+    LibBalsaMailboxLocalPoolItem *item;
 
-    ++local->pool_seqno;
+    if (lbml_pool_touch(pool, message) != NULL) {
+        /* Already in the pool; drop the extra reference. */
+        g_object_unref(message);
+        return;
+    }
+
+    item = g_new0(LibBalsaMailboxLocalPoolItem, 1);
+    item->message = message; /* we take over the reference count */
+    item->size = lbml_pool_item_size(item);
+    g_queue_push_head(&pool->lru, item);
+    g_hash_table_insert(pool->items, message, pool->lru.head);
+    pool->size += item->size;
 
-    for (item = oldest = &local->message_pool[0];
-         item < &local->message_pool[LBML_POOL_SIZE];
-         item++) {
-        if (item->pool_seqno < oldest->pool_seqno)
-            oldest = item;
+    lbml_pool_enforce_budget(pool);
+}
+
+/* libbalsa_mailbox_local_pool_get_mime_message:
+ * returns a new reference to the parsed structure of the message, if
+ * the pool still holds it, or NULL.
+ */
+GMimeMessage *
+libbalsa_mailbox_local_pool_get_mime_message(LibBalsaMailboxLocal * local,
+                                             LibBalsaMessage * message)
+{
+    LibBalsaMailboxLocalPool *pool;
+    GList *link;
+    LibBalsaMailboxLocalPoolItem *item;
+
+    g_return_val_if_fail(LIBBALSA_IS_MAILBOX_LOCAL(local), NULL);
+
+    pool = &local->message_pool;
+    link = lbml_pool_touch(pool, message);
+    item = link != NULL ? link->data : NULL;
+    if (item == NULL || item->mime_msg == NULL) {
+        ++pool->misses;
+        return NULL;
+    }
+
+    ++pool->hits;
+    return g_object_ref(item->mime_msg);
+}
+
+/* libbalsa_mailbox_local_pool_set_mime_message:
+ * remember the parsed structure of the message, or forget it when
+ * mime_msg is NULL (for example, when the mailbox file was rewritten).
+ */
+void
+libbalsa_mailbox_local_pool_set_mime_message(LibBalsaMailboxLocal * local,
+                                             LibBalsaMessage * message,
+                                             GMimeMessage * mime_msg)
+{
+    LibBalsaMailboxLocalPool *pool;
+    GList *link;
+    LibBalsaMailboxLocalPoolItem *item;
+
+    g_return_if_fail(LIBBALSA_IS_MAILBOX_LOCAL(local));
+
+    pool = &local->message_pool;
+    link = lbml_pool_touch(pool, message);
+    if (link == NULL) {
+        if (mime_msg == NULL)
+            return;
+        lbml_message_pool_take_message(local, g_object_ref(message));
+        link = pool->lru.head;
     }
 
-    if (oldest->message != NULL)
-        g_object_unref(oldest->message);
-    oldest->message = message; /* we take over the reference count */
-    oldest->pool_seqno = local->pool_seqno;
+    item = link->data;
+    if (item->mime_msg != NULL)
+        g_object_unref(item->mime_msg);
+    item->mime_msg = mime_msg != NULL ? g_object_ref(mime_msg) : NULL;
+
+    pool->size -= item->size;
+    item->size = lbml_pool_item_size(item);
+    pool->size += item->size;
+
+    lbml_pool_enforce_budget(pool);
+}
+
+void
+libbalsa_mailbox_local_pool_get_stats(LibBalsaMailboxLocal * local,
+                                      guint * hits, guint * misses,
+                                      gsize * size)
+{
+    g_return_if_fail(LIBBALSA_IS_MAILBOX_LOCAL(local));
+
+    if (hits != NULL)
+        *hits = local->message_pool.hits;
+    if (misses != NULL)
+        *misses = local->message_pool.misses;
+    if (size != NULL)
+        *size = local->message_pool.size;
+}
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+/* Under memory pressure, give back the largest items first; the higher
+ * the warning level, the less we keep. */
+static void
+lbml_low_memory_warning_cb(GMemoryMonitor * monitor,
+                           GMemoryMonitorWarningLevel level,
+                           LibBalsaMailboxLocal * local)
+{
+    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
+    gsize target;
+
+    if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+        target = 0;
+    else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+        target = lbml_pool_budget / 4;
+    else
+        target = lbml_pool_budget / 2;
+
+    libbalsa_lock_mailbox(mailbox);
+    lbml_pool_shrink(&local->message_pool, target);
+    libbalsa_unlock_mailbox(mailbox);
 }
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
 
 static void
 lbm_local_get_message_with_msg_info(LibBalsaMailboxLocal * local,
@@ -414,6 +660,16 @@ libbalsa_mailbox_local_finalize(GObject * object)
         ml->load_messages_id = 0;
     }
 
+#if GLIB_CHECK_VERSION(2, 64, 0)
+    if (ml->low_memory_id) {
+        g_signal_handler_disconnect(lbml_memory_monitor, ml->low_memory_id);
+        ml->low_memory_id = 0;
+    }
+#endif                          /* GLIB_CHECK_VERSION(2, 64, 0) */
+
+    lbml_pool_clear(&ml->message_pool);
+    g_hash_table_destroy(ml->message_pool.items);
+
     if (G_OBJECT_CLASS(parent_class)->finalize)
 	G_OBJECT_CLASS(parent_class)->finalize(object);
 }
@@ -741,7 +997,6 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
 {
     LibBalsaMailboxLocal *local = LIBBALSA_MAILBOX_LOCAL(mailbox);
     guint i;
-    LibBalsaMailboxLocalPool *item;
 
     if(local->sync_id) {
         g_source_remove(local->sync_id);
@@ -777,15 +1032,7 @@ libbalsa_mailbox_local_close_mailbox(LibBalsaMailbox * mailbox,
         }
     }
 
-    for (item = &local->message_pool[0];
-         item < &local->message_pool[LBML_POOL_SIZE]; item++) {
-        if (item->message) {
-            g_object_unref(item->message);
-            item->message = NULL;
-        }
-        item->pool_seqno = 0;
-    }
-    local->pool_seqno = 0;
+    lbml_pool_clear(&local->message_pool);
 
     if (LIBBALSA_MAILBOX_CLASS(parent_class)->close_mailbox)
         LIBBALSA_MAILBOX_CLASS(parent_class)->close_mailbox(mailbox,
@@ -923,20 +1170,15 @@ message_match_real(LibBalsaMailbox *mailbox, guint msgno,
             }
 	}
 	if (CONDITION_CHKMATCH(cond,CONDITION_MATCH_BODY)) {
-            GString *body;
             g_assert(is_refed);
 	    if (!message->mailbox) {
                 /* No need to body-unref */
                 g_object_unref(message);
 		return FALSE; /* We don't want to match if an error occurred */
             }
-            body = content2reply(message->body_list, NULL, 0, FALSE, FALSE);
-	    if (body) {
-		if (body->str)
-                    match = libbalsa_utf8_strstr(body->str,
-                                                 cond->match.string.string);
-		g_string_free(body,TRUE);
-	    }
+            if (message->body_list)
+                match = content_find_text(message->body_list,
+                                          cond->match.string.string);
 	}
 	break;
     case CONDITION_REGEX:
@@ -2010,6 +2252,23 @@ lbml_threading_flat(LibBalsaMailbox * mailbox)
 /*  End of threading functions  */
 /*------------------------------*/
 
+/* Helper for maildir and mh: make the data of a file, or renames and
+ * new entries in a directory, durable. */
+gboolean
+libbalsa_mailbox_local_sync_path(const gchar * path)
+{
+    int fd;
+    gboolean retval;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FALSE;
+    retval = fsync(fd) == 0;
+    close(fd);
+
+    return retval;
+}
+
 /* Helper for maildir and mh. */
 GMimeMessage *
 libbalsa_mailbox_local_get_mime_message(LibBalsaMailbox * mailbox,
@@ -2126,6 +2385,24 @@ lbm_local_sort(LibBalsaMailbox * mailbox, GArray *sort_array)
     lbm_local_queue_save_tree(LIBBALSA_MAILBOX_LOCAL(mailbox));
 }
 
+static guint lbml_add_sync_interval = LBML_ADD_SYNC_DEFAULT_INTERVAL;
+
+void
+libbalsa_mailbox_local_set_add_sync_interval(guint interval)
+{
+    lbml_add_sync_interval = interval;
+}
+
+guint
+libbalsa_mailbox_local_get_add_sync_interval(void)
+{
+    return lbml_add_sync_interval;
+}
+
+/* Append all messages from the iterator. When the backend supports it,
+ * the whole batch is written under one lock and synced to disk every
+ * lbml_add_sync_interval messages (0 means once, at the end), instead
+ * of once per message. */
 static guint
 libbalsa_mailbox_local_add_messages(LibBalsaMailbox          * mailbox,
                                     LibBalsaAddMessageIterator msg_iterator,
@@ -2135,23 +2412,50 @@ libbalsa_mailbox_local_add_messages(LibBalsaMailbox          * mailbox,
     LibBalsaMessageFlag flag;
     GMimeStream *stream;
     LibBalsaMailboxLocal *local;
+    LibBalsaMailboxLocalClass *klass;
     guint cnt;
-    LibBalsaMailboxLocalAddMessageFunc *add_message;
+    guint committed;
+    guint pending;
+    gboolean success = TRUE;
 
     local = LIBBALSA_MAILBOX_LOCAL(mailbox);
-    cnt = 0;
-    add_message = LIBBALSA_MAILBOX_LOCAL_GET_CLASS(local)->add_message;
-    while (msg_iterator(&flag, &stream, iter_data)) {
-        gboolean success;
+    klass = LIBBALSA_MAILBOX_LOCAL_GET_CLASS(local);
+
+    if (klass->add_begin && !klass->add_begin(local, err))
+        return 0;
 
-        success = (*add_message)(local, stream, flag, err);
+    cnt = committed = pending = 0;
+    while (msg_iterator(&flag, &stream, iter_data)) {
+        success = klass->add_message(local, stream, flag, err);
         g_object_unref(stream);
         if (!success)
             break;
         cnt++;
+
+        if (klass->add_commit && lbml_add_sync_interval > 0
+            && ++pending >= lbml_add_sync_interval) {
+            if (!klass->add_commit(local, err)) {
+                success = FALSE;
+                break;
+            }
+            committed = cnt;
+            pending = 0;
+        }
     }
 
-    return cnt;
+    if (klass->add_commit) {
+        /* Whatever was appended before a failure is still kept. */
+        if (klass->add_commit(local, success ? err : NULL))
+            committed = cnt;
+    } else
+        committed = cnt;
+
+    /* Messages that could not be committed may still be in the
+     * mailbox; report them too. */
+    if (klass->add_end && klass->add_end(local))
+        committed = cnt;
+
+    return committed;
 }
 
 #define FLAGS_REALLY_DIFFER(flags0, flags1) \
@@ -44,12 +44,19 @@ GType libbalsa_mailbox_local_get_type(void);
 typedef struct _LibBalsaMailboxLocal LibBalsaMailboxLocal;
 typedef struct _LibBalsaMailboxLocalClass LibBalsaMailboxLocalClass;
 
+/* The message pool is a byte-budgeted LRU cache of recently used
+ * messages, together with their parsed MIME structure, so that going
+ * back to a recently viewed message does not parse it again. */
 struct _LibBalsaMailboxLocalPool {
-    LibBalsaMessage * message;
-    guint pool_seqno;
+    GQueue lru;                 /* LibBalsaMailboxLocalPoolItem's,
+                                 * most recently used first */
+    GHashTable *items;          /* LibBalsaMessage -> GList link in lru */
+    gsize size;                 /* estimated bytes held by the pool */
+    guint hits;                 /* parsed structure found in the pool */
+    guint misses;               /* parsed structure had to be built */
 };
 typedef struct _LibBalsaMailboxLocalPool LibBalsaMailboxLocalPool;
-#define LBML_POOL_SIZE 32
+#define LBML_POOL_DEFAULT_BUDGET (16 * 1024 * 1024)
 
 struct _LibBalsaMailboxLocalMessageInfo {
     LibBalsaMessageFlag flags;          /* May have pseudo-flags */
@@ -72,8 +79,8 @@ struct _LibBalsaMailboxLocal {
     guint load_messages_id; /* id of the idle load-messages job */
     guint msgno;            /* where to start loading messages */
     GPtrArray *threading_info;
-    LibBalsaMailboxLocalPool message_pool[LBML_POOL_SIZE];
-    guint pool_seqno;
+    LibBalsaMailboxLocalPool message_pool;
+    gulong low_memory_id;
 };
 
 typedef gboolean LibBalsaMailboxLocalAddMessageFunc(LibBalsaMailboxLocal *
@@ -82,6 +89,18 @@ typedef gboolean LibBalsaMailboxLocalAddMessageFunc(LibBalsaMailboxLocal *
                                                     LibBalsaMessageFlag
                                                     flags, GError ** err);
 
+/* Optional bulk-append hooks: add_begin is called once before a batch
+ * of add_message calls, add_commit flushes and syncs what has been
+ * appended so far, and add_end releases whatever add_begin acquired;
+ * it returns TRUE if the messages appended since the last successful
+ * commit are still in the mailbox, FALSE if they were dropped. */
+typedef gboolean LibBalsaMailboxLocalAddBeginFunc(LibBalsaMailboxLocal *
+                                                  local, GError ** err);
+typedef gboolean LibBalsaMailboxLocalAddCommitFunc(LibBalsaMailboxLocal *
+                                                   local, GError ** err);
+typedef gboolean LibBalsaMailboxLocalAddEndFunc(LibBalsaMailboxLocal *
+                                                local);
+
 struct _LibBalsaMailboxLocalClass {
     LibBalsaMailboxClass klass;
 
@@ -92,6 +111,9 @@ struct _LibBalsaMailboxLocalClass {
     LibBalsaMailboxLocalMessageInfo *(*get_info)(LibBalsaMailboxLocal * local,
                                                  guint msgno);
     LibBalsaMailboxLocalAddMessageFunc *add_message;
+    LibBalsaMailboxLocalAddBeginFunc *add_begin;
+    LibBalsaMailboxLocalAddCommitFunc *add_commit;
+    LibBalsaMailboxLocalAddEndFunc *add_end;
 };
 
 LibBalsaMailbox *libbalsa_mailbox_local_new(const gchar * path,
@@ -113,7 +135,28 @@ void libbalsa_mailbox_local_msgno_removed(LibBalsaMailbox * mailbox,
 					  guint msgno);
 void libbalsa_mailbox_local_remove_files(LibBalsaMailboxLocal *mailbox);
 
+/* Message pool. */
+void libbalsa_mailbox_local_set_pool_budget(gsize budget);
+gsize libbalsa_mailbox_local_get_pool_budget(void);
+GMimeMessage *libbalsa_mailbox_local_pool_get_mime_message(LibBalsaMailboxLocal
+                                                           * local,
+                                                           LibBalsaMessage *
+                                                           message);
+void libbalsa_mailbox_local_pool_set_mime_message(LibBalsaMailboxLocal *
+                                                  local,
+                                                  LibBalsaMessage * message,
+                                                  GMimeMessage * mime_msg);
+void libbalsa_mailbox_local_pool_get_stats(LibBalsaMailboxLocal * local,
+                                           guint * hits, guint * misses,
+                                           gsize * size);
+
+/* Bulk append: messages between syncs to disk. */
+#define LBML_ADD_SYNC_DEFAULT_INTERVAL 1000
+void libbalsa_mailbox_local_set_add_sync_interval(guint interval);
+guint libbalsa_mailbox_local_get_add_sync_interval(void);
+
 /* Helpers for maildir and mh. */
+gboolean libbalsa_mailbox_local_sync_path(const gchar * path);
 GMimeMessage *libbalsa_mailbox_local_get_mime_message(LibBalsaMailbox *
 						      mailbox,
 						      const gchar * name1,
@@ -97,6 +97,9 @@ static guint lbm_maildir_fileno(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalMessageInfo
     *lbm_maildir_get_info(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalAddMessageFunc lbm_maildir_add_message;
+static LibBalsaMailboxLocalAddBeginFunc lbm_maildir_add_begin;
+static LibBalsaMailboxLocalAddCommitFunc lbm_maildir_add_commit;
+static LibBalsaMailboxLocalAddEndFunc lbm_maildir_add_end;
 
 /* util functions */
 static struct message_info *message_info_from_msgno(LibBalsaMailboxMaildir
@@ -171,6 +174,9 @@ libbalsa_mailbox_maildir_class_init(LibBalsaMailboxMaildirClass * klass)
     libbalsa_mailbox_local_class->fileno       = lbm_maildir_fileno;
     libbalsa_mailbox_local_class->get_info     = lbm_maildir_get_info;
     libbalsa_mailbox_local_class->add_message  = lbm_maildir_add_message;
+    libbalsa_mailbox_local_class->add_begin    = lbm_maildir_add_begin;
+    libbalsa_mailbox_local_class->add_commit   = lbm_maildir_add_commit;
+    libbalsa_mailbox_local_class->add_end      = lbm_maildir_add_end;
 }
 
 static void
@@ -838,6 +844,11 @@ libbalsa_mailbox_maildir_fetch_message_structure(LibBalsaMailbox * mailbox,
 						 LibBalsaMessage * message,
 						 LibBalsaFetchFlag flags)
 {
+    if (!message->mime_msg)
+        message->mime_msg =
+            libbalsa_mailbox_local_pool_get_mime_message
+            (LIBBALSA_MAILBOX_LOCAL(mailbox), message);
+
     if (!message->mime_msg) {
 	struct message_info *msg_info =
             message_info_from_msgno((LibBalsaMailboxMaildir *) mailbox,
@@ -846,6 +857,10 @@ libbalsa_mailbox_maildir_fetch_message_structure(LibBalsaMailbox * mailbox,
 	    libbalsa_mailbox_local_get_mime_message(mailbox,
 						    msg_info->subdir,
 						    msg_info->filename);
+        if (message->mime_msg)
+            libbalsa_mailbox_local_pool_set_mime_message
+                (LIBBALSA_MAILBOX_LOCAL(mailbox), message,
+                 message->mime_msg);
     }
 
     return LIBBALSA_MAILBOX_CLASS(parent_class)->
@@ -939,7 +954,9 @@ lbm_maildir_add_message(LibBalsaMailboxLocal * local,
     free_message_info(msg_info);
     g_free(tmp);
 
-    if ((mtime = libbalsa_mailbox_get_mtime(mailbox)) != 0)
+    /* In a bulk add, lbm_maildir_add_end takes care of this. */
+    if (!LIBBALSA_MAILBOX_MAILDIR(local)->adding
+        && (mtime = libbalsa_mailbox_get_mtime(mailbox)) != 0)
 	/* If we checked or synced the mailbox less than 1 second ago,
 	 * the cached modification time could be the same as the new
 	 * modification time, so we'll invalidate the cached time. */
@@ -948,6 +965,47 @@ lbm_maildir_add_message(LibBalsaMailboxLocal * local,
     return retval;
 }
 
+static gboolean
+lbm_maildir_add_begin(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LIBBALSA_MAILBOX_MAILDIR(local)->adding = TRUE;
+
+    return TRUE;
+}
+
+/* New messages are moved into "new"; sync that directory once for the
+ * whole batch. */
+static gboolean
+lbm_maildir_add_commit(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LibBalsaMailboxMaildir *mdir = LIBBALSA_MAILBOX_MAILDIR(local);
+
+    if (!libbalsa_mailbox_local_sync_path(mdir->newdir)) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR,
+                    _("Could not sync %s: %s"), mdir->newdir,
+                    g_strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The messages stay in "new" even if they could not be synced. */
+static gboolean
+lbm_maildir_add_end(LibBalsaMailboxLocal * local)
+{
+    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
+    time_t mtime;
+
+    LIBBALSA_MAILBOX_MAILDIR(local)->adding = FALSE;
+
+    if ((mtime = libbalsa_mailbox_get_mtime(mailbox)) != 0)
+	libbalsa_mailbox_set_mtime(mailbox, --mtime);
+
+    return TRUE;
+}
+
 static guint
 libbalsa_mailbox_maildir_total_messages(LibBalsaMailbox * mailbox)
 {
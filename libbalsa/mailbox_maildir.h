@@ -45,6 +45,7 @@ struct _LibBalsaMailboxMaildir {
     gchar *curdir;
     gchar *newdir;
     gchar *tmpdir;
+    gboolean adding;    /* inside a bulk add */
 };
 
 struct _LibBalsaMailboxMaildirClass {
@@ -46,6 +46,9 @@
 
 /* #define DEBUG_SEEK TRUE */
 
+/* Distance between restart points in the index of a compressed mbox. */
+#define LBM_MBOX_GZIP_SPAN (4 * 1024 * 1024)
+
 struct message_info {
     LibBalsaMailboxLocalMessageInfo local_info;
     LibBalsaMessageFlag orig_flags;     /* Has only real flags */
@@ -86,6 +89,9 @@ static gboolean libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox,
 static LibBalsaMailboxLocalMessageInfo
     *lbm_mbox_get_info(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalAddMessageFunc lbm_mbox_add_message;
+static LibBalsaMailboxLocalAddBeginFunc lbm_mbox_add_begin;
+static LibBalsaMailboxLocalAddCommitFunc lbm_mbox_add_commit;
+static LibBalsaMailboxLocalAddEndFunc lbm_mbox_add_end;
 
 static gboolean
 libbalsa_mailbox_mbox_fetch_message_structure(LibBalsaMailbox * mailbox,
@@ -107,8 +113,30 @@ struct _LibBalsaMailboxMbox {
     GMimeStream *gmime_stream;
     off_t size;
     gboolean messages_info_changed;
+    gboolean compressed;        /* read-only gzip archive */
+
+    /* Bulk append state, between lbm_mbox_add_begin and
+     * lbm_mbox_add_end. */
+    GMimeStream *append_stream; /* the locked mailbox file */
+    GByteArray *append_buffer;  /* appended data not yet written */
+    off_t append_committed;     /* file length at the last commit */
+    gchar append_last;          /* last byte appended, 0 if none */
+    gboolean append_failed;
+
+    /* Fingerprint of the file as of the last check, used to tell an
+     * append from a rewrite without locking the file. */
+    ino_t ino;
+    off_t tail_size;            /* size when tail_hash was taken */
+    guint32 tail_hash;          /* hash of the bytes just before it */
 };
 
+/* Appended messages are collected and written in chunks of about this
+ * size. */
+#define LBM_MBOX_APPEND_BUFFER (256 * 1024)
+
+/* Number of bytes at the end of the file covered by the fingerprint. */
+#define LBM_MBOX_TAIL_LEN 256
+
 GType libbalsa_mailbox_mbox_get_type(void)
 {
     static GType mailbox_type = 0;
@@ -169,6 +197,9 @@ libbalsa_mailbox_mbox_class_init(LibBalsaMailboxMboxClass * klass)
 
     libbalsa_mailbox_local_class->get_info = lbm_mbox_get_info;
     libbalsa_mailbox_local_class->add_message = lbm_mbox_add_message;
+    libbalsa_mailbox_local_class->add_begin = lbm_mbox_add_begin;
+    libbalsa_mailbox_local_class->add_commit = lbm_mbox_add_commit;
+    libbalsa_mailbox_local_class->add_end = lbm_mbox_add_end;
     object_class->dispose = libbalsa_mailbox_mbox_dispose;
 }
 
@@ -378,6 +409,14 @@ lbm_mbox_get_cache_filename(LibBalsaMailboxMbox * mbox)
     return filename;
 }
 
+/* Compressed mboxes are recognized by name; see
+ * libbalsa_mailbox_type_from_path. */
+static gboolean
+lbm_mbox_path_is_compressed(const gchar * path)
+{
+    return g_str_has_suffix(path, ".gz");
+}
+
 static void
 lbm_mbox_save(LibBalsaMailboxMbox * mbox)
 {
@@ -702,14 +741,35 @@ libbalsa_mailbox_mbox_open(LibBalsaMailbox * mailbox, GError **err)
 	return FALSE;
     }
 
-    mailbox->readonly = access (path, W_OK);
+    mbox->compressed = lbm_mbox_path_is_compressed(path);
+    mailbox->readonly = mbox->compressed || access (path, W_OK);
     fd = open(path, mailbox->readonly ? O_RDONLY : O_RDWR);
     if (fd == -1) {
 	g_set_error(err, LIBBALSA_MAILBOX_ERROR, LIBBALSA_MAILBOX_OPEN_ERROR,
 		    _("Cannot open mailbox."));
 	return FALSE;
     }
-    gmime_stream = libbalsa_mime_stream_shared_new(fd);
+
+    if (mbox->compressed) {
+        /* The restart-point index is kept next to the offset cache. */
+        gchar *cache_filename = lbm_mbox_get_cache_filename(mbox);
+        gchar *index_filename = g_strconcat(cache_filename, ".gzidx", NULL);
+        LibBalsaGzipIndex *gzip;
+
+        g_free(cache_filename);
+        gzip = libbalsa_gzip_index_new(fd, index_filename,
+                                       LBM_MBOX_GZIP_SPAN, err);
+        g_free(index_filename);
+        if (!gzip) {
+            close(fd);
+            return FALSE;
+        }
+        gmime_stream = libbalsa_mime_stream_shared_new_gzip(fd, gzip);
+        /* From here on, we work with the uncompressed size. */
+        st.st_size = libbalsa_gzip_index_get_size(gzip);
+        libbalsa_gzip_index_unref(gzip);
+    } else
+        gmime_stream = libbalsa_mime_stream_shared_new(fd);
 
     libbalsa_mime_stream_shared_lock(gmime_stream);
     if (st.st_size > 0
@@ -942,8 +1002,60 @@ lbm_mbox_check_file(LibBalsaMailboxMbox * mbox,
     return retval;
 }
 
+/* Hash the LBM_MBOX_TAIL_LEN bytes before offset size, without
+ * locking; returns FALSE if they cannot be read. */
+static gboolean
+lbm_mbox_tail_hash(int fd, off_t size, guint32 * hash)
+{
+    guchar buf[LBM_MBOX_TAIL_LEN];
+    off_t start;
+    ssize_t len;
+    ssize_t i;
+    guint32 h = 5381;
+
+    start = MAX(size - LBM_MBOX_TAIL_LEN, 0);
+    len = pread(fd, buf, size - start, start);
+    if (len != size - start)
+        return FALSE;
+
+    for (i = 0; i < len; i++)
+        h = (h << 5) + h + buf[i];
+    *hash = h;
+
+    return TRUE;
+}
+
+/* Remember the inode and tail of the file at mbox->size. */
+static void
+lbm_mbox_save_fingerprint(LibBalsaMailboxMbox * mbox, int fd,
+                          const struct stat * st)
+{
+    mbox->ino = st->st_ino;
+    mbox->tail_size =
+        lbm_mbox_tail_hash(fd, mbox->size, &mbox->tail_hash) ?
+        mbox->size : -1;
+}
+
+/* Compare the file with the fingerprint taken at the last check: TRUE
+ * if the only change is that data was appended. */
 static gboolean
-lbm_mbox_check(LibBalsaMailbox * mailbox, const gchar * path)
+lbm_mbox_is_append(LibBalsaMailboxMbox * mbox, int fd,
+                   const struct stat * st)
+{
+    guint32 hash;
+
+    return st->st_ino == mbox->ino
+        && mbox->tail_size == mbox->size
+        && st->st_size > mbox->size
+        && lbm_mbox_tail_hash(fd, mbox->size, &hash)
+        && hash == mbox->tail_hash;
+}
+
+/* Look for unread messages in a closed mbox. If start is positive, the
+ * file is known to have been appended to at that offset, so only the
+ * new part is scanned. */
+static gboolean
+lbm_mbox_check(LibBalsaMailbox * mailbox, const gchar * path, off_t start)
 {
     LibBalsaMailboxMbox *mbox = LIBBALSA_MAILBOX_MBOX(mailbox);
     int fd;
@@ -963,9 +1075,14 @@ lbm_mbox_check(LibBalsaMailbox * mailbox, const gchar * path)
 
     line = g_byte_array_sized_new(80);
 
-    retval = lbm_mbox_check_cache(mbox, &buffer, line);
-    if (!retval)
+    if (start > 0) {
+        lbm_mbox_seek(&buffer, start);
         retval = lbm_mbox_check_file(mbox, &buffer, line);
+    } else {
+        retval = lbm_mbox_check_cache(mbox, &buffer, line);
+        if (!retval)
+            retval = lbm_mbox_check_file(mbox, &buffer, line);
+    }
 
     g_byte_array_free(line, TRUE);
     mbox_unlock(mailbox, buffer.stream);
@@ -985,11 +1102,17 @@ libbalsa_mailbox_mbox_check(LibBalsaMailbox * mailbox)
     guint msgno;
     time_t mtime;
     off_t start;
+    int fd;
 
     g_assert(LIBBALSA_IS_MAILBOX_MBOX(mailbox));
 
     mbox = LIBBALSA_MAILBOX_MBOX(mailbox);
     path = libbalsa_mailbox_local_get_path(mailbox);
+    if (lbm_mbox_path_is_compressed(path))
+        /* Compressed archives are not appended to; a changed file is
+         * reindexed when it is opened again. */
+        return;
+
     if (mbox->gmime_stream ?
         fstat(GMIME_STREAM_FS(mbox->gmime_stream)->fd, &st) :
         stat(path, &st)) {
@@ -998,31 +1121,55 @@ libbalsa_mailbox_mbox_check(LibBalsaMailbox * mailbox)
     }
 
     mtime = libbalsa_mailbox_get_mtime(mailbox);
+    if (mtime != 0 && st.st_mtime == mtime && st.st_size == mbox->size)
+	return;
+
+    /* Something changed, or this is the first check; the pre-check
+     * below reads the file but does not lock it. */
+    fd = mbox->gmime_stream ?
+        GMIME_STREAM_FS(mbox->gmime_stream)->fd : open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+
     if (mtime == 0) {
-	/* First check--just cache the mtime and size. */
+	/* First check--just cache the mtime, size and fingerprint. */
         libbalsa_mailbox_set_mtime(mailbox, st.st_mtime);
 	mbox->size = st.st_size;
 #if DEBUG_SEEK
         g_print("%s %s set size from stat %d\n", __func__, mailbox->name,
                 mbox->size);
 #endif
+        lbm_mbox_save_fingerprint(mbox, fd, &st);
+        if (!mbox->gmime_stream)
+            close(fd);
 	return;
     }
-    if (st.st_mtime == mtime && st.st_size == mbox->size)
-	return;
 
     libbalsa_mailbox_set_mtime(mailbox, st.st_mtime);
 
     if (!MAILBOX_OPEN(mailbox)) {
-	libbalsa_mailbox_set_unread_messages_flag(mailbox,
-						  lbm_mbox_check(mailbox,
-								 path));
+        gboolean is_append = lbm_mbox_is_append(mbox, fd, &st);
+
+        /* An append cannot make unread messages disappear, so if we
+         * already know of some, there is nothing to look for;
+         * otherwise only the appended part needs to be scanned. */
+        if (!(is_append && mailbox->has_unread_messages))
+            libbalsa_mailbox_set_unread_messages_flag(mailbox,
+                                                      lbm_mbox_check
+                                                      (mailbox, path,
+                                                       is_append ?
+                                                       mbox->size : 0));
 	/* Cache the file size, so we don't check the next time. */
 	mbox->size = st.st_size;
 #if DEBUG_SEEK
         g_print("%s %s set size from stat %d\n", __func__, mailbox->name,
                 mbox->size);
 #endif
+        lbm_mbox_save_fingerprint(mbox, fd, &st);
+        if (!mbox->gmime_stream)
+            close(fd);
 	return;
     }
 
@@ -1115,6 +1262,7 @@ libbalsa_mailbox_mbox_check(LibBalsaMailbox * mailbox)
     g_print("%s %s set size from tell %d\n", __func__, mailbox->name,
             mbox->size);
 #endif
+    lbm_mbox_save_fingerprint(mbox, fd, &st);
     libbalsa_mime_stream_shared_unlock(mbox_stream);
     mbox_unlock(mailbox, mbox_stream);
     libbalsa_mailbox_local_load_messages(mailbox, msgno);
@@ -1168,28 +1316,6 @@ lbm_mbox_get_mime_message(LibBalsaMailbox * mailbox,
     return mime_message;
 }
 
-/* Write one or two newlines to stream. */
-static gint
-lbm_mbox_newline(GMimeStream * stream)
-{
-    gint retval;
-    static const gchar newlines[] = "\n\n";
-
-    if (g_mime_stream_seek(stream, -1, GMIME_STREAM_SEEK_CUR) < 0) {
-    	retval = -1;
-    } else {
-        gchar buf;
-
-    	retval = g_mime_stream_read(stream, &buf, 1);
-    	if (retval == 1) {
-    		retval =
-    			g_mime_stream_write(stream, newlines, buf == '\n' ? 1 : 2);
-    	}
-    }
-
-    return retval;
-}
-
 /* Store the message status flags in str, padded with spaces to a minimum
  * length of len.
  */
@@ -1439,7 +1565,7 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
      */
     libbalsa_mailbox_mbox_check(mailbox);
     mbox = LIBBALSA_MAILBOX_MBOX(mailbox);
-    if (mbox->msgno_2_msg_info->len == 0)
+    if (mbox->msgno_2_msg_info->len == 0 || mbox->compressed)
 	return TRUE;
     mbox_stream = mbox->gmime_stream;
 
@@ -1706,8 +1832,13 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
             mbox->messages_info_changed = TRUE;
 	    continue;
 	}
-	if (msg_info->local_info.message)
+	if (msg_info->local_info.message) {
 	    msg_info->local_info.message->msgno = j + 1;
+            /* The pooled structure refers to the old file offsets. */
+            libbalsa_mailbox_local_pool_set_mime_message
+                (LIBBALSA_MAILBOX_LOCAL(mailbox),
+                 msg_info->local_info.message, NULL);
+        }
 
 	msg_info->status = msg_info->x_status = msg_info->mime_version = -1;
 	mime_msg = g_mime_parser_construct_message(gmime_parser);
@@ -1741,6 +1872,9 @@ libbalsa_mailbox_mbox_sync(LibBalsaMailbox * mailbox, gboolean expunge)
 	else {
 	    g_object_unref(msg_info->local_info.message->mime_msg);
 	    msg_info->local_info.message->mime_msg = mime_msg;
+            libbalsa_mailbox_local_pool_set_mime_message
+                (LIBBALSA_MAILBOX_LOCAL(mailbox),
+                 msg_info->local_info.message, mime_msg);
 	    /*
 	     * reinit the message parts info
 	     */
@@ -1773,7 +1907,17 @@ libbalsa_mailbox_mbox_fetch_message_structure(LibBalsaMailbox * mailbox,
 					      LibBalsaFetchFlag flags)
 {
     if (!message->mime_msg)
+        message->mime_msg =
+            libbalsa_mailbox_local_pool_get_mime_message
+            (LIBBALSA_MAILBOX_LOCAL(mailbox), message);
+
+    if (!message->mime_msg) {
 	message->mime_msg = lbm_mbox_get_mime_message(mailbox, message->msgno);
+        if (message->mime_msg)
+            libbalsa_mailbox_local_pool_set_mime_message
+                (LIBBALSA_MAILBOX_LOCAL(mailbox), message,
+                 message->mime_msg);
+    }
 
     return LIBBALSA_MAILBOX_CLASS(parent_class)->
         fetch_message_structure(mailbox, message, flags);
@@ -1885,27 +2029,16 @@ lbm_mbox_armored_stream(GMimeStream * stream)
     return fstream;
 }
 
-/* Called with mailbox locked. */
-static gboolean
-lbm_mbox_add_message(LibBalsaMailboxLocal * local,
-                     GMimeStream          * stream,
-                     LibBalsaMessageFlag    flags,
-                     GError              ** err)
+/* Build the "From " line for the message in stream. */
+static gchar *
+lbm_mbox_from_line(GMimeStream * stream)
 {
-    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
     LibBalsaMessage *message;
     gchar date_string[27];
     gchar *sender;
     gchar *address;
     gchar *brack;
-    gchar *from = NULL;
-    const char *path;
-    int fd;
-    GMimeObject *armored_object;
-    GMimeStream *armored_dest;
-    GMimeStream *dest;
-    off_t retval;
-    off_t orig_length;
+    gchar *from;
 
     message = libbalsa_message_new();
     libbalsa_message_load_envelope_from_stream(message, stream);
@@ -1930,23 +2063,65 @@ lbm_mbox_add_message(LibBalsaMailboxLocal * local,
     }
     from = g_strdup_printf ("From %s %s", address, date_string );
     g_free(address);
-    
+
+    return from;
+}
+
+/* Write the pending appended data to the mailbox file. */
+static gboolean
+lbm_mbox_append_flush(LibBalsaMailboxMbox * mbox, GError ** err)
+{
+    GByteArray *buffer = mbox->append_buffer;
+
+    if (buffer->len > 0
+        && g_mime_stream_write(mbox->append_stream, (gchar *) buffer->data,
+                               buffer->len) < (gssize) buffer->len) {
+        mbox->append_failed = TRUE;
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR, _("Data copy error"));
+        return FALSE;
+    }
+    g_byte_array_set_size(buffer, 0);
+
+    return TRUE;
+}
+
+/* Called with mailbox locked: open and lock the mailbox file for a batch
+ * of appends. */
+static gboolean
+lbm_mbox_add_begin(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
+    LibBalsaMailboxMbox *mbox = (LibBalsaMailboxMbox *) local;
+    const char *path;
+    int fd;
+    GMimeStream *dest;
+    off_t orig_length;
+    gchar last = 0;
+
+    g_return_val_if_fail(mbox->append_stream == NULL, FALSE);
+
     path = libbalsa_mailbox_local_get_path(local);
+    if (lbm_mbox_path_is_compressed(path)) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR,
+                    _("%s: %s is a compressed archive."), "MBOX", path);
+        return FALSE;
+    }
+
     /* open in read-write mode */
     fd = open(path, O_RDWR);
     if (fd < 0) {
         g_set_error(err, LIBBALSA_MAILBOX_ERROR,
                     LIBBALSA_MAILBOX_APPEND_ERROR,
                     _("%s: could not open %s."), "MBOX", path);
-        g_free(from);
         return FALSE;
     }
-    
+
     orig_length = lseek (fd, 0, SEEK_END);
     lseek (fd, 0, SEEK_SET);
     dest = g_mime_stream_fs_new (fd);
     if (!dest) {
-	g_free(from);
         g_set_error(err, LIBBALSA_MAILBOX_ERROR,
                     LIBBALSA_MAILBOX_APPEND_ERROR,
                     _("%s: could not get new MIME stream."),
@@ -1959,12 +2134,107 @@ lbm_mbox_add_message(LibBalsaMailboxLocal * local,
                     LIBBALSA_MAILBOX_APPEND_ERROR,
                     _("%s: %s is not in mbox format."),
                     "MBOX", path);
-	g_free(from);
 	return FALSE;
     }
     mbox_lock ( mailbox, dest );
 
+    /* Remember how the file ends, so that the first message gets the
+     * right separator. */
+    if (orig_length > 0
+        && (g_mime_stream_seek(dest, orig_length - 1,
+                               GMIME_STREAM_SEEK_SET) < 0
+            || g_mime_stream_read(dest, &last, 1) != 1)) {
+        mbox_unlock(mailbox, dest);
+        g_object_unref(dest);
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR, _("Data copy error"));
+        return FALSE;
+    }
+    g_mime_stream_seek(dest, orig_length, GMIME_STREAM_SEEK_SET);
+
+    mbox->append_stream = dest;
+    mbox->append_buffer = g_byte_array_sized_new(LBM_MBOX_APPEND_BUFFER);
+    mbox->append_committed = orig_length;
+    mbox->append_last = last;
+    mbox->append_failed = FALSE;
+
+    return TRUE;
+}
+
+/* Write out everything appended so far, and sync it to disk. */
+static gboolean
+lbm_mbox_add_commit(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LibBalsaMailboxMbox *mbox = (LibBalsaMailboxMbox *) local;
+
+    g_return_val_if_fail(mbox->append_stream != NULL, FALSE);
+
+    if (mbox->append_failed || !lbm_mbox_append_flush(mbox, err))
+        return FALSE;
+
+    if (fsync(GMIME_STREAM_FS(mbox->append_stream)->fd) < 0) {
+        mbox->append_failed = TRUE;
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR,
+                    _("%s: could not sync %s: %s"), "MBOX",
+                    libbalsa_mailbox_local_get_path(local),
+                    g_strerror(errno));
+        return FALSE;
+    }
+    mbox->append_committed = g_mime_stream_tell(mbox->append_stream);
+
+    return TRUE;
+}
+
+/* Drop anything after the last commit, and unlock the mailbox file. */
+static gboolean
+lbm_mbox_add_end(LibBalsaMailboxLocal * local)
+{
+    LibBalsaMailbox *mailbox = (LibBalsaMailbox *) local;
+    LibBalsaMailboxMbox *mbox = (LibBalsaMailboxMbox *) local;
+    GMimeStream *dest = mbox->append_stream;
+
+    g_return_val_if_fail(dest != NULL, FALSE);
+
+    if (mbox->append_failed
+        && ftruncate(GMIME_STREAM_FS(dest)->fd,
+                     mbox->append_committed) < 0)
+        libbalsa_information(LIBBALSA_INFORMATION_WARNING,
+                             _("%s: could not truncate %s: %s"), "MBOX",
+                             libbalsa_mailbox_local_get_path(local),
+                             g_strerror(errno));
+    mbox_unlock(mailbox, dest);
+    g_object_unref(dest);
+    g_byte_array_free(mbox->append_buffer, TRUE);
+
+    mbox->append_stream = NULL;
+    mbox->append_buffer = NULL;
+
+    return !mbox->append_failed;
+}
+
+/* Called with mailbox locked, between lbm_mbox_add_begin and
+ * lbm_mbox_add_end. */
+static gboolean
+lbm_mbox_append(LibBalsaMailboxMbox * mbox,
+                GMimeStream         * stream,
+                LibBalsaMessageFlag   flags,
+                GError             ** err)
+{
+    gchar *from;
+    gsize from_len;
+    GMimeObject *armored_object;
+    GMimeStream *armored_dest;
+    GMimeStream *mem;
+    GByteArray *bytes;
+    gssize retval;
+
+    from = lbm_mbox_from_line(stream);
+    from_len = strlen(from);
+
     /* From_ armor */
+    mem = g_mime_stream_mem_new();
+    armored_dest = lbm_mbox_armored_stream(mem);
     libbalsa_mime_stream_shared_lock(stream);
     g_mime_stream_reset(stream);
     armored_object = lbm_mbox_armored_object(stream);
@@ -1972,29 +2242,63 @@ lbm_mbox_add_message(LibBalsaMailboxLocal * local,
      * update them in place later, if necessary. */
     update_message_status_headers(GMIME_MESSAGE(armored_object),
                                   flags | LIBBALSA_MESSAGE_FLAG_RECENT);
-    armored_dest = lbm_mbox_armored_stream(dest);
-
-    retval = g_mime_stream_seek(dest, 0, GMIME_STREAM_SEEK_END);
-    if (retval > 0)
-        retval = lbm_mbox_newline(dest);
-    if (retval < 0
-        || g_mime_stream_write_string(dest, from) < (gint) strlen(from)
-	|| g_mime_object_write_to_stream(armored_object, armored_dest) < 0) {
+    retval = g_mime_object_write_to_stream(armored_object, armored_dest);
+    if (retval >= 0)
+        retval = g_mime_stream_flush(armored_dest);
+    g_object_unref(armored_object);
+    libbalsa_mime_stream_shared_unlock(stream);
+    g_object_unref(armored_dest);
+
+    if (retval < 0) {
         g_set_error(err, LIBBALSA_MAILBOX_ERROR,
                     LIBBALSA_MAILBOX_APPEND_ERROR, _("Data copy error"));
-	retval = -1;
+        g_object_unref(mem);
+        g_free(from);
+        return FALSE;
     }
+
+    /* Separate from the previous message by an empty line. */
+    if (mbox->append_last != 0)
+        g_byte_array_append(mbox->append_buffer, (guint8 *) "\n\n",
+                            mbox->append_last == '\n' ? 1 : 2);
+    g_byte_array_append(mbox->append_buffer, (guint8 *) from, from_len);
+    mbox->append_last = from[from_len - 1];
     g_free(from);
-    g_object_unref(armored_object);
-    libbalsa_mime_stream_shared_unlock(stream);
-    g_object_unref(armored_dest);
 
-    if (retval < 0 && truncate(path, orig_length) < 0)
-        retval = -2;
-    mbox_unlock (mailbox, dest);
-    g_object_unref(dest);
+    bytes = GMIME_STREAM_MEM(mem)->buffer;
+    if (bytes->len > 0) {
+        g_byte_array_append(mbox->append_buffer, bytes->data, bytes->len);
+        mbox->append_last = bytes->data[bytes->len - 1];
+    }
+    g_object_unref(mem);
+
+    if (mbox->append_buffer->len >= LBM_MBOX_APPEND_BUFFER)
+        return lbm_mbox_append_flush(mbox, err);
 
-    return retval >= 0;
+    return TRUE;
+}
+
+/* Called with mailbox locked. */
+static gboolean
+lbm_mbox_add_message(LibBalsaMailboxLocal * local,
+                     GMimeStream          * stream,
+                     LibBalsaMessageFlag    flags,
+                     GError              ** err)
+{
+    LibBalsaMailboxMbox *mbox = (LibBalsaMailboxMbox *) local;
+    gboolean retval;
+
+    if (mbox->append_stream)
+        return lbm_mbox_append(mbox, stream, flags, err);
+
+    /* Not part of a batch. */
+    if (!lbm_mbox_add_begin(local, err))
+        return FALSE;
+    retval = lbm_mbox_append(mbox, stream, flags, err)
+        && lbm_mbox_add_commit(local, err);
+    lbm_mbox_add_end(local);
+
+    return retval;
 }
 
 static guint
@@ -67,6 +67,9 @@ static void lbm_mh_remove_files(LibBalsaMailboxLocal *mailbox);
 static LibBalsaMailboxLocalMessageInfo
     *lbm_mh_get_info(LibBalsaMailboxLocal * local, guint msgno);
 static LibBalsaMailboxLocalAddMessageFunc lbm_mh_add_message;
+static LibBalsaMailboxLocalAddBeginFunc lbm_mh_add_begin;
+static LibBalsaMailboxLocalAddCommitFunc lbm_mh_add_commit;
+static LibBalsaMailboxLocalAddEndFunc lbm_mh_add_end;
 
 static gboolean libbalsa_mailbox_mh_open(LibBalsaMailbox * mailbox,
 					 GError **err);
@@ -149,6 +152,9 @@ libbalsa_mailbox_mh_class_init(LibBalsaMailboxMhClass * klass)
     libbalsa_mailbox_local_class->remove_files = lbm_mh_remove_files;
     libbalsa_mailbox_local_class->get_info     = lbm_mh_get_info;
     libbalsa_mailbox_local_class->add_message  = lbm_mh_add_message;
+    libbalsa_mailbox_local_class->add_begin    = lbm_mh_add_begin;
+    libbalsa_mailbox_local_class->add_commit   = lbm_mh_add_commit;
+    libbalsa_mailbox_local_class->add_end      = lbm_mh_add_end;
 }
 
 static void
@@ -1002,6 +1008,11 @@ libbalsa_mailbox_mh_fetch_message_structure(LibBalsaMailbox * mailbox,
 					    LibBalsaMessage * message,
 					    LibBalsaFetchFlag flags)
 {
+    if (!message->mime_msg)
+        message->mime_msg =
+            libbalsa_mailbox_local_pool_get_mime_message
+            (LIBBALSA_MAILBOX_LOCAL(mailbox), message);
+
     if (!message->mime_msg) {
 	struct message_info *msg_info;
 	gchar *base_name;
@@ -1020,6 +1031,9 @@ libbalsa_mailbox_mh_fetch_message_structure(LibBalsaMailbox * mailbox,
 				        "Status");
 	    g_mime_object_remove_header(GMIME_OBJECT(message->mime_msg),
 				        "X-Status");
+            libbalsa_mailbox_local_pool_set_mime_message
+                (LIBBALSA_MAILBOX_LOCAL(mailbox), message,
+                 message->mime_msg);
 	}
     }
 
@@ -1029,27 +1043,35 @@ libbalsa_mailbox_mh_fetch_message_structure(LibBalsaMailbox * mailbox,
 
 /* Update .mh_sequences when a new message is added to the mailbox;
  * we'll just add new lines and let the next sync merge them with any
- * existing lines. */
+ * existing lines. In a bulk add, the lines are collected and written
+ * by lbm_mh_add_commit. */
 static void
 lbm_mh_update_sequences(LibBalsaMailboxMh * mh, gint fileno,
 			LibBalsaMessageFlag flags)
 {
+    GString *lines;
     FILE *fp;
 
-    fp = fopen(mh->sequences_filename, "a");
-
-    if (!fp)
-	return;
+    lines = mh->add_sequences ? mh->add_sequences : g_string_new(NULL);
 
     if (flags & LIBBALSA_MESSAGE_FLAG_NEW)
-	fprintf(fp, "unseen: %d\n", fileno);
+	g_string_append_printf(lines, "unseen: %d\n", fileno);
     if (flags & LIBBALSA_MESSAGE_FLAG_FLAGGED)
-	fprintf(fp, "flagged: %d\n", fileno);
+	g_string_append_printf(lines, "flagged: %d\n", fileno);
     if (flags & LIBBALSA_MESSAGE_FLAG_REPLIED)
-	fprintf(fp, "replied: %d\n", fileno);
+	g_string_append_printf(lines, "replied: %d\n", fileno);
     if (flags & LIBBALSA_MESSAGE_FLAG_RECENT)
-	fprintf(fp, "recent: %d\n", fileno);
-    fclose(fp);
+	g_string_append_printf(lines, "recent: %d\n", fileno);
+
+    if (lines == mh->add_sequences)
+        return;
+
+    fp = fopen(mh->sequences_filename, "a");
+    if (fp) {
+        fputs(lines->str, fp);
+        fclose(fp);
+    }
+    g_string_free(lines, TRUE);
 }
 
 /* Called with mailbox locked. */
@@ -1071,8 +1093,10 @@ lbm_mh_add_message(LibBalsaMailboxLocal * local,
 
     mh = LIBBALSA_MAILBOX_MH(local);
 
-    /* Make sure we know the highest message number: */
-    lbm_mh_parse_mailbox(mh, FALSE);
+    /* Make sure we know the highest message number; in a bulk add,
+     * lbm_mh_add_begin did that already. */
+    if (!mh->add_sequences)
+        lbm_mh_parse_mailbox(mh, FALSE);
 
     /* open tempfile */
     path = libbalsa_mailbox_local_get_path(local);
@@ -1139,6 +1163,8 @@ lbm_mh_add_message(LibBalsaMailboxLocal * local,
 	return FALSE;
     }
     mh->last_fileno = fileno;
+    if (mh->add_filenos)
+        g_array_append_val(mh->add_filenos, fileno);
 
     lbm_mh_update_sequences(mh, fileno,
                             flags | LIBBALSA_MESSAGE_FLAG_RECENT);
@@ -1146,6 +1172,94 @@ lbm_mh_add_message(LibBalsaMailboxLocal * local,
     return TRUE;
 }
 
+static gboolean
+lbm_mh_add_begin(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(local);
+
+    g_return_val_if_fail(mh->add_sequences == NULL, FALSE);
+
+    /* Make sure we know the highest message number: */
+    lbm_mh_parse_mailbox(mh, FALSE);
+    mh->add_sequences = g_string_new(NULL);
+    mh->add_filenos = g_array_new(FALSE, FALSE, sizeof(int));
+
+    return TRUE;
+}
+
+/* Sync the new messages, append the pending sequences and sync them
+ * and the directory. */
+static gboolean
+lbm_mh_add_commit(LibBalsaMailboxLocal * local, GError ** err)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(local);
+    const gchar *path;
+    FILE *fp;
+    gboolean retval;
+    guint i;
+
+    g_return_val_if_fail(mh->add_sequences != NULL, FALSE);
+
+    path = libbalsa_mailbox_local_get_path(local);
+    for (i = 0; i < mh->add_filenos->len; i++) {
+        gchar *filename =
+            g_strdup_printf("%s/%d", path,
+                            g_array_index(mh->add_filenos, int, i));
+
+        retval = libbalsa_mailbox_local_sync_path(filename);
+        if (!retval)
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_APPEND_ERROR,
+                        _("Could not sync %s: %s"), filename,
+                        g_strerror(errno));
+        g_free(filename);
+        if (!retval)
+            return FALSE;
+    }
+    g_array_set_size(mh->add_filenos, 0);
+
+    if (mh->add_sequences->len > 0) {
+        fp = fopen(mh->sequences_filename, "a");
+        retval = fp != NULL
+            && fputs(mh->add_sequences->str, fp) >= 0
+            && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fp)
+            fclose(fp);
+        if (!retval) {
+            g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                        LIBBALSA_MAILBOX_APPEND_ERROR,
+                        _("Could not write %s: %s"),
+                        mh->sequences_filename, g_strerror(errno));
+            return FALSE;
+        }
+        g_string_truncate(mh->add_sequences, 0);
+    }
+
+    if (!libbalsa_mailbox_local_sync_path(path)) {
+        g_set_error(err, LIBBALSA_MAILBOX_ERROR,
+                    LIBBALSA_MAILBOX_APPEND_ERROR,
+                    _("Could not sync %s: %s"), path, g_strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+lbm_mh_add_end(LibBalsaMailboxLocal * local)
+{
+    LibBalsaMailboxMh *mh = LIBBALSA_MAILBOX_MH(local);
+
+    /* Lines that could not be committed are dropped; the next sync
+     * rebuilds the sequences from the mailbox.  The messages stay. */
+    g_string_free(mh->add_sequences, TRUE);
+    mh->add_sequences = NULL;
+    g_array_free(mh->add_filenos, TRUE);
+    mh->add_filenos = NULL;
+
+    return TRUE;
+}
+
 static guint
 libbalsa_mailbox_mh_total_messages(LibBalsaMailbox * mailbox)
 {
@@ -45,6 +45,9 @@ struct _LibBalsaMailboxMh {
     gchar* sequences_filename;
     time_t mtime_sequences;
     guint last_fileno;
+    GString *add_sequences; /* .mh_sequences lines pending in a bulk add */
+    GArray *add_filenos;    /* ...and the messages written since the last
+                             * commit, to be synced */
 };
 
 struct _LibBalsaMailboxMhClass {
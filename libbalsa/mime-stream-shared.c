@@ -27,6 +27,10 @@
  * the stream is not locked.  The lock should be held while carrying out
  * sequences of operations such as seek+read, seek+write, read+tell,
  * read+test-eos.
+ *
+ * A stream created with libbalsa_mime_stream_shared_new_gzip reads the
+ * uncompressed data of a gzip file through a LibBalsaGzipIndex, which
+ * is shared like the lock; such a stream is read-only.
  */
 
 #if defined(HAVE_CONFIG_H) && HAVE_CONFIG_H
@@ -35,6 +39,7 @@
 
 #include "mime-stream-shared.h"
 
+#include <errno.h>
 #include <unistd.h>
 
 #include <gmime/gmime-stream.h>
@@ -46,6 +51,7 @@ struct _LibBalsaMimeStreamShared {
     GMimeStreamFs parent_object;
 
     LibBalsaMimeStreamSharedLock *lock;
+    LibBalsaGzipIndex *gzip;
 };
 
 struct _LibBalsaMimeStreamSharedClass {
@@ -65,6 +71,7 @@ static gint64 lbmss_stream_seek(GMimeStream * stream, gint64 offset,
                                GMimeSeekWhence whence);
 static GMimeStream *lbmss_stream_substream(GMimeStream * stream,
                                            gint64 start, gint64 end);
+static gint64 lbmss_stream_length(GMimeStream * stream);
 
 static GMimeStreamFsClass *parent_class = NULL;
 static GMutex lbmss_mutex;
@@ -111,6 +118,7 @@ lbmss_stream_class_init(LibBalsaMimeStreamSharedClass * klass)
     stream_class->reset     = lbmss_stream_reset;
     stream_class->seek      = lbmss_stream_seek;
     stream_class->substream = lbmss_stream_substream;
+    stream_class->length    = lbmss_stream_length;
 }
 
 /* The shared lock. */
@@ -160,6 +168,8 @@ lbmss_finalize(GObject *object)
         (LibBalsaMimeStreamShared *) object;
 
     lbmss_lock_unref(stream_shared->lock);
+    if (stream_shared->gzip)
+        libbalsa_gzip_index_unref(stream_shared->gzip);
 
     G_OBJECT_CLASS(parent_class)->finalize(object);
 }
@@ -170,10 +180,48 @@ lbmss_finalize(GObject *object)
     (LIBBALSA_MIME_STREAM_SHARED(stream)->lock->count > 0 \
      && LIBBALSA_MIME_STREAM_SHARED(stream)->lock->thread == g_thread_self())
 
+#define lbmss_is_gzip(stream) \
+    (LIBBALSA_MIME_STREAM_SHARED(stream)->gzip != NULL)
+
+/* The end of the stream, taking the bounds into account. */
+static gint64
+lbmss_gzip_end(GMimeStream * stream)
+{
+    return stream->bound_end != -1 ? stream->bound_end :
+        libbalsa_gzip_index_get_size(LIBBALSA_MIME_STREAM_SHARED(stream)->
+                                     gzip);
+}
+
+static ssize_t
+lbmss_gzip_read(GMimeStream * stream, char *buf, size_t len)
+{
+    GMimeStreamFs *fstream = GMIME_STREAM_FS(stream);
+    gint64 end = lbmss_gzip_end(stream);
+    gssize nread;
+
+    if (stream->position >= end) {
+        fstream->eos = TRUE;
+        return 0;
+    }
+    len = MIN((gint64) len, end - stream->position);
+
+    nread =
+        libbalsa_gzip_index_read(LIBBALSA_MIME_STREAM_SHARED(stream)->gzip,
+                                 stream->position, buf, len);
+    if (nread > 0)
+        stream->position += nread;
+    else if (nread == 0)
+        fstream->eos = TRUE;
+
+    return nread;
+}
+
 static ssize_t
 lbmss_stream_read(GMimeStream * stream, char *buf, size_t len)
 {
     g_return_val_if_fail(lbmss_thread_has_lock(stream), -1);
+    if (lbmss_is_gzip(stream))
+        return lbmss_gzip_read(stream, buf, len);
     return GMIME_STREAM_CLASS(parent_class)->read(stream, buf, len);
 }
 
@@ -181,6 +229,10 @@ static ssize_t
 lbmss_stream_write(GMimeStream * stream, const char *buf, size_t len)
 {
     g_return_val_if_fail(lbmss_thread_has_lock(stream), -1);
+    if (lbmss_is_gzip(stream)) {
+        errno = EROFS;
+        return -1;
+    }
     return GMIME_STREAM_CLASS(parent_class)->write(stream, buf, len);
 }
 
@@ -191,14 +243,57 @@ lbmss_stream_reset(GMimeStream * stream)
     return GMIME_STREAM_CLASS(parent_class)->reset(stream);
 }
 
+static gint64
+lbmss_gzip_seek(GMimeStream * stream, gint64 offset,
+                GMimeSeekWhence whence)
+{
+    gint64 end = lbmss_gzip_end(stream);
+    gint64 real;
+
+    switch (whence) {
+    case GMIME_STREAM_SEEK_SET:
+        real = offset;
+        break;
+    case GMIME_STREAM_SEEK_CUR:
+        real = stream->position + offset;
+        break;
+    case GMIME_STREAM_SEEK_END:
+        real = end + offset;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (real < stream->bound_start || real > end) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    GMIME_STREAM_FS(stream)->eos = real >= end;
+    stream->position = real;
+
+    return real;
+}
+
 static gint64
 lbmss_stream_seek(GMimeStream * stream, gint64 offset,
                   GMimeSeekWhence whence)
 {
     g_return_val_if_fail(lbmss_thread_has_lock(stream), -1);
+    if (lbmss_is_gzip(stream))
+        return lbmss_gzip_seek(stream, offset, whence);
     return GMIME_STREAM_CLASS(parent_class)->seek(stream, offset, whence);
 }
 
+static gint64
+lbmss_stream_length(GMimeStream * stream)
+{
+    if (lbmss_is_gzip(stream))
+        return lbmss_gzip_end(stream) - stream->bound_start;
+    return GMIME_STREAM_CLASS(parent_class)->length(stream);
+}
+
 static GMimeStream *
 lbmss_stream_substream(GMimeStream * stream, gint64 start, gint64 end)
 {
@@ -209,6 +304,10 @@ lbmss_stream_substream(GMimeStream * stream, gint64 start, gint64 end)
         g_object_new(LIBBALSA_TYPE_MIME_STREAM_SHARED, NULL, NULL);
     stream_shared->lock =
         lbmss_lock_ref(LIBBALSA_MIME_STREAM_SHARED(stream)->lock);
+    if (lbmss_is_gzip(stream))
+        stream_shared->gzip =
+            libbalsa_gzip_index_ref(LIBBALSA_MIME_STREAM_SHARED(stream)->
+                                    gzip);
 
     fstream = GMIME_STREAM_FS(stream_shared);
     fstream->owner = FALSE;
@@ -251,6 +350,41 @@ libbalsa_mime_stream_shared_new(int fd)
     return GMIME_STREAM(fstream);
 }
 
+/**
+ * libbalsa_mime_stream_shared_new_gzip:
+ * @fd: file descriptor of a gzip file
+ * @gzip: index of the gzip file
+ *
+ * Create a new read-only GMimeStreamShared object that reads the
+ * uncompressed data of the gzip file @fd.  The stream takes a reference
+ * to @gzip.
+ *
+ * Returns a stream using @fd.
+ *
+ **/
+GMimeStream *
+libbalsa_mime_stream_shared_new_gzip(int fd, LibBalsaGzipIndex * gzip)
+{
+    LibBalsaMimeStreamShared *stream_shared;
+    GMimeStreamFs *fstream;
+
+    g_return_val_if_fail(gzip != NULL, NULL);
+
+    stream_shared =
+        g_object_new(LIBBALSA_TYPE_MIME_STREAM_SHARED, NULL, NULL);
+    stream_shared->lock = lbmss_lock_new();
+    stream_shared->gzip = libbalsa_gzip_index_ref(gzip);
+
+    fstream = GMIME_STREAM_FS(stream_shared);
+    fstream->owner = TRUE;
+    fstream->eos = FALSE;
+    fstream->fd = fd;
+
+    g_mime_stream_construct(GMIME_STREAM(fstream), 0, -1);
+
+    return GMIME_STREAM(fstream);
+}
+
 /**
  * libbalsa_mime_stream_shared_lock:
  * @stream: shared stream
@@ -26,6 +26,7 @@
 #endif
 
 #include <gmime/gmime-stream-fs.h>
+#include "gzip-index.h"
 
 #define LIBBALSA_TYPE_MIME_STREAM_SHARED                           \
     (libbalsa_mime_stream_shared_get_type ())
@@ -54,6 +55,8 @@ typedef struct _LibBalsaMimeStreamSharedClass LibBalsaMimeStreamSharedClass;
 GType libbalsa_mime_stream_shared_get_type(void);
 
 GMimeStream *libbalsa_mime_stream_shared_new(int fd);
+GMimeStream *libbalsa_mime_stream_shared_new_gzip(int fd,
+                                                  LibBalsaGzipIndex * gzip);
 
 void libbalsa_mime_stream_shared_lock  (GMimeStream * stream);
 void libbalsa_mime_stream_shared_unlock(GMimeStream * stream);
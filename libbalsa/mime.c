@@ -200,6 +200,155 @@ content2reply(LibBalsaMessageBody * root, gchar * reply_prefix_str,
     return reply;
 }
 
+/*
+ * Streaming text search.
+ *
+ * content_find_text() looks for text (case insensitively, like
+ * libbalsa_utf8_strstr) in the text parts of a message without building
+ * the reply text: each text/plain part is read in chunks through the
+ * decoding and charset-converting filters of its stream, and the search
+ * stops at the first match. The tail of each chunk is carried over to
+ * the next one, so that matches across chunk boundaries are found.
+ * HTML parts still go through process_mime_part, as they must be
+ * converted to text before searching.
+ */
+
+#define FIND_TEXT_CHUNK 8192
+
+/* Make buf[0..*len) valid UTF-8, replacing bad bytes with '?'; an
+ * incomplete character at the end is not touched, and its length is
+ * returned, so that the caller can complete it with the next chunk. */
+static gsize
+find_text_validate(gchar * buf, gsize len)
+{
+    const gchar *end;
+
+    while (!g_utf8_validate(buf, len, &end)) {
+        gsize valid = end - buf;
+        gsize rest = len - valid;
+
+        if (rest < 4
+            && g_utf8_get_char_validated(end, rest) == (gunichar) - 2)
+            return rest;        /* Incomplete, not invalid. */
+        buf[valid] = '?';
+    }
+
+    return 0;
+}
+
+static gboolean
+find_text_in_stream(GMimeStream * stream, const gchar * text)
+{
+    gsize overlap;
+    gchar *buf;
+    gsize held = 0;
+    gboolean match = FALSE;
+
+    /* A match may need up to 4 bytes for each character of text, less
+     * the one that starts in the next chunk. */
+    overlap = 4 * g_utf8_strlen(text, -1);
+    /* Room for the tail, an incomplete character, the chunk and the
+     * terminating nul. */
+    buf = g_malloc(overlap + 3 + FIND_TEXT_CHUNK + 1);
+
+    while (!match) {
+        gssize count;
+        gsize len, incomplete, keep;
+        gchar saved;
+
+        count = g_mime_stream_read(stream, buf + held, FIND_TEXT_CHUNK);
+        if (count <= 0)
+            break;
+        len = held + count;
+
+        incomplete = find_text_validate(buf, len);
+        saved = buf[len - incomplete];
+        buf[len - incomplete] = '\0';
+        match = libbalsa_utf8_strstr(buf, text);
+        buf[len - incomplete] = saved;
+
+        /* Hold the tail, starting at a character boundary, together
+         * with any incomplete character. */
+        keep = MIN(len - incomplete, overlap);
+        while (keep > 0 && (buf[len - incomplete - keep] & 0xc0) == 0x80)
+            --keep;
+        held = keep + incomplete;
+        memmove(buf, buf + len - held, held);
+    }
+    g_free(buf);
+
+    return match;
+}
+
+static gboolean
+find_text_in_part(LibBalsaMessage * message, LibBalsaMessageBody * body,
+                  const gchar * text)
+{
+    LibBalsaMessageBody *part;
+    gchar *mime_type;
+    LibBalsaHTMLType html_type;
+    GMimeStream *stream;
+    gboolean match;
+
+    switch (libbalsa_message_body_type(body)) {
+    case LIBBALSA_MESSAGE_BODY_TYPE_MULTIPART:
+        for (part = body->parts; part; part = part->next)
+            if (find_text_in_part(message, part, text))
+                return TRUE;
+        return FALSE;
+    case LIBBALSA_MESSAGE_BODY_TYPE_TEXT:
+        break;
+    default:
+        return FALSE;
+    }
+
+    mime_type = libbalsa_message_body_get_mime_type(body);
+    html_type = libbalsa_html_type(mime_type);
+    g_free(mime_type);
+
+    if (html_type) {
+        GString *str = process_mime_part(message, body, NULL, 0, FALSE,
+                                         FALSE);
+
+        if (!str)
+            return FALSE;
+        match = libbalsa_utf8_strstr(str->str, text);
+        g_string_free(str, TRUE);
+
+        return match;
+    }
+
+    stream = libbalsa_message_body_get_stream(body, NULL);
+    if (!stream)
+        return FALSE;
+
+    libbalsa_mailbox_lock_store(message->mailbox);
+    g_mime_stream_reset(stream);
+    match = find_text_in_stream(stream, text);
+    libbalsa_mailbox_unlock_store(message->mailbox);
+    g_object_unref(stream);
+
+    return match;
+}
+
+/* content_find_text:
+   the message structure must already be referenced by the caller.
+*/
+gboolean
+content_find_text(LibBalsaMessageBody * root, const gchar * text)
+{
+    LibBalsaMessageBody *body;
+
+    if (!text || !*text)
+        return TRUE;
+
+    for (body = root; body; body = body->next)
+        if (find_text_in_part(root->message, body, text))
+            return TRUE;
+
+    return FALSE;
+}
+
 /*
  * implement RFC2646 `text=flowed' 
  * first version by Emmanuel <e allaud wanadoo fr>
@@ -34,5 +34,6 @@ GString *process_mime_part(LibBalsaMessage * message,
 GString *content2reply(LibBalsaMessageBody *root,
 		       gchar * reply_prefix_str, gint llen,
 		       gboolean ignore_html, gboolean flow);
+gboolean content_find_text(LibBalsaMessageBody * root, const gchar * text);
 
 #endif				/* __LIBBALSA_MIME_H__ */
@@ -129,6 +129,46 @@ net_client_siobuf_ungetc(NetClientSioBuf *client)
 }
 
 
+const gchar *
+net_client_siobuf_peek(NetClientSioBuf *client, gsize *avail, GError **error)
+{
+	NetClientSioBufPrivate *priv;
+	const gchar *result;
+
+	g_return_val_if_fail(NET_IS_CLIENT_SIOBUF(client) && (avail != NULL), NULL);
+
+	priv = client->priv;
+	if (net_client_siobuf_fill(client, error)) {
+		*avail = priv->buffer->len - (priv->read_ptr - priv->buffer->str);
+		result = priv->read_ptr;
+	} else {
+		*avail = 0U;
+		result = NULL;
+	}
+
+	return result;
+}
+
+
+void
+net_client_siobuf_consume(NetClientSioBuf *client, gsize count)
+{
+	NetClientSioBufPrivate *priv;
+	gsize avail;
+
+	g_return_if_fail(NET_IS_CLIENT_SIOBUF(client));
+
+	priv = client->priv;
+	if ((priv->buffer->len != 0U) && (priv->read_ptr != NULL)) {
+		avail = priv->buffer->len - (priv->read_ptr - priv->buffer->str);
+		if (count > avail) {
+			count = avail;
+		}
+		priv->read_ptr += count;
+	}
+}
+
+
 gchar *
 net_client_siobuf_gets(NetClientSioBuf *client, gchar *buffer, gsize buflen, GError **error)
 {
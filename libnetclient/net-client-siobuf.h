@@ -97,6 +97,32 @@ gint net_client_siobuf_getc(NetClientSioBuf *client, GError **error);
 gint net_client_siobuf_ungetc(NetClientSioBuf *client);
 
 
+/** @brief Look at the buffered data of a SIOBUF network client object
+ *
+ * @param client SIOBUF network client object
+ * @param avail filled with the number of bytes available at the returned location
+ * @param error filled with error information on error
+ * @return the unread part of the current line, including the terminating CRLF, or NULL if reading more data from the remote
+ *         server failed
+ *
+ * Read the next line from the remote server if the internal buffer is empty, and return the data which has not been consumed
+ * yet, without consuming it.  The returned data is NUL-terminated, and remains valid until the next call which reads from the
+ * client.  Call net_client_siobuf_consume() to mark (a part of) it as read.
+ */
+const gchar *net_client_siobuf_peek(NetClientSioBuf *client, gsize *avail, GError **error);
+
+
+/** @brief Consume buffered data of a SIOBUF network client object
+ *
+ * @param client SIOBUF network client object
+ * @param count number of bytes which shall be consumed
+ *
+ * Mark the first count bytes returned by net_client_siobuf_peek() as read.  The count is limited to the number of bytes which
+ * are available in the internal buffer.
+ */
+void net_client_siobuf_consume(NetClientSioBuf *client, gsize count);
+
+
 /** @brief Read a buffer from a SIOBUF network client object
  *
  * @param client SIOBUF network client object
@@ -796,6 +796,8 @@ test_siobuf(void)
 	gint read_res;
 	gboolean op_res;
 	gchar *recv_data;
+	const gchar *peek_data;
+	gsize avail;
 
 	sput_fail_unless(net_client_siobuf_new(NULL, 65000) == NULL, "missing host");
 	sput_fail_unless((siobuf = net_client_siobuf_new("localhost", 65000)) != NULL, "localhost; port 65000");
@@ -816,6 +818,12 @@ test_siobuf(void)
 	sput_fail_unless(net_client_siobuf_ungetc(NULL) == -1, "ungetc w/o client");
 	sput_fail_unless(net_client_siobuf_ungetc(siobuf) == -1, "ungetc at beginning of buffer");
 
+	sput_fail_unless(net_client_siobuf_peek(NULL, &avail, NULL) == NULL, "peek w/o client");
+	sput_fail_unless(net_client_siobuf_peek(siobuf, NULL, NULL) == NULL, "peek w/o avail");
+	sput_fail_unless((net_client_siobuf_peek(siobuf, &avail, NULL) == NULL) && (avail == 0U), "peek fails, not connected");
+	net_client_siobuf_consume(NULL, 1U);
+	net_client_siobuf_consume(siobuf, 1U);
+
 	sput_fail_unless(net_client_set_timeout(NET_CLIENT(siobuf), 10) == TRUE, "set timeout");
 	sput_fail_unless(net_client_connect(NET_CLIENT(siobuf), NULL) == TRUE, "connect");
 	sput_fail_unless(net_client_write_buffer(NET_CLIENT(siobuf), "line1\r\nLINE2\r\nABCD3\r\n", 21U, NULL) == TRUE, "write data");
@@ -871,6 +879,11 @@ test_siobuf(void)
 	g_free(recv_data);
 
 	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == '9', "getc ok");
+	peek_data = net_client_siobuf_peek(siobuf, &avail, NULL);
+	sput_fail_unless((peek_data != NULL) && (avail == 5U) && (strcmp(peek_data, "876\r\n") == 0), "peek ok");
+	net_client_siobuf_consume(siobuf, 2U);
+	sput_fail_unless(net_client_siobuf_getc(siobuf, NULL) == '6', "getc after consume ok");
+	sput_fail_unless((net_client_siobuf_peek(siobuf, &avail, NULL) == peek_data + 3) && (avail == 2U), "peek after getc ok");
 	sput_fail_unless(net_client_siobuf_discard_line(NULL, NULL) == -1, "discard line w/o client");
 	sput_fail_unless(net_client_siobuf_discard_line(siobuf, NULL) == '\n', "discard line ok");
 	sput_fail_unless(net_client_siobuf_discard_line(siobuf, NULL) == -1, "discard line w/o data");
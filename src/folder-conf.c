@@ -62,7 +62,8 @@ struct _FolderDialogData {
     LibBalsaServerCfg *server_cfg;
     LibBalsaServer *server;
     GtkWidget *subscribed, *list_inbox, *prefix;
-    GtkWidget *connection_limit, *enable_persistent,
+    GtkWidget *connection_limit, *preconnect, *offline_budget, *offline_rate,
+        *enable_persistent,
         *use_idle, *has_bugs, *use_status;
 };
 
@@ -230,6 +231,10 @@ folder_conf_clicked_ok(FolderDialogData * fcw)
 
     imap = LIBBALSA_IMAP_SERVER(fcw->server);
     libbalsa_imap_server_set_max_connections(imap, gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(fcw->connection_limit)));
+    libbalsa_imap_server_set_preconnect(imap, gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(fcw->preconnect)));
+    libbalsa_imap_server_set_offline_limits(imap,
+    	gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(fcw->offline_budget)),
+    	gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(fcw->offline_rate)));
     libbalsa_imap_server_enable_persistent_cache(imap, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fcw->enable_persistent)));
     libbalsa_imap_server_set_use_idle(imap, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fcw->use_idle)));
     libbalsa_imap_server_set_bug(imap, ISBUG_FETCH, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(fcw->has_bugs)));
@@ -419,6 +424,7 @@ folder_conf_imap_node(BalsaMailboxNode *mn)
     static FolderDialogData *fcw_new;
     GtkWidget *box;
     GtkWidget *button;
+    guint offline_budget, offline_rate;
 
     /* Allow only one dialog per mailbox node, and one with mn == NULL
      * for creating a new folder. */
@@ -496,6 +502,18 @@ folder_conf_imap_node(BalsaMailboxNode *mn)
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(fcw->connection_limit),
     	(gdouble) libbalsa_imap_server_get_max_connections(LIBBALSA_IMAP_SERVER(fcw->server)));
     libbalsa_server_cfg_add_item(fcw->server_cfg, FALSE, _("_Max number of connections:"), fcw->connection_limit);
+    fcw->preconnect = gtk_spin_button_new_with_range(0.0, 40.0, 1.0);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(fcw->preconnect),
+    	(gdouble) libbalsa_imap_server_get_preconnect(LIBBALSA_IMAP_SERVER(fcw->server)));
+    libbalsa_server_cfg_add_item(fcw->server_cfg, FALSE, _("Connections to open at _startup:"), fcw->preconnect);
+    libbalsa_imap_server_get_offline_limits(LIBBALSA_IMAP_SERVER(fcw->server), &offline_budget, &offline_rate);
+    fcw->offline_budget = gtk_spin_button_new_with_range(0.0, 100000.0, 10.0);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(fcw->offline_budget), (gdouble) offline_budget);
+    libbalsa_server_cfg_add_item(fcw->server_cfg, FALSE, _("Disk space for _offline copies (MB):"), fcw->offline_budget);
+    fcw->offline_rate = gtk_spin_button_new_with_range(0.0, 100000.0, 10.0);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(fcw->offline_rate), (gdouble) offline_rate);
+    libbalsa_server_cfg_add_item(fcw->server_cfg, FALSE, _("Offline copy _download rate (kB/s, 0: unlimited):"),
+    	fcw->offline_rate);
     fcw->enable_persistent = libbalsa_server_cfg_add_check(fcw->server_cfg, FALSE, _("Enable _persistent cache"),
     	libbalsa_imap_server_has_persistent_cache(LIBBALSA_IMAP_SERVER(fcw->server)), NULL, NULL);
     fcw->use_idle = libbalsa_server_cfg_add_check(fcw->server_cfg, FALSE, _("Use IDLE command"),
@@ -66,6 +66,7 @@ struct _BalsaMailboxConfView {
     GtkWidget *identity_combo_box;
     GtkWidget *show_to;
     GtkWidget *subscribe;
+    GtkWidget *offline;
 #ifdef HAVE_GPGME
     GtkWidget *chk_crypt;
 #endif
@@ -942,6 +943,21 @@ mailbox_conf_view_new_full(LibBalsaMailbox * mailbox,
         g_signal_connect_swapped(view_info->subscribe, "toggled",
                                  callback, window);
 
+    /* Offline copy check button */
+    view_info->offline = NULL;
+    if (mailbox != NULL && LIBBALSA_IS_MAILBOX_IMAP(mailbox)) {
+        view_info->offline =
+            libbalsa_create_grid_check(_("Keep an _offline copy"),
+                                       grid, ++row,
+                                       libbalsa_mailbox_get_offline(mailbox));
+        if (mcw)
+            g_signal_connect(view_info->offline, "toggled",
+                             G_CALLBACK(check_for_blank_fields), mcw);
+        if (callback)
+            g_signal_connect_swapped(view_info->offline, "toggled",
+                                     callback, window);
+    }
+
     /* Thread messages check button */
     thread_messages =
         libbalsa_mailbox_get_threading_type(mailbox) !=
@@ -1041,6 +1057,15 @@ mailbox_conf_view_check(BalsaMailboxConfView * view_info,
 				       LB_MAILBOX_SUBSCRIBE_NO))
 	changed = TRUE;
 
+    /* Starting or stopping the offline copy needs no redraw. */
+    if (view_info->offline != NULL) {
+        active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON
+                                              (view_info->offline));
+        if (libbalsa_mailbox_set_offline(mailbox, active))
+            libbalsa_mailbox_imap_update_offline(LIBBALSA_MAILBOX_IMAP
+                                                 (mailbox));
+    }
+
     /* Threading */
 
     active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON
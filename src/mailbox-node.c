@@ -612,6 +612,7 @@ balsa_mailbox_node_new_from_config(const gchar* group)
 		     G_CALLBACK(imap_dir_cb), NULL);
     libbalsa_server_connect_signals(folder->server,
                                     G_CALLBACK(ask_password), NULL);
+    libbalsa_imap_server_preconnect(LIBBALSA_IMAP_SERVER(folder->server));
     balsa_mailbox_node_load_config(folder, group);
 
     folder->dir = libbalsa_conf_get_string("Directory");
@@ -3443,6 +3443,10 @@ bw_check_messages_thread(struct check_messages_thread_info *info)
     	if (info->with_progress_dialog) {
     		libbalsa_progress_dialog_ensure(&progress_dialog, _("Checking Mail…"), GTK_WINDOW(info->window), _("Mailboxes"));
     	}
+    	/* Ask each IMAP server about all its mailboxes at once. */
+    	if ((info->window == NULL) || info->window->network_available) {
+    		libbalsa_mailbox_imap_check_list(list);
+    	}
     	g_slist_foreach(list, (GFunc) bw_mailbox_check, info);
     	g_slist_foreach(list, (GFunc) g_object_unref, NULL);
     	g_slist_free(list);
@@ -29,6 +29,7 @@
 #include <glib/gi18n.h>
 #include "balsa-app.h"
 #include "server.h"
+#include "imap-server.h"
 #include "quote-color.h"
 #include "toolbar-prefs.h"
 
@@ -465,6 +466,8 @@ config_mailbox_init(const gchar * prefix)
 	g_signal_connect_swapped(server, "config-changed",
                                  G_CALLBACK(config_mailbox_update),
 				 mailbox);
+        if (LIBBALSA_IS_IMAP_SERVER(server))
+            libbalsa_imap_server_preconnect(LIBBALSA_IMAP_SERVER(server));
     }
 
     if (LIBBALSA_IS_MAILBOX_POP3(mailbox)) {
@@ -744,6 +747,19 @@ config_global_load(void)
             libbalsa_conf_get_int_with_default("ThreadingType", &def_used);
         if (!def_used)
             libbalsa_mailbox_set_threading_type(NULL, type);
+        /* Memory budget for parsed local messages, in kilobytes. */
+        type =
+            libbalsa_conf_get_int_with_default("MessageCacheBudget",
+                                               &def_used);
+        if (!def_used && type > 0)
+            libbalsa_mailbox_local_set_pool_budget((gsize) type * 1024);
+        /* Messages appended to a local mailbox between syncs to disk;
+         * 0 syncs only once, at the end of each batch. */
+        type =
+            libbalsa_conf_get_int_with_default("AddSyncInterval",
+                                               &def_used);
+        if (!def_used)
+            libbalsa_mailbox_local_set_add_sync_interval(type);
     }
 
     /* ... Quote colouring */
@@ -1271,6 +1287,10 @@ config_save(void)
 			 libbalsa_mailbox_get_sort_field(NULL));
     libbalsa_conf_set_int("ThreadingType",
 			 libbalsa_mailbox_get_threading_type(NULL));
+    libbalsa_conf_set_int("MessageCacheBudget",
+                          libbalsa_mailbox_local_get_pool_budget() / 1024);
+    libbalsa_conf_set_int("AddSyncInterval",
+                          libbalsa_mailbox_local_get_add_sync_interval());
     libbalsa_conf_set_bool("MarkQuoted", balsa_app.mark_quoted);
     libbalsa_conf_set_string("QuoteRegex", balsa_app.quote_regex);
     libbalsa_conf_set_bool("UseSystemFonts", balsa_app.use_system_fonts);
@@ -1779,6 +1799,9 @@ config_load_mailbox_view(const gchar * url)
     if (libbalsa_conf_has_key("Subscribe"))
         view->subscribe = libbalsa_conf_get_int("Subscribe");
 
+    if (libbalsa_conf_has_key("Offline"))
+        view->offline = libbalsa_conf_get_bool("Offline");
+
     if (libbalsa_conf_has_key("Exposed"))
         view->exposed = libbalsa_conf_get_bool("Exposed");
 
@@ -1839,6 +1862,8 @@ config_save_mailbox_view(const gchar * url, LibBalsaMailboxView * view)
 	libbalsa_conf_set_int("Show",        view->show);
     if (view->subscribe      == LB_MAILBOX_SUBSCRIBE_NO)
 	libbalsa_conf_set_int("Subscribe",   view->subscribe);
+    if (view->offline        != libbalsa_mailbox_get_offline(NULL))
+	libbalsa_conf_set_bool("Offline",    view->offline);
     if (view->exposed        != libbalsa_mailbox_get_exposed(NULL))
 	libbalsa_conf_set_bool("Exposed",    view->exposed);
     if (balsa_app.remember_open_mboxes) {